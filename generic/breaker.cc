@@ -0,0 +1,213 @@
+/*
+ * breaker.cc: Per-processor circuit breakers of the eCAP Tcl adapter.
+ */
+
+#include "breaker.h"
+
+/* The order must follow enum BreakerState... */
+const char *const Adapter::Breakers::stateNames[] = {
+  "closed", "open", "half_open", NULL
+};
+
+static inline Tcl_WideInt nowMs() {
+  Tcl_Time now;
+  Tcl_GetTime(&now);
+  return ((Tcl_WideInt) now.sec) * 1000 + now.usec / 1000;
+}; /* nowMs */
+
+Adapter::Breakers::Breakers(Stats &s): stats(s), lock(NULL) {
+  reset();
+}
+
+Adapter::Breakers::~Breakers() {
+  Tcl_MutexFinalize(&lock);
+}
+
+bool Adapter::Breakers::enabled() const {
+  return error_rate || timeout_rate;
+}
+
+void Adapter::Breakers::reset() {
+  error_rate   = 0;
+  timeout_rate = 0;
+  min_calls    = 20;
+  window       = 10000;
+  cooldown     = 30000;
+  sample       = 100;
+  Tcl_MutexLock(&lock);
+  breakers.clear();
+  routes.clear();
+  sample_credit = 0;
+  Tcl_MutexUnlock(&lock);
+}
+
+bool Adapter::Breakers::sampled() {
+  bool result;
+  Tcl_MutexLock(&lock);
+  result = takeSample();
+  Tcl_MutexUnlock(&lock);
+  return result;
+}
+
+// Spreads the bypassed transactions evenly: sample% of the calls return
+// true. Must be called with the lock held.
+bool Adapter::Breakers::takeSample() {
+  if (sample >= 100) return true;
+  sample_credit += sample;
+  if (sample_credit < 100) return false;
+  sample_credit -= 100;
+  return true;
+}
+
+bool Adapter::Breakers::bypass(const std::string &processor,
+                               unsigned long *probe) {
+  bool result = false;
+  if (!enabled() || processor.empty()) return false;
+  Tcl_MutexLock(&lock);
+  std::map<std::string, Breaker>::iterator it = breakers.find(processor);
+  if (it != breakers.end()) {
+    Breaker &breaker = it->second;
+    Tcl_WideInt now = nowMs();
+    if (breaker.state == BREAKER_OPEN && now - breaker.opened_at >= cooldown) {
+      // The cooldown is over: let a single transaction probe the processor
+      breaker.state = BREAKER_HALF_OPEN;
+      stats.incr(STATS_BREAKER_HALF_OPEN);
+    }
+    switch (breaker.state) {
+      case BREAKER_CLOSED:
+        break;
+      case BREAKER_OPEN:
+        result = takeSample();
+        break;
+      case BREAKER_HALF_OPEN:
+        // A probe that never reported back is replaced after a cooldown
+        if (breaker.probing && now - breaker.probe_at < cooldown) {
+          result = true;
+        } else {
+          breaker.probing = true;
+          breaker.probe_at = now;
+          breaker.probe = ++probes;
+          if (probe) *probe = breaker.probe;
+        }
+        break;
+    }
+    if (result) breaker.bypassed++;
+  }
+  Tcl_MutexUnlock(&lock);
+  return result;
+}
+
+void Adapter::Breakers::record(const std::string &processor,
+                               BreakerOutcome outcome,
+                               const std::string &reason,
+                               unsigned long probe) {
+  if (!enabled() || processor.empty()) return;
+  if (outcome == OUTCOME_IGNORED) {
+    // A probe no processor handled: let the next transaction probe
+    if (!probe) return;
+    Tcl_MutexLock(&lock);
+    std::map<std::string, Breaker>::iterator it = breakers.find(processor);
+    if (it != breakers.end() && it->second.probe == probe) {
+      it->second.probing = false;
+    }
+    Tcl_MutexUnlock(&lock);
+    return;
+  }
+  Tcl_WideInt now = nowMs();
+  Tcl_MutexLock(&lock);
+  Breaker &breaker = breakers[processor];
+  if (outcome != OUTCOME_OK) {
+    breaker.last_error = reason.empty() ?
+      (outcome == OUTCOME_TIMEOUT ? "timeout" : "error") : reason;
+  }
+  switch (breaker.state) {
+    case BREAKER_OPEN:
+      // Transactions let through by sampling do not change the state
+      break;
+    case BREAKER_HALF_OPEN:
+      // Only the probe decides: the transactions started before the
+      // breaker opened, or a probe that has been replaced, do not count
+      if (!breaker.probing || probe != breaker.probe) break;
+      if (outcome == OUTCOME_OK) {
+        breaker.state = BREAKER_CLOSED;
+        breaker.probing = false;
+        breaker.window_start = now;
+        breaker.calls = breaker.errors = breaker.timeouts = 0;
+        stats.incr(STATS_BREAKER_CLOSED);
+      } else {
+        trip(breaker, now);
+      }
+      break;
+    case BREAKER_CLOSED:
+      if (now - breaker.window_start >= window) {
+        breaker.window_start = now;
+        breaker.calls = breaker.errors = breaker.timeouts = 0;
+      }
+      breaker.calls++;
+      if (outcome == OUTCOME_ERROR)   breaker.errors++;
+      if (outcome == OUTCOME_TIMEOUT) breaker.timeouts++;
+      if (breaker.calls < min_calls) break;
+      if ((error_rate &&
+           breaker.errors * 100 >= error_rate * breaker.calls) ||
+          (timeout_rate &&
+           breaker.timeouts * 100 >= timeout_rate * breaker.calls)) {
+        trip(breaker, now);
+      }
+      break;
+  }
+  Tcl_MutexUnlock(&lock);
+}
+
+// Opens the breaker. Must be called with the lock held.
+void Adapter::Breakers::trip(Breaker &breaker, Tcl_WideInt now) {
+  breaker.state = BREAKER_OPEN;
+  breaker.opened_at = now;
+  breaker.probing = false;
+  breaker.opened++;
+  stats.incr(STATS_BREAKER_OPENED);
+}
+
+void Adapter::Breakers::learn(const std::string &mime,
+                              const std::string &processor) {
+  if (!enabled() || mime.empty() || processor.empty()) return;
+  Tcl_MutexLock(&lock);
+  routes[mime] = processor;
+  Tcl_MutexUnlock(&lock);
+}
+
+std::string Adapter::Breakers::processorFor(const std::string &mime) const {
+  std::string processor;
+  if (!enabled()) return processor;
+  Tcl_MutexLock(&lock);
+  std::map<std::string, std::string>::const_iterator it = routes.find(mime);
+  processor = it != routes.end() ? it->second : mime;
+  Tcl_MutexUnlock(&lock);
+  return processor;
+}
+
+Tcl_Obj *Adapter::Breakers::toDict() const {
+  Tcl_Obj *dict = Tcl_NewDictObj(), *item;
+  Tcl_MutexLock(&lock);
+  for (std::map<std::string, Breaker>::const_iterator it = breakers.begin();
+       it != breakers.end(); ++it) {
+    const Breaker &breaker = it->second;
+    item = Tcl_NewDictObj();
+    Tcl_DictObjPut(NULL, item, Tcl_NewStringObj("state", -1),
+                   Tcl_NewStringObj(stateNames[breaker.state], -1));
+    Tcl_DictObjPut(NULL, item, Tcl_NewStringObj("calls", -1),
+                   Tcl_NewWideIntObj(breaker.calls));
+    Tcl_DictObjPut(NULL, item, Tcl_NewStringObj("errors", -1),
+                   Tcl_NewWideIntObj(breaker.errors));
+    Tcl_DictObjPut(NULL, item, Tcl_NewStringObj("timeouts", -1),
+                   Tcl_NewWideIntObj(breaker.timeouts));
+    Tcl_DictObjPut(NULL, item, Tcl_NewStringObj("opened", -1),
+                   Tcl_NewWideIntObj(breaker.opened));
+    Tcl_DictObjPut(NULL, item, Tcl_NewStringObj("bypassed", -1),
+                   Tcl_NewWideIntObj(breaker.bypassed));
+    Tcl_DictObjPut(NULL, item, Tcl_NewStringObj("last_error", -1),
+                   Tcl_NewStringObj(breaker.last_error.c_str(), -1));
+    Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj(it->first.c_str(), -1), item);
+  }
+  Tcl_MutexUnlock(&lock);
+  return dict;
+}
@@ -0,0 +1,89 @@
+/*
+ * breaker.h: Per-processor circuit breakers of the eCAP Tcl adapter.
+ * A breaker measures the error and timeout rates of the transactions
+ * handled by a processor, and when a rate exceeds its threshold, it opens:
+ * new transactions of the processor bypass adaptation for a cooldown
+ * period. Then a single transaction is let through, to probe whether the
+ * processor has recovered.
+ * The breakers are used by the host thread, and read by ::ecap-tcl::stats.
+ */
+#ifndef ECAPTCL_BREAKER_H
+#define ECAPTCL_BREAKER_H
+
+#include <map>
+#include <string>
+#include <tcl.h>
+#include "stats.h"
+
+namespace Adapter {
+
+enum BreakerState { BREAKER_CLOSED, BREAKER_OPEN, BREAKER_HALF_OPEN };
+
+/* How a transaction ended, as far as its processor is concerned */
+enum BreakerOutcome {
+  OUTCOME_IGNORED, // no processor handled the transaction
+  OUTCOME_OK, OUTCOME_ERROR, OUTCOME_TIMEOUT
+};
+
+class Breakers {
+  public:
+    Breakers(Stats &s);
+    ~Breakers();
+
+    // Configuration (see reset() for the defaults)
+    unsigned int error_rate;   // %, 0: disabled
+    unsigned int timeout_rate; // %, 0: disabled
+    unsigned int min_calls;    // transactions, before the rates count
+    unsigned int window;       // msecs, the rates are measured over
+    unsigned int cooldown;     // msecs, a breaker stays open
+    unsigned int sample;       // % of new transactions bypassed
+
+    bool enabled() const;
+    void reset(); // restores the default configuration, forgets processors
+
+    // Returns true if one more transaction should be bypassed, according
+    // to sample (i.e. 25: one every four transactions)
+    bool sampled();
+    // Returns true if a new transaction of processor must bypass adaptation.
+    // A transaction let through as the probe of a half-open breaker gets
+    // its probe (otherwise 0) to pass to record(): only the outcome of the
+    // probe changes the state of a half-open breaker.
+    bool bypass(const std::string &processor, unsigned long *probe = NULL);
+    void record(const std::string &processor, BreakerOutcome outcome,
+                const std::string &reason, unsigned long probe = 0);
+
+    // The processor that handled the last transaction of a MIME type: new
+    // transactions are checked against its breaker.
+    void learn(const std::string &mime, const std::string &processor);
+    std::string processorFor(const std::string &mime) const;
+
+    static const char *const stateNames[];
+    // Returns a (zero reference count) dict, with the state of each breaker
+    Tcl_Obj *toDict() const;
+
+  private:
+    struct Breaker {
+      BreakerState state = BREAKER_CLOSED;
+      Tcl_WideInt  window_start = 0;
+      Tcl_WideInt  opened_at = 0;
+      Tcl_WideInt  probe_at = 0;
+      unsigned int calls = 0, errors = 0, timeouts = 0; // in this window
+      bool         probing = false; // the half-open probe is running
+      unsigned long probe = 0;      // ... and which one it is
+      Tcl_WideInt  bypassed = 0, opened = 0;
+      std::string  last_error;
+    };
+    void trip(Breaker &breaker, Tcl_WideInt now);
+    bool takeSample();
+
+    Stats &stats;
+    unsigned int sample_credit = 0;
+    unsigned long probes = 0;
+    mutable Tcl_Mutex lock;
+    std::map<std::string, Breaker> breakers;
+    std::map<std::string, std::string> routes; // mime -> processor
+};
+
+} // namespace Adapter
+
+#endif /* ECAPTCL_BREAKER_H */
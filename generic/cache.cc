@@ -0,0 +1,558 @@
+/*
+ * cache.cc: A cache of adapted responses of the eCAP Tcl adapter.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+/* The first line of a cache file, followed by the sizes of the key, of the
+ * headers (name and value, each ended by a null byte), and of the body. */
+static const char CacheFileMagic[] = "ECAPTCL-CACHE-1";
+
+/* A response larger than this fraction of the memory is not cached */
+static const size_t MaxEntryFraction = 8;
+
+/* The entries evicted from memory while this many files are waiting to be
+ * written are not written */
+static const size_t MaxDiskJobs = 64;
+
+/* The suffix of the cache files, and of the files being written */
+static const char CacheFileSuffix[] = ".ecap";
+static const char CacheTempSuffix[] = ".ecap.tmp";
+
+Adapter::CachedResponse::CachedResponse(const CachedHeaders &h,
+                                        std::string &body): headers(h) {
+  data.swap(body);
+  start  = data.data();
+  length = data.size();
+}
+
+Adapter::CachedResponse::CachedResponse(const CachedHeaders &h, void *m,
+                                        size_t m_size, const char *body,
+                                        size_t body_size):
+  headers(h), map(m), map_size(m_size), start(body), length(body_size) {
+}
+
+Adapter::CachedResponse::~CachedResponse() {
+  if (map) munmap(map, map_size);
+}
+
+size_t Adapter::CachedResponse::size() const {
+  size_t total = sizeof(*this) + (map ? 0 : data.capacity());
+  for (CachedHeaders::const_iterator it = headers.begin();
+       it != headers.end(); ++it) {
+    total += it->first.size() + it->second.size() + 2 * sizeof(std::string);
+  }
+  return total;
+}
+
+Adapter::ResponseCache::ResponseCache() {
+}
+
+Adapter::ResponseCache::~ResponseCache() {
+  int result;
+  bool stopping;
+  Tcl_MutexLock(&lock);
+  stopping = disk_running;
+  disk_running = false;
+  Tcl_ConditionNotify(&disk_wake);
+  Tcl_MutexUnlock(&lock);
+  if (stopping) Tcl_JoinThread(disk_thread, &result);
+  Tcl_ConditionFinalize(&disk_wake);
+  Tcl_MutexFinalize(&lock);
+}
+
+bool Adapter::ResponseCache::configure(size_t memory_limit,
+                                       const std::string &directory,
+                                       size_t disk_limit,
+                                       std::string &error) {
+  struct stat info;
+  if (!directory.empty() &&
+      (stat(directory.c_str(), &info) < 0 || !S_ISDIR(info.st_mode) ||
+       access(directory.c_str(), W_OK) < 0)) {
+    error = "cache_dir is not a writable directory: " + directory;
+    return false;
+  }
+  Tcl_MutexLock(&lock);
+  if (!directory.empty() && !disk_running) {
+    if (Tcl_CreateThread(&disk_thread, diskThread, this,
+                         TCL_THREAD_STACK_DEFAULT,
+                         TCL_THREAD_JOINABLE) != TCL_OK) {
+      Tcl_MutexUnlock(&lock);
+      error = "cannot create the thread of cache_dir";
+      return false;
+    }
+    disk_running = true;
+  }
+  max_memory = memory_limit;
+  evictMemory(max_memory);
+  if (directory != dir) {
+    // The entries of the old directory are forgotten (and removed), and
+    // the files left in the new one by previous runs are removed...
+    evictDisk(0);
+    dir = directory;
+    purging = dir;
+    disk_generation++;
+  }
+  max_disk = dir.empty() ? 0 : disk_limit;
+  evictDisk(max_disk);
+  Tcl_ConditionNotify(&disk_wake);
+  Tcl_MutexUnlock(&lock);
+  return true;
+}
+
+size_t Adapter::ResponseCache::maxEntrySize() const {
+  return max_memory / MaxEntryFraction;
+}
+
+void Adapter::ResponseCache::setVersion(const std::string &mime,
+                                        const std::string &version) {
+  Tcl_MutexLock(&lock);
+  if (version.empty()) {
+    versions.erase(mime);
+  } else {
+    versions[mime] = version;
+  }
+  Tcl_MutexUnlock(&lock);
+}
+
+bool Adapter::ResponseCache::version(const std::string &mime,
+                                     std::string &version) const {
+  bool found;
+  Tcl_MutexLock(&lock);
+  std::unordered_map<std::string, std::string>::const_iterator it =
+    versions.find(mime);
+  if ((found = it != versions.end())) version = it->second;
+  Tcl_MutexUnlock(&lock);
+  return found;
+}
+
+Adapter::CacheLookup
+Adapter::ResponseCache::lookup(const std::string &key, Xaction *action,
+                               CachedResponsePtr &response) {
+  CacheLookup result = CACHE_MISS;
+  Tcl_MutexLock(&lock);
+  std::unordered_map<std::string, MemoryEntry>::iterator it =
+    memory.find(key);
+  std::unordered_map<std::string, std::vector<Xaction *> >::iterator
+    waiting;
+  if (it != memory.end()) {
+    memory_lru.splice(memory_lru.begin(), memory_lru, it->second.lru);
+    response = it->second.response;
+    result = CACHE_HIT;
+  } else if ((waiting = adapting.find(key)) != adapting.end()) {
+    // Being adapted, or mapped back from disk
+    waiting->second.push_back(action);
+    result = CACHE_WAIT;
+  } else if (disk.find(key) != disk.end()) {
+    // The disk thread maps it back to memory, and the caller waits for it
+    // like for a transaction adapting it...
+    adapting[key].push_back(action);
+    disk_jobs.push_back(DiskJob());
+    disk_jobs.back().key = key;
+    disk_loads++;
+    Tcl_ConditionNotify(&disk_wake);
+    result = CACHE_LOAD;
+  } else {
+    adapting[key]; // the caller adapts it
+  }
+  Tcl_MutexUnlock(&lock);
+  return result;
+}
+
+bool Adapter::ResponseCache::store(const std::string &key,
+                                   const CachedResponsePtr &response,
+                                   std::vector<Xaction *> &waiters) {
+  size_t size = response->size() + key.size();
+  bool stored;
+  Tcl_MutexLock(&lock);
+  if ((stored = max_memory && size <= maxEntrySize() &&
+                memory.find(key) == memory.end())) {
+    evictMemory(max_memory - size);
+    memory_lru.push_front(key);
+    MemoryEntry &entry = memory[key];
+    entry.response = response;
+    entry.lru = memory_lru.begin();
+    memory_size += size;
+  }
+  Tcl_MutexUnlock(&lock);
+  abandon(key, waiters);
+  return stored;
+}
+
+void Adapter::ResponseCache::abandon(const std::string &key,
+                                     std::vector<Xaction *> &waiters) {
+  Tcl_MutexLock(&lock);
+  std::unordered_map<std::string, std::vector<Xaction *> >::iterator it =
+    adapting.find(key);
+  if (it != adapting.end()) {
+    waiters.swap(it->second);
+    adapting.erase(it);
+  }
+  Tcl_MutexUnlock(&lock);
+}
+
+void Adapter::ResponseCache::forget(const std::string &key, Xaction *action) {
+  Tcl_MutexLock(&lock);
+  std::unordered_map<std::string, std::vector<Xaction *> >::iterator it =
+    adapting.find(key);
+  if (it != adapting.end()) {
+    std::vector<Xaction *> &waiters = it->second;
+    for (std::vector<Xaction *>::iterator w = waiters.begin();
+         w != waiters.end(); ++w) {
+      if (*w == action) {
+        waiters.erase(w);
+        break;
+      }
+    }
+  }
+  loaded.erase(std::remove(loaded.begin(), loaded.end(), action),
+               loaded.end());
+  Tcl_MutexUnlock(&lock);
+}
+
+bool Adapter::ResponseCache::loading() const {
+  bool result;
+  Tcl_MutexLock(&lock);
+  result = disk_loads != 0 || !loaded.empty();
+  Tcl_MutexUnlock(&lock);
+  return result;
+}
+
+void Adapter::ResponseCache::takeLoaded(std::vector<Xaction *> &waiters) {
+  Tcl_MutexLock(&lock);
+  waiters.swap(loaded);
+  loaded.clear();
+  Tcl_MutexUnlock(&lock);
+}
+
+void Adapter::ResponseCache::clear() {
+  Tcl_MutexLock(&lock);
+  memory.clear();
+  memory_lru.clear();
+  memory_size = 0;
+  evictDisk(0);
+  Tcl_MutexUnlock(&lock);
+}
+
+Tcl_Obj *Adapter::ResponseCache::toDict() const {
+  Tcl_Obj *dict = Tcl_NewDictObj();
+  Tcl_MutexLock(&lock);
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("entries", -1),
+                 Tcl_NewWideIntObj(memory.size()));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("bytes", -1),
+                 Tcl_NewWideIntObj(memory_size));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("max_bytes", -1),
+                 Tcl_NewWideIntObj(max_memory));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("disk_entries", -1),
+                 Tcl_NewWideIntObj(disk.size()));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("disk_bytes", -1),
+                 Tcl_NewWideIntObj(disk_size));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("max_disk_bytes", -1),
+                 Tcl_NewWideIntObj(max_disk));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("adapting", -1),
+                 Tcl_NewWideIntObj(adapting.size()));
+  Tcl_MutexUnlock(&lock);
+  return dict;
+}
+
+// Evicts the least recently used entries, until memory_size <= limit. The
+// entries evicted go to disk (written by the disk thread), if there is a
+// disk and they are not there already.
+void Adapter::ResponseCache::evictMemory(size_t limit) {
+  while (memory_size > limit && !memory_lru.empty()) {
+    std::unordered_map<std::string, MemoryEntry>::iterator it =
+      memory.find(memory_lru.back());
+    memory_size -= it->second.response->size() + it->first.size();
+    if (max_disk && disk_jobs.size() < MaxDiskJobs &&
+        disk.find(it->first) == disk.end()) {
+      disk_jobs.push_back(DiskJob());
+      disk_jobs.back().key = it->first;
+      disk_jobs.back().response = it->second.response;
+      Tcl_ConditionNotify(&disk_wake);
+    }
+    memory.erase(it);
+    memory_lru.pop_back();
+  }
+}
+
+// The files of the entries evicted are removed by the disk thread.
+void Adapter::ResponseCache::evictDisk(size_t limit) {
+  while (disk_size > limit && !disk_lru.empty()) {
+    std::unordered_map<std::string, DiskEntry>::iterator it =
+      disk.find(disk_lru.back());
+    unlinking.push_back(it->second.path);
+    dropDisk(it);
+  }
+  if (!unlinking.empty()) Tcl_ConditionNotify(&disk_wake);
+}
+
+// Forgets an entry, leaving its file alone
+void Adapter::ResponseCache::dropDisk(
+    std::unordered_map<std::string, DiskEntry>::iterator it) {
+  std::unordered_map<std::string, std::string>::iterator file =
+    files.find(it->second.path);
+  if (file != files.end() && file->second == it->first) files.erase(file);
+  disk_size -= it->second.size;
+  disk_lru.erase(it->second.lru);
+  disk.erase(it);
+}
+
+// The file of a key: the process that wrote it (see purge()), and the
+// (FNV-1a) hash of the key, which the file checks against the whole key.
+// Two keys of the same hash share the file: the last written evicts the
+// other one (see spill()).
+std::string Adapter::ResponseCache::diskPath(const std::string &key) const {
+  unsigned long long hash = 14695981039346656037ULL;
+  char name[64];
+  for (std::string::size_type i = 0; i < key.size(); i++) {
+    hash ^= (unsigned char) key[i];
+    hash *= 1099511628211ULL;
+  }
+  snprintf(name, sizeof(name), "/%ld-%016llx%s", (long) getpid(), hash,
+           CacheFileSuffix);
+  return dir + name;
+}
+
+Tcl_ThreadCreateType Adapter::ResponseCache::diskThread(ClientData data) {
+  ((ResponseCache *) data)->serveDisk();
+  TCL_THREAD_CREATE_RETURN;
+}
+
+// Purges a new directory, removes the files of the entries evicted, then
+// writes and maps files, in the order they were asked for.
+void Adapter::ResponseCache::serveDisk() {
+  std::string directory;
+  std::vector<std::string> paths;
+  DiskJob job;
+  Tcl_MutexLock(&lock);
+  while (disk_running) {
+    if (!purging.empty()) {
+      directory.swap(purging);
+      purging.clear();
+      Tcl_MutexUnlock(&lock);
+      purge(directory);
+    } else if (!unlinking.empty()) {
+      paths.swap(unlinking);
+      unlinking.clear();
+      Tcl_MutexUnlock(&lock);
+      for (std::vector<std::string>::const_iterator it = paths.begin();
+           it != paths.end(); ++it) {
+        unlink(it->c_str());
+      }
+    } else if (!disk_jobs.empty()) {
+      job = disk_jobs.front();
+      disk_jobs.pop_front();
+      Tcl_MutexUnlock(&lock);
+      if (job.response) {
+        spill(job.key, job.response);
+      } else {
+        load(job.key);
+      }
+      job.response.reset();
+    } else {
+      Tcl_ConditionWait(&disk_wake, &lock, NULL);
+      continue;
+    }
+    Tcl_MutexLock(&lock);
+  }
+  Tcl_MutexUnlock(&lock);
+}
+
+// Removes the cache files of this process, and of the processes that are
+// gone (i.e. of a previous run of the host): the entries of cache_dir are
+// not kept across runs, and their files would not count in
+// cache_disk_size.
+void Adapter::ResponseCache::purge(const std::string &directory) {
+  std::vector<std::string> paths;
+  struct dirent *entry;
+  DIR *handle;
+  char *end;
+  if ((handle = opendir(directory.c_str())) == NULL) return;
+  while ((entry = readdir(handle)) != NULL) {
+    std::string name(entry->d_name);
+    long pid = strtol(name.c_str(), &end, 10);
+    if (end == name.c_str() || *end != '-' || pid <= 0) continue;
+    if ((name.size() <= strlen(CacheFileSuffix) ||
+         name.compare(name.size() - strlen(CacheFileSuffix),
+                      std::string::npos, CacheFileSuffix) != 0) &&
+        (name.size() <= strlen(CacheTempSuffix) ||
+         name.compare(name.size() - strlen(CacheTempSuffix),
+                      std::string::npos, CacheTempSuffix) != 0)) continue;
+    if (pid != (long) getpid() &&
+        (kill((pid_t) pid, 0) == 0 || errno != ESRCH)) continue;
+    paths.push_back(directory + "/" + name);
+  }
+  closedir(handle);
+  for (std::vector<std::string>::const_iterator it = paths.begin();
+       it != paths.end(); ++it) {
+    Tcl_MutexLock(&lock);
+    bool known = files.find(*it) != files.end();
+    Tcl_MutexUnlock(&lock);
+    if (!known) unlink(it->c_str());
+  }
+}
+
+// Writes a response to disk: to a temporary file, renamed when complete,
+// so a file is never seen half written. The entry is added if cache_dir
+// has not changed meanwhile.
+void Adapter::ResponseCache::spill(const std::string &key,
+                                   const CachedResponsePtr &response) {
+  std::string headers, path, temporary;
+  unsigned long generation;
+  char line[128];
+  FILE *file;
+  bool skip;
+  for (CachedHeaders::const_iterator it = response->headers.begin();
+       it != response->headers.end(); ++it) {
+    headers.append(it->first).push_back('\0');
+    headers.append(it->second).push_back('\0');
+  }
+  snprintf(line, sizeof(line), "%s %lu %lu %lu\n", CacheFileMagic,
+           (unsigned long) key.size(), (unsigned long) headers.size(),
+           (unsigned long) response->bodySize());
+  size_t size = strlen(line) + key.size() + headers.size() +
+                response->bodySize();
+  Tcl_MutexLock(&lock);
+  skip = size > max_disk / MaxEntryFraction || disk.find(key) != disk.end();
+  path = diskPath(key);
+  generation = disk_generation;
+  Tcl_MutexUnlock(&lock);
+  if (skip) return;
+  temporary = path.substr(0, path.size() - strlen(CacheFileSuffix)) +
+              CacheTempSuffix;
+  if ((file = fopen(temporary.c_str(), "wb")) == NULL) return;
+  bool ok = fputs(line, file) >= 0 &&
+    fwrite(key.data(), 1, key.size(), file) == key.size() &&
+    fwrite(headers.data(), 1, headers.size(), file) == headers.size() &&
+    fwrite(response->body(), 1, response->bodySize(), file) ==
+      response->bodySize();
+  if (fclose(file) != 0) ok = false;
+  if (!ok || rename(temporary.c_str(), path.c_str()) < 0) {
+    unlink(temporary.c_str());
+    return;
+  }
+  Tcl_MutexLock(&lock);
+  if (generation != disk_generation || size > max_disk / MaxEntryFraction) {
+    unlinking.push_back(path);
+  } else {
+    // The file replaced the one of another key of the same hash...
+    std::unordered_map<std::string, std::string>::iterator occupant =
+      files.find(path);
+    if (occupant != files.end()) dropDisk(disk.find(occupant->second));
+    unlinking.erase(std::remove(unlinking.begin(), unlinking.end(), path),
+                    unlinking.end());
+    evictDisk(max_disk - size);
+    disk_lru.push_front(key);
+    DiskEntry &entry = disk[key];
+    entry.path = path;
+    entry.size = size;
+    entry.lru  = disk_lru.begin();
+    disk_size += size;
+    files[path] = key;
+  }
+  Tcl_MutexUnlock(&lock);
+}
+
+// Maps the file of an entry back to memory, and hands the transactions
+// that waited for it to the host thread: they find it in memory, or (if
+// the file is gone) adapt the response.
+void Adapter::ResponseCache::load(const std::string &key) {
+  std::unordered_map<std::string, DiskEntry>::iterator it;
+  std::unordered_map<std::string, std::vector<Xaction *> >::iterator
+    waiting;
+  std::string path;
+  CachedResponsePtr response;
+  Tcl_MutexLock(&lock);
+  if ((it = disk.find(key)) != disk.end()) path = it->second.path;
+  Tcl_MutexUnlock(&lock);
+  if (!path.empty()) response = mapFile(key, path);
+  Tcl_MutexLock(&lock);
+  it = disk.find(key);
+  if (response) {
+    if (it != disk.end()) {
+      disk_lru.splice(disk_lru.begin(), disk_lru, it->second.lru);
+    }
+    if (memory.find(key) == memory.end()) {
+      // Even if it is larger than maxEntrySize(): its body is mapped
+      size_t size = response->size() + key.size();
+      evictMemory(size < max_memory ? max_memory - size : 0);
+      memory_lru.push_front(key);
+      MemoryEntry &entry = memory[key];
+      entry.response = response;
+      entry.lru = memory_lru.begin();
+      memory_size += size;
+    }
+  } else if (it != disk.end() && it->second.path == path) {
+    // The file is gone (or is not ours any more)
+    dropDisk(it);
+  }
+  if ((waiting = adapting.find(key)) != adapting.end()) {
+    loaded.insert(loaded.end(), waiting->second.begin(),
+                  waiting->second.end());
+    adapting.erase(waiting);
+  }
+  disk_loads--;
+  Tcl_MutexUnlock(&lock);
+}
+
+// Maps the file of a response: its body is sent from the mapped file.
+Adapter::CachedResponsePtr
+Adapter::ResponseCache::mapFile(const std::string &key,
+                                const std::string &path) {
+  struct stat info;
+  unsigned long key_size, headers_size, body_size;
+  int fd, consumed = 0;
+  void *map;
+
+  if ((fd = open(path.c_str(), O_RDONLY)) < 0) {
+    return CachedResponsePtr();
+  }
+  if (fstat(fd, &info) < 0 || info.st_size <= 0) {
+    close(fd);
+    return CachedResponsePtr();
+  }
+  map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return CachedResponsePtr();
+
+  const char *p = (const char *) map, *end = p + info.st_size;
+  const char *eol = (const char *) memchr(p, '\n', end - p);
+  std::string first(p, eol ? eol - p : 0);
+  std::string format(CacheFileMagic);
+  format += " %lu %lu %lu%n";
+  if (eol == NULL ||
+      sscanf(first.c_str(), format.c_str(), &key_size,
+             &headers_size, &body_size, &consumed) != 3 ||
+      (size_t) consumed != first.size() ||
+      (size_t) (end - eol - 1) != key_size + headers_size + body_size ||
+      key.compare(0, std::string::npos, eol + 1, key_size) != 0) {
+    munmap(map, info.st_size);
+    return CachedResponsePtr();
+  }
+  p = eol + 1 + key_size;
+  const char *body = p + headers_size;
+  CachedHeaders headers;
+  while (p < body) {
+    const char *name_end = (const char *) memchr(p, '\0', body - p);
+    if (name_end == NULL) break;
+    const char *value_end = (const char *)
+      memchr(name_end + 1, '\0', body - name_end - 1);
+    if (value_end == NULL) break;
+    headers.push_back(std::make_pair(std::string(p, name_end - p),
+      std::string(name_end + 1, value_end - name_end - 1)));
+    p = value_end + 1;
+  }
+  return CachedResponsePtr(new CachedResponse(headers, map, info.st_size,
+                                              body, body_size));
+}
@@ -0,0 +1,162 @@
+/*
+ * cache.h: A cache of adapted responses, for deterministic processors. A
+ * response whose virgin body is known to be the same (same URI, ETag,
+ * Last-Modified and Content-Encoding), adapted by a processor that has not
+ * changed (same declared version), is served from the cache, without
+ * calling Tcl.
+ * Entries are kept in memory (least recently used first out) and, with
+ * cache_dir, the entries evicted from memory are written to disk, and
+ * mapped back (mmap) when hit. The files are written and mapped by a thread
+ * of the cache, without the lock: a transaction that hits the disk waits
+ * for its entry to be mapped back to memory, and is resumed by the host
+ * thread (see Service::resume()).
+ * Misses are collapsed: while a transaction adapts a response for the
+ * cache, the transactions for the same key wait for it, instead of
+ * adapting it too.
+ * The cache is used by the host thread, and by the ::ecap-tcl::cache
+ * command (from any thread): it is guarded by a lock.
+ */
+#ifndef ECAPTCL_CACHE_H
+#define ECAPTCL_CACHE_H
+
+#include <deque>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <tcl.h>
+
+namespace Adapter {
+
+class Xaction;
+
+typedef std::vector<std::pair<std::string, std::string> > CachedHeaders;
+
+/* An adapted response: its headers, and its body (in memory or mapped) */
+class CachedResponse {
+  public:
+    CachedResponse(const CachedHeaders &h, std::string &body); // takes body
+    CachedResponse(const CachedHeaders &h, void *map, size_t map_size,
+                   const char *body, size_t body_size);
+    ~CachedResponse();
+
+    const CachedHeaders headers;
+    const char *body() const {return start;}
+    size_t      bodySize() const {return length;}
+    size_t      size() const; // memory used, roughly
+
+  private:
+    CachedResponse(const CachedResponse &);
+    CachedResponse &operator =(const CachedResponse &);
+
+    std::string data;
+    void       *map = NULL;
+    size_t      map_size = 0;
+    const char *start;
+    size_t      length;
+};
+typedef std::shared_ptr<const CachedResponse> CachedResponsePtr;
+
+// CACHE_LOAD: the entry is on disk, wait for it to be mapped
+enum CacheLookup { CACHE_HIT, CACHE_MISS, CACHE_WAIT, CACHE_LOAD };
+
+class ResponseCache {
+  public:
+    ResponseCache();
+    ~ResponseCache();
+
+    // Returns false, leaving an error message in error. Entries beyond the
+    // new limits are evicted.
+    bool configure(size_t memory, const std::string &dir, size_t disk,
+                   std::string &error);
+    bool enabled() const {return max_memory != 0;}
+    size_t maxEntrySize() const; // larger responses are not cached
+
+    // The versions declared by processors, for the MIME types they handle
+    // (no version: the responses of the MIME type are not cached)
+    void setVersion(const std::string &mime, const std::string &version);
+    bool version(const std::string &mime, std::string &version) const;
+
+    // A hit sets response. On a miss, the caller must adapt the response,
+    // and store() or abandon() it. A transaction told to wait is resumed
+    // when the one adapting the response is done.
+    CacheLookup lookup(const std::string &key, Xaction *action,
+                       CachedResponsePtr &response);
+    // Both return the transactions waiting for the key (store() returns
+    // false if the response is too large to be cached)
+    bool store(const std::string &key, const CachedResponsePtr &response,
+               std::vector<Xaction *> &waiters);
+    void abandon(const std::string &key, std::vector<Xaction *> &waiters);
+    // A waiting transaction that is gone
+    void forget(const std::string &key, Xaction *action);
+    // Are entries being mapped back from disk (the host thread must poll
+    // for them)? takeLoaded() returns the transactions that waited for them,
+    // to be resumed.
+    bool loading() const;
+    void takeLoaded(std::vector<Xaction *> &waiters);
+
+    void clear();
+    // Returns a (zero reference count) dict with the sizes of the cache
+    Tcl_Obj *toDict() const;
+
+  private:
+    typedef std::list<std::string> LruList;
+    struct MemoryEntry {
+      CachedResponsePtr response;
+      LruList::iterator lru;
+    };
+    struct DiskEntry {
+      std::string       path;
+      size_t            size;
+      LruList::iterator lru;
+    };
+
+    // A file to write (response set) or to map, for the disk thread
+    struct DiskJob {
+      std::string       key;
+      CachedResponsePtr response;
+    };
+
+    void evictMemory(size_t limit);
+    void evictDisk(size_t limit);
+    void dropDisk(std::unordered_map<std::string, DiskEntry>::iterator it);
+    std::string diskPath(const std::string &key) const;
+
+    // The disk thread, and its jobs (called without the lock)
+    static Tcl_ThreadCreateType diskThread(ClientData clientData);
+    void serveDisk();
+    void spill(const std::string &key, const CachedResponsePtr &response);
+    void load(const std::string &key);
+    void purge(const std::string &directory);
+    static CachedResponsePtr mapFile(const std::string &key,
+                                     const std::string &path);
+
+    mutable Tcl_Mutex lock = NULL;
+    size_t      max_memory = 0;
+    size_t      max_disk = 0;
+    std::string dir;
+    size_t      memory_size = 0;
+    size_t      disk_size = 0;
+    LruList     memory_lru; // the most recently used first
+    LruList     disk_lru;
+    std::unordered_map<std::string, MemoryEntry> memory;
+    std::unordered_map<std::string, DiskEntry>   disk;
+    std::unordered_map<std::string, std::string> files; // path: its key
+    std::unordered_map<std::string, std::vector<Xaction *> > adapting;
+    std::unordered_map<std::string, std::string> versions;
+
+    Tcl_ThreadId         disk_thread;
+    bool                 disk_running = false;
+    Tcl_Condition        disk_wake = NULL;
+    std::deque<DiskJob>  disk_jobs;
+    size_t               disk_loads = 0; // queued or running
+    unsigned long        disk_generation = 0; // incremented with dir
+    std::string          purging; // a new dir, to purge first
+    std::vector<std::string> unlinking; // the files of evicted entries
+    std::vector<Xaction *> loaded;
+};
+
+} // namespace Adapter
+
+#endif /* ECAPTCL_CACHE_H */
@@ -18,6 +18,39 @@ class ValuesToDict: public libecap::NamedValueVisitor {
     Tcl_Obj *object;
 };
 
+/* Gets the action of the call evaluated by the interpreter. The call stays
+ * locked while the guard is in scope, so the host cannot abandon the call
+ * (and release the action) while a command uses it. */
+class ActionGuard {
+  public:
+    ActionGuard(Tcl_Interp *interp): action(NULL) {
+      call = (Adapter::TclCallClientData *)
+        Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_ACTION, NULL);
+      if (call == NULL) {
+        Tcl_SetResult(interp, (char *) "called ouside an action context: "
+                              "no action poiner found", TCL_STATIC);
+        return;
+      }
+      Tcl_MutexLock(&call->lock);
+      action = call->action;
+      if (action == NULL) {
+        Tcl_SetResult(interp, (char *) "called ouside an action context: "
+                              "no action poiner found", TCL_STATIC);
+      } else if (action->host() == NULL) {
+        Tcl_SetResult(interp, (char *) "called ouside an action context: "
+                              "no host pointer found", TCL_STATIC);
+        action = NULL;
+      }
+    }
+    ~ActionGuard() {
+      if (call) Tcl_MutexUnlock(&call->lock);
+    }
+    Adapter::TclHook hook() const { return call->hook; }
+    Adapter::Xaction *action;
+  private:
+    Adapter::TclCallClientData *call;
+};
+
 int TcleCAP_InitialiseInterpreter(Tcl_Interp *interp) {
   Tcl_Namespace *ecap, *action;
 
@@ -42,6 +75,38 @@ int TcleCAP_InitialiseInterpreter(Tcl_Interp *interp) {
                        TcleCAP_ActionContentCmd , NULL, NULL);
   Tcl_CreateObjCommand(interp, "::ecap-tcl::action::client",
                        TcleCAP_ActionClientCmd , NULL, NULL);
+  Tcl_CreateObjCommand(interp, "::ecap-tcl::action::processor",
+                       TcleCAP_ActionProcessorCmd , NULL, NULL);
+  Tcl_CreateObjCommand(interp, "::ecap-tcl::action::block",
+                       TcleCAP_ActionBlockCmd , NULL, NULL);
+  Tcl_CreateObjCommand(interp, "::ecap-tcl::action::meta",
+                       TcleCAP_ActionMetaCmd , NULL, NULL);
+  Tcl_CreateObjCommand(interp, "::ecap-tcl::action::coroutine",
+                       TcleCAP_ActionCoroutineCmd , NULL, NULL);
+  Tcl_CreateObjCommand(interp, "::ecap-tcl::action::suspend",
+                       TcleCAP_ActionSuspendCmd , NULL, NULL);
+  Tcl_CreateObjCommand(interp, "::ecap-tcl::resume",
+                       TcleCAP_ResumeCmd , NULL, NULL);
+  Tcl_CreateObjCommand(interp, "::ecap-tcl::stats",
+                       TcleCAP_StatsCmd , NULL, NULL);
+  Tcl_CreateObjCommand(interp, "::ecap-tcl::shared",
+                       TcleCAP_SharedCmd , NULL, NULL);
+  Tcl_CreateObjCommand(interp, "::ecap-tcl::match",
+                       TcleCAP_MatchCmd , NULL, NULL);
+  Tcl_CreateObjCommand(interp, "::ecap-tcl::cache",
+                       TcleCAP_CacheCmd , NULL, NULL);
+  Tcl_CreateObjCommand(interp, "::ecap-tcl::profile",
+                       TcleCAP_ProfileCmd , NULL, NULL);
+  Tcl_CreateObjCommand(interp, "::ecap-tcl::pool",
+                       TcleCAP_PoolCmd , NULL, NULL);
+  Tcl_CreateObjCommand(interp, "::ecap-tcl::native",
+                       TcleCAP_NativeCmd , NULL, NULL);
+  Tcl_CreateObjCommand(interp, "::ecap-tcl::log",
+                       TcleCAP_LogCmd , NULL, NULL);
+#ifdef HAVE_PCRE2
+  Tcl_CreateObjCommand(interp, "::ecap-tcl::re",
+                       TcleCAP_ReCmd , NULL, NULL);
+#endif
 
   /* Create the ensemble ::ecap-tcl::action */
   Tcl_CreateEnsemble(interp, "::ecap-tcl::action", action, 0);
@@ -51,7 +116,6 @@ int TcleCAP_InitialiseInterpreter(Tcl_Interp *interp) {
 
 int TcleCAP_ActionHeaderCmd(ClientData clientData, Tcl_Interp *interp,
                             int objc, Tcl_Obj *const objv[]) {
-  ClientData data;
   Adapter::Xaction *action;
   int index, i;
 
@@ -64,18 +128,8 @@ int TcleCAP_ActionHeaderCmd(ClientData clientData, Tcl_Interp *interp,
   };
 
   /* Get the action pointer from the interpreter... */
-  data = Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_ACTION, NULL);
-  if (data == NULL) {
-    Tcl_SetResult(interp, (char *) "called ouside an action context: "
-                          "no action poiner found", TCL_STATIC);
-    return TCL_ERROR;
-  }
-  action = (Adapter::Xaction *) data;
-  if (action->host() == NULL) {
-    Tcl_SetResult(interp, (char *) "called ouside an action context: "
-                          "no host pointer found", TCL_STATIC);
-    return TCL_ERROR;
-  }
+  ActionGuard guard(interp);
+  if ((action = guard.action) == NULL) return TCL_ERROR;
 
   if (objc < 2) {
       Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
@@ -159,7 +213,6 @@ int TcleCAP_ActionHeaderCmd(ClientData clientData, Tcl_Interp *interp,
 
 int TcleCAP_ActionHostCmd(ClientData clientData, Tcl_Interp *interp,
                           int objc, Tcl_Obj *const objv[]) {
-  ClientData data;
   Adapter::Xaction *action;
   int index;
 
@@ -172,18 +225,8 @@ int TcleCAP_ActionHostCmd(ClientData clientData, Tcl_Interp *interp,
   };
 
   /* Get the action pointer from the interpreter... */
-  data = Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_ACTION, NULL);
-  if (data == NULL) {
-    Tcl_SetResult(interp, (char *) "called ouside an action context: "
-                          "no action poiner found", TCL_STATIC);
-    return TCL_ERROR;
-  }
-  action = (Adapter::Xaction *) data;
-  if (action->host() == NULL) {
-    Tcl_SetResult(interp, (char *) "called ouside an action context: "
-                          "no host pointer found", TCL_STATIC);
-    return TCL_ERROR;
-  }
+  ActionGuard guard(interp);
+  if ((action = guard.action) == NULL) return TCL_ERROR;
 
   if (objc < 2) {
     Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
@@ -209,14 +252,23 @@ int TcleCAP_ActionHostCmd(ClientData clientData, Tcl_Interp *interp,
 
 int TcleCAP_ActionContentCmd(ClientData clientData, Tcl_Interp *interp,
                           int objc, Tcl_Obj *const objv[]) {
-  int index, len = 0;
+  Adapter::Xaction *action;
+  int index, len = 0, i;
 
   static const char *const optionStrings[] = {
-      "bytelength",
+      "bytelength", "digest", "json", "minify", "mode", "tags",
       NULL
   };
   enum options {
-      CONTENT_BYTELENGTH
+      CONTENT_BYTELENGTH, CONTENT_DIGEST, CONTENT_JSON, CONTENT_MINIFY,
+      CONTENT_MODE, CONTENT_TAGS
+  };
+  static const char *const modeStrings[] = {
+      "chunked", "whole",
+      NULL
+  };
+  enum modes {
+      MODE_CHUNKED, MODE_WHOLE
   };
 
   if (objc < 2) {
@@ -249,13 +301,136 @@ int TcleCAP_ActionContentCmd(ClientData clientData, Tcl_Interp *interp,
       }
       Tcl_SetObjResult(interp, Tcl_NewIntObj(len));
       break;
+    case CONTENT_DIGEST: {
+      if (objc != 2 && objc != 4) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?virgin|adapted algorithm?");
+        return TCL_ERROR;
+      }
+      ActionGuard guard(interp);
+      if ((action = guard.action) == NULL) return TCL_ERROR;
+      if (objc == 2) {
+        // All the digests of the transaction, i.e. virgin:sha256 <hex>...
+        Tcl_Obj *dict = Tcl_NewDictObj();
+        const std::vector<Adapter::BodyDigest> &digests = action->digests();
+        for (std::vector<Adapter::BodyDigest>::const_iterator it =
+               digests.begin(); it != digests.end(); ++it) {
+          Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj(it->name().c_str(), -1),
+                         Tcl_NewStringObj(it->hex().c_str(), -1));
+        }
+        Tcl_SetObjResult(interp, dict);
+        break;
+      }
+      int side, algorithm;
+      std::string error;
+      if (Tcl_GetIndexFromObj(interp, objv[2], Adapter::BodyDigest::sides,
+            "side", 0, &side) != TCL_OK ||
+          Tcl_GetIndexFromObj(interp, objv[3],
+            Adapter::BodyDigest::algorithms, "algorithm", 0,
+            &algorithm) != TCL_OK) {
+        return TCL_ERROR;
+      }
+      // Starts computing the digest, if it is not computed yet...
+      if (!action->addDigest((Adapter::BodyDigest::Side) side,
+             (Adapter::BodyDigest::Algorithm) algorithm, error)) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(error.c_str(), -1));
+        return TCL_ERROR;
+      }
+      const std::vector<Adapter::BodyDigest> &digests = action->digests();
+      for (std::vector<Adapter::BodyDigest>::const_iterator it =
+             digests.begin(); it != digests.end(); ++it) {
+        if (it->side() == side && it->algorithm() == algorithm) {
+          Tcl_SetObjResult(interp, Tcl_NewStringObj(it->hex().c_str(), -1));
+        }
+      }
+      break;
+    }
+    case CONTENT_MINIFY: {
+      if (objc > 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?none|html|css|js?");
+        return TCL_ERROR;
+      }
+      ActionGuard guard(interp);
+      if ((action = guard.action) == NULL) return TCL_ERROR;
+      if (objc == 3) {
+        int language;
+        std::string error;
+        if (Tcl_GetIndexFromObj(interp, objv[2], Adapter::Minifier::languages,
+              "language", 0, &language) != TCL_OK) {
+          return TCL_ERROR;
+        }
+        if (!action->setMinifier((Adapter::Minifier::Language) language,
+                                 error)) {
+          Tcl_SetObjResult(interp, Tcl_NewStringObj(error.c_str(), -1));
+          return TCL_ERROR;
+        }
+      }
+      Tcl_SetObjResult(interp, Tcl_NewStringObj(
+        Adapter::Minifier::languages[action->minifier()], -1));
+      break;
+    }
+    case CONTENT_MODE: {
+      if (objc > 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?chunked|whole?");
+        return TCL_ERROR;
+      }
+      ActionGuard guard(interp);
+      if ((action = guard.action) == NULL) return TCL_ERROR;
+      if (objc == 3) {
+        int mode;
+        if (Tcl_GetIndexFromObj(interp, objv[2], modeStrings, "mode", 0,
+              &mode) != TCL_OK) {
+          return TCL_ERROR;
+        }
+        if (!action->setWholeBody((enum modes) mode == MODE_WHOLE)) {
+          Tcl_SetResult(interp, (char *) "content mode cannot be changed "
+                        "after content has been received", TCL_STATIC);
+          return TCL_ERROR;
+        }
+      }
+      if (action->scanner()) {
+        Tcl_SetResult(interp, (char *) (action->scannerHook() ==
+          Adapter::HOOK_TAGS_ADAPT ? "tags" : "json"), TCL_STATIC);
+        break;
+      }
+      Tcl_SetObjResult(interp, Tcl_NewStringObj(
+        modeStrings[action->wholeBody() ? MODE_WHOLE : MODE_CHUNKED], -1));
+      break;
+    }
+    case CONTENT_JSON:
+    case CONTENT_TAGS: {
+      Adapter::TclHook hook = (enum options) index == CONTENT_TAGS ?
+        Adapter::HOOK_TAGS_ADAPT : Adapter::HOOK_JSON_ADAPT;
+      ActionGuard guard(interp);
+      if ((action = guard.action) == NULL) return TCL_ERROR;
+      if (objc > 2) {
+        // Switch to tags (json) mode, and subscribe to tags (paths)...
+        std::vector<std::string> names;
+        std::string error;
+        for (i = 2; i < objc; i++) names.push_back(Tcl_GetString(objv[i]));
+        if (!action->setScanner(hook, names, error)) {
+          Tcl_SetObjResult(interp, Tcl_NewStringObj(error.c_str(), -1));
+          return TCL_ERROR;
+        }
+      }
+      Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+      if (action->scanner() && action->scannerHook() == hook) {
+        const std::vector<std::string> &names =
+          action->scanner()->subscriptions();
+        for (std::vector<std::string>::const_iterator it = names.begin();
+             it != names.end(); ++it) {
+          Tcl_ListObjAppendElement(NULL, list,
+                                   Tcl_NewStringObj(it->c_str(), -1));
+        }
+      }
+      Tcl_SetObjResult(interp, list);
+      break;
+    }
   }
   return TCL_OK;
 }
 
 int TcleCAP_ActionClientCmd(ClientData clientData, Tcl_Interp *interp,
                           int objc, Tcl_Obj *const objv[]) {
-  ClientData data;
   Adapter::Xaction *action;
   int index;
 
@@ -268,13 +443,8 @@ int TcleCAP_ActionClientCmd(ClientData clientData, Tcl_Interp *interp,
   };
 
   /* Get the action pointer from the interpreter... */
-  data = Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_ACTION, NULL);
-  action = (Adapter::Xaction *) data;
-  if (action->host() == NULL) {
-    Tcl_SetResult(interp, (char *) "called ouside an action context: "
-                          "no host pointer found", TCL_STATIC);
-    return TCL_ERROR;
-  }
+  ActionGuard guard(interp);
+  if ((action = guard.action) == NULL) return TCL_ERROR;
 
   if (objc < 2) {
     Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
@@ -298,3 +468,1182 @@ int TcleCAP_ActionClientCmd(ClientData clientData, Tcl_Interp *interp,
   }
   return TCL_OK;
 }
+
+int TcleCAP_ActionProcessorCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[]) {
+  Adapter::Xaction *action;
+  int index;
+
+  static const char *const optionStrings[] = {
+      "name", "failed",
+      NULL
+  };
+  enum options {
+      PROCESSOR_NAME, PROCESSOR_FAILED
+  };
+
+  /* Get the action pointer from the interpreter... */
+  ActionGuard guard(interp);
+  if ((action = guard.action) == NULL) return TCL_ERROR;
+
+  if (objc < 2) {
+    Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
+    return TCL_ERROR;
+  }
+  if (Tcl_GetIndexFromObj(interp, objv[1], optionStrings, "option", 0,
+        &index) != TCL_OK) {
+    return TCL_ERROR;
+  }
+
+  switch ((enum options) index) {
+    case PROCESSOR_NAME:
+      if (objc > 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?name?");
+        return TCL_ERROR;
+      }
+      if (objc == 3) action->setProcessor(Tcl_GetString(objv[2]));
+      Tcl_SetObjResult(interp,
+        Tcl_NewStringObj(action->processor().c_str(), -1));
+      break;
+    case PROCESSOR_FAILED:
+      if (objc > 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?reason?");
+        return TCL_ERROR;
+      }
+      action->processorFailed(objc == 3 ? Tcl_GetString(objv[2]) : "");
+      break;
+  }
+  return TCL_OK;
+}
+
+int TcleCAP_ActionBlockCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[]) {
+  Adapter::TclCallClientData *call;
+
+  if (objc != 1) {
+    Tcl_WrongNumArgs(interp, 1, objv, "");
+    return TCL_ERROR;
+  }
+  /* Get the call from the interpreter (wantsUrl calls have no action)... */
+  call = (Adapter::TclCallClientData *)
+    Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_ACTION, NULL);
+  if (call == NULL) {
+    Tcl_SetResult(interp, (char *) "called ouside an action context: "
+                          "no action poiner found", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  if (call->hook == Adapter::HOOK_ACTION_STOP) {
+    Tcl_SetResult(interp, (char *) "cannot block from actionStop: "
+                          "the message has been sent", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  /* The host blocks the message, when the call returns... */
+  Tcl_MutexLock(&call->lock);
+  call->blocked = true;
+  Tcl_MutexUnlock(&call->lock);
+  return TCL_OK;
+}
+
+int TcleCAP_ActionMetaCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[]) {
+  Adapter::Xaction *action;
+  int index, i;
+
+  static const char *const optionStrings[] = {
+      "get", "remove", "set",
+      NULL
+  };
+  enum options {
+      META_GET, META_REMOVE, META_SET
+  };
+
+  /* Get the action pointer from the interpreter... */
+  ActionGuard guard(interp);
+  if ((action = guard.action) == NULL) return TCL_ERROR;
+
+  if (objc < 2) {
+      Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
+      return TCL_ERROR;
+  }
+  if (Tcl_GetIndexFromObj(interp, objv[1], optionStrings, "option", 0,
+          &index) != TCL_OK) {
+      return TCL_ERROR;
+  }
+
+  switch ((enum options) index) {
+    case META_SET: {
+      if (objc < 4 || objc % 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, "name value ?name value ...?");
+        return TCL_ERROR;
+      }
+      for (i = 2; i < objc; i += 2) {
+        const std::string name(Tcl_GetString(objv[i]));
+        if (strncasecmp(name.c_str(), "X-Ecap-Tcl", 10) == 0) {
+          Tcl_SetObjResult(interp, Tcl_ObjPrintf("reserved meta-information "
+            "name: \"%s\"", name.c_str()));
+          return TCL_ERROR;
+        }
+        action->setMeta(name, Tcl_GetString(objv[i+1]));
+      }
+      break;
+    }
+    case META_GET: {
+      if (objc > 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?name?");
+        return TCL_ERROR;
+      }
+      if (objc == 2) {
+        // Visit all options, including the ones of the adapter...
+        ValuesToDict visitor(interp, Tcl_NewDictObj());
+        action->visitEachOption(visitor);
+        Tcl_SetObjResult(interp, visitor.object);
+      } else {
+        const libecap::Area value =
+          action->option(libecap::Name(Tcl_GetString(objv[2])));
+        if (!value.start) {
+          Tcl_ResetResult(interp);
+        } else {
+          Tcl_SetObjResult(interp,
+              Tcl_NewStringObj((char *) value.start, value.size));
+        }
+      }
+      break;
+    }
+    case META_REMOVE: {
+      if (objc < 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "name ?name ...?");
+        return TCL_ERROR;
+      }
+      for (i = 2; i < objc; i ++) {
+        action->unsetMeta(Tcl_GetString(objv[i]));
+      }
+      break;
+    }
+  }
+  return TCL_OK;
+}
+
+/* ::ecap-tcl::action coroutine cmd ?arg ...?: from actionStart, creates the
+ * coroutine of the transaction (running cmd until it yields). Each call
+ * after actionStart then resumes it, instead of calling the hook, with an
+ * event (the name of the hook and its arguments, without the token): the
+ * value yielded next is the result of the call. */
+int TcleCAP_ActionCoroutineCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[]) {
+  Adapter::Xaction *action;
+  Tcl_Obj *cmdv[objc + 1];
+  Tcl_CmdInfo info;
+  int i, code;
+
+  if (objc < 2) {
+    Tcl_WrongNumArgs(interp, 1, objv, "cmd ?arg ...?");
+    return TCL_ERROR;
+  }
+  {
+    ActionGuard guard(interp);
+    if ((action = guard.action) == NULL) return TCL_ERROR;
+    if (guard.hook() != Adapter::HOOK_ACTION_START) {
+      Tcl_SetResult(interp, (char *) "a coroutine can only be created by "
+                            "actionStart", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    if (action->coroutine()) {
+      Tcl_SetResult(interp, (char *) "the transaction has a coroutine",
+                    TCL_STATIC);
+      return TCL_ERROR;
+    }
+    cmdv[0] = Tcl_NewStringObj("::coroutine", -1);
+    cmdv[1] = Tcl_NewStringObj(action->coroutineName().c_str(), -1);
+  }
+  /* The guard is released: the coroutine runs Tcl code, which may use the
+   * commands of the action... */
+  for (i = 1; i < objc; i++) cmdv[i + 1] = objv[i];
+  Tcl_IncrRefCount(cmdv[0]);
+  Tcl_IncrRefCount(cmdv[1]);
+  code = Tcl_EvalObjv(interp, objc + 1, cmdv, 0);
+  if (code == TCL_OK &&
+      Tcl_GetCommandInfo(interp, Tcl_GetString(cmdv[1]), &info)) {
+    /* ... and it has yielded: the next calls resume it */
+    ActionGuard guard(interp);
+    if ((action = guard.action) == NULL) {
+      Tcl_DeleteCommand(interp, Tcl_GetString(cmdv[1]));
+      code = TCL_ERROR;
+    } else {
+      action->setCoroutine();
+    }
+  }
+  Tcl_DecrRefCount(cmdv[0]);
+  Tcl_DecrRefCount(cmdv[1]);
+  return code;
+}
+
+/* ::ecap-tcl::action suspend: from contentDone (with event_loop), suspends
+ * the call: the result of the hook is ignored, and the call goes on, while
+ * the thread serves other transactions (and its events), until
+ * ::ecap-tcl::resume completes it. Returns the handle of the call. */
+int TcleCAP_ActionSuspendCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[]) {
+  Adapter::TclCallClientData *call;
+  Adapter::Service *service;
+  std::string handle;
+
+  if (objc != 1) {
+    Tcl_WrongNumArgs(interp, 1, objv, "");
+    return TCL_ERROR;
+  }
+  service = (Adapter::Service *)
+    Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_SERVICE, NULL);
+  if (service == NULL) {
+    Tcl_SetResult(interp, (char *) "no service pointer found", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  if (!service->event_loop) {
+    Tcl_SetResult(interp, (char *) "calls can be suspended only with "
+                          "event_loop", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  {
+    ActionGuard guard(interp);
+    if (guard.action == NULL) return TCL_ERROR;
+    if (guard.hook() != Adapter::HOOK_CONTENT_DONE) {
+      Tcl_SetResult(interp, (char *) "only contentDone can be suspended",
+                    TCL_STATIC);
+      return TCL_ERROR;
+    }
+  }
+  call = (Adapter::TclCallClientData *)
+    Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_ACTION, NULL);
+  if (call->suspended) {
+    Tcl_SetResult(interp, (char *) "the call is suspended", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  handle = Adapter::suspendCall(interp, call);
+  Tcl_SetObjResult(interp, Tcl_NewStringObj(handle.data(), handle.size()));
+  return TCL_OK;
+}
+
+/* ::ecap-tcl::resume ?-code code? handle ?result?: completes a call
+ * suspended (in this interpreter) by ::ecap-tcl::action suspend, as if its
+ * hook had returned result, with code (ok, the default, error, break, or
+ * block, as ::ecap-tcl::action block). Returns 1, or 0 if the host no
+ * longer waits for the call (its transaction has ended, or the time budget
+ * of the call has passed). */
+int TcleCAP_ResumeCmd(ClientData clientData, Tcl_Interp *interp,
+                      int objc, Tcl_Obj *const objv[]) {
+  static const char *const codeStrings[] = {
+      "ok", "error", "break", "block",
+      NULL
+  };
+  static const int codes[] = {
+      TCL_OK, TCL_ERROR, TCL_BREAK, ECAPTCL_BLOCK
+  };
+  int index = 0, first = 1;
+  bool delivered = false;
+
+  if (objc > 2 && strcmp(Tcl_GetString(objv[1]), "-code") == 0) {
+    if (Tcl_GetIndexFromObj(interp, objv[2], codeStrings, "code", 0,
+            &index) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    first = 3;
+  }
+  if (objc - first < 1 || objc - first > 2) {
+    Tcl_WrongNumArgs(interp, 1, objv, "?-code code? handle ?result?");
+    return TCL_ERROR;
+  }
+  if (!Adapter::resumeCall(interp, Tcl_GetString(objv[first]), codes[index],
+                           objc - first == 2 ? objv[first + 1] : NULL,
+                           delivered)) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("no suspended call \"%s\"",
+                                           Tcl_GetString(objv[first])));
+    return TCL_ERROR;
+  }
+  Tcl_SetObjResult(interp, Tcl_NewBooleanObj(delivered));
+  return TCL_OK;
+}
+
+int TcleCAP_StatsCmd(ClientData clientData, Tcl_Interp *interp,
+                     int objc, Tcl_Obj *const objv[]) {
+  ClientData data;
+  Adapter::Service *service;
+  int index;
+
+  /* Get the service pointer from the interpreter... */
+  data = Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_SERVICE, NULL);
+  if (data == NULL) {
+    Tcl_SetResult(interp, (char *) "no service pointer found", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  service = (Adapter::Service *) data;
+
+  if (objc > 2) {
+    Tcl_WrongNumArgs(interp, 1, objv, "?counter?");
+    return TCL_ERROR;
+  }
+  if (objc == 1) {
+    Tcl_Obj *dict = service->stats.toDict();
+    Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("breakers", -1),
+                   service->breakers.toDict());
+    Tcl_Obj *pools = Tcl_NewDictObj();
+    for (std::vector<Adapter::WorkerPoolPtr>::const_iterator it =
+           service->pools.begin(); it != service->pools.end(); ++it) {
+      Tcl_DictObjPut(NULL, pools, Tcl_NewStringObj((*it)->name.data(),
+                                                   (*it)->name.size()),
+                     (*it)->toDict());
+    }
+    Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("pools", -1), pools);
+    Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("log", -1),
+                   Adapter::Logger::toDict());
+    /* With shm_name, the counters of all the processes of the host... */
+    Tcl_Obj *host = service->stats.hostDict();
+    Tcl_Obj *shm  = service->shm.toDict();
+    if (host) Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("host", -1), host);
+    if (shm)  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("shm", -1), shm);
+    Tcl_SetObjResult(interp, dict);
+    return TCL_OK;
+  }
+  if (Tcl_GetIndexFromObj(interp, objv[1], Adapter::Stats::names, "counter",
+        0, &index) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  Tcl_SetObjResult(interp, Tcl_NewWideIntObj(
+    service->stats.get((Adapter::StatsCounter) index)));
+  return TCL_OK;
+}
+
+int TcleCAP_SharedCmd(ClientData clientData, Tcl_Interp *interp,
+                      int objc, Tcl_Obj *const objv[]) {
+  const Adapter::SharedSnapshot *snapshot;
+  const Adapter::SharedSlice *value;
+  int index, size;
+  const char *key;
+
+  static const char *const optionStrings[] = {
+      "exists", "get", "load", "size", "swap",
+      NULL
+  };
+  enum options {
+      SHARED_EXISTS, SHARED_GET, SHARED_LOAD, SHARED_SIZE, SHARED_SWAP
+  };
+
+  if (objc < 3) {
+      Tcl_WrongNumArgs(interp, 1, objv, "option table ?arg ...?");
+      return TCL_ERROR;
+  }
+  if (Tcl_GetIndexFromObj(interp, objv[1], optionStrings, "option", 0,
+          &index) != TCL_OK) {
+      return TCL_ERROR;
+  }
+
+  switch ((enum options) index) {
+    case SHARED_EXISTS:
+    case SHARED_GET: {
+      if ((enum options) index == SHARED_EXISTS ? objc != 4 :
+          (objc < 4 || objc > 5)) {
+        Tcl_WrongNumArgs(interp, 2, objv, (enum options) index ==
+                         SHARED_EXISTS ? "table key" : "table key ?default?");
+        return TCL_ERROR;
+      }
+      snapshot = Adapter::SharedStore::snapshot(interp, Tcl_GetString(objv[2]));
+      key = Tcl_GetStringFromObj(objv[3], &size);
+      value = snapshot ? snapshot->find(key, size) : NULL;
+      if ((enum options) index == SHARED_EXISTS) {
+        Tcl_SetObjResult(interp, Tcl_NewBooleanObj(value != NULL));
+      } else if (value) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(value->start, value->size));
+      } else if (objc == 5) {
+        Tcl_SetObjResult(interp, objv[4]);
+      } else {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("key \"%s\" not known in "
+                         "table \"%s\"", key, Tcl_GetString(objv[2])));
+        return TCL_ERROR;
+      }
+      break;
+    }
+    case SHARED_SIZE: {
+      if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "table");
+        return TCL_ERROR;
+      }
+      snapshot = Adapter::SharedStore::snapshot(interp, Tcl_GetString(objv[2]));
+      Tcl_SetObjResult(interp, Tcl_NewWideIntObj(snapshot ?
+                                                 snapshot->size() : 0));
+      break;
+    }
+    case SHARED_LOAD:
+    case SHARED_SWAP: {
+      bool map = false, ok;
+      int arg = 2;
+      if ((enum options) index == SHARED_LOAD && objc == 5 &&
+          strcmp(Tcl_GetString(objv[2]), "-mmap") == 0) {
+        map = true;
+        arg++;
+      }
+      if (objc != arg + 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, (enum options) index ==
+                         SHARED_LOAD ? "?-mmap? table file" : "table dict");
+        return TCL_ERROR;
+      }
+      // Build the new snapshot, before replacing the current one...
+      Adapter::SharedSnapshot *fresh = new Adapter::SharedSnapshot;
+      if ((enum options) index == SHARED_LOAD) {
+        ok = fresh->fromFile(interp, objv[arg + 1], map);
+      } else {
+        ok = fresh->fromDict(interp, objv[arg + 1]);
+      }
+      if (!ok) {
+        delete fresh;
+        return TCL_ERROR;
+      }
+      size = fresh->size();
+      Adapter::SharedStore::table(Tcl_GetString(objv[arg]), true)->
+        swap(Adapter::SharedSnapshotPtr(fresh));
+      Tcl_SetObjResult(interp, Tcl_NewIntObj(size));
+      break;
+    }
+  }
+  return TCL_OK;
+}
+
+int TcleCAP_MatchCmd(ClientData clientData, Tcl_Interp *interp,
+                     int objc, Tcl_Obj *const objv[]) {
+  Adapter::UrlRulesPtr rules;
+  const std::string *value = NULL;
+  std::string error;
+  int index, size, count, i;
+  Tcl_Obj **items;
+  const char *str;
+
+  static const char *const optionStrings[] = {
+      "host", "load", "set", "size", "url",
+      NULL
+  };
+  enum options {
+      MATCH_HOST, MATCH_LOAD, MATCH_SET, MATCH_SIZE, MATCH_URL
+  };
+
+  if (objc < 3) {
+      Tcl_WrongNumArgs(interp, 1, objv, "option rules ?arg ...?");
+      return TCL_ERROR;
+  }
+  if (Tcl_GetIndexFromObj(interp, objv[1], optionStrings, "option", 0,
+          &index) != TCL_OK) {
+      return TCL_ERROR;
+  }
+
+  switch ((enum options) index) {
+    case MATCH_HOST:
+    case MATCH_URL: {
+      if (objc < 4 || objc > 5) {
+        Tcl_WrongNumArgs(interp, 2, objv, (enum options) index ==
+                         MATCH_URL ? "rules url ?default?" :
+                                     "rules host ?default?");
+        return TCL_ERROR;
+      }
+      rules = Adapter::UrlRuleSets::get(Tcl_GetString(objv[2]));
+      if (rules) {
+        str = Tcl_GetStringFromObj(objv[3], &size);
+        value = (enum options) index == MATCH_URL ?
+          rules->matchUrl(str, size) : rules->matchHost(str, size);
+      }
+      if (value) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(value->data(),
+                                                  value->size()));
+      } else if (objc == 5) {
+        Tcl_SetObjResult(interp, objv[4]);
+      }
+      break;
+    }
+    case MATCH_SIZE: {
+      if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "rules");
+        return TCL_ERROR;
+      }
+      rules = Adapter::UrlRuleSets::get(Tcl_GetString(objv[2]));
+      Tcl_SetObjResult(interp, Tcl_NewWideIntObj(rules ? rules->size() : 0));
+      break;
+    }
+    case MATCH_LOAD:
+    case MATCH_SET: {
+      if (objc != 4) {
+        Tcl_WrongNumArgs(interp, 2, objv, (enum options) index ==
+                         MATCH_LOAD ? "rules file" : "rules list");
+        return TCL_ERROR;
+      }
+      // Compile the new rules, before replacing the current ones...
+      Adapter::UrlRules *fresh = new Adapter::UrlRules;
+      bool ok = true;
+      if ((enum options) index == MATCH_LOAD) {
+        ok = fresh->load(Tcl_GetString(objv[3]), error);
+      } else {
+        if (Tcl_ListObjGetElements(interp, objv[3], &count, &items)
+            != TCL_OK) {
+          delete fresh;
+          return TCL_ERROR;
+        }
+        if (count % 2) {
+          error = "missing value to go with the last pattern";
+          ok = false;
+        }
+        for (i = 0; ok && i < count; i += 2) {
+          ok = fresh->add(Tcl_GetString(items[i]),
+                          Tcl_GetString(items[i+1]), error);
+        }
+      }
+      if (!ok) {
+        delete fresh;
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(error.c_str(), -1));
+        return TCL_ERROR;
+      }
+      size = fresh->size();
+      Adapter::UrlRuleSets::set(Tcl_GetString(objv[2]),
+                                Adapter::UrlRulesPtr(fresh));
+      Tcl_SetObjResult(interp, Tcl_NewIntObj(size));
+      break;
+    }
+  }
+  return TCL_OK;
+}
+
+int TcleCAP_CacheCmd(ClientData clientData, Tcl_Interp *interp,
+                     int objc, Tcl_Obj *const objv[]) {
+  ClientData data;
+  Adapter::Service *service;
+  std::string version;
+  int index;
+
+  static const char *const optionStrings[] = {
+      "clear", "stats", "version",
+      NULL
+  };
+  enum options {
+      CACHE_CLEAR, CACHE_STATS, CACHE_VERSION
+  };
+
+  /* Get the service pointer from the interpreter... */
+  data = Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_SERVICE, NULL);
+  if (data == NULL) {
+    Tcl_SetResult(interp, (char *) "no service pointer found", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  service = (Adapter::Service *) data;
+
+  if (objc < 2) {
+      Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
+      return TCL_ERROR;
+  }
+  if (Tcl_GetIndexFromObj(interp, objv[1], optionStrings, "option", 0,
+          &index) != TCL_OK) {
+      return TCL_ERROR;
+  }
+
+  switch ((enum options) index) {
+    case CACHE_CLEAR:
+    case CACHE_STATS: {
+      if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, NULL);
+        return TCL_ERROR;
+      }
+      if ((enum options) index == CACHE_CLEAR) {
+        service->cache.clear();
+      } else {
+        Tcl_SetObjResult(interp, service->cache.toDict());
+      }
+      break;
+    }
+    case CACHE_VERSION: {
+      if (objc < 3 || objc > 4) {
+        Tcl_WrongNumArgs(interp, 2, objv, "mime ?version?");
+        return TCL_ERROR;
+      }
+      // MIME types are lower case, without parameters (as in Xaction)...
+      std::string mime(Tcl_GetString(objv[2]));
+      for (std::string::size_type i = 0; i < mime.size(); ++i)
+        mime[i] = tolower(mime[i]);
+      if (objc == 4) {
+        service->cache.setVersion(mime, Tcl_GetString(objv[3]));
+      }
+      if (service->cache.version(mime, version)) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(version.data(),
+                                                  version.size()));
+      }
+      break;
+    }
+  }
+  return TCL_OK;
+}
+
+int TcleCAP_ProfileCmd(ClientData clientData, Tcl_Interp *interp,
+                       int objc, Tcl_Obj *const objv[]) {
+  ClientData data;
+  Adapter::Service *service;
+  std::vector<std::string> files;
+  std::string dir, stacks, error;
+  Tcl_WideInt interval;
+  Tcl_Obj *list;
+  int index;
+
+  static const char *const optionStrings[] = {
+      "folded", "reset", "start", "stats", "stop", "write",
+      NULL
+  };
+  enum options {
+      PROFILE_FOLDED, PROFILE_RESET, PROFILE_START, PROFILE_STATS,
+      PROFILE_STOP, PROFILE_WRITE
+  };
+
+  /* Get the service pointer from the interpreter... */
+  data = Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_SERVICE, NULL);
+  if (data == NULL) {
+    Tcl_SetResult(interp, (char *) "no service pointer found", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  service = (Adapter::Service *) data;
+
+  if (objc < 2) {
+      Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
+      return TCL_ERROR;
+  }
+  if (Tcl_GetIndexFromObj(interp, objv[1], optionStrings, "option", 0,
+          &index) != TCL_OK) {
+      return TCL_ERROR;
+  }
+
+  switch ((enum options) index) {
+    case PROFILE_START: {
+      if (objc > 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?msecs?");
+        return TCL_ERROR;
+      }
+      interval = service->profile_interval ? service->profile_interval : 10;
+      if (objc == 3) {
+        if (Tcl_GetWideIntFromObj(interp, objv[2], &interval) != TCL_OK) {
+          return TCL_ERROR;
+        }
+        if (interval <= 0) {
+          Tcl_SetResult(interp, (char *) "the interval must be positive",
+                        TCL_STATIC);
+          return TCL_ERROR;
+        }
+      }
+      if (!Adapter::Profiler::start((unsigned long) interval, error)) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(error.c_str(), -1));
+        return TCL_ERROR;
+      }
+      break;
+    }
+    case PROFILE_STOP:
+    case PROFILE_RESET:
+    case PROFILE_STATS: {
+      if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, NULL);
+        return TCL_ERROR;
+      }
+      if ((enum options) index == PROFILE_STOP) {
+        Adapter::Profiler::stop();
+      } else if ((enum options) index == PROFILE_RESET) {
+        Adapter::Profiler::reset();
+      } else {
+        Tcl_SetObjResult(interp, Adapter::Profiler::toDict());
+      }
+      break;
+    }
+    case PROFILE_FOLDED: {
+      if (objc > 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?worker?");
+        return TCL_ERROR;
+      }
+      if (!Adapter::Profiler::folded(objc == 3 ? Tcl_GetString(objv[2]) : "",
+                                     stacks)) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown worker \"%s\"",
+                                               Tcl_GetString(objv[2])));
+        return TCL_ERROR;
+      }
+      Tcl_SetObjResult(interp, Tcl_NewStringObj(stacks.data(),
+                                                stacks.size()));
+      break;
+    }
+    case PROFILE_WRITE: {
+      if (objc > 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?dir?");
+        return TCL_ERROR;
+      }
+      dir = objc == 3 ? Tcl_GetString(objv[2]) : service->profile_dir;
+      if (dir.empty()) {
+        Tcl_SetResult(interp, (char *) "no directory (and no profile_dir)",
+                      TCL_STATIC);
+        return TCL_ERROR;
+      }
+      if (!Adapter::Profiler::write(dir, files, error)) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(error.data(),
+                                                  error.size()));
+        return TCL_ERROR;
+      }
+      list = Tcl_NewListObj(0, NULL);
+      for (std::vector<std::string>::const_iterator it = files.begin();
+           it != files.end(); ++it) {
+        Tcl_ListObjAppendElement(NULL, list,
+                                 Tcl_NewStringObj(it->data(), it->size()));
+      }
+      Tcl_SetObjResult(interp, list);
+      break;
+    }
+  }
+  return TCL_OK;
+}
+
+int TcleCAP_PoolCmd(ClientData clientData, Tcl_Interp *interp,
+                    int objc, Tcl_Obj *const objv[]) {
+  ClientData data;
+  Adapter::Service *service;
+  Adapter::WorkerPool *pool;
+  int index;
+
+  static const char *const optionStrings[] = {
+      "current", "names", "of", "register",
+      NULL
+  };
+  enum options {
+      POOL_CURRENT, POOL_NAMES, POOL_OF, POOL_REGISTER
+  };
+
+  /* Get the service pointer from the interpreter... */
+  data = Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_SERVICE, NULL);
+  if (data == NULL) {
+    Tcl_SetResult(interp, (char *) "no service pointer found", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  service = (Adapter::Service *) data;
+
+  if (objc < 2) {
+      Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
+      return TCL_ERROR;
+  }
+  if (Tcl_GetIndexFromObj(interp, objv[1], optionStrings, "option", 0,
+          &index) != TCL_OK) {
+      return TCL_ERROR;
+  }
+
+  switch ((enum options) index) {
+    case POOL_CURRENT: {
+      if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, NULL);
+        return TCL_ERROR;
+      }
+      // The threads of a pool know it: the main interpreter serves the
+      // default pool (when it has no threads)...
+      pool = (Adapter::WorkerPool *)
+        Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_POOL, NULL);
+      if (pool == NULL) pool = service->pools.front().get();
+      Tcl_SetObjResult(interp, Tcl_NewStringObj(pool->name.data(),
+                                                pool->name.size()));
+      break;
+    }
+    case POOL_NAMES: {
+      if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, NULL);
+        return TCL_ERROR;
+      }
+      Tcl_Obj *names = Tcl_NewListObj(0, NULL);
+      for (std::vector<Adapter::WorkerPoolPtr>::const_iterator it =
+             service->pools.begin(); it != service->pools.end(); ++it) {
+        Tcl_ListObjAppendElement(NULL, names,
+          Tcl_NewStringObj((*it)->name.data(), (*it)->name.size()));
+      }
+      Tcl_SetObjResult(interp, names);
+      break;
+    }
+    case POOL_OF:
+    case POOL_REGISTER: {
+      if ((enum options) index == POOL_OF ? objc != 3 :
+          (objc != 4 && (objc != 5 ||
+                         strcmp(Tcl_GetString(objv[4]), "-headers") != 0))) {
+        Tcl_WrongNumArgs(interp, 2, objv, (enum options) index == POOL_OF ?
+                         "mime" : "mime processor ?-headers?");
+        return TCL_ERROR;
+      }
+      // MIME types are lower case, without parameters (as in Xaction)...
+      std::string mime(Tcl_GetString(objv[2]));
+      for (std::string::size_type i = 0; i < mime.size(); ++i)
+        mime[i] = tolower(mime[i]);
+      if ((enum options) index == POOL_REGISTER) {
+        service->learnProcessor(mime, Tcl_GetString(objv[3]));
+        // The processor adapts headers: ::ecap-tcl::headersAdapt is called
+        // only for the MIME types registered so...
+        if (objc == 5) service->learnHeadersAdapter(mime);
+        break;
+      }
+      pool = service->poolFor(mime).get();
+      Tcl_SetObjResult(interp, Tcl_NewStringObj(pool->name.data(),
+                                                pool->name.size()));
+      break;
+    }
+  }
+  return TCL_OK;
+}
+
+int TcleCAP_NativeCmd(ClientData clientData, Tcl_Interp *interp,
+                      int objc, Tcl_Obj *const objv[]) {
+  Adapter::NativeProcessorsPtr natives = Adapter::NativeProcessors::current();
+  int index;
+
+  static const char *const optionStrings[] = {
+      "adapt", "processors",
+      NULL
+  };
+  enum options {
+      NATIVE_ADAPT, NATIVE_PROCESSORS
+  };
+
+  if (objc < 2) {
+      Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
+      return TCL_ERROR;
+  }
+  if (Tcl_GetIndexFromObj(interp, objv[1], optionStrings, "option", 0,
+          &index) != TCL_OK) {
+      return TCL_ERROR;
+  }
+
+  switch ((enum options) index) {
+    case NATIVE_PROCESSORS: {
+      if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, NULL);
+        return TCL_ERROR;
+      }
+      Tcl_SetObjResult(interp, natives->toDict());
+      break;
+    }
+    case NATIVE_ADAPT: {
+      // Adapts a whole body with a native processor (i.e. in the middle of
+      // a Tcl processor), as the message of a detached transaction...
+      if (objc < 4 || objc > 5) {
+        Tcl_WrongNumArgs(interp, 2, objv, "processor data ?mime?");
+        return TCL_ERROR;
+      }
+      Adapter::NativeProcessorPtr processor =
+        natives->processorNamed(Tcl_GetString(objv[2]));
+      if (!processor) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown native processor "
+                         "\"%s\"", Tcl_GetString(objv[2])));
+        return TCL_ERROR;
+      }
+      std::string mime(objc == 5 ? Tcl_GetString(objv[4]) : "");
+      for (std::string::size_type i = 0; i < mime.size(); ++i)
+        mime[i] = tolower(mime[i]);
+      int size;
+      const unsigned char *bytes = Tcl_GetByteArrayFromObj(objv[3], &size);
+      std::string body((const char *) bytes, size), tail;
+      Adapter::NativeBinding binding(processor, mime);
+      int code = binding.start();
+      if (code == TCL_OK) code = binding.contentAdapt(body);
+      if (code == TCL_OK) code = binding.contentDone(true, tail);
+      if (code != TCL_BREAK) binding.stop();
+      switch (code) {
+        case TCL_OK:
+          body.append(tail);
+          Tcl_SetObjResult(interp, Tcl_NewByteArrayObj(
+            (const unsigned char *) body.data(), body.size()));
+          break;
+        case TCL_BREAK:
+          // The processor does not adapt such data: it is unchanged...
+          Tcl_SetObjResult(interp, objv[3]);
+          break;
+        case ECAPTCL_BLOCK:
+          Tcl_SetObjResult(interp, Tcl_ObjPrintf("native processor \"%s\" "
+                           "blocked the data", Tcl_GetString(objv[2])));
+          return TCL_ERROR;
+        default:
+          Tcl_SetObjResult(interp, Tcl_NewStringObj(binding.error().data(),
+                                                    binding.error().size()));
+          return TCL_ERROR;
+      }
+      break;
+    }
+  }
+  return TCL_OK;
+}
+
+/* ::ecap-tcl::log level message ?fields?: queues a message (with a dict of
+ * fields) for the writer of the log. Never waits: a message below the level
+ * of the log is discarded at once, and a message that does not fit in the
+ * ring of the interpreter is dropped. */
+int TcleCAP_LogCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[]) {
+  int level, length;
+
+  if (objc < 3 || objc > 4) {
+    Tcl_WrongNumArgs(interp, 1, objv, "level message ?fields?");
+    return TCL_ERROR;
+  }
+  if (Tcl_GetIndexFromObj(interp, objv[1], Adapter::Logger::levels, "level",
+        0, &level) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  if (!Adapter::Logger::enabled(level)) {
+    Adapter::Logger::noteFiltered();
+    return TCL_OK;
+  }
+  if (objc == 4) {
+    if (Tcl_ListObjLength(interp, objv[3], &length) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    if (length % 2) {
+      Tcl_SetResult(interp, (char *) "fields must be a dict of names and "
+                            "values", TCL_STATIC);
+      return TCL_ERROR;
+    }
+  }
+  Adapter::Logger::log(interp, level, objv[2], objc == 4 ? objv[3] : NULL);
+  return TCL_OK;
+}
+
+#ifdef HAVE_PCRE2
+/* The content of a subject: its bytes, if it is a byte array (i.e. a body
+ * not converted from its encoding), else its (UTF-8) string */
+static const char *reSubject(Tcl_Obj *obj, int *length, bool bytes) {
+  if (bytes) return (const char *) Tcl_GetByteArrayFromObj(obj, length);
+  return Tcl_GetStringFromObj(obj, length);
+}; /* reSubject */
+
+int TcleCAP_ReCmd(ClientData clientData, Tcl_Interp *interp,
+                  int objc, Tcl_Obj *const objv[]) {
+  ClientData data;
+  Adapter::Service *service;
+  Adapter::Regex *regex;
+  int index, i;
+
+  static const char *const optionStrings[] = {
+      "compile", "delete", "info", "match", "names", "sub",
+      NULL
+  };
+  enum options {
+      RE_COMPILE, RE_DELETE, RE_INFO, RE_MATCH, RE_NAMES, RE_SUB
+  };
+  static const char *const compileStrings[] = {
+      "-dotall", "-extended", "-multiline", "-nocase", "-utf",
+      NULL
+  };
+  static const uint32_t compileFlags[] = {
+      PCRE2_DOTALL, PCRE2_EXTENDED, PCRE2_MULTILINE, PCRE2_CASELESS,
+      PCRE2_UTF | PCRE2_UCP
+  };
+  static const char *const matchStrings[] = {
+      "-all", "-partial",
+      NULL
+  };
+  enum matchOptions {
+      MATCH_ALL, MATCH_PARTIAL
+  };
+
+  /* Get the service pointer from the interpreter... */
+  data = Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_SERVICE, NULL);
+  if (data == NULL) {
+    Tcl_SetResult(interp, (char *) "no service pointer found", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  service = (Adapter::Service *) data;
+
+  if (objc < 2) {
+      Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
+      return TCL_ERROR;
+  }
+  if (Tcl_GetIndexFromObj(interp, objv[1], optionStrings, "option", 0,
+          &index) != TCL_OK) {
+      return TCL_ERROR;
+  }
+
+  switch ((enum options) index) {
+    case RE_COMPILE: {
+      uint32_t flags = 0;
+      int flag;
+      std::string error;
+      for (i = 2; i < objc - 2; i++) {
+        if (Tcl_GetIndexFromObj(interp, objv[i], compileStrings, "option",
+              0, &flag) != TCL_OK) {
+          return TCL_ERROR;
+        }
+        flags |= compileFlags[flag];
+      }
+      if (objc < 4) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?-nocase? ?-multiline? ?-dotall? "
+                         "?-extended? ?-utf? name pattern");
+        return TCL_ERROR;
+      }
+      int size;
+      const char *pattern = Tcl_GetStringFromObj(objv[objc - 1], &size);
+      regex = Adapter::Regex::compile(std::string(pattern, size), flags,
+                                      error);
+      if (regex == NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't compile pattern: %s",
+                                               error.c_str()));
+        return TCL_ERROR;
+      }
+      Adapter::RegexCache::store(interp, Tcl_GetString(objv[objc - 2]),
+                                 regex);
+      Tcl_SetObjResult(interp, objv[objc - 2]);
+      break;
+    }
+    case RE_DELETE:
+      for (i = 2; i < objc; i++) {
+        Adapter::RegexCache::remove(interp, Tcl_GetString(objv[i]));
+      }
+      break;
+    case RE_NAMES:
+      if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, NULL);
+        return TCL_ERROR;
+      }
+      Tcl_SetObjResult(interp, Adapter::RegexCache::names(interp));
+      break;
+    case RE_INFO: {
+      if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "name");
+        return TCL_ERROR;
+      }
+      regex = Adapter::RegexCache::find(interp, Tcl_GetString(objv[2]));
+      if (regex == NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown pattern \"%s\"",
+                                               Tcl_GetString(objv[2])));
+        return TCL_ERROR;
+      }
+      Tcl_Obj *dict = Tcl_NewDictObj(), *flags = Tcl_NewListObj(0, NULL);
+      for (i = 0; compileStrings[i]; i++) {
+        if ((regex->options & compileFlags[i]) == compileFlags[i])
+          Tcl_ListObjAppendElement(NULL, flags,
+                                   Tcl_NewStringObj(compileStrings[i], -1));
+      }
+      Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("pattern", -1),
+        Tcl_NewStringObj(regex->pattern.data(), regex->pattern.size()));
+      Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("options", -1), flags);
+      Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("captures", -1),
+                     Tcl_NewIntObj(regex->captures()));
+      Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("jit", -1),
+                     Tcl_NewBooleanObj(regex->jit));
+      Tcl_SetObjResult(interp, dict);
+      break;
+    }
+    case RE_MATCH:
+    case RE_SUB: {
+      bool sub = (enum options) index == RE_SUB, all = false;
+      int option, args = sub ? 3 : 2, length;
+      Tcl_Obj *held = NULL, *varName = NULL;
+      for (i = 2; i < objc - args; i++) {
+        if (Tcl_GetIndexFromObj(interp, objv[i], matchStrings, "option", 0,
+              &option) != TCL_OK) {
+          return TCL_ERROR;
+        }
+        if ((enum matchOptions) option == MATCH_ALL) {
+          all = true;
+        } else if (i + 1 < objc - args) {
+          varName = objv[++i];
+        } else {
+          Tcl_SetResult(interp, (char *) "-partial requires a variable name",
+                        TCL_STATIC);
+          return TCL_ERROR;
+        }
+      }
+      if (objc - i != args) {
+        Tcl_WrongNumArgs(interp, 2, objv, sub ?
+          "?-all? ?-partial varName? name string replacement" :
+          "?-all? ?-partial varName? name string");
+        return TCL_ERROR;
+      }
+      regex = Adapter::RegexCache::find(interp, Tcl_GetString(objv[i]));
+      if (regex == NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown pattern \"%s\"",
+                                               Tcl_GetString(objv[i])));
+        return TCL_ERROR;
+      }
+      // The subject is the content held back by the last call (if any),
+      // followed by the string...
+      bool bytes = objv[i + 1]->typePtr == Adapter::bytearrayType ||
+                   objv[i + 1]->typePtr == Adapter::proper_bytearrayType;
+      const char *subject = reSubject(objv[i + 1], &length, bytes);
+      std::string joined;
+      if (varName) held = Tcl_ObjGetVar2(interp, varName, NULL, 0);
+      if (held) {
+        int heldLength;
+        const char *heldStart = reSubject(held, &heldLength, bytes);
+        if (heldLength) {
+          joined.reserve(heldLength + length);
+          joined.append(heldStart, heldLength);
+          joined.append(subject, length);
+          subject = joined.data();
+          length = joined.size();
+        }
+      }
+      service->stats.incr(Adapter::STATS_RE_CALLS);
+      service->stats.incr(Adapter::STATS_RE_BYTES, length);
+      std::string out, error, replacement;
+      Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+      size_t offset = 0, last = 0, hold = length;
+      if (sub) {
+        int size;
+        const char *start = Tcl_GetStringFromObj(objv[i + 2], &size);
+        replacement.assign(start, size);
+        out.reserve(length);
+      }
+      while (offset <= (size_t) length) {
+        int found = regex->match(subject, length, offset, varName != NULL,
+                                 error);
+        if (found == -2) {
+          Tcl_DecrRefCount(list);
+          Tcl_SetObjResult(interp, Tcl_NewStringObj(error.c_str(), -1));
+          return TCL_ERROR;
+        }
+        if (found == 0) break;
+        if (found == -1) {
+          // The end of the subject may start a match: hold it back...
+          hold = regex->holdFrom(subject, last);
+          break;
+        }
+        if (sub) {
+          out.append(subject + last, regex->start(0) - last);
+          regex->expand(subject, replacement, out);
+        } else {
+          for (unsigned int c = 0; c <= regex->captures(); c++) {
+            size_t start = regex->start(c);
+            size_t size = start == PCRE2_UNSET ? 0 : regex->end(c) - start;
+            if (start == PCRE2_UNSET) start = 0;
+            Tcl_ListObjAppendElement(NULL, list, bytes ?
+              Tcl_NewByteArrayObj((const unsigned char *) subject + start,
+                                  size) :
+              Tcl_NewStringObj(subject + start, size));
+          }
+        }
+        last = offset = regex->end(0);
+        if (!all) break;
+        if (regex->end(0) == regex->start(0)) {
+          // An empty match: go on from the next character...
+          if (offset >= (size_t) length) break;
+          offset += regex->charLength(subject + offset, length - offset);
+        }
+      }
+      if (varName) {
+        size_t from = hold < (size_t) length ? hold : length;
+        Tcl_Obj *tail = bytes ?
+          Tcl_NewByteArrayObj((const unsigned char *) subject + from,
+                              length - from) :
+          Tcl_NewStringObj(subject + from, length - from);
+        if (Tcl_ObjSetVar2(interp, varName, NULL, tail,
+                           TCL_LEAVE_ERR_MSG) == NULL) {
+          Tcl_DecrRefCount(list);
+          return TCL_ERROR;
+        }
+      }
+      if (!sub) {
+        Tcl_SetObjResult(interp, list);
+        break;
+      }
+      Tcl_DecrRefCount(list);
+      if (hold > (size_t) length) hold = length;
+      out.append(subject + last, hold - last);
+      Tcl_SetObjResult(interp, bytes ?
+        Tcl_NewByteArrayObj((const unsigned char *) out.data(), out.size()) :
+        Tcl_NewStringObj(out.data(), out.size()));
+      break;
+    }
+  }
+  return TCL_OK;
+}
+#endif /* HAVE_PCRE2 */
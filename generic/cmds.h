@@ -1,6 +1,9 @@
 #include <tcl.h>
 
-#define TCLECAP_INTERP_KEY_ACTION "::ecap-tcl::action"
+#define TCLECAP_INTERP_KEY_ACTION  "::ecap-tcl::action"
+#define TCLECAP_INTERP_KEY_SERVICE "::ecap-tcl::service"
+#define TCLECAP_INTERP_KEY_POOL    "::ecap-tcl::pool"
+#define TCLECAP_INTERP_KEY_SUSPENDED "::ecap-tcl::suspended"
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,6 +18,38 @@ int TcleCAP_ActionContentCmd(ClientData clientData, Tcl_Interp *interp,
                           int objc, Tcl_Obj *const objv[]);
 int TcleCAP_ActionClientCmd(ClientData clientData, Tcl_Interp *interp,
                           int objc, Tcl_Obj *const objv[]);
+int TcleCAP_ActionProcessorCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[]);
+int TcleCAP_ActionBlockCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[]);
+int TcleCAP_ActionMetaCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[]);
+int TcleCAP_ActionCoroutineCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[]);
+int TcleCAP_ActionSuspendCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[]);
+int TcleCAP_ResumeCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[]);
+int TcleCAP_StatsCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[]);
+int TcleCAP_SharedCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[]);
+int TcleCAP_MatchCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[]);
+int TcleCAP_CacheCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[]);
+int TcleCAP_ProfileCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[]);
+int TcleCAP_PoolCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[]);
+int TcleCAP_NativeCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[]);
+int TcleCAP_LogCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[]);
+#ifdef HAVE_PCRE2
+int TcleCAP_ReCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *const objv[]);
+#endif
 #ifdef __cplusplus
 }
 #endif
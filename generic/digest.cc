@@ -0,0 +1,222 @@
+/*
+ * digest.cc: Streaming digests of the bodies of the eCAP Tcl adapter:
+ * XXH64 (fast, not cryptographic, with seed 0) and SHA-256 (FIPS 180-4).
+ */
+
+#include <cstring>
+#include "digest.h"
+
+/* The order must follow enum Side (enum Algorithm)... */
+const char *const Adapter::BodyDigest::sides[] = {
+  "virgin", "adapted", NULL
+};
+const char *const Adapter::BodyDigest::algorithms[] = {
+  "xxh64", "sha256", NULL
+};
+static const char *const SideMetaNames[] = {"Virgin", "Adapted"};
+static const char *const AlgorithmMetaNames[] = {"Xxh64", "Sha256"};
+
+static const uint64_t Prime64[5] = {
+  0x9E3779B185EBCA87ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL,
+  0x85EBCA77C2B2AE63ULL, 0x27D4EB2F165667C5ULL
+};
+
+static const uint32_t Sha256K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}; /* rotl64 */
+
+static inline uint32_t rotr32(uint32_t x, int r) {
+  return (x >> r) | (x << (32 - r));
+}; /* rotr32 */
+
+static inline uint64_t read64le(const unsigned char *p) {
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; i--) value = (value << 8) | p[i];
+  return value;
+}; /* read64le */
+
+static inline uint32_t read32le(const unsigned char *p) {
+  return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 |
+         (uint32_t) p[3] << 24;
+}; /* read32le */
+
+static inline uint64_t xxh64Round(uint64_t acc, uint64_t input) {
+  acc += input * Prime64[1];
+  return rotl64(acc, 31) * Prime64[0];
+}; /* xxh64Round */
+
+static std::string toHex(const unsigned char *bytes, size_t size) {
+  static const char digits[] = "0123456789abcdef";
+  std::string hex(2 * size, '0');
+  for (size_t i = 0; i < size; i++) {
+    hex[2 * i]     = digits[bytes[i] >> 4];
+    hex[2 * i + 1] = digits[bytes[i] & 0x0f];
+  }
+  return hex;
+}; /* toHex */
+
+static int indexOf(const char *const names[], const std::string &name) {
+  for (int i = 0; names[i]; i++) {
+    if (name == names[i]) return i;
+  }
+  return -1;
+}; /* indexOf */
+
+int Adapter::BodyDigest::sideOf(const std::string &name) {
+  return indexOf(sides, name);
+}
+
+int Adapter::BodyDigest::algorithmOf(const std::string &name) {
+  return indexOf(algorithms, name);
+}
+
+Adapter::BodyDigest::BodyDigest(Side s, Algorithm a):
+    digest_side(s), digest_algorithm(a) {
+  static const uint32_t Sha256Init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memcpy(words, Sha256Init, sizeof(words));
+  lanes[0] = Prime64[0] + Prime64[1];
+  lanes[1] = Prime64[1];
+  lanes[2] = 0;
+  lanes[3] = -Prime64[0];
+}
+
+std::string Adapter::BodyDigest::name() const {
+  return std::string(sides[digest_side]) + ":" + algorithms[digest_algorithm];
+}
+
+std::string Adapter::BodyDigest::metaName() const {
+  return std::string("X-Ecap-Tcl-Digest-") + SideMetaNames[digest_side] +
+         "-" + AlgorithmMetaNames[digest_algorithm];
+}
+
+void Adapter::BodyDigest::update(const char *data, size_t size) {
+  const unsigned char *p = (const unsigned char *) data;
+  const size_t blockSize = digest_algorithm == SHA256 ? 64 : 32;
+  total += size;
+  if (held) {
+    size_t n = blockSize - held < size ? blockSize - held : size;
+    memcpy(block + held, p, n);
+    held += n;
+    p += n;
+    size -= n;
+    if (held < blockSize) return;
+    if (digest_algorithm == SHA256) sha256Block(block);
+    else xxh64Stripe(block);
+    held = 0;
+  }
+  // Whole blocks are digested where they are, without copying them...
+  for (; size >= blockSize; p += blockSize, size -= blockSize) {
+    if (digest_algorithm == SHA256) sha256Block(p);
+    else xxh64Stripe(p);
+  }
+  memcpy(block, p, size);
+  held = size;
+}
+
+std::string Adapter::BodyDigest::hex() const {
+  return digest_algorithm == SHA256 ? sha256Hex() : xxh64Hex();
+}
+
+void Adapter::BodyDigest::xxh64Stripe(const unsigned char *data) {
+  for (int i = 0; i < 4; i++) {
+    lanes[i] = xxh64Round(lanes[i], read64le(data + 8 * i));
+  }
+}
+
+std::string Adapter::BodyDigest::xxh64Hex() const {
+  uint64_t h;
+  const unsigned char *p = block, *end = block + held;
+  if (total >= 32) {
+    h = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) +
+        rotl64(lanes[3], 18);
+    for (int i = 0; i < 4; i++) {
+      h ^= xxh64Round(0, lanes[i]);
+      h = h * Prime64[0] + Prime64[3];
+    }
+  } else {
+    h = Prime64[4];
+  }
+  h += total;
+  for (; p + 8 <= end; p += 8) {
+    h ^= xxh64Round(0, read64le(p));
+    h = rotl64(h, 27) * Prime64[0] + Prime64[3];
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t) read32le(p) * Prime64[0];
+    h = rotl64(h, 23) * Prime64[1] + Prime64[2];
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= *p * Prime64[4];
+    h = rotl64(h, 11) * Prime64[0];
+  }
+  h ^= h >> 33;
+  h *= Prime64[1];
+  h ^= h >> 29;
+  h *= Prime64[2];
+  h ^= h >> 32;
+  unsigned char bytes[8];
+  for (int i = 7; i >= 0; i--, h >>= 8) bytes[i] = h & 0xff;
+  return toHex(bytes, sizeof(bytes));
+}
+
+void Adapter::BodyDigest::sha256Block(const unsigned char *data) {
+  uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t) data[4 * i] << 24 | (uint32_t) data[4 * i + 1] << 16 |
+           (uint32_t) data[4 * i + 2] << 8 | (uint32_t) data[4 * i + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^
+                  (w[i - 15] >> 3);
+    uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^
+                  (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  a = words[0]; b = words[1]; c = words[2]; d = words[3];
+  e = words[4]; f = words[5]; g = words[6]; h = words[7];
+  for (int i = 0; i < 64; i++) {
+    t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) +
+         ((e & f) ^ (~e & g)) + Sha256K[i] + w[i];
+    t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) +
+         ((a & b) ^ (a & c) ^ (b & c));
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  words[0] += a; words[1] += b; words[2] += c; words[3] += d;
+  words[4] += e; words[5] += f; words[6] += g; words[7] += h;
+}
+
+// The padding is digested by a copy, so the digest can go on...
+std::string Adapter::BodyDigest::sha256Hex() const {
+  BodyDigest last(*this);
+  unsigned char pad[72] = {0x80}, bytes[32];
+  uint64_t bits = total * 8;
+  size_t padding = (held < 56 ? 56 : 120) - held;
+  for (int i = 0; i < 8; i++) pad[padding + i] = bits >> (56 - 8 * i);
+  last.update((const char *) pad, padding + 8);
+  for (int i = 0; i < 8; i++) {
+    bytes[4 * i]     = last.words[i] >> 24;
+    bytes[4 * i + 1] = last.words[i] >> 16;
+    bytes[4 * i + 2] = last.words[i] >> 8;
+    bytes[4 * i + 3] = last.words[i];
+  }
+  return toHex(bytes, sizeof(bytes));
+}
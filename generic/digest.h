@@ -0,0 +1,58 @@
+/*
+ * digest.h: Streaming digests of the bodies of the eCAP Tcl adapter.
+ * A digest is computed incrementally over the virgin (or the adapted)
+ * content of a transaction, as the content goes through the adapter, so
+ * fingerprinting a body needs neither buffering it, nor a second pass over
+ * it in Tcl. The digests of a transaction are read with
+ * ::ecap-tcl::action content digest, and are exported as meta-information.
+ */
+#ifndef ECAPTCL_DIGEST_H
+#define ECAPTCL_DIGEST_H
+
+#include <cstdint>
+#include <string>
+
+namespace Adapter {
+
+class BodyDigest {
+  public:
+    enum Side { VIRGIN, ADAPTED, SIDES_NUMBER };
+    enum Algorithm { XXH64, SHA256, ALGORITHMS_NUMBER };
+    static const char *const sides[];
+    static const char *const algorithms[];
+
+    // The index of a name in sides (algorithms), -1: unknown
+    static int sideOf(const std::string &name);
+    static int algorithmOf(const std::string &name);
+
+    BodyDigest(Side s, Algorithm a);
+
+    Side side() const { return digest_side; }
+    Algorithm algorithm() const { return digest_algorithm; }
+    // i.e. virgin:sha256
+    std::string name() const;
+    // i.e. X-Ecap-Tcl-Digest-Virgin-Sha256
+    std::string metaName() const;
+
+    void update(const char *data, size_t size);
+    // The digest (in hex) of the content so far: more can be added
+    std::string hex() const;
+
+  private:
+    void sha256Block(const unsigned char *data);
+    void xxh64Stripe(const unsigned char *data);
+    std::string sha256Hex() const;
+    std::string xxh64Hex() const;
+
+    Side          digest_side;
+    Algorithm     digest_algorithm;
+    uint64_t      total = 0;  // bytes digested
+    unsigned char block[64];  // the bytes of an incomplete block
+    size_t        held = 0;
+    uint32_t      words[8];   // sha256
+    uint64_t      lanes[4];   // xxh64
+};
+
+} // namespace Adapter
+
+#endif /* ECAPTCL_DIGEST_H */
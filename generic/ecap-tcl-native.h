@@ -0,0 +1,117 @@
+/*
+ * ecap-tcl-native.h: The interface of native (C++) processors, loaded by
+ * the eCAP Tcl adapter from the shared objects named by native_processors.
+ * A native processor adapts the messages of the MIME types it registers,
+ * instead of the Tcl processors: the adapter calls it directly (from the
+ * host thread), with the same lifecycle as the Tcl commands, and without
+ * converting anything to Tcl objects.
+ *
+ * A shared object exports (with C linkage) an initialisation function:
+ *
+ *   extern "C" const char *EcapTcl_NativeInit(int version,
+ *                                             EcapTcl::NativeRegistry *r);
+ *
+ * which checks version (ECAPTCL_NATIVE_API_VERSION), registers its
+ * processors and returns NULL, or returns an error message.
+ * A processor may be used by several threads at once (Tcl processors can
+ * call it, see ::ecap-tcl::native): its actions are used by one thread at
+ * a time.
+ * The calls of a transaction run on the host thread, and cannot be
+ * abandoned: a call must return within the time budget of its hook
+ * (call_timeout, call_timeouts), else it is counted as a failure of its
+ * processor (native_overruns), whose circuit breaker bypasses it.
+ */
+#ifndef ECAPTCL_NATIVE_API_H
+#define ECAPTCL_NATIVE_API_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+#define ECAPTCL_NATIVE_API_VERSION 2
+#define ECAPTCL_NATIVE_INIT        "EcapTcl_NativeInit"
+
+namespace EcapTcl {
+
+// The message being adapted, as seen by a native processor
+class NativeMessage {
+  public:
+    virtual const std::string &uri() const = 0;
+    virtual const std::string &mime() const = 0; // lower case
+    // The headers of the adapted message
+    virtual bool header(const std::string &name, std::string &value) const = 0;
+    virtual void setHeader(const std::string &name,
+                           const std::string &value) = 0;
+    virtual void removeHeader(const std::string &name) = 0;
+    // Meta-information, exported to the host (as ::ecap-tcl::action meta)
+    virtual void setMeta(const std::string &name, const std::string &value) = 0;
+    // Passes the whole body to contentDone (as ::ecap-tcl::action content
+    // mode whole): only from actionStart. Returns false if it is too late.
+    virtual bool wholeBody() = 0;
+    // The host blocks the message, when the current call returns
+    virtual void block() = 0;
+    // Reports a failure (counted by the circuit breaker of the processor)
+    virtual void failed(const std::string &reason) = 0;
+
+  protected:
+    virtual ~NativeMessage() {}
+};
+
+// The adaptation of a message, created by NativeProcessor::actionStart.
+// The content is passed as it is held by the adapter (data and size, valid
+// during the call), and the adapted content is written to out (empty on
+// entry). A call returning false has failed: its content is passed
+// unmodified.
+class NativeAction {
+  public:
+    virtual ~NativeAction() {}
+
+    virtual bool contentAdapt(NativeMessage &message, const char *data,
+                              size_t size, std::string &out) = 0;
+    // data is the whole body (in whole-body mode, else empty): out is the
+    // last adapted content
+    virtual bool contentDone(NativeMessage & /* message */, bool /* atEnd */,
+                             const char *data, size_t size,
+                             std::string &out) {
+      out.append(data, size);
+      return true;
+    }
+    virtual void actionStop(NativeMessage & /* message */) {}
+};
+
+enum NativeVerdict { NATIVE_UNDECIDED, NATIVE_ADAPT, NATIVE_SKIP };
+
+class NativeProcessor {
+  public:
+    virtual ~NativeProcessor() {}
+
+    // The name of the processor (for its circuit breaker, and the stats)
+    virtual std::string name() const = 0;
+    // Decides whether a URL is adapted, before ::ecap-tcl::wantsUrl is
+    // called. The first processor with a verdict wins.
+    virtual NativeVerdict wantsUrl(const char * /* url */) {
+      return NATIVE_UNDECIDED;
+    }
+    // Starts adapting a message (NULL: the processor does not adapt it)
+    virtual NativeAction *actionStart(NativeMessage &message) = 0;
+};
+
+class NativeRegistry {
+  public:
+    // Registers a processor for a MIME type (lower case, or type/*). The
+    // registry owns the processor, which can be registered several times.
+    virtual void add(const std::shared_ptr<NativeProcessor> &processor,
+                     const std::string &mime) = 0;
+
+  protected:
+    virtual ~NativeRegistry() {}
+};
+
+} // namespace EcapTcl
+
+extern "C" {
+typedef const char *EcapTcl_NativeInitProc(int version,
+                                           EcapTcl::NativeRegistry *registry);
+}
+
+#endif /* ECAPTCL_NATIVE_API_H */
@@ -14,6 +14,7 @@
  *  http://www.e-cap.org/
  */
 
+#include <unistd.h>
 #include "ecap-tcl.h"
 
 /* Declare a mutex for coordinating multiple threads. */
@@ -45,6 +46,13 @@ static char *packVoidPtr(char *buff, void *ptr, const char *name, size_t bsz);
 static void initialiseThread(Tcl_Interp *interp, void *data);
 static void evalThreadScript(Tcl_Interp *interp, void *data);
 static void evalInThread(Tcl_Interp *interp, void *data);
+static void checkHooks(Tcl_Interp *interp, void *data);
+static void bindThread(Tcl_Interp *interp, void *data);
+static int  warmThread(Tcl_Interp *interp, void *data);
+static Tcl_WideInt retireThread(Tcl_Interp *interp, void *data);
+static void joinedThread(void *data, Tcl_WideInt before);
+static void logError(Tcl_Interp *interp, const char *message);
+static void dropSuspended(Tcl_Interp *interp, TclCallClientData *data);
 
 static const std::string CfgErrorPrefix = ECAPTCL_ERROR_CONFIGURATION;
 static const std::string ErrorPrefix    = ECAPTCL_ERROR_PREFIX;
@@ -64,11 +72,100 @@ static std::string getErrorMsg(Tcl_Interp *interp, int code = TCL_ERROR) {
   return msg;
 }; /* getErrorMsg */
 
+static unsigned long parseUnsigned(const std::string &name,
+                                   const std::string &value) {
+  try {
+    std::string::size_type sz;   // alias of size_t
+    unsigned long number = std::stoul(value, &sz);
+    if (sz == value.size()) return number;
+  } catch (const std::exception &e) {
+  }
+  throw libecap::TextException(CfgErrorPrefix +
+    "invalid integer value for " + name + ": " + value);
+}; /* parseUnsigned */
+
+/* The order must follow enum TclHook... */
+const char *const TclHookNames[] = {
+  "wantsUrl", "headersAdapt", "actionStart", "contentAdapt", "tagsAdapt",
+  "jsonAdapt", "contentDone", "actionStop", NULL
+};
+
+/* How long (msecs) the host waits beyond the time budget of a call, before
+ * abandoning it: the Tcl time limit should normally stop the call first. */
+static const unsigned int TimeoutGrace = 50;
+
+/* The most URLs blocked by wantsUrl we remember, until their transactions
+ * start (the host may never start some of them). */
+static const size_type MaxBlockedUrls = 1024;
+
+/* The pool of threads_number, serving what no named pool serves */
+static const char *const DefaultPoolName = "default";
+
+/* With event_loop, how often (msecs, at most) the host wakes us to service
+ * the events of the main interpreter, and to look for completed calls */
+static const Tcl_WideInt EventPollDelay = 10;
+
+/* The rule set consulted by wantsUrl (loaded from url_rules, or by Tcl) */
+static const char *const WantsUrlRules = "wantsUrl";
+
+/* The largest body we pre-allocate for, based on Content-Length... */
+static const size_type MaxBodyReserve = 16 * 1024 * 1024;
+
+/* ... and the buffer of ab, which the host consumes as it is produced */
+static const size_type AbReserve = 64 * 1024;
+
+/* The transactions recycled, instead of being freed */
+static const size_t MaxPooledXactions = 1024;
+static Adapter::BlockPool XactionBlocks(sizeof(Adapter::Xaction),
+                                        MaxPooledXactions);
+static std::atomic<unsigned long> XactionSerial(0);
+
+static unsigned long parsePercent(const std::string &name,
+                                  const std::string &value) {
+  unsigned long number = parseUnsigned(name, value);
+  if (number <= 100) return number;
+  throw libecap::TextException(CfgErrorPrefix +
+    "invalid percentage for " + name + ": " + value);
+}; /* parsePercent */
+
+static inline Tcl_WideInt timeMs(const Tcl_Time &t) {
+  return ((Tcl_WideInt) t.sec) * 1000 + t.usec / 1000;
+}; /* timeMs */
+
+static inline Tcl_WideInt timeUs(const Tcl_Time &t) {
+  return ((Tcl_WideInt) t.sec) * 1000000 + t.usec;
+}; /* timeUs */
+
+/* The meta-information every transaction exports (see Xaction::option()).
+ * The order must follow MetaNames. */
+enum MetaOption {
+  META_TIME, META_QUEUE_TIME, META_HOOKS, META_BYTES_IN, META_BYTES_OUT,
+  META_PROCESSOR, META_MINIFY_SAVED, META_NUMBER
+};
+static const char *const MetaNames[] = {
+  "X-Ecap-Tcl-Time", "X-Ecap-Tcl-Queue-Time", "X-Ecap-Tcl-Hooks",
+  "X-Ecap-Tcl-Bytes-In", "X-Ecap-Tcl-Bytes-Out", "X-Ecap-Tcl-Processor",
+  "X-Ecap-Tcl-Minify-Saved", NULL
+};
+
+static std::string formatMs(Tcl_WideInt usecs) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.3f", usecs / 1000.0);
+  return buffer;
+}; /* formatMs */
+
 } // namespace Adapter
 
 Adapter::Service::Service(const std::string &uri_suffix):
-    adapter_id_suffix(uri_suffix)
+    adapter_id_suffix(uri_suffix), breakers(stats), shm(stats)
 {
+  pools.push_back(WorkerPoolPtr(new WorkerPool(DefaultPoolName)));
+}
+
+// The threads of the pools (usually freed by stop()) use the service; the
+// pools go with their last transaction
+Adapter::Service::~Service() {
+  freePool();
 }
 
 std::string Adapter::Service::uri() const {
@@ -91,15 +188,27 @@ void Adapter::Service::configure(const libecap::Options &cfg) {
   Cfgtor cfgtor(*this);
   cfg.visitEachOption(cfgtor);
 
+  setHookTimeouts();
+  loadUrlRules();
+  configureCache();
+  attachShm();
+
   // check for post-configuration errors and inconsistencies
-  if (nthread == 0 && service_init_script.empty()) {
+  if (pools.front()->nthread == 0 && service_init_script.empty()) {
     throw libecap::TextException(CfgErrorPrefix +
       "no threads mode, service_init_script must be set");
   }
-  if (nthread != 0 && service_thread_init_script.empty()) {
+  if (pools.front()->nthread != 0 && service_thread_init_script.empty()) {
     throw libecap::TextException(CfgErrorPrefix +
       "threads mode, service_thread_init_script must be set");
   }
+  for (std::vector<WorkerPoolPtr>::const_iterator it = pools.begin() + 1;
+       it != pools.end(); ++it) {
+    if ((*it)->nthread == 0 || (*it)->thread_init_script.empty()) {
+      throw libecap::TextException(CfgErrorPrefix + "pool." + (*it)->name +
+        ": threads_number and thread_init_script must be set");
+    }
+  }
 }
 
 void Adapter::Service::reconfigure(const libecap::Options &cfg) {
@@ -110,8 +219,39 @@ void Adapter::Service::reconfigure(const libecap::Options &cfg) {
   service_thread_init_script.clear();
   service_thread_retire_script.clear();
   threads_number.clear();
-  nthread = 0;
+  pools.front()->nthread = 0;
+  min_chunk_bytes = 0;
+  max_chunk_delay = 0;
+  mime_min_chunk_bytes.clear();
+  call_timeout = 0;
+  call_timeouts.clear();
+  call_command_limit = 0;
+  timeout_fallback = FALLBACK_PARTIAL;
+  shed_queue_depth = 0;
+  url_rules.clear();
+  // ... and the rules it loaded (loadUrlRules() loads them again)
+  UrlRuleSets::set(WantsUrlRules, UrlRulesPtr());
+  cache_size = 0;
+  cache_dir.clear();
+  cache_disk_size = DefaultCacheDiskSize;
+  profile_interval = 0;
+  profile_dir.clear();
+  native_processors.clear();
+  recycle_xactions = 0;
+  recycle_bytes = 0;
+  recycle_age = 0;
+  recycle_rss = 0;
+  log_target.clear();
+  log_level = Logger::LEVEL_INFO;
+  content_digests.clear();
+  minify_types.clear();
+  shm_name.clear();
+  shm_size = DefaultShmSize;
+  shm_decision_ttl = 0;
+  event_loop = false;
+  breakers.reset();
   freePool();
+  resetPools();
   configure(cfg);
 }
 
@@ -131,6 +271,78 @@ void Adapter::Service::setOne(const libecap::Name &name, const libecap::Area &va
     service_thread_retire_script = value;
   } else if (name == "threads_number") {
     setThreadsNumber(value);
+  } else if (name == "min_chunk_bytes") {
+    min_chunk_bytes = parseUnsigned(name.image(), value);
+  } else if (name == "max_chunk_delay") {
+    max_chunk_delay = parseUnsigned(name.image(), value);
+  } else if (name == "mime_min_chunk_bytes") {
+    setMimeMinChunkBytes(value);
+  } else if (name == "call_timeout") {
+    call_timeout = parseUnsigned(name.image(), value);
+  } else if (name == "call_timeouts") {
+    call_timeouts = value;
+  } else if (name == "call_command_limit") {
+    call_command_limit = parseUnsigned(name.image(), value);
+  } else if (name == "timeout_fallback") {
+    setTimeoutFallback(value);
+  } else if (name == "shed_queue_depth") {
+    shed_queue_depth = parseUnsigned(name.image(), value);
+  } else if (name == "url_rules") {
+    url_rules = value;
+  } else if (name == "cache_size") {
+    cache_size = parseUnsigned(name.image(), value);
+  } else if (name == "cache_dir") {
+    cache_dir = value;
+  } else if (name == "cache_disk_size") {
+    cache_disk_size = parseUnsigned(name.image(), value);
+  } else if (name == "profile_interval") {
+    profile_interval = parseUnsigned(name.image(), value);
+  } else if (name == "profile_dir") {
+    profile_dir = value;
+  } else if (name == "native_processors") {
+    native_processors = value;
+  } else if (name == "recycle_xactions") {
+    recycle_xactions = parseUnsigned(name.image(), value);
+  } else if (name == "recycle_bytes") {
+    recycle_bytes = parseUnsigned(name.image(), value);
+  } else if (name == "recycle_age") {
+    recycle_age = parseUnsigned(name.image(), value);
+  } else if (name == "recycle_rss") {
+    recycle_rss = parseUnsigned(name.image(), value);
+  } else if (name == "log_target") {
+    log_target = value;
+  } else if (name == "log_level") {
+    log_level = Logger::levelOf(value);
+    if (log_level < 0) {
+      throw libecap::TextException(CfgErrorPrefix +
+        "invalid log_level: " + value);
+    }
+  } else if (name == "content_digests") {
+    setContentDigests(value);
+  } else if (name == "minify") {
+    setMinifyTypes(value);
+  } else if (name == "shm_name") {
+    shm_name = value;
+  } else if (name == "shm_size") {
+    shm_size = parseUnsigned(name.image(), value);
+  } else if (name == "shm_decision_ttl") {
+    shm_decision_ttl = parseUnsigned(name.image(), value);
+  } else if (name == "event_loop") {
+    event_loop = parseUnsigned(name.image(), value) != 0;
+  } else if (name.image().compare(0, 5, "pool.") == 0) {
+    setPoolOption(name.image(), value);
+  } else if (name == "shed_sample") {
+    breakers.sample = parsePercent(name.image(), value);
+  } else if (name == "breaker_error_rate") {
+    breakers.error_rate = parsePercent(name.image(), value);
+  } else if (name == "breaker_timeout_rate") {
+    breakers.timeout_rate = parsePercent(name.image(), value);
+  } else if (name == "breaker_min_calls") {
+    breakers.min_calls = parseUnsigned(name.image(), value);
+  } else if (name == "breaker_window") {
+    breakers.window = parseUnsigned(name.image(), value);
+  } else if (name == "breaker_cooldown") {
+    breakers.cooldown = parseUnsigned(name.image(), value);
   } else if (name.assignedHostId()) {
     // skip host-standard options we do not know or care about
   } else {
@@ -142,50 +354,648 @@ void Adapter::Service::setOne(const libecap::Name &name, const libecap::Area &va
 void Adapter::Service::setThreadsNumber(const std::string &value) {
 
   freePool();
-  nthread = 0;
+  pools.front()->nthread = 0;
   threads_number = value;
   if (threads_number.empty()) return;
+  pools.front()->nthread = parseUnsigned("threads_number", value);
+}
 
-  try {
-    std::string::size_type sz;   // alias of size_t
-    nthread = std::stoi(value,&sz);
-  } catch (int e) {
+// Sets an option of a named pool (created by its first option):
+//   pool.js.threads_number=2 pool.js.mime_types=application/javascript
+void Adapter::Service::setPoolOption(const std::string &option,
+                                     const std::string &value) {
+  std::string::size_type dot = option.find('.', 5);
+  std::string name = option.substr(5, dot == std::string::npos ?
+                                          dot : dot - 5);
+  std::string key = dot == std::string::npos ? "" : option.substr(dot + 1);
+  if (name.empty() || name == DefaultPoolName ||
+      name.find_first_not_of("abcdefghijklmnopqrstuvwxyz"
+                             "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-") !=
+        std::string::npos) {
+    throw libecap::TextException(CfgErrorPrefix +
+      "invalid pool name in " + option);
+  }
+  WorkerPoolPtr pool = poolNamed(name);
+  if (!pool) {
+    pool.reset(new WorkerPool(name));
+    pools.push_back(pool);
+  }
+  if (key == "threads_number") {
+    pool->nthread = parseUnsigned(option, value);
+  } else if (key == "thread_init_script") {
+    pool->thread_init_script = value;
+  } else if (key == "call_timeout") {
+    pool->call_timeout = parseUnsigned(option, value);
+  } else if (key == "shed_queue_depth") {
+    pool->shed_queue_depth = parseUnsigned(option, value);
+  } else if (key == "mime_types" || key == "processors") {
+    std::set<std::string> &items = key == "processors" ? pool->processors :
+                                                         pool->mime_types;
+    std::istringstream list(value);
+    std::string item;
+    items.clear();
+    while (std::getline(list, item, ',')) {
+      if (key == "mime_types") {
+        for (std::string::size_type i = 0; i < item.size(); ++i)
+          item[i] = tolower(item[i]);
+      }
+      if (!item.empty()) items.insert(item);
+    }
+  } else {
+    throw libecap::TextException(CfgErrorPrefix +
+      "unsupported configuration parameter: " + option);
+  }
+}
+
+// Forgets the named pools (their threads must have been freed): the
+// transactions bound to one keep it until they end
+void Adapter::Service::resetPools(void) {
+  pools.resize(1);
+}
+
+Adapter::WorkerPoolPtr Adapter::Service::poolNamed(const std::string &name)
+    const {
+  for (std::vector<WorkerPoolPtr>::const_iterator it = pools.begin();
+       it != pools.end(); ++it) {
+    if ((*it)->name == name) return *it;
+  }
+  return WorkerPoolPtr();
+}
+
+// The pool of a new transaction: the first named pool serving its MIME
+// type, else the first one serving the processor of its MIME type, else
+// the default pool.
+Adapter::WorkerPoolPtr Adapter::Service::poolFor(const std::string &mime)
+    const {
+  std::vector<WorkerPoolPtr>::const_iterator it;
+  std::string processor;
+  if (pools.size() == 1) return pools.front();
+  for (it = pools.begin() + 1; it != pools.end(); ++it) {
+    if ((*it)->servesMime(mime)) return *it;
+  }
+  processor = processorOf(mime);
+  for (it = pools.begin() + 1; it != pools.end(); ++it) {
+    if ((*it)->servesProcessor(processor)) return *it;
+  }
+  return pools.front();
+}
+
+void Adapter::Service::learnProcessor(const std::string &mime,
+                                      const std::string &processor) const {
+  if (mime.empty() || processor.empty()) return;
+  Tcl_MutexLock(&processors_lock);
+  processors[mime] = processor;
+  Tcl_MutexUnlock(&processors_lock);
+}
+
+std::string Adapter::Service::processorOf(const std::string &mime) const {
+  std::string processor;
+  Tcl_MutexLock(&processors_lock);
+  std::map<std::string, std::string>::const_iterator it =
+    processors.find(mime);
+  if (it != processors.end()) processor = it->second;
+  Tcl_MutexUnlock(&processors_lock);
+  return processor;
+}
+
+void Adapter::Service::learnHeadersAdapter(const std::string &mime) const {
+  if (mime.empty()) return;
+  Tcl_MutexLock(&processors_lock);
+  headers_adapters.insert(mime);
+  Tcl_MutexUnlock(&processors_lock);
+}
+
+bool Adapter::Service::adaptsHeaders(const std::string &mime) const {
+  bool adapts;
+  Tcl_MutexLock(&processors_lock);
+  adapts = headers_adapters.empty() ||
+           headers_adapters.find(mime) != headers_adapters.end();
+  Tcl_MutexUnlock(&processors_lock);
+  return adapts;
+}
+
+// Parses a list of mime/type:bytes pairs, separated by commas:
+//   mime_min_chunk_bytes=text/html:65536,application/json:0
+void Adapter::Service::setMimeMinChunkBytes(const std::string &value) {
+  std::istringstream list(value);
+  std::string item;
+  mime_min_chunk_bytes.clear();
+  while (std::getline(list, item, ',')) {
+    std::string::size_type colon = item.rfind(':');
+    if (colon == std::string::npos || colon == 0) {
+      throw libecap::TextException(CfgErrorPrefix +
+        "invalid mime_min_chunk_bytes item (expected mime:bytes): " + item);
+    }
+    std::string mime = item.substr(0, colon);
+    for (std::string::size_type i = 0; i < mime.size(); ++i)
+      mime[i] = tolower(mime[i]);
+    mime_min_chunk_bytes[mime] =
+      parseUnsigned("mime_min_chunk_bytes", item.substr(colon + 1));
+  }
+}
+
+// Parses a list of side:algorithm pairs, separated by commas:
+//   content_digests=virgin:xxh64,adapted:sha256
+void Adapter::Service::setContentDigests(const std::string &value) {
+  std::istringstream list(value);
+  std::string item;
+  content_digests.clear();
+  while (std::getline(list, item, ',')) {
+    std::string::size_type colon = item.find(':');
+    int side = -1, algorithm = -1;
+    if (colon != std::string::npos) {
+      side = BodyDigest::sideOf(item.substr(0, colon));
+      algorithm = BodyDigest::algorithmOf(item.substr(colon + 1));
+    }
+    if (side < 0 || algorithm < 0) {
+      throw libecap::TextException(CfgErrorPrefix +
+        "invalid content_digests item (expected virgin|adapted:"
+        "xxh64|sha256): " + item);
+    }
+    BodyDigest digest((BodyDigest::Side) side,
+                      (BodyDigest::Algorithm) algorithm);
+    bool known = false;
+    for (std::vector<BodyDigest>::const_iterator it =
+           content_digests.begin(); it != content_digests.end(); ++it) {
+      if (it->name() == digest.name()) known = true;
+    }
+    if (!known) content_digests.push_back(digest);
+  }
+}
+
+// Parses a list of MIME types, separated by commas, each with the language
+// of its minifier (html, css or js), unless the MIME type implies it:
+//   minify=text/html,text/css,application/json:js
+void Adapter::Service::setMinifyTypes(const std::string &value) {
+  std::istringstream list(value);
+  std::string item;
+  minify_types.clear();
+  while (std::getline(list, item, ',')) {
+    std::string::size_type colon = item.rfind(':');
+    std::string mime = item.substr(0, colon);
+    for (std::string::size_type i = 0; i < mime.size(); ++i)
+      mime[i] = tolower(mime[i]);
+    int language = Minifier::languageOfMime(mime);
+    if (colon != std::string::npos)
+      language = Minifier::languageOf(item.substr(colon + 1));
+    if (mime.empty() || language <= Minifier::NONE) {
+      throw libecap::TextException(CfgErrorPrefix +
+        "invalid minify item (expected mime or mime:html|css|js): " + item);
+    }
+    minify_types[mime] = (Minifier::Language) language;
+  }
+}
+
+// Resolves the time budget of each hook: call_timeout, unless overriden by
+// call_timeouts, a list of hook:msecs pairs, separated by commas:
+//   call_timeouts=wantsUrl:20,contentDone:2000
+void Adapter::Service::setHookTimeouts(void) {
+  std::istringstream list(call_timeouts);
+  std::string item;
+  int hook;
+  for (hook = 0; hook < HOOK_NUMBER; hook++) hook_timeout[hook] = call_timeout;
+  while (std::getline(list, item, ',')) {
+    std::string::size_type colon = item.find(':');
+    std::string name = item.substr(0, colon);
+    for (hook = 0; hook < HOOK_NUMBER; hook++) {
+      if (name == TclHookNames[hook]) break;
+    }
+    if (colon == std::string::npos || hook == HOOK_NUMBER) {
+      throw libecap::TextException(CfgErrorPrefix +
+        "invalid call_timeouts item (expected hook:msecs): " + item);
+    }
+    hook_timeout[hook] =
+      parseUnsigned("call_timeouts", item.substr(colon + 1));
+  }
+}
+
+// Applies the cache limits (the entries beyond them are evicted): without
+// cache_size, the cache is disabled.
+void Adapter::Service::configureCache(void) {
+  std::string error;
+  if (!cache_dir.empty() && !cache_size) {
+    throw libecap::TextException(CfgErrorPrefix +
+      "cache_dir needs cache_size");
+  }
+  if (!cache.configure(cache_size, cache_dir, cache_disk_size, error)) {
+    throw libecap::TextException(CfgErrorPrefix + error);
+  }
+}
+
+// Attaches to the shared memory segment of shm_name (detaches, without)
+void Adapter::Service::attachShm(void) {
+  std::string error;
+  if (!shm.attach(shm_name, shm_size, error)) {
+    throw libecap::TextException(CfgErrorPrefix + error);
+  }
+}
+
+// Starts the log (shared by the services of the process) with log_target
+// and log_level: stop() stops it, once the other services are done too.
+void Adapter::Service::startLog(void) {
+  std::string error;
+  if (!Logger::start(log_target, log_level, error)) {
+    throw libecap::TextException(CfgErrorPrefix + "log_target: " + error);
+  }
+  // Started again: one start() is matched by one stop()...
+  if (logging) Logger::stop();
+  logging = true;
+}
+
+// Starts the profiler, if profile_interval is set
+void Adapter::Service::startProfile(void) {
+  std::string error;
+  if (profile_interval && !Profiler::start(profile_interval, error)) {
+    throw libecap::TextException(CfgErrorPrefix + "profile_interval: " +
+                                 error);
+  }
+}
+
+// Writes the folded stacks collected by the profiler to profile_dir (if
+// set), one file per worker. Called by stop(): an error is logged, not
+// thrown, so the service still stops.
+void Adapter::Service::writeProfile(void) const {
+  std::vector<std::string> files;
+  std::string error;
+  if (profile_dir.empty()) return;
+  if (!Profiler::write(profile_dir, files, error) && mainInterp) {
+    logError(mainInterp, (ErrorPrefix + "profile_dir: " + error).c_str());
+  }
+}
+
+// Loads the shared objects of native_processors, and makes their processors
+// the ones tried before the Tcl processors. Needs the main interpreter.
+void Adapter::Service::loadNatives(void) {
+  std::shared_ptr<NativeProcessors> natives =
+    std::make_shared<NativeProcessors>();
+  std::string error;
+  if (!natives->load(mainInterp, native_processors, error)) {
+    throw libecap::TextException(ErrorPrefix + error);
+  }
+  NativeProcessors::install(natives);
+}
+
+// Accounts a call of a native processor, as evalCall does for Tcl: it
+// never waits for a thread. A native call cannot be abandoned (it runs on
+// the host thread): one that took longer than the time budget of its hook
+// is a failure of its processor, so a processor that keeps overrunning
+// trips its circuit breaker, and is bypassed.
+void Adapter::Service::noteNativeCall(Xaction *action, TclHook hook,
+                                      const Tcl_Time &begin) const {
+  WorkerPool *pool = action->pool();
+  unsigned int budget;
+  Tcl_Time end;
+  Tcl_WideInt elapsed;
+  Tcl_GetTime(&end);
+  elapsed = timeUs(end) - timeUs(begin);
+  stats.incr(STATS_NATIVE_CALLS);
+  stats.incr(STATS_NATIVE_USECS, elapsed);
+  action->noteCall(hook, 0, elapsed);
+  budget = pool && pool->call_timeout ? pool->call_timeout :
+                                        hook_timeout[hook];
+  if (budget && elapsed > (Tcl_WideInt) budget * 1000) {
+    stats.incr(STATS_NATIVE_OVERRUNS);
+    action->processorFailed(std::string(TclHookNames[hook]) +
+                            " exceeded its time budget");
+  }
+}
+
+// Compiles the rules of url_rules, and makes them the rule set of wantsUrl.
+// Without url_rules, the rule set is left to Tcl (::ecap-tcl::match load).
+void Adapter::Service::loadUrlRules(void) {
+  std::string error;
+  // Not in the constructor: the service is created during static
+  // initialisation, when the rule sets may not be initialised yet.
+  wants_url_rules = UrlRuleSets::slot(WantsUrlRules);
+  if (url_rules.empty()) return;
+  UrlRules *rules = new UrlRules;
+  if (!rules->load(url_rules, error)) {
+    delete rules;
+    throw libecap::TextException(CfgErrorPrefix + error);
+  }
+  UrlRuleSets::set(WantsUrlRules, UrlRulesPtr(rules));
+}
+
+void Adapter::Service::setTimeoutFallback(const std::string &value) {
+  if (value == "virgin") {
+    timeout_fallback = FALLBACK_VIRGIN;
+  } else if (value == "partial") {
+    timeout_fallback = FALLBACK_PARTIAL;
+  } else if (value == "block") {
+    timeout_fallback = FALLBACK_BLOCK;
+  } else {
     throw libecap::TextException(CfgErrorPrefix +
-      "invalid integer value for threads_number: " + value);
+      "invalid timeout_fallback (expected virgin, partial or block): " +
+      value);
+  }
+}
+
+// Returns true if a new transaction must bypass adaptation: too many
+// transactions are being adapted (by the service, or by its pool), or the
+// processor that handles its MIME type has been failing.
+bool Adapter::Service::shed(Xaction *action) const {
+  WorkerPool *pool = action->pool();
+  if (shed_queue_depth &&
+      stats.get(STATS_ACTIVE_XACTIONS) >= (Tcl_WideInt) shed_queue_depth &&
+      breakers.sampled()) {
+    stats.incr(STATS_SHED_DEPTH);
+    return true;
+  }
+  if (pool->shed_queue_depth &&
+      pool->get(POOL_ACTIVE_XACTIONS) >=
+        (Tcl_WideInt) pool->shed_queue_depth &&
+      breakers.sampled()) {
+    stats.incr(STATS_SHED_DEPTH);
+    pool->incr(POOL_SHED_DEPTH);
+    return true;
+  }
+  if (breakers.bypass(breakers.processorFor(action->mime()),
+                      &action->breaker_probe)) {
+    stats.incr(STATS_SHED_BREAKER);
+    return true;
   }
+  return false;
+}
+
+// Remembers that the transaction of url must be blocked, when it starts.
+// Beyond MaxBlockedUrls, the oldest block is forgotten.
+void Adapter::Service::blockUrl(const std::string &url) const {
+  blocked_urls[url].push_back(++blocked_serial);
+  blocked_serials[blocked_serial] = url;
+  if (blocked_serials.size() <= MaxBlockedUrls) return;
+  std::map<unsigned long, std::string>::iterator oldest =
+    blocked_serials.begin();
+  std::map<std::string, std::deque<unsigned long> >::iterator it =
+    blocked_urls.find(oldest->second);
+  it->second.pop_front(); // the oldest of its URL too
+  if (it->second.empty()) blocked_urls.erase(it);
+  blocked_serials.erase(oldest);
+}
+
+// Returns true if wantsUrl asked for the transaction of url to be blocked.
+bool Adapter::Service::takeBlockedUrl(const std::string &url) const {
+  if (blocked_urls.empty()) return false;
+  std::map<std::string, std::deque<unsigned long> >::iterator it =
+    blocked_urls.find(url);
+  if (it == blocked_urls.end()) return false;
+  blocked_serials.erase(it->second.front());
+  it->second.pop_front();
+  if (it->second.empty()) blocked_urls.erase(it);
+  return true;
+}
+
+Adapter::size_type Adapter::Service::minChunkBytes(const std::string &mime)
+                                                                     const {
+  std::map<std::string, size_type>::const_iterator it =
+    mime_min_chunk_bytes.find(mime);
+  if (it != mime_min_chunk_bytes.end()) return it->second;
+  return min_chunk_bytes;
+}
+
+Adapter::Minifier::Language
+Adapter::Service::minifyLanguage(const std::string &mime) const {
+  std::map<std::string, Minifier::Language>::const_iterator it =
+    minify_types.find(mime);
+  return it == minify_types.end() ? Minifier::NONE : it->second;
+}
+
+void Adapter::Service::scheduleFlush(Xaction *action) const {
+  if (max_chunk_delay) flushing.insert(action);
+}
+
+void Adapter::Service::cancelFlush(Xaction *action) const {
+  flushing.erase(action);
+}
+
+void Adapter::Service::waitSuspended(Xaction *action) const {
+  suspended.insert(action);
+}
+
+void Adapter::Service::cancelSuspended(Xaction *action) const {
+  suspended.erase(action);
+}
+
+// Must the host wake us regularly: for the events of the main interpreter,
+// to find the suspended calls that have been completed, or the cached
+// responses mapped back from disk?
+bool Adapter::Service::pollsEvents() const {
+  return !suspended.empty() || (event_loop && !pools.front()->threads) ||
+    cache.loading();
 }
 
 void Adapter::Service::freePool(void) {
   // Call free scripts...
-  if (pool != NULL) {
-    TPoolFree(pool);
+  for (std::vector<WorkerPoolPtr>::const_iterator it = pools.begin();
+       it != pools.end(); ++it) {
+    freePool(it->get());
   }
-  pool = NULL;
+}
+
+// Stops the threads of a pool: the transactions bound to them can no longer
+// be served (see dispatchCall), but keep the pool until they end.
+void Adapter::Service::freePool(WorkerPool *wpool) {
+  if (wpool->threads == NULL) return;
+  TPoolFree(wpool->threads);
+  wpool->threads = NULL;
+  wpool->generation++;
 }
 
 void Adapter::Service::initPool(void) {
+  initPool(pools.front().get(), service_thread_init_script);
+  for (std::vector<WorkerPoolPtr>::const_iterator it = pools.begin() + 1;
+       it != pools.end(); ++it) {
+    initPool(it->get(), (*it)->thread_init_script);
+  }
+}
+
+void Adapter::Service::initPool(WorkerPool *wpool, const std::string &script) {
   TPoolThread *t;
+  TPool *pool = wpool->threads;
+  unsigned int nthread = wpool->nthread;
+  wpool->service = this;
+  wpool->init_script = script;
   if (pool != NULL) {
     // We already have a pool..
-    if (pool->nthread == nthread) return;
-    freePool();
+    if (pool->nthread == nthread) {
+      TPoolEvents(pool, event_loop);
+      return;
+    }
+    freePool(wpool);
   }
-  pool = TPoolInit(nthread);
-  if (service_thread_init_script.empty()) return;
+  if (nthread == 0) return;
+  pool = wpool->threads = TPoolInit(nthread);
+  // Recycled interpreters are initialised as the first ones...
+  pool->warm   = warmThread;
+  pool->retire = retireThread;
+  pool->joined = joinedThread;
+  pool->data   = (void *) wpool;
+  TPoolEvents(pool, event_loop);
+  if (script.empty()) return;
   // Initialise thread interprerter...
   for (unsigned int i = 0; i < nthread; i++) {
     t = TPoolStartInThreadPosition(pool, i, initialiseThread,
-                           (void *) NULL);
+                           (void *) this);
+    TPoolThreadWait(t);
+    t = TPoolStartInThreadPosition(pool, i, bindThread, (void *) wpool);
     TPoolThreadWait(t);
   }
   // Call init scripts...
   for (unsigned int i = 0; i < nthread; i++) {
     t = TPoolStartInThreadPosition(pool, i, evalThreadScript,
-                           (void *) service_thread_init_script.c_str());
+                           (void *) script.c_str());
     TPoolThreadWait(t);
   }
 }
 
+// Looks for the optional hooks, in the interpreters that will evaluate them
+// (all threads of a pool are initialised by the same script).
+void Adapter::Service::detectHooks(void) {
+  for (std::vector<WorkerPoolPtr>::const_iterator it = pools.begin();
+       it != pools.end(); ++it) {
+    if ((*it)->threads) {
+      TPoolThreadWait(TPoolStartInThreadPosition((*it)->threads, 0,
+                        checkHooks, (void *) it->get()));
+    } else {
+      checkHooks(mainInterp, (void *) it->get());
+    }
+  }
+}
+
+void Adapter::checkHooks(Tcl_Interp *interp, void *data) {
+  WorkerPool *pool = (WorkerPool *) data;
+  Tcl_CmdInfo info;
+  pool->headers_hook =
+    Tcl_GetCommandInfo(interp, "::ecap-tcl::headersAdapt", &info) != 0;
+}
+
+// The interpreter of a thread knows its pool (see ::ecap-tcl::pool current)
+void Adapter::bindThread(Tcl_Interp *interp, void *data) {
+  Tcl_SetAssocData(interp, TCLECAP_INTERP_KEY_POOL, NULL, data);
+}
+
+// Initialises the interpreter replacing the one of a thread of the pool,
+// in a new thread, while the old interpreter is still serving.
+int Adapter::warmThread(Tcl_Interp *interp, void *data) {
+  WorkerPool *pool = (WorkerPool *) data;
+  try {
+    initialiseThread(interp, (void *) pool->service);
+    bindThread(interp, data);
+    if (!pool->init_script.empty()) {
+      evalThreadScript(interp, (void *) pool->init_script.c_str());
+    }
+  } catch (const std::exception &e) {
+    logError(interp, e.what());
+    return TCL_ERROR;
+  }
+  return TCL_OK;
+}
+
+// Reports an error that no call can return, in the log of interp
+void Adapter::logError(Tcl_Interp *interp, const char *message) {
+  Tcl_Obj *text;
+  if (!Logger::enabled(Logger::LEVEL_ERROR)) {
+    Logger::noteFiltered();
+    return;
+  }
+  text = Tcl_NewStringObj(message, -1);
+  Tcl_IncrRefCount(text);
+  Logger::log(interp, Logger::LEVEL_ERROR, text, NULL);
+  Tcl_DecrRefCount(text);
+}
+
+// The resident set size of the process (0 if unknown)
+static libecap::size_type residentBytes(void) {
+  std::ifstream statm("/proc/self/statm");
+  libecap::size_type pages = 0, resident = 0;
+  if (!(statm >> pages >> resident)) return 0;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Deletes the interpreter of a thread that has been replaced, in its
+// thread. Returns the resident size before, for joinedThread.
+Tcl_WideInt Adapter::retireThread(Tcl_Interp *interp, void *data) {
+  WorkerPool *pool = (WorkerPool *) data;
+  size_type before;
+  if (!pool->service->service_thread_retire_script.empty()) {
+    try {
+      evalThreadScript(interp,
+        (void *) pool->service->service_thread_retire_script.c_str());
+    } catch (const std::exception &e) {
+      logError(interp, e.what());
+    }
+  }
+  pool->service->dropStaleCoroutines(interp);
+  before = residentBytes();
+  Tcl_DeleteInterp(interp);
+  return (Tcl_WideInt) before;
+}
+
+// The thread of a retired interpreter has exited (and given back its
+// allocator caches): accounts the memory reclaimed.
+void Adapter::joinedThread(void *data, Tcl_WideInt before) {
+  WorkerPool *pool = (WorkerPool *) data;
+  size_type after = residentBytes();
+  pool->incr(POOL_RECYCLED);
+  pool->service->stats.incr(STATS_INTERPS_RECYCLED);
+  if ((size_type) before > after) {
+    pool->incr(POOL_RECLAIMED_BYTES, before - after);
+    pool->service->stats.incr(STATS_INTERPS_RECLAIMED, before - after);
+  }
+}
+
+// A transaction is done with the thread it was bound to: replaces the
+// interpreter of the thread, if it has served enough (see recycle_*).
+void Adapter::Service::releaseThread(WorkerPool *pool, TPoolThread *thread,
+                                     size_type bytes) const {
+  TPool *threads = pool->threads;
+  TPoolUsage usage;
+  Tcl_Time now;
+  bool recycle;
+  // The pool may have been replaced by a reconfiguration...
+  if (threads == NULL || !TPoolOwns(threads, thread)) return;
+  TPoolUnbind(thread, bytes, &usage);
+  Tcl_GetTime(&now);
+  recycle = (recycle_xactions && usage.served >= recycle_xactions) ||
+            (recycle_bytes && (size_type) usage.bytes >= recycle_bytes) ||
+            (recycle_age && now.sec - usage.born.sec >= recycle_age);
+  if (!recycle && recycle_rss) {
+    if (now.sec != rss_checked.sec) {
+      rss = residentBytes();
+      rss_checked = now;
+    }
+    recycle = rss >= recycle_rss && TPoolHeaviest(threads) == thread;
+  }
+  if (recycle) TPoolRecycle(thread);
+}
+
+void Adapter::Service::staleCoroutine(Tcl_Interp *interp,
+                                      const std::string &name) const {
+  Tcl_MutexLock(&coroutines_lock);
+  stale_coroutines[interp].push_back(name);
+  Tcl_MutexUnlock(&coroutines_lock);
+}
+
+// Called in the thread of interp (and, for the main interpreter, holding
+// eCAPTcl).
+void Adapter::Service::dropStaleCoroutines(Tcl_Interp *interp) const {
+  std::vector<std::string> names;
+  std::map<Tcl_Interp *, std::vector<std::string> >::iterator it;
+  Tcl_CmdInfo info;
+  Tcl_MutexLock(&coroutines_lock);
+  it = stale_coroutines.find(interp);
+  if (it != stale_coroutines.end()) {
+    names.swap(it->second);
+    stale_coroutines.erase(it);
+  }
+  Tcl_MutexUnlock(&coroutines_lock);
+  for (std::vector<std::string>::const_iterator name = names.begin();
+       name != names.end(); ++name) {
+    if (Tcl_GetCommandInfo(interp, name->c_str(), &info)) {
+      Tcl_DeleteCommand(interp, name->c_str());
+    }
+  }
+}
+
 void Adapter::Service::evalScript(const std::string &path) {
   if (path.empty()) return;
   if (TclInitialized != true) {
@@ -200,9 +1010,11 @@ void Adapter::initialiseThread(Tcl_Interp *interp, void *data) {
     throw libecap::TextException(ErrorPrefix +
       "Tcl is not properly initialised");
   }
+  Tcl_SetAssocData(interp, TCLECAP_INTERP_KEY_SERVICE, NULL, data);
   if (TcleCAP_InitialiseInterpreter(interp) != TCL_OK) {
     throw libecap::TextException(ErrorPrefix + getErrorMsg(interp));
   }
+  Profiler::attach(interp, interp == mainInterp);
 }
 
 void Adapter::evalThreadScript(Tcl_Interp *interp, void *data) {
@@ -232,18 +1044,149 @@ void Adapter::evalThreadScript(Tcl_Interp *interp, void *data) {
   }
 }
 
+namespace Adapter {
+
+// The string (or the bytes, of a byte array) of a result...
+static void resultString(Tcl_Obj *result, std::string &out) {
+  const char *str;
+  int len;
+  if (result->typePtr == bytearrayType ||
+      result->typePtr == proper_bytearrayType) {
+    str = (const char*) Tcl_GetByteArrayFromObj(result, &len);
+  } else {
+    str = Tcl_GetStringFromObj(result, &len);
+  }
+  out.assign(str, len);
+}; /* resultString */
+
+/* The calls suspended in an interpreter, by handle */
+struct SuspendedCalls {
+  unsigned long next = 0;
+  std::map<std::string, TclCallClientData *> calls;
+};
+
+static void deleteSuspended(ClientData clientData, Tcl_Interp *interp) {
+  SuspendedCalls *suspended = (SuspendedCalls *) clientData;
+  for (std::map<std::string, TclCallClientData *>::iterator it =
+       suspended->calls.begin(); it != suspended->calls.end(); ++it) {
+    releaseCall(it->second);
+  }
+  delete suspended;
+}; /* deleteSuspended */
+
+static SuspendedCalls *interpSuspended(Tcl_Interp *interp) {
+  SuspendedCalls *suspended = (SuspendedCalls *)
+    Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_SUSPENDED, NULL);
+  if (suspended == NULL) {
+    suspended = new SuspendedCalls;
+    Tcl_SetAssocData(interp, TCLECAP_INTERP_KEY_SUSPENDED, deleteSuspended,
+                     suspended);
+  }
+  return suspended;
+}; /* interpSuspended */
+
+// A hook that failed after suspending its call: the call ends now.
+static void dropSuspended(Tcl_Interp *interp, TclCallClientData *data) {
+  SuspendedCalls *suspended = interpSuspended(interp);
+  for (std::map<std::string, TclCallClientData *>::iterator it =
+       suspended->calls.begin(); it != suspended->calls.end(); ++it) {
+    if (it->second == data) {
+      suspended->calls.erase(it);
+      releaseCall(data);
+      return;
+    }
+  }
+}; /* dropSuspended */
+
+} // namespace Adapter
+
+std::string Adapter::suspendCall(Tcl_Interp *interp, TclCallClientData *data) {
+  SuspendedCalls *suspended = interpSuspended(interp);
+  char handle[48];
+  // The calls the host no longer waits for (the transaction has ended, or
+  // the time budget has passed) will never be resumed: forget them...
+  std::map<std::string, TclCallClientData *>::iterator it =
+    suspended->calls.begin();
+  while (it != suspended->calls.end()) {
+    bool abandoned;
+    Tcl_MutexLock(&it->second->lock);
+    abandoned = it->second->abandoned;
+    Tcl_MutexUnlock(&it->second->lock);
+    if (abandoned) {
+      releaseCall(it->second);
+      suspended->calls.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  snprintf(handle, sizeof(handle), "ecap-tcl-suspended%lu",
+           ++suspended->next);
+  Tcl_MutexLock(&data->lock);
+  data->suspended = true;
+  data->refCount++;
+  Tcl_MutexUnlock(&data->lock);
+  suspended->calls[handle] = data;
+  return handle;
+}
+
+bool Adapter::resumeCall(Tcl_Interp *interp, const std::string &handle,
+                         int code, Tcl_Obj *result, bool &delivered) {
+  SuspendedCalls *suspended = interpSuspended(interp);
+  std::map<std::string, TclCallClientData *>::iterator it =
+    suspended->calls.find(handle);
+  TclCallClientData *data;
+  if (it == suspended->calls.end()) return false;
+  data = it->second;
+  suspended->calls.erase(it);
+  Tcl_MutexLock(&data->lock);
+  delivered = !data->abandoned && !data->completed;
+  if (delivered) {
+    // The host finds the call completed, when it next polls us...
+    data->code = code;
+    if (code == TCL_OK && result) resultString(result, data->result);
+    data->completed = true;
+  }
+  Tcl_MutexUnlock(&data->lock);
+  releaseCall(data);
+  return true;
+}
+
+// The number of commands interp has executed (info cmdcount), calling the
+// command directly, without evaluating (and counting) a script.
+static Tcl_WideInt commandCount(Tcl_Interp *interp) {
+  Tcl_CmdInfo info;
+  Tcl_Obj *name;
+  Tcl_WideInt count = 0;
+  if (!Tcl_GetCommandInfo(interp, "::tcl::info::cmdcount", &info)) return 0;
+  name = Tcl_NewStringObj("::tcl::info::cmdcount", -1);
+  Tcl_IncrRefCount(name);
+  if (info.objProc(info.objClientData, interp, 1, &name) == TCL_OK) {
+    Tcl_GetWideIntFromObj(NULL, Tcl_GetObjResult(interp), &count);
+  }
+  Tcl_DecrRefCount(name);
+  Tcl_ResetResult(interp);
+  return count;
+}; /* commandCount */
+
 void Adapter::evalInThread(Tcl_Interp *interp, void *clientdata) {
   TclCallClientData *data = (TclCallClientData *) clientdata;
-  Tcl_Obj *objv[data->objc], *result;
-  unsigned int i;
-  int len;
+  Tcl_Obj *objv[data->objc], *result, *resume[2] = {NULL, NULL}, **evalv;
+  Tcl_CmdInfo info;
+  unsigned int i, evalc;
+  int len, code, limits = 0;
+  bool cancelled, profiled, coroutine, suspended, dropped = false;
   const char *str;
   if (TclInitialized != true) {
     throw libecap::TextException(ErrorPrefix +
       "Tcl is not properly initialised");
   }
-  /* Set the associated data to interp */
-  Tcl_SetAssocData(interp, TCLECAP_INTERP_KEY_ACTION, NULL, data->action);
+  Tcl_MutexLock(&data->lock);
+  if (data->abandoned) {
+    // The host gave up waiting before we even started...
+    Tcl_MutexUnlock(&data->lock);
+    releaseCall(data);
+    return;
+  }
   for (i=0; i<data->objc; i++) {
     switch (data->init[i]) {
       case string:
@@ -259,158 +1202,480 @@ void Adapter::evalInThread(Tcl_Interp *interp, void *clientdata) {
       case boolean:
         objv[i] = Tcl_NewBooleanObj(data->token[i] == NULL ? 0 : 1);
         break;
+      case list:
+        objv[i] = Tcl_NewListObj(0, NULL);
+        for (std::vector<std::string>::const_iterator it =
+             data->items->begin(); it != data->items->end(); ++it) {
+          Tcl_ListObjAppendElement(NULL, objv[i],
+                                   Tcl_NewStringObj(it->data(), it->size()));
+        }
+        break;
     }
     Tcl_IncrRefCount(objv[i]);
   }
+  // The calls after actionStart resume the coroutine of the transaction, if
+  // it has one, with an event: the name of the hook and its arguments...
+  coroutine = data->hook > HOOK_ACTION_START && data->action &&
+              data->action->coroutine();
+  evalv = objv;
+  evalc = data->objc;
+  if (coroutine || data->hook == HOOK_ACTION_START) {
+    resume[0] = Tcl_NewStringObj(data->coroutine.data(),
+                                 data->coroutine.size());
+    Tcl_IncrRefCount(resume[0]);
+  }
+  if (coroutine) {
+    resume[1] = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, resume[1],
+                             Tcl_NewStringObj(TclHookNames[data->hook], -1));
+    for (i=2; i<data->objc; i++) {
+      Tcl_ListObjAppendElement(NULL, resume[1], objv[i]);
+    }
+    Tcl_IncrRefCount(resume[1]);
+    evalv = resume;
+    evalc = 2;
+  }
+  data->interp  = interp;
+  data->running = true;
+  Tcl_Time now;
+  Tcl_GetTime(&now);
+  data->started = timeUs(now);
+  Tcl_MutexUnlock(&data->lock);
+  /* Set the associated data to interp */
+  Tcl_SetAssocData(interp, TCLECAP_INTERP_KEY_ACTION, NULL, data);
   if (interp == mainInterp) Tcl_MutexLock(&eCAPTcl);
-  data->code = Tcl_EvalObjv(interp, data->objc, objv,
-                            TCL_EVAL_GLOBAL | TCL_EVAL_DIRECT);
-  if (data->code == TCL_OK) {
-    result = Tcl_GetObjResult(interp);
-    Tcl_IncrRefCount(result);
-    switch (data->expects) {
-      case result_string: {
-        // Get its type...
-        if (result->typePtr == bytearrayType ||
-            result->typePtr == proper_bytearrayType) {
-          str = (const char*) Tcl_GetByteArrayFromObj(result, &len);
-          // printf("%s Got a byte array (%d) (%p)\n", Tcl_GetString(objv[0]),
-          //        len, bytearrayType); fflush(0);
-        } else {
-          str = Tcl_GetStringFromObj(result, &len);
-          // printf("%s Got a string (%d) (%p)\n", Tcl_GetString(objv[0]),
-          //        len, bytearrayType); fflush(0);
+  if (data->hook == HOOK_ACTION_START) {
+    Service *service = (Service *)
+      Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_SERVICE, NULL);
+    if (service) service->dropStaleCoroutines(interp);
+  }
+  /* Enforce the time budget and the command limit of the call... */
+  if (data->timeout) {
+    Tcl_Time limit;
+    Tcl_GetTime(&limit);
+    limit.sec  += data->timeout / 1000;
+    limit.usec += (data->timeout % 1000) * 1000;
+    if (limit.usec >= 1000000) {limit.sec++; limit.usec -= 1000000;}
+    Tcl_LimitSetTime(interp, &limit);
+    Tcl_LimitTypeSet(interp, TCL_LIMIT_TIME);
+    limits |= TCL_LIMIT_TIME;
+  }
+  if (data->commands) {
+    // The command limit is absolute: add the commands executed so far...
+    Tcl_LimitSetCommands(interp, (int) (commandCount(interp) +
+                                        data->commands));
+    Tcl_LimitTypeSet(interp, TCL_LIMIT_COMMANDS);
+    limits |= TCL_LIMIT_COMMANDS;
+  }
+  // break and continue are results (i.e. "do not modify"), not errors...
+  Tcl_AllowExceptions(interp);
+  profiled = Profiler::running() && Profiler::enter(interp, objv[0]);
+  if (coroutine && !Tcl_GetCommandInfo(interp, Tcl_GetString(resume[0]),
+                                       &info)) {
+    // The coroutine has returned (or failed): nothing more to adapt...
+    code = TCL_BREAK;
+  } else {
+    code = Tcl_EvalObjv(interp, evalc, evalv,
+                        TCL_EVAL_GLOBAL | TCL_EVAL_DIRECT);
+  }
+  if (profiled) Profiler::leave(interp);
+  if (limits) {
+    if (Tcl_LimitExceeded(interp)) code = ECAPTCL_TIMEOUT;
+    if (limits & TCL_LIMIT_TIME)     Tcl_LimitTypeReset(interp, TCL_LIMIT_TIME);
+    if (limits & TCL_LIMIT_COMMANDS) Tcl_LimitTypeReset(interp,
+                                                        TCL_LIMIT_COMMANDS);
+  }
+  Tcl_MutexLock(&data->lock);
+  data->running = false;
+  cancelled = data->cancelled;
+  if (data->blocked && code != ECAPTCL_TIMEOUT) code = ECAPTCL_BLOCK;
+  // A suspended hook has returned, but its call goes on until
+  // ::ecap-tcl::resume (unless the hook has failed, or has called it)...
+  suspended = data->suspended && !data->completed;
+  if (suspended && code != TCL_OK && code != TCL_BREAK &&
+      code != TCL_CONTINUE) {
+    data->suspended = suspended = false;
+    dropped = true;
+  }
+  if (suspended) {
+    if (!data->abandoned) data->code = ECAPTCL_SUSPEND;
+  } else if (!data->abandoned && !data->completed) {
+    data->code = code;
+    if (code == TCL_OK) {
+      result = Tcl_GetObjResult(interp);
+      Tcl_IncrRefCount(result);
+      switch (data->expects) {
+        case result_string: {
+          resultString(result, data->result);
+          break;
+        }
+        case result_boolean: {
+          data->result_boolean = 0;
+          data->code = Tcl_GetBooleanFromObj(interp, result,
+                                           &(data->result_boolean));
+          break;
+        }
+        case result_list: {
+          Tcl_Obj **items;
+          int count;
+          data->code = Tcl_ListObjGetElements(interp, result, &count, &items);
+          if (data->code != TCL_OK) break;
+          data->result_items.reserve(count);
+          for (int item = 0; item < count; item++) {
+            str = Tcl_GetStringFromObj(items[item], &len);
+            data->result_items.push_back(std::string(str, len));
+          }
+          break;
         }
-        data->result.assign(str, len);
-        break;
-      }
-      case result_boolean: {
-        data->result_boolean = 0;
-        data->code = Tcl_GetBooleanFromObj(interp, result,
-                                         &(data->result_boolean));
-        break;
       }
+      Tcl_DecrRefCount(result);
     }
-    Tcl_DecrRefCount(result);
+  }
+  Tcl_MutexUnlock(&data->lock);
+  if (dropped) dropSuspended(interp, data);
+  if (cancelled) {
+    // Tcl_CancelEval() may have arrived after the evaluation had finished:
+    // deliver it now (it is an async handler), and clear it, or the
+    // interpreter will refuse to evaluate anything else.
+    if (Tcl_AsyncReady()) Tcl_AsyncInvoke(interp, TCL_OK);
+    Tcl_Canceled(interp, 0);
+  }
+  // A coroutine does not outlive its transaction: delete it after
+  // actionStop (if it is still waiting for events), or if actionStart
+  // failed after creating it.
+  if (resume[0] && (data->hook == HOOK_ACTION_STOP ||
+                    (data->hook == HOOK_ACTION_START && code != TCL_OK)) &&
+      Tcl_GetCommandInfo(interp, Tcl_GetString(resume[0]), &info)) {
+    Tcl_DeleteCommand(interp, Tcl_GetString(resume[0]));
   }
   Tcl_SetAssocData(interp, TCLECAP_INTERP_KEY_ACTION, NULL, NULL);
+  Tcl_ResetResult(interp);
+  // Let go of the shared tables replaced during the call...
+  SharedStore::releaseStale(interp);
   if (interp == mainInterp) Tcl_MutexUnlock(&eCAPTcl);
   for (i=0; i<data->objc; i++) Tcl_DecrRefCount(objv[i]);
+  if (resume[0]) Tcl_DecrRefCount(resume[0]);
+  if (resume[1]) Tcl_DecrRefCount(resume[1]);
+  releaseCall(data);
 }
 
-int Adapter::Service::actionStart(Xaction *action) const {
-  TclCallClientData data;
-  data.objc     = 2;
-  data.token[0] = "::ecap-tcl::actionStart"; data.init[0] = string;
-  data.token[1] = action->token;             data.init[1] = string;
-  data.action   = action;
-  data.expects  = result_string;
-
-  if (nthread && pool) {
-    // Use the thread pool...
-    thread = TPoolThreadStart(pool, evalInThread,
-                                      (void *) &data);
-    TPoolThreadWait(thread);
-  } else {
-    // Use main interpreter...
-    evalInThread(mainInterp, (void *) &data);
+Adapter::_TclCallClientData::_TclCallClientData(TclHook h, Xaction *a):
+    objc(0), code(TCL_OK), hook(h), action(a) {
+}
+
+void Adapter::releaseCall(TclCallClientData *data) {
+  int refCount;
+  Tcl_MutexLock(&data->lock);
+  refCount = --data->refCount;
+  Tcl_MutexUnlock(&data->lock);
+  if (refCount == 0) {
+    Tcl_MutexFinalize(&data->lock);
+    delete data;
   }
-  size = 0;
-  return data.code;
 }
 
-int Adapter::Service::actionStop(Xaction *action) const {
-  TclCallClientData data;
-  data.objc     = 2;
-  data.token[0] = "::ecap-tcl::actionStop"; data.init[0] = string;
-  data.token[1] = action->token;            data.init[1] = string;
-  data.action   = action;
-  data.expects  = result_string;
-
-  if (nthread && pool) {
-    // Use the thread pool...
-    if (thread) {
-      TPoolStartInThread(thread, evalInThread, (void *) &data);
-    } else {
-      thread = TPoolThreadStart(pool, evalInThread, (void *) &data);
-    }
-    TPoolThreadWait(thread);
-    thread = NULL;
-  } else {
-    // Use main interpreter...
-    evalInThread(mainInterp, (void *) &data);
+// Cancels the evaluation of a call, if it is still running.
+void Adapter::cancelCall(TclCallClientData *data) {
+  Tcl_MutexLock(&data->lock);
+  if (data->running && !data->cancelled) {
+    // Not TCL_CANCEL_UNWIND: only Tcl_Canceled() can clear a cancellation
+    // that arrives late (see evalInThread), and it cannot clear that one.
+    // A script that catches the error still hits its time limit.
+    Tcl_CancelEval(data->interp, NULL, NULL, 0);
+    data->cancelled = true;
   }
-  return data.code;
+  Tcl_MutexUnlock(&data->lock);
 }
 
-int Adapter::Service::contentAdapt(Xaction *action,
-                                   std::string &chunk) const {
-  TclCallClientData data;
-  data.objc     = 3;
-  data.token[0] = "::ecap-tcl::contentAdapt"; data.init[0] = string;
-  data.token[1] = action->token;              data.init[1] = string;
-  data.token[2] = chunk.data();               data.init[2] = bytearray;
-  data.size[2]  = chunk.size();
-  data.action   = action;
-  data.expects  = result_string;
-  size += chunk.size();
+// Evaluates a call, and accounts the time spent waiting for a thread, and
+// in Tcl, to the transaction (and its pool, and the service).
+int Adapter::Service::evalCall(TclCallClientData *data) const {
+  Xaction *action = data->action;
+  WorkerPool *pool = action ? action->pool() : pools.front().get();
+  Tcl_Time begin, end;
+  Tcl_WideInt started, total, wait;
+  int code;
+  Tcl_GetTime(&begin);
+  if (action && (data->hook == HOOK_ACTION_START || action->coroutine())) {
+    data->coroutine = action->coroutineName();
+  }
+  code = dispatchCall(data, pool);
+  Tcl_GetTime(&end);
+  total = timeUs(end) - timeUs(begin);
+  Tcl_MutexLock(&data->lock);
+  started = data->started;
+  Tcl_MutexUnlock(&data->lock);
+  // A call that never started has been waiting all the time...
+  wait = started ? started - timeUs(begin) : total;
+  if (wait < 0) wait = 0;
+  if (wait > total) wait = total;
+  stats.incr(STATS_QUEUE_USECS, wait);
+  stats.incr(STATS_TCL_USECS, total - wait);
+  pool->incr(POOL_CALLS);
+  pool->incr(POOL_QUEUE_USECS, wait);
+  pool->incr(POOL_TCL_USECS, total - wait);
+  if (action) action->noteCall(data->hook, wait, total - wait);
+  if (action && action->coroutine()) {
+    stats.incr(data->hook == HOOK_ACTION_START ? STATS_COROUTINE_XACTIONS :
+                                                 STATS_COROUTINE_RESUMES);
+  }
+  return code;
+}
 
-  if (nthread && pool) {
-    // Use the thread pool...
-    if (thread) {
-      TPoolStartInThread(thread, evalInThread, (void *) &data);
-    } else {
-      thread = TPoolThreadStart(pool, evalInThread, (void *) &data);
+// Evaluates a call, either in the main interpreter, or in the thread of
+// the pool that serves the transaction. If the call has a time budget,
+// the evaluation is abandoned (and cancelled) if it does not return in
+// time, and ECAPTCL_TIMEOUT is returned.
+int Adapter::Service::dispatchCall(TclCallClientData *data,
+                                   WorkerPool *wpool) const {
+  Xaction *action = data->action;
+  TPoolThread *t = action ? action->thread : NULL;
+  TPool *pool = wpool->threads;
+  data->timeout  = wpool->call_timeout ? wpool->call_timeout :
+                                         hook_timeout[data->hook];
+  data->commands = call_command_limit;
+
+  if ((t && action->thread_generation != wpool->generation) ||
+      (wpool->nthread && !pool)) {
+    // The threads of the pool have been stopped (by a reconfiguration),
+    // and the state of the transaction with them: give up...
+    stats.incr(STATS_CALL_TIMEOUTS);
+    wpool->incr(POOL_CALL_TIMEOUTS);
+    return ECAPTCL_TIMEOUT;
+  }
+
+  if (!(wpool->nthread && pool)) {
+    // Use main interpreter: Tcl limits are the only way to bound the call.
+    data->refCount++;
+    evalInThread(mainInterp, (void *) data);
+    if (data->code == ECAPTCL_TIMEOUT) {
+      stats.incr(STATS_CALL_LIMITS);
+      wpool->incr(POOL_CALL_LIMITS);
     }
-    TPoolThreadWait(thread);
+    return data->code;
+  }
+
+  // Use the thread pool. All calls of a transaction are evaluated by the
+  // same thread, where the state of the transaction lives. The host waits
+  // for each call, so at most one call waits for a thread (busy with an
+  // abandoned call): calls start in the order they arrive.
+  data->refCount++; // The worker holds a reference too...
+  // The first call of a transaction binds it to its thread...
+  if (action) {
+    t = TPoolStartBound(pool, t, data->timeout, evalInThread, (void *) data);
   } else {
-    // Use main interpreter...
-    evalInThread(mainInterp, (void *) &data);
+    t = TPoolStartTimeout(pool, NULL, data->timeout, evalInThread,
+                          (void *) data);
   }
-  if (data.code == TCL_OK) {
-    chunk = data.result;
+  if (t == NULL) {
+    data->refCount--;
+    stats.incr(STATS_CALL_TIMEOUTS);
+    wpool->incr(POOL_CALL_TIMEOUTS);
+    return ECAPTCL_TIMEOUT;
   }
-  return data.code;
+  if (action) {
+    action->thread = t;
+    action->thread_generation = wpool->generation;
+  }
+  if (!data->timeout) {
+    TPoolThreadWait(t);
+  } else if (!TPoolThreadWaitTimeout(t, data->timeout + TimeoutGrace)) {
+    // The evaluation did not return in time: cancel it, and give up. The
+    // worker will release the call when the evaluation unwinds.
+    Tcl_MutexLock(&data->lock);
+    data->abandoned = true;
+    data->action    = NULL;
+    Tcl_MutexUnlock(&data->lock);
+    cancelCall(data);
+    if (action) action->holdCall(data);
+    stats.incr(STATS_CALL_TIMEOUTS);
+    wpool->incr(POOL_CALL_TIMEOUTS);
+    return ECAPTCL_TIMEOUT;
+  }
+  if (data->code == ECAPTCL_TIMEOUT) {
+    stats.incr(STATS_CALL_LIMITS);
+    wpool->incr(POOL_CALL_LIMITS);
+  }
+  return data->code;
 }
 
-int Adapter::Service::contentDone(Xaction *action, bool atEnd,
-                                  std::string &chunk) const {
-  TclCallClientData data;
-  data.objc     = 3;
-  data.token[0] = "::ecap-tcl::contentDone"; data.init[0] = string;
-  data.token[1] = action->token;             data.init[1] = string;
-  if (atEnd) data.token[2] = "1"; else data.token[2] = NULL;
-  data.init[2]  = boolean;
-  data.action   = action;
-  data.expects  = result_string;
-
-  if (nthread && pool) {
-    // Use the thread pool...
-    if (thread) {
-      TPoolStartInThread(thread, evalInThread, (void *) &data);
-    } else {
-      thread = TPoolThreadStart(pool, evalInThread, (void *) &data);
-    }
-    TPoolThreadWait(thread);
-  } else {
-    // Use main interpreter...
-    evalInThread(mainInterp, (void *) &data);
+int Adapter::Service::headersAdapt(Xaction *action,
+                                   std::string &result) const {
+  TclCallClientData *data = new TclCallClientData(HOOK_HEADERS_ADAPT, action);
+  int code;
+  data->objc     = 2;
+  data->token[0] = "::ecap-tcl::headersAdapt"; data->init[0] = string;
+  data->token[1] = action->token;              data->init[1] = string;
+  data->expects  = result_string;
+
+  code = evalCall(data);
+  if (code == TCL_OK) {
+    result.swap(data->result);
   }
-  if (data.code == TCL_OK) {
-    chunk = data.result;
+  releaseCall(data);
+  return code;
+}
+
+int Adapter::Service::actionStart(Xaction *action) const {
+  NativeProcessorPtr processor =
+    NativeProcessors::current()->processorFor(action->mime());
+  TclCallClientData *data;
+  int code;
+  if (processor) {
+    // A native processor is tried first: if it adapts the message, Tcl
+    // is not called for the rest of the transaction...
+    Tcl_Time begin;
+    Tcl_GetTime(&begin);
+    code = action->startNative(processor);
+    noteNativeCall(action, HOOK_ACTION_START, begin);
+    if (code != TCL_BREAK) {
+      stats.incr(STATS_NATIVE_XACTIONS);
+      return code;
+    }
   }
-  return data.code;
+  data = new TclCallClientData(HOOK_ACTION_START, action);
+  data->objc     = 2;
+  data->token[0] = "::ecap-tcl::actionStart"; data->init[0] = string;
+  data->token[1] = action->token;             data->init[1] = string;
+  data->expects  = result_string;
+
+  code = evalCall(data);
+  releaseCall(data);
+  size = 0;
+  return code;
 }
 
-void Adapter::Service::start() {
+int Adapter::Service::actionStop(Xaction *action) const {
+  TclCallClientData *data;
+  int code;
+  if (NativeBinding *native = action->native()) {
+    Tcl_Time begin;
+    Tcl_GetTime(&begin);
+    code = native->stop();
+    noteNativeCall(action, HOOK_ACTION_STOP, begin);
+    return code;
+  }
+  data = new TclCallClientData(HOOK_ACTION_STOP, action);
+  data->objc     = 2;
+  data->token[0] = "::ecap-tcl::actionStop"; data->init[0] = string;
+  data->token[1] = action->token;            data->init[1] = string;
+  data->expects  = result_string;
+
+  code = evalCall(data);
+  releaseCall(data);
+  return code;
+}
+
+int Adapter::Service::contentAdapt(Xaction *action,
+                                   std::string &chunk) const {
+  TclCallClientData *data;
+  int code;
+  if (NativeBinding *native = action->native()) {
+    Tcl_Time begin;
+    Tcl_GetTime(&begin);
+    code = native->contentAdapt(chunk);
+    noteNativeCall(action, HOOK_CONTENT_ADAPT, begin);
+    return code;
+  }
+  data = new TclCallClientData(HOOK_CONTENT_ADAPT, action);
+  data->objc     = 3;
+  data->token[0] = "::ecap-tcl::contentAdapt"; data->init[0] = string;
+  data->token[1] = action->token;              data->init[1] = string;
+  data->token[2] = chunk.data();               data->init[2] = bytearray;
+  data->size[2]  = chunk.size();
+  data->expects  = result_string;
+  size += chunk.size();
+  stats.incr(STATS_ADAPT_CALLS);
+  stats.incr(STATS_ADAPT_BYTES, chunk.size());
+
+  code = evalCall(data);
+  if (code == TCL_OK) {
+    chunk.swap(data->result);
+  }
+  releaseCall(data);
+  return code;
+}
+
+int Adapter::Service::scanAdapt(Xaction *action, TclHook hook,
+                                const std::vector<std::string> &items,
+                                std::vector<std::string> &result) const {
+  TclCallClientData *data = new TclCallClientData(hook, action);
+  int code;
+  data->objc     = 3;
+  data->token[0] = hook == HOOK_TAGS_ADAPT ? "::ecap-tcl::tagsAdapt" :
+                                             "::ecap-tcl::jsonAdapt";
+                                            data->init[0] = string;
+  data->token[1] = action->token;           data->init[1] = string;
+  data->token[2] = NULL;                    data->init[2] = list;
+  data->items    = &items;
+  data->expects  = result_list;
+  if (hook == HOOK_TAGS_ADAPT) {
+    stats.incr(STATS_TAGS_CALLS);
+    stats.incr(STATS_TAGS, items.size());
+  } else {
+    stats.incr(STATS_JSON_CALLS);
+    stats.incr(STATS_JSON_VALUES, items.size() / 2);
+  }
+
+  code = evalCall(data);
+  if (code == TCL_OK) {
+    result.swap(data->result_items);
+  }
+  releaseCall(data);
+  return code;
+}
+
+int Adapter::Service::contentDone(Xaction *action, bool atEnd,
+                                  std::string &chunk,
+                                  const std::string *body) const {
+  TclCallClientData *data;
+  int code;
+  if (NativeBinding *native = action->native()) {
+    Tcl_Time begin;
+    Tcl_GetTime(&begin);
+    if (body) chunk.assign(*body);
+    code = native->contentDone(atEnd, chunk);
+    noteNativeCall(action, HOOK_CONTENT_DONE, begin);
+    return code;
+  }
+  data = new TclCallClientData(HOOK_CONTENT_DONE, action);
+  data->objc     = 3;
+  data->token[0] = "::ecap-tcl::contentDone"; data->init[0] = string;
+  data->token[1] = action->token;             data->init[1] = string;
+  if (atEnd) data->token[2] = "1"; else data->token[2] = NULL;
+  data->init[2]  = boolean;
+  if (body) {
+    // Whole-body mode: the body is passed as an extra argument...
+    data->objc     = 4;
+    data->token[3] = body->data();            data->init[3] = bytearray;
+    data->size[3]  = body->size();
+    stats.incr(STATS_WHOLE_BODY_BYTES, body->size());
+  }
+  data->expects  = result_string;
+
+  code = evalCall(data);
+  if (code == TCL_OK) {
+    chunk.swap(data->result);
+  } else if (code == ECAPTCL_SUSPEND) {
+    action->suspendCall(data);
+  }
+  releaseCall(data);
+  return code;
+}
+
+void Adapter::Service::start() {
   Tcl_Obj *byteArrayObject;
   int status;
   libecap::adapter::Service::start();
   // custom code would go here, but this service does not have one
   /* We must initialise Tcl, if this has not already been done. */
   if (TclInitialized == true) {
+    startLog();
+    loadNatives();
     evalScript(service_start_script);
     initPool();
+    detectHooks();
+    startProfile();
     return;
   }
 
@@ -439,15 +1704,26 @@ void Adapter::Service::start() {
   Tcl_DecrRefCount(byteArrayObject);
   TclInitialized = true;
   Tcl_MutexUnlock(&eCAPTcl);
+  initialiseThread(mainInterp, (void *) this);
+  startLog();
+  loadNatives();
   evalScript(service_init_script);
   evalScript(service_start_script);
   initPool();
+  detectHooks();
+  startProfile();
 }
 
 void Adapter::Service::stop() {
+  Profiler::stop();
   freePool();
   libecap::adapter::Service::stop();
+  writeProfile();
   evalScript(service_stop_script);
+  if (logging) {
+    logging = false;
+    Logger::stop();
+  }
 }
 
 void Adapter::Service::retire() {
@@ -455,41 +1731,138 @@ void Adapter::Service::retire() {
   evalScript(service_retire_script);
 }
 
-bool Adapter::Service::wantsUrl(const char *url) const {
-  TclCallClientData data;
-  data.objc     = 2;
-  data.token[0] = "::ecap-tcl::wantsUrl"; data.init[0] = string;
-  data.token[1] = url;                    data.init[1] = string;
-  data.action   = NULL;
-  data.expects  = result_boolean;
-  bool wanted = true;
+bool Adapter::Service::makesAsyncXactions() const {
+  // We need resume() calls for flushing coalesced chunks on time, for the
+  // event loop, and for the responses mapped back from cache_dir...
+  return max_chunk_delay != 0 || event_loop || !cache_dir.empty();
+}
 
-  // printf("wantsUrl:  %s\n", url);
-  if (nthread && pool) {
-    // Use the thread pool...
-    if (thread) {
-      TPoolStartInThread(thread, evalInThread, (void *) &data);
+void Adapter::Service::suspend(timeval &timeout) {
+  Tcl_Time now;
+  Tcl_WideInt wait, deadline;
+  if (flushing.empty() && !pollsEvents()) return;
+  Tcl_GetTime(&now);
+  wait = ((Tcl_WideInt) timeout.tv_sec) * 1000 + timeout.tv_usec / 1000;
+  if (pollsEvents() && wait > EventPollDelay) wait = EventPollDelay;
+  for (std::set<Xaction *>::const_iterator it = flushing.begin();
+       it != flushing.end(); ++it) {
+    deadline = (*it)->flushDeadline() - timeMs(now);
+    if (deadline < wait) wait = deadline > 0 ? deadline : 0;
+  }
+  timeout.tv_sec  = wait / 1000;
+  timeout.tv_usec = (wait % 1000) * 1000;
+}
+
+void Adapter::Service::resume() {
+  Tcl_Time now;
+  if (event_loop && !pools.front()->threads && mainInterp) {
+    // Without threads, the events of the main interpreter are serviced by
+    // the thread of the host, now...
+    Tcl_MutexLock(&eCAPTcl);
+    while (Tcl_DoOneEvent(TCL_ALL_EVENTS | TCL_DONT_WAIT)) {}
+    Tcl_MutexUnlock(&eCAPTcl);
+  }
+  std::vector<Xaction *> loaded;
+  cache.takeLoaded(loaded);
+  for (std::vector<Xaction *>::const_iterator it = loaded.begin();
+       it != loaded.end(); ++it) {
+    // Xaction::resume() finds the response in memory...
+    if ((*it)->host()) (*it)->host()->resume();
+  }
+  if (flushing.empty() && suspended.empty()) return;
+  Tcl_GetTime(&now);
+  std::set<Xaction *>::iterator it = flushing.begin();
+  while (it != flushing.end()) {
+    Xaction *action = *it;
+    if (action->flushDue(now)) {
+      flushing.erase(it++);
+      // Ask the host to call Xaction::resume()...
+      if (action->host()) action->host()->resume();
     } else {
-      thread = TPoolThreadStart(pool, evalInThread, (void *) &data);
+      ++it;
     }
-    TPoolThreadWait(thread);
-  } else {
-    // Use main interpreter...
-    evalInThread(mainInterp, (void *) &data);
   }
-  switch (data.code) {
+  it = suspended.begin();
+  while (it != suspended.end()) {
+    Xaction *action = *it;
+    if (action->suspendedDue(now)) {
+      // Xaction::resume() completes the transaction...
+      suspended.erase(it++);
+      if (action->host()) action->host()->resume();
+    } else {
+      ++it;
+    }
+  }
+}
+
+bool Adapter::Service::wantsUrl(const char *url) const {
+  // The rules decide first: adapt, skip or block the URL, without Tcl...
+  UrlRulesPtr rules;
+  if (wants_url_rules) rules = std::atomic_load(wants_url_rules);
+  if (rules && rules->size()) {
+    const std::string *verdict = rules->matchUrl(url, strlen(url));
+    if (verdict && (*verdict == "adapt" || *verdict == "skip" ||
+                    *verdict == "block")) {
+      stats.incr(STATS_URL_RULES);
+      if (*verdict == "block") blockUrl(url);
+      return *verdict != "skip";
+    }
+  }
+
+  // Then the native processors...
+  switch (NativeProcessors::current()->wantsUrl(url)) {
+    case EcapTcl::NATIVE_ADAPT: return true;
+    case EcapTcl::NATIVE_SKIP:  return false;
+    case EcapTcl::NATIVE_UNDECIDED: break;
+  }
+
+  // Then what Tcl has decided for the URL, in any process of the host...
+  SharedVerdict verdict = VERDICT_ADAPT;
+  bool shared = false;
+  if (shm_decision_ttl && shm.findDecision(url, verdict)) {
+    stats.incr(STATS_SHM_DECISION_HITS);
+    if (verdict == VERDICT_BLOCK) blockUrl(url);
+    return verdict != VERDICT_SKIP;
+  }
+
+  TclCallClientData *data = new TclCallClientData(HOOK_WANTS_URL, NULL);
+  data->objc     = 2;
+  data->token[0] = "::ecap-tcl::wantsUrl"; data->init[0] = string;
+  data->token[1] = url;                    data->init[1] = string;
+  data->expects  = result_boolean;
+  bool wanted = true;
+
+  // printf("wantsUrl:  %s\n", url);
+  switch (evalCall(data)) {
     case TCL_OK:
-      wanted = data.result_boolean == 0 ? false : true;
+      wanted = data->result_boolean == 0 ? false : true;
+      verdict = wanted ? VERDICT_ADAPT : VERDICT_SKIP;
+      shared = true;
       break;
     case TCL_ERROR:
     case TCL_CONTINUE:
       wanted = true;
       break;
     case TCL_BREAK:
+    case ECAPTCL_TIMEOUT:
+      // Do not delay the transaction any further: do not adapt it
       wanted = false;
       break;
+    case ECAPTCL_BLOCK:
+      // Block the transaction as soon as it starts...
+      blockUrl(url);
+      wanted = true;
+      verdict = VERDICT_BLOCK;
+      shared = true;
+      break;
   }
-  // printf("  wantsUrl: %d (%d)\n", wanted ? 1 : 0, data.code);
+  releaseCall(data);
+  // Errors and timeouts are not decisions: they are not shared
+  if (shared && shm_decision_ttl &&
+      shm.storeDecision(url, verdict, shm_decision_ttl)) {
+    stats.incr(STATS_SHM_DECISION_STORES);
+  }
+  // printf("  wantsUrl: %d\n", wanted ? 1 : 0);
   return wanted;
 }
 
@@ -512,22 +1885,144 @@ Adapter::Xaction::Xaction(libecap::shared_ptr<Service> aService,
                           libecap::host::Xaction *x):
                           service(aService),
                           hostx(x),
+                          worker_pool(aService->pools.front()),
+                          serial(++XactionSerial),
                           receivingVb(opUndecided), sendingAb(opUndecided) {
 }
 
 Adapter::Xaction::~Xaction() {
+  service->cancelFlush(this);
+  releaseCache();
+  releaseHeldCall(true);
+  if (thread && thread_generation == worker_pool->generation) {
+    service->releaseThread(worker_pool.get(), thread, vb_size);
+  }
+  delete native_binding;
+  delete body_scanner;
+  delete body_minifier;
+  recycle(buffer);
+  recycle(pending);
+  recycle(virgin_copy);
   if (libecap::host::Xaction *x = hostx) {
     hostx = 0;
     x->adaptationAborted();
   }
 }
 
-const libecap::Area Adapter::Xaction::option(const libecap::Name &) const {
-  return libecap::Area(); // this transaction has no meta-information
+void *Adapter::Xaction::operator new(size_t size) {
+  if (size != sizeof(Xaction)) return ::operator new(size);
+  return XactionBlocks.take();
+}
+
+void Adapter::Xaction::operator delete(void *block, size_t size) {
+  if (size != sizeof(Xaction)) {
+    ::operator delete(block);
+    return;
+  }
+  XactionBlocks.give(block);
+}
+
+// The meta-information of the transaction: how long it spent in the
+// adapter, its sizes, its processor, the digests of its content, and the
+// annotations set by Tcl with ::ecap-tcl::action meta set.
+const libecap::Area Adapter::Xaction::option(const libecap::Name &name) const {
+  std::string value;
+  for (int i = 0; i < META_NUMBER; i++) {
+    if (name == MetaNames[i]) {
+      if (builtinMeta(i, value)) return libecap::Area::FromTempString(value);
+      return libecap::Area();
+    }
+  }
+  for (std::vector<BodyDigest>::const_iterator it = body_digests.begin();
+       it != body_digests.end(); ++it) {
+    if (name == it->metaName())
+      return libecap::Area::FromTempString(it->hex());
+  }
+  std::map<std::string, std::string>::const_iterator it =
+    meta.find(name.image());
+  if (it != meta.end()) return libecap::Area::FromTempString(it->second);
+  return libecap::Area();
+}
+
+void Adapter::Xaction::visitEachOption(libecap::NamedValueVisitor &visitor)
+                                                                     const {
+  std::string value;
+  for (int i = 0; i < META_NUMBER; i++) {
+    if (builtinMeta(i, value)) {
+      visitor.visit(libecap::Name(MetaNames[i]),
+                    libecap::Area::FromTempString(value));
+    }
+  }
+  for (std::vector<BodyDigest>::const_iterator it = body_digests.begin();
+       it != body_digests.end(); ++it) {
+    visitor.visit(libecap::Name(it->metaName()),
+                  libecap::Area::FromTempString(it->hex()));
+  }
+  for (std::map<std::string, std::string>::const_iterator it = meta.begin();
+       it != meta.end(); ++it) {
+    visitor.visit(libecap::Name(it->first),
+                  libecap::Area::FromTempString(it->second));
+  }
+}
+
+bool Adapter::Xaction::builtinMeta(int option, std::string &value) const {
+  std::ostringstream out;
+  Tcl_WideInt total = 0;
+  switch ((MetaOption) option) {
+    case META_TIME:
+      for (int hook = 0; hook < HOOK_NUMBER; hook++) total += hook_usecs[hook];
+      value = formatMs(total);
+      return true;
+    case META_QUEUE_TIME:
+      value = formatMs(queue_usecs);
+      return true;
+    case META_HOOKS:
+      // i.e. actionStart:0.120,contentAdapt:3.400/5 (msecs/calls)
+      for (int hook = 0; hook < HOOK_NUMBER; hook++) {
+        if (!hook_calls[hook]) continue;
+        if (out.tellp() > 0) out << ',';
+        out << TclHookNames[hook] << ':' << formatMs(hook_usecs[hook]);
+        if (hook_calls[hook] > 1) out << '/' << hook_calls[hook];
+      }
+      value = out.str();
+      return !value.empty();
+    case META_BYTES_IN:
+      out << vb_size;
+      value = out.str();
+      return true;
+    case META_BYTES_OUT:
+      out << ab_size;
+      value = out.str();
+      return true;
+    case META_PROCESSOR:
+      value = processor_name;
+      return !value.empty();
+    case META_MINIFY_SAVED:
+      if (!body_minifier) return false;
+      out << (Tcl_WideInt) body_minifier->bytesIn() -
+             (Tcl_WideInt) body_minifier->bytesOut();
+      value = out.str();
+      return true;
+    case META_NUMBER:
+      break;
+  }
+  return false;
+}
+
+void Adapter::Xaction::noteCall(TclHook hook, Tcl_WideInt wait,
+                                Tcl_WideInt elapsed) {
+  queue_usecs += wait;
+  hook_usecs[hook] += elapsed;
+  hook_calls[hook]++;
+}
+
+void Adapter::Xaction::setMeta(const std::string &name,
+                               const std::string &value) {
+  meta[name] = value;
 }
 
-void Adapter::Xaction::visitEachOption(libecap::NamedValueVisitor &) const {
-  // this transaction has no meta-information to pass to the visitor
+bool Adapter::Xaction::unsetMeta(const std::string &name) {
+  return meta.erase(name) != 0;
 }
 
 libecap::host::Xaction *Adapter::Xaction::host() const {return hostx;}
@@ -538,18 +2033,43 @@ libecap::Message &Adapter::Xaction::adapted() const {
 
 void Adapter::Xaction::start() {
   Must(hostx);
-  if (hostx->virgin().body()) {
-    receivingVb = opOn;
-    hostx->vbMake(); // ask host to supply virgin body
-  } else {
+  storeUri();
+  storeMime();
+  worker_pool = service->poolFor(mime_type);
+  worker_pool->incr(POOL_XACTIONS);
+  service->stats.incr(STATS_XACTIONS);
+  if (service->takeBlockedUrl(getUri().toString())) {
+    // Blocked by wantsUrl: the body is never requested...
+    service->stats.incr(STATS_BLOCKED);
+    receivingVb = opNever;
+    sendingAb = opNever;
+    lastHostCall()->blockVirgin();
+    return;
+  }
+  if (lookupCache()) return;
+  adapt();
+}
+
+void Adapter::Xaction::adapt() {
+  bool headers_hook = worker_pool->headers_hook &&
+                      service->adaptsHeaders(mime_type);
+  if ((hostx->virgin().body() || headers_hook) && service->shed(this)) {
+    // Overloaded, or the processor is failing: do not adapt...
+    receivingVb = opNever;
+    sendingAb = opNever;
+    lastHostCall()->useVirgin();
+    return;
+  }
+  if (!hostx->virgin().body()) {
     // we are not interested in vb if there is not one
     receivingVb = opNever;
   }
+  // ... otherwise the body is asked for (makeVb()) once the hooks called
+  // before it have not blocked the transaction
 
   /* adapt message header */
 
   // libecap::shared_ptr<libecap::Message> adapted = hostx->virgin().clone();
-  storeUri();
   adaptedx = hostx->virgin().clone();
   Must(adaptedx != 0);
 
@@ -563,24 +2083,353 @@ void Adapter::Xaction::start() {
   //   libecap::Area::FromTempString(libecap::MyHost().uri());
   // adapted->header().add(name, value);
 
+  packVoidPtr(token, (void *) this, "_", ACTION_TOKEN_SIZE);
+  if (adaptedx->body()) {
+    // Minify the content, if its MIME type is configured to...
+    Minifier::Language language = service->minifyLanguage(mime_type);
+    std::string error;
+    if (language != Minifier::NONE && !setMinifier(language, error))
+      service->stats.incr(STATS_MINIFY_ENCODED);
+  }
+  if (headers_hook) {
+    // Let Tcl adapt the headers: if it is done with the message, the body
+    // will not go through Tcl at all.
+    std::string result;
+    tcl_started = true;
+    service->stats.incr(STATS_ACTIVE_XACTIONS);
+    worker_pool->incr(POOL_ACTIVE_XACTIONS);
+    int code = service->headersAdapt(this, result);
+    handled = code == TCL_OK || !processor_name.empty();
+    if (code != ECAPTCL_BLOCK) makeVb();
+    if (!checkCode(code)) {
+      if (hostx) headersOnly();
+      return;
+    }
+    if (!adaptedx->body() || (code == TCL_OK && result == "done")) {
+      headersOnly();
+      return;
+    }
+  }
+
   if (!adaptedx->body()) {
+    makeVb();
     sendingAb = opNever; // there is nothing to send
     lastHostCall()->useAdapted(adaptedx);
   } else {
     // hostx->useAdapted(adaptedx);
+    if (!tcl_started) {
+      tcl_started = true;
+      service->stats.incr(STATS_ACTIVE_XACTIONS);
+      worker_pool->incr(POOL_ACTIVE_XACTIONS);
+    }
     tcl_action_start = true;
-    packVoidPtr(token, (void *) this, "_", ACTION_TOKEN_SIZE);
-    if (service->actionStart(this) != TCL_OK) {
-      // Do what?
+    min_chunk_bytes = service->minChunkBytes(mime_type);
+    int code = service->actionStart(this);
+    handled = handled || code != TCL_BREAK || !processor_name.empty();
+    if (code != ECAPTCL_BLOCK) makeVb();
+    if (!checkCode(code)) {
+      return;
     }
+    keep_virgin = service->timeout_fallback == FALLBACK_VIRGIN &&
+                  service->hook_timeout[body_scanner ? scanner_hook :
+                                                       HOOK_CONTENT_ADAPT] &&
+                  !whole_body;
+    // Pre-allocate the buffers, if we know the size of the body...
+    size_type length = announcedVbSize();
+    if (whole_body) {
+      service->stats.incr(STATS_WHOLE_BODY_XACTIONS);
+      if (length)
+        takeBuffer(pending, length < MaxBodyReserve ? length : MaxBodyReserve);
+    } else if (min_chunk_bytes) {
+      takeBuffer(pending, min_chunk_bytes);
+    }
+    takeBuffer(buffer, length && length < AbReserve ? length : AbReserve);
   }
 }
 
-void Adapter::Xaction::stop() {
-  if (tcl_action_start && hostx) {
-    tcl_action_start = false;
-    service->actionStop(this);
+// Asks the host to supply the virgin body, if there is one
+void Adapter::Xaction::makeVb() {
+  if (receivingVb != opUndecided) return;
+  body_digests = service->content_digests;
+  receivingVb = opOn;
+  hostx->vbMake();
+}
+
+Adapter::size_type Adapter::Xaction::announcedVbSize() const {
+  static const libecap::Name contentLength("Content-Length");
+  if (!hostx || !hostx->virgin().header().hasAny(contentLength)) return 0;
+  const libecap::Area value = hostx->virgin().header().value(contentLength);
+  return strtoul(std::string(value.start, value.size).c_str(), NULL, 10);
+}
+
+// Content buffers come from (and go back to) the pool of the host thread,
+// so transactions reuse the memory of the previous ones.
+void Adapter::Xaction::takeBuffer(std::string &s, size_type size) {
+  if (!s.empty() || s.capacity() >= size) return;
+  service->stats.incr(BufferPool::take(s, size) ? STATS_BUFFERS_REUSED :
+                                                  STATS_BUFFERS_ALLOCATED);
+}
+
+void Adapter::Xaction::recycle(std::string &s) {
+  static const size_type Unallocated = std::string().capacity();
+  if (s.capacity() <= Unallocated) {
+    s.clear();
+    return;
+  }
+  service->stats.incr(BufferPool::give(s) ? STATS_BUFFERS_RECYCLED :
+                                            STATS_BUFFERS_FREED);
+}
+
+// Digests content as it goes through the adapter: vb as it is received,
+// ab as it is consumed by the host.
+void Adapter::Xaction::digest(BodyDigest::Side side, const char *data,
+                              size_type size) {
+  if (!size) return;
+  for (std::vector<BodyDigest>::iterator it = body_digests.begin();
+       it != body_digests.end(); ++it) {
+    if (it->side() != side) continue;
+    it->update(data, size);
+    service->stats.incr(STATS_DIGEST_BYTES, size);
+  }
+}
+
+// Appends adapted content to buffer, taking the memory of chunk if buffer
+// is empty (it usually is: the host consumes ab as it is produced).
+void Adapter::Xaction::bufferAb(std::string &chunk, bool atEnd) {
+  if (minifying()) minify(chunk, atEnd);
+  if (cache_owner && !cache_overflow) {
+    if (cache_body.size() + chunk.size() > service->cache.maxEntrySize()) {
+      cache_overflow = true;
+      std::string().swap(cache_body);
+    } else {
+      cache_body += chunk;
+    }
+  }
+  if (buffer.empty() && chunk.capacity() >= buffer.capacity()) {
+    buffer.swap(chunk);
+  } else {
+    buffer += chunk;
+  }
+  recycle(chunk);
+}
+
+// Replaces chunk with its minified content (what the minifier held from
+// the previous chunks included, and, atEnd, everything it holds).
+void Adapter::Xaction::minify(std::string &chunk, bool atEnd) {
+  std::string out;
+  takeBuffer(out, chunk.size());
+  body_minifier->feed(chunk.data(), chunk.size(), out);
+  if (atEnd) {
+    body_minifier->finish(out);
+    service->stats.incr(STATS_MINIFIED_XACTIONS);
+  }
+  service->stats.incr(STATS_MINIFY_BYTES_IN, chunk.size());
+  service->stats.incr(STATS_MINIFY_BYTES_SAVED,
+                      (Tcl_WideInt) chunk.size() - (Tcl_WideInt) out.size());
+  chunk.swap(out);
+  recycle(out);
+}
+
+// After a call has timed out, the content is no longer minified.
+bool Adapter::Xaction::minifying() const {
+  return body_minifier && !failed;
+}
+
+// A response is cached if it is the full response of a GET request, which
+// the origin validates (ETag or Last-Modified), which is the same for all
+// clients, and whose MIME type has a processor declaring its version.
+bool Adapter::Xaction::cacheable() {
+  static const libecap::Name etag("ETag");
+  static const libecap::Name lastModified("Last-Modified");
+  static const libecap::Name contentEncoding("Content-Encoding");
+  static const libecap::Name setCookie("Set-Cookie");
+  static const libecap::Name cacheControl("Cache-Control");
+  static const libecap::Name vary("Vary");
+  typedef const libecap::StatusLine *CLSLP;
+  typedef const libecap::RequestLine *CLRLP;
+  std::string version;
+
+  if (!service->cache.enabled() || !hostx->virgin().body() ||
+      !service->cache.version(mime_type, version)) return false;
+  CLSLP status = dynamic_cast<CLSLP>(&hostx->virgin().firstLine());
+  CLRLP request = dynamic_cast<CLRLP>(&hostx->cause().firstLine());
+  if (!status || status->statusCode() != 200 || !request ||
+      request->method() != libecap::methodGet) return false;
+  const libecap::Header &header = hostx->virgin().header();
+  if (!header.hasAny(etag) && !header.hasAny(lastModified)) return false;
+  if (header.hasAny(setCookie)) return false;
+  if (header.hasAny(cacheControl)) {
+    std::string value = header.value(cacheControl).toString();
+    for (std::string::size_type i = 0; i < value.size(); ++i)
+      value[i] = tolower(value[i]);
+    if (value.find("private") != std::string::npos ||
+        value.find("no-store") != std::string::npos) return false;
+  }
+  if (header.hasAny(vary)) {
+    // Content-Encoding is a part of the key: only it may vary...
+    std::string value = header.value(vary).toString();
+    for (std::string::size_type i = 0; i < value.size(); ++i)
+      value[i] = tolower(value[i]);
+    if (value != "accept-encoding") return false;
+  }
+  cache_key = version;
+  cache_key += '\n';
+  cache_key += mime_type;
+  cache_key += '\n';
+  cache_key.append(uri.start, uri.size);
+  const libecap::Name *const parts[] = {&etag, &lastModified,
+                                        &contentEncoding};
+  for (unsigned int i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+    cache_key += '\n';
+    if (header.hasAny(*parts[i])) {
+      const libecap::Area value = header.value(*parts[i]);
+      cache_key.append(value.start, value.size);
+    }
+  }
+  return true;
+}
+
+bool Adapter::Xaction::lookupCache() {
+  if (!cacheable()) return false;
+  switch (service->cache.lookup(cache_key, this, cached)) {
+    case CACHE_HIT:
+      service->stats.incr(STATS_CACHE_HITS);
+      useCached();
+      return true;
+    case CACHE_WAIT:
+      // Another transaction is adapting the response: wait for it...
+      service->stats.incr(STATS_CACHE_COLLAPSED);
+      cache_waiting = true;
+      return true;
+    case CACHE_LOAD:
+      // The response is mapped back from disk: Service::resume() resumes
+      // us when it is in memory...
+      cache_waiting = true;
+      return true;
+    case CACHE_MISS: {
+      // Another process may have adapted the response...
+      if ((cached = service->shm.findResponse(cache_key))) {
+        std::vector<Xaction *> waiters;
+        service->stats.incr(STATS_CACHE_HITS);
+        service->stats.incr(STATS_SHM_CACHE_HITS);
+        service->cache.store(cache_key, cached, waiters);
+        resumeWaiters(waiters);
+        useCached();
+        return true;
+      }
+      service->stats.incr(STATS_CACHE_MISSES);
+      cache_owner = true;
+      size_type length = announcedVbSize();
+      if (length <= service->cache.maxEntrySize()) cache_body.reserve(length);
+      break;
+    }
   }
+  return false;
+}
+
+class HeaderNames: public libecap::NamedValueVisitor {
+  public:
+    virtual void visit(const libecap::Name &name, const libecap::Area &) {
+      names.push_back(name);
+    }
+    std::vector<libecap::Name> names;
+};
+
+class HeadersToList: public libecap::NamedValueVisitor {
+  public:
+    HeadersToList(Adapter::CachedHeaders &h): headers(h) {}
+    virtual void visit(const libecap::Name &name,
+                       const libecap::Area &value) {
+      headers.push_back(std::make_pair(name.image(), value.toString()));
+    }
+    Adapter::CachedHeaders &headers;
+};
+
+// Sends the cached response: the virgin message, with the adapted headers
+// and body. The virgin body is not needed.
+void Adapter::Xaction::useCached() {
+  static const libecap::Name contentLength("Content-Length");
+  HeaderNames virgin;
+  char length[32];
+  receivingVb = opNever;
+  hostx->vbDiscard();
+  // Only the adapted body goes through the adapter...
+  for (std::vector<BodyDigest>::const_iterator it =
+         service->content_digests.begin();
+       it != service->content_digests.end(); ++it) {
+    if (it->side() == BodyDigest::ADAPTED) body_digests.push_back(*it);
+  }
+  adaptedx = hostx->virgin().clone();
+  Must(adaptedx != 0);
+  adaptedx->header().visitEach(virgin);
+  for (std::vector<libecap::Name>::const_iterator it = virgin.names.begin();
+       it != virgin.names.end(); ++it) {
+    adaptedx->header().removeAny(*it);
+  }
+  for (CachedHeaders::const_iterator it = cached->headers.begin();
+       it != cached->headers.end(); ++it) {
+    adaptedx->header().add(libecap::Name(it->first),
+                           libecap::Area::FromTempString(it->second));
+  }
+  // The length of the body is known now...
+  adaptedx->header().removeAny(contentLength);
+  snprintf(length, sizeof(length), "%lu", (unsigned long) cached->bodySize());
+  adaptedx->header().add(contentLength, libecap::Area::FromTempBuffer(length,
+                                                              strlen(length)));
+  hostx->useAdapted(adaptedx);
+}
+
+// The owner of a miss caches the response, if it has been fully adapted.
+void Adapter::Xaction::storeCache(bool atEnd) {
+  std::vector<Xaction *> waiters;
+  if (!cache_owner) return;
+  if (!atEnd || failed || tcl_error || headers_only || cache_overflow ||
+      !adaptedx) {
+    releaseCache();
+    return;
+  }
+  CachedHeaders headers;
+  HeadersToList visitor(headers);
+  adaptedx->header().visitEach(visitor);
+  cache_body.shrink_to_fit();
+  CachedResponsePtr response(new CachedResponse(headers, cache_body));
+  cache_owner = false;
+  if (service->cache.store(cache_key, response, waiters))
+    service->stats.incr(STATS_CACHE_STORES);
+  if (service->shm.storeResponse(cache_key, response))
+    service->stats.incr(STATS_SHM_CACHE_STORES);
+  resumeWaiters(waiters);
+}
+
+void Adapter::Xaction::releaseCache() {
+  std::vector<Xaction *> waiters;
+  if (cache_waiting) {
+    cache_waiting = false;
+    service->cache.forget(cache_key, this);
+  }
+  if (!cache_owner) return;
+  cache_owner = false;
+  std::string().swap(cache_body);
+  service->cache.abandon(cache_key, waiters);
+  resumeWaiters(waiters);
+}
+
+// Asks the host to call resume() for the transactions waiting for us: they
+// find the response in the cache, or (if we failed) adapt it themselves.
+void Adapter::Xaction::resumeWaiters(std::vector<Xaction *> &waiters) {
+  for (std::vector<Xaction *>::const_iterator it = waiters.begin();
+       it != waiters.end(); ++it) {
+    if ((*it)->hostx) (*it)->hostx->resume();
+  }
+}
+
+void Adapter::Xaction::stop() {
+  service->cancelFlush(this);
+  releaseSuspended();
+  releaseCache();
+  if (hostx) finishTcl();
+  // Cancel any evaluation still running for us...
+  releaseHeldCall(true);
   hostx = 0;
   // the caller will delete
 }
@@ -596,11 +2445,17 @@ void Adapter::Xaction::abMake() {
   Must(sendingAb == opUndecided); // have not yet started or decided not to send
   Must(hostx->virgin().body()); // that is our only source of ab content
 
-  // we are or were receiving vb
-  Must(receivingVb == opOn || receivingVb == opComplete);
+  // we are or were receiving vb (or send a cached response)
+  Must(receivingVb == opOn || receivingVb == opComplete || cached);
 
   sendingAb = opOn;
-  if (!buffer.empty())
+  if (cached) {
+    if (cached->bodySize()) hostx->noteAbContentAvailable();
+    hostx->noteAbContentDone(true);
+    sendingAb = opComplete;
+    return;
+  }
+  if (vb_direct ? vb_size > ab_size : !buffer.empty())
     hostx->noteAbContentAvailable();
 }
 
@@ -617,24 +2472,134 @@ void Adapter::Xaction::abStopMaking() {
 
 libecap::Area Adapter::Xaction::abContent(size_type offset, size_type size) {
   Must(sendingAb == opOn || sendingAb == opComplete);
+  if (cached) {
+    offset += cached_offset;
+    if (offset >= cached->bodySize()) return libecap::Area();
+    if (size > cached->bodySize() - offset) size = cached->bodySize() - offset;
+    return libecap::Area::FromTempBuffer(cached->body() + offset, size);
+  }
+  if (vb_direct) {
+    if (offset >= vb_size - ab_size) return libecap::Area();
+    return hostx->vbContent(offset, size);
+  }
   return libecap::Area::FromTempString(buffer.substr(offset, size));
 }
 
 void Adapter::Xaction::abContentShift(size_type size) {
   Must(sendingAb == opOn || sendingAb == opComplete);
-  buffer.erase(0, size);
+  if (cached) {
+    if (size > cached->bodySize() - cached_offset)
+      size = cached->bodySize() - cached_offset;
+    digest(BodyDigest::ADAPTED, cached->body() + cached_offset, size);
+    cached_offset += size;
+  } else if (vb_direct) {
+    if (size > vb_size - ab_size) size = vb_size - ab_size;
+    if (!size) return;
+    if (!body_digests.empty()) {
+      const libecap::Area vb = hostx->vbContent(0, size);
+      digest(BodyDigest::ADAPTED, vb.start, vb.size);
+    }
+    hostx->vbContentShift(size);
+    // The host may only stop vb once it has read all of it...
+    if (vb_ended && ab_size + size == vb_size) stopVb();
+  } else {
+    if (size > buffer.size()) size = buffer.size();
+    digest(BodyDigest::ADAPTED, buffer.data(), size);
+    buffer.erase(0, size);
+  }
+  ab_size += size;
 }
 
 void Adapter::Xaction::noteVbContentDone(bool atEnd) {
   Must(receivingVb == opOn);
   std::string chunk;
-  service->contentDone(this, atEnd, chunk);
-  hostx->useAdapted(adaptedx);
-  if (chunk.size()) {
-    buffer += chunk; // buffer what we got
-    if (sendingAb == opOn)
+  int code;
+  if (vb_direct) {
+    // The host still reads ab from vb (see abContentShift())...
+    vb_ended = true;
+    if (vb_size == ab_size) stopVb();
+    if (sendingAb == opOn) {
+      hostx->noteAbContentDone(atEnd);
+      sendingAb = opComplete;
+    }
+    return;
+  }
+  if (failed || headers_only) {
+    // A call has timed out (or Tcl is done with the message): the
+    // remaining content has been copied...
+  } else if (whole_body) {
+    code = service->contentDone(this, atEnd, chunk, &pending);
+    if (code == ECAPTCL_SUSPEND) {
+      suspended_at_end = atEnd; // see resumeContentDone()
+      return;
+    }
+    if (!checkCode(code) && !hostx) return;
+    recycle(pending);
+  } else {
+    if (!pending.empty()) flushPending(STATS_COALESCE_FLUSH_END);
+    if (!hostx) return;
+    if (!failed) {
+      code = service->contentDone(this, atEnd, chunk);
+      if (code == ECAPTCL_SUSPEND) {
+        suspended_at_end = atEnd;
+        return;
+      }
+      if (!checkCode(code) && !hostx) return;
+    }
+  }
+  finishContent(atEnd, chunk);
+}
+
+// The suspended contentDone call has been completed by ::ecap-tcl::resume
+// (or its time budget has passed): the message ends as it would have, had
+// the hook returned the result.
+void Adapter::Xaction::resumeContentDone() {
+  TclCallClientData *data = suspended_call;
+  std::string chunk;
+  int code;
+  service->cancelSuspended(this);
+  suspended_call = NULL;
+  Tcl_MutexLock(&data->lock);
+  if (data->completed) {
+    code = data->code;
+    if (code == TCL_OK) chunk.swap(data->result);
+  } else {
+    // Whatever ::ecap-tcl::resume brings now is discarded...
+    data->abandoned = true;
+    data->action    = NULL;
+    code = ECAPTCL_TIMEOUT;
+  }
+  Tcl_MutexUnlock(&data->lock);
+  releaseCall(data);
+  service->stats.incr(code == ECAPTCL_TIMEOUT ? STATS_SUSPEND_TIMEOUTS :
+                                                STATS_RESUMED_CALLS);
+  if (!hostx) return;
+  if (!checkCode(code) && !hostx) return;
+  if (whole_body) recycle(pending);
+  finishContent(suspended_at_end, chunk);
+}
+
+// Sends the rest of the message, once contentDone has returned chunk.
+void Adapter::Xaction::finishContent(bool atEnd, std::string &chunk) {
+  static const libecap::Name contentLength("Content-Length");
+  if (body_scanner && !failed && !headers_only) {
+    // What the scanner still holds (i.e. an unfinished tag) is content...
+    std::string held;
+    body_scanner->finish(held);
+    chunk.insert(0, held);
+  }
+  recycle(virgin_copy);
+  if (!headers_only) {
+    // Minified content is shorter...
+    if (minifying()) adaptedx->header().removeAny(contentLength);
+    hostx->useAdapted(adaptedx);
+  }
+  if (chunk.size() || minifying()) {
+    bufferAb(chunk, true); // buffer what we got
+    if (sendingAb == opOn && !buffer.empty())
       hostx->noteAbContentAvailable();
   }
+  storeCache(atEnd);
   stopVb();
   if (sendingAb == opOn) {
     hostx->noteAbContentDone(atEnd);
@@ -645,16 +2610,409 @@ void Adapter::Xaction::noteVbContentDone(bool atEnd) {
 void Adapter::Xaction::noteVbContentAvailable() {
   Must(receivingVb == opOn);
 
+  if (vb_direct) {
+    // Tcl is done with the message: the host reads ab from vb, where the
+    // content not yet consumed is still held...
+    const libecap::Area vb = hostx->vbContent(vb_size - ab_size,
+                                              libecap::nsize);
+    service->stats.incr(STATS_VB_CHUNKS);
+    service->stats.incr(STATS_VB_BYTES, vb.size);
+    vb_size += vb.size;
+    digest(BodyDigest::VIRGIN, vb.start, vb.size);
+    if (sendingAb == opOn && vb.size)
+      hostx->noteAbContentAvailable();
+    return;
+  }
   const libecap::Area vb = hostx->vbContent(0, libecap::nsize); // get all vb
-  std::string chunk = vb.toString(); // expensive, but simple
+  service->stats.incr(STATS_VB_CHUNKS);
+  service->stats.incr(STATS_VB_BYTES, vb.size);
+  vb_size += vb.size;
+  digest(BodyDigest::VIRGIN, vb.start, vb.size);
+  if (passthrough) {
+    // A call has timed out: copy the content without adapting it...
+    if (minifying()) {
+      // ... Tcl is done with the message, but it is still minified
+      std::string chunk(vb.start, vb.size);
+      bufferAb(chunk);
+    } else {
+      buffer.append(vb.start, vb.size);
+    }
+    hostx->vbContentShift(vb.size);
+    if (sendingAb == opOn)
+      hostx->noteAbContentAvailable();
+    return;
+  }
+  if (keep_virgin) virgin_copy.append(vb.start, vb.size);
+  if (whole_body) {
+    // Buffer everything, Tcl will get the body in contentDone...
+    pending.append(vb.start, vb.size);
+    hostx->vbContentShift(vb.size);
+    return;
+  }
+  if (min_chunk_bytes) {
+    // Coalesce small chunks, to save Tcl calls...
+    if (pending.empty()) {
+      Tcl_GetTime(&pending_since);
+      service->scheduleFlush(this);
+      takeBuffer(pending, min_chunk_bytes);
+    }
+    pending.append(vb.start, vb.size);
+    hostx->vbContentShift(vb.size);
+    if (pending.size() >= min_chunk_bytes) {
+      flushPending(STATS_COALESCE_FLUSH_SIZE);
+    } else if (service->max_chunk_delay) {
+      Tcl_Time now;
+      Tcl_GetTime(&now);
+      if (flushDue(now)) flushPending(STATS_COALESCE_FLUSH_TIMER);
+    }
+    return;
+  }
+  std::string chunk;
+  takeBuffer(chunk, vb.size);
+  chunk.assign(vb.start, vb.size);
   hostx->vbContentShift(vb.size); // we have a copy; do not need vb any more
-  service->contentAdapt(this, chunk);
-  buffer += chunk; // buffer what we got
+  if (!checkCode(adaptChunk(chunk), &chunk)) {
+    recycle(chunk);
+    return;
+  }
+  bufferAb(chunk); // buffer what we got
+
+  if (sendingAb == opOn)
+    hostx->noteAbContentAvailable();
+}
+
+void Adapter::Xaction::resume() {
+  if (suspended_call) {
+    resumeContentDone();
+    return;
+  }
+  if (cache_waiting) {
+    // The transaction adapting the response is done...
+    cache_waiting = false;
+    if (hostx && !lookupCache()) adapt();
+    return;
+  }
+  if (!hostx || pending.empty()) return;
+  flushPending(STATS_COALESCE_FLUSH_TIMER);
+}
+
+void Adapter::Xaction::flushPending(StatsCounter reason) {
+  std::string chunk;
+  service->cancelFlush(this);
+  service->stats.incr(reason);
+  chunk.swap(pending);
+  if (!checkCode(adaptChunk(chunk), &chunk)) {
+    recycle(chunk);
+    return;
+  }
+  bufferAb(chunk); // buffer what we got
 
   if (sendingAb == opOn)
     hostx->noteAbContentAvailable();
 }
 
+// Passes a chunk of vb to contentAdapt or, in tags and json modes, the
+// subscribed items of the chunk to the hook of the scanner (if it has any).
+// chunk is replaced by the adapted content, unless the call fails (it then
+// has the items unmodified).
+int Adapter::Xaction::adaptChunk(std::string &chunk) {
+  if (!body_scanner) return service->contentAdapt(this, chunk);
+  std::string out;
+  BodyItems items;
+  std::vector<std::string> replaced;
+  int code;
+  body_scanner->feed(chunk.data(), chunk.size(), out, items);
+  if (items.values.empty()) {
+    // Nothing for Tcl in this chunk...
+    chunk.swap(out);
+    return TCL_OK;
+  }
+  if (items.labels.empty()) {
+    code = service->scanAdapt(this, scanner_hook, items.values, replaced);
+  } else {
+    // Pass label value pairs (i.e. a dict of paths and JSON values)...
+    std::vector<std::string> pairs;
+    pairs.reserve(2 * items.values.size());
+    for (size_t i = 0; i < items.values.size(); i++) {
+      pairs.push_back(items.labels[i]);
+      pairs.push_back(items.values[i]);
+    }
+    code = service->scanAdapt(this, scanner_hook, pairs, replaced);
+  }
+  if (code == TCL_OK && replaced.size() != items.values.size()) {
+    code = TCL_ERROR;
+  }
+  BodyScanner::splice(out, code == TCL_OK ? replaced : items.values,
+                      items.offsets, chunk);
+  return code;
+}
+
+bool Adapter::Xaction::wholeBody() const {
+  return whole_body;
+}
+
+bool Adapter::Xaction::setWholeBody(bool whole) {
+  // The mode cannot change, once Tcl has seen a part of the body...
+  if ((whole != whole_body || body_scanner) && vb_size) return false;
+  whole_body = whole;
+  delete body_scanner;
+  body_scanner = NULL;
+  return true;
+}
+
+const Adapter::BodyScanner *Adapter::Xaction::scanner() const {
+  return body_scanner;
+}
+
+Adapter::TclHook Adapter::Xaction::scannerHook() const {
+  return scanner_hook;
+}
+
+bool Adapter::Xaction::setScanner(TclHook hook,
+                                  const std::vector<std::string> &names,
+                                  std::string &error) {
+  // More items can be subscribed to, but the mode cannot change...
+  if ((!body_scanner || hook != scanner_hook) && vb_size) {
+    error = "content mode cannot be changed after content has been received";
+    return false;
+  }
+  if (body_scanner && hook != scanner_hook) {
+    delete body_scanner;
+    body_scanner = NULL;
+  }
+  if (!body_scanner) {
+    if (hook == HOOK_TAGS_ADAPT) {
+      body_scanner = new HtmlTokenizer;
+    } else {
+      body_scanner = new JsonScanner;
+    }
+    scanner_hook = hook;
+  }
+  whole_body = false;
+  for (std::vector<std::string>::const_iterator it = names.begin();
+       it != names.end(); ++it) {
+    if (!body_scanner->subscribe(*it, error)) return false;
+  }
+  return true;
+}
+
+// Returns false if the call has timed out, after applying the fallback of
+// the service (which may end the transaction: check hostx), or if the call
+// blocked the message (which ends the transaction). chunk is the (virgin)
+// content given to the call, if any.
+bool Adapter::Xaction::checkCode(int code, std::string *chunk) {
+  switch (code) {
+    case TCL_ERROR:
+      tcl_error = true;
+      break;
+    case ECAPTCL_BLOCK:
+      blocked();
+      return false;
+    case ECAPTCL_TIMEOUT:
+      timedOut(chunk);
+      return false;
+  }
+  return true;
+}
+
+void Adapter::Xaction::blocked() {
+  service->stats.incr(STATS_BLOCKED);
+  service->cancelFlush(this);
+  finishTcl();
+  if (receivingVb == opUndecided) {
+    receivingVb = opNever; // blocked before the body was asked for
+  } else {
+    stopVb(); // the rest of the body is not needed
+  }
+  sendingAb = opNever;
+  recycle(pending);
+  recycle(virgin_copy);
+  lastHostCall()->blockVirgin();
+}
+
+void Adapter::Xaction::timedOut(std::string *chunk) {
+  static const libecap::Name contentLength("Content-Length");
+  // What the minifier holds goes out, and the rest is not minified...
+  std::string held;
+  if (minifying()) {
+    body_minifier->finish(held);
+    service->stats.incr(STATS_MINIFY_BYTES_SAVED, -(Tcl_WideInt) held.size());
+  }
+  failed = true;
+  service->cancelFlush(this);
+  finishTcl();
+  switch (service->timeout_fallback) {
+    case FALLBACK_BLOCK:
+      service->stats.incr(STATS_FALLBACK_BLOCK);
+      stopVb();
+      sendingAb = opNever;
+      lastHostCall()->blockVirgin();
+      return;
+    case FALLBACK_VIRGIN:
+      service->stats.incr(STATS_FALLBACK_VIRGIN);
+      if (!vb_size) {
+        // Nothing consumed: the host can use the virgin message as it is
+        receivingVb = opComplete;
+        sendingAb = opNever;
+        lastHostCall()->useVirgin();
+        return;
+      }
+      if (whole_body || keep_virgin) {
+        adaptedx = hostx->virgin().clone();
+        buffer.swap(whole_body ? pending : virgin_copy);
+        break;
+      }
+      // We do not have the virgin content: pass what we have...
+    case FALLBACK_PARTIAL:
+      if (service->timeout_fallback == FALLBACK_PARTIAL)
+        service->stats.incr(STATS_FALLBACK_PARTIAL);
+      // The content may have been changed...
+      if (vb_size) adaptedx->header().removeAny(contentLength);
+      buffer += held;
+      buffer += pending;
+      if (chunk) buffer += *chunk;
+      if (body_scanner) body_scanner->finish(buffer);
+      break;
+  }
+  recycle(pending);
+  recycle(virgin_copy);
+  passthrough = true;
+  if (sendingAb == opOn && !buffer.empty())
+    hostx->noteAbContentAvailable();
+}
+
+// Sends the adapted headers now, with the virgin body, which is copied
+// without calling Tcl (minified, if there is a minifier).
+void Adapter::Xaction::headersOnly() {
+  static const libecap::Name contentLength("Content-Length");
+  finishTcl();
+  if (!adaptedx->body()) {
+    sendingAb = opNever; // there is nothing to send
+    lastHostCall()->useAdapted(adaptedx);
+    return;
+  }
+  service->stats.incr(STATS_HEADERS_ONLY);
+  headers_only = passthrough = true;
+  if (minifying()) {
+    adaptedx->header().removeAny(contentLength);
+  } else if (buffer.empty()) {
+    // Nothing to change in the body: the host reads it from vb...
+    vb_direct = true;
+  }
+  hostx->useAdapted(adaptedx);
+}
+
+void Adapter::Xaction::finishTcl() {
+  releaseCache();
+  if (!tcl_started) return;
+  tcl_started = false;
+  service->stats.incr(STATS_ACTIVE_XACTIONS, -1);
+  worker_pool->incr(POOL_ACTIVE_XACTIONS, -1);
+  // The thread may still be busy with an abandoned call...
+  if (tcl_action_start && !callRunning()) {
+    if (service->actionStop(this) == TCL_ERROR) tcl_error = true;
+  } else if (has_coroutine) {
+    // ... then nothing deletes the coroutine of the transaction
+    service->staleCoroutine(thread ? thread->interp : mainInterp,
+                            coroutineName());
+  }
+  tcl_action_start = false;
+  service->learnProcessor(mime_type, processor_name);
+  service->breakers.learn(mime_type, processor_name);
+  service->breakers.record(processor_name.empty() ? mime_type :
+                           processor_name, outcome(), failure_reason,
+                           breaker_probe);
+}
+
+Adapter::BreakerOutcome Adapter::Xaction::outcome() const {
+  if (!handled)  return OUTCOME_IGNORED;
+  if (failed)    return OUTCOME_TIMEOUT;
+  if (tcl_error) return OUTCOME_ERROR;
+  return OUTCOME_OK;
+}
+
+const std::string &Adapter::Xaction::processor() const {
+  return processor_name;
+}
+
+void Adapter::Xaction::setProcessor(const std::string &name) {
+  processor_name = name;
+}
+
+void Adapter::Xaction::processorFailed(const std::string &reason) {
+  tcl_error = true;
+  failure_reason = reason;
+}
+
+void Adapter::Xaction::holdCall(TclCallClientData *data) {
+  releaseHeldCall(false);
+  Tcl_MutexLock(&data->lock);
+  data->refCount++;
+  Tcl_MutexUnlock(&data->lock);
+  held_call = data;
+}
+
+void Adapter::Xaction::suspendCall(TclCallClientData *data) {
+  Tcl_Time now;
+  unsigned int timeout = worker_pool->call_timeout ?
+    worker_pool->call_timeout : service->hook_timeout[HOOK_CONTENT_DONE];
+  Tcl_MutexLock(&data->lock);
+  data->refCount++;
+  Tcl_MutexUnlock(&data->lock);
+  suspended_call = data;
+  // The time budget of the call covers its suspension...
+  Tcl_GetTime(&now);
+  suspended_deadline = timeout ? timeMs(now) + timeout : 0;
+  service->stats.incr(STATS_SUSPENDED_CALLS);
+  service->waitSuspended(this);
+}
+
+bool Adapter::Xaction::suspendedDue(const Tcl_Time &now) const {
+  bool completed;
+  if (!suspended_call) return false;
+  if (suspended_deadline && timeMs(now) >= suspended_deadline) return true;
+  Tcl_MutexLock(&suspended_call->lock);
+  completed = suspended_call->completed;
+  Tcl_MutexUnlock(&suspended_call->lock);
+  return completed;
+}
+
+void Adapter::Xaction::releaseSuspended() {
+  if (!suspended_call) return;
+  service->cancelSuspended(this);
+  Tcl_MutexLock(&suspended_call->lock);
+  suspended_call->abandoned = true;
+  suspended_call->action    = NULL;
+  Tcl_MutexUnlock(&suspended_call->lock);
+  releaseCall(suspended_call);
+  suspended_call = NULL;
+}
+
+bool Adapter::Xaction::callRunning() const {
+  bool running;
+  if (!held_call) return false;
+  Tcl_MutexLock(&held_call->lock);
+  running = held_call->running;
+  Tcl_MutexUnlock(&held_call->lock);
+  return running;
+}
+
+void Adapter::Xaction::releaseHeldCall(bool cancel) {
+  if (!held_call) return;
+  if (cancel) cancelCall(held_call);
+  releaseCall(held_call);
+  held_call = NULL;
+}
+
+Tcl_WideInt Adapter::Xaction::flushDeadline() const {
+  return timeMs(pending_since) + service->max_chunk_delay;
+}
+
+bool Adapter::Xaction::flushDue(const Tcl_Time &now) const {
+  return service->max_chunk_delay && !pending.empty() &&
+         timeMs(now) >= flushDeadline();
+}
+
 bool Adapter::Xaction::callable() const {
   return hostx != 0; // no point to call us if we are done
 }
@@ -673,6 +3031,116 @@ const libecap::Area Adapter::Xaction::getUri() const {
   return uri;
 }
 
+void Adapter::Xaction::storeMime() {
+  static const libecap::Name contentType("Content-Type");
+  mime_type.clear();
+  if (!hostx || !hostx->virgin().header().hasAny(contentType)) return;
+  const libecap::Area value = hostx->virgin().header().value(contentType);
+  std::string::size_type i, end;
+  mime_type.assign(value.start, value.size);
+  end = mime_type.find(';');
+  if (end != std::string::npos) mime_type.erase(end);
+  i = mime_type.find_first_not_of(" \t");
+  end = mime_type.find_last_not_of(" \t");
+  if (i == std::string::npos) {
+    mime_type.clear();
+    return;
+  }
+  mime_type = mime_type.substr(i, end - i + 1);
+  for (i = 0; i < mime_type.size(); ++i) mime_type[i] = tolower(mime_type[i]);
+}
+
+const std::string &Adapter::Xaction::mime() const {
+  return mime_type;
+}
+
+Adapter::WorkerPool *Adapter::Xaction::pool() const {
+  return worker_pool.get();
+}
+
+Adapter::Minifier::Language Adapter::Xaction::minifier() const {
+  return body_minifier ? body_minifier->language() : Minifier::NONE;
+}
+
+// The minifier cannot change once content has been received, and content
+// that is not identity encoded cannot be minified (it is not decoded).
+bool Adapter::Xaction::setMinifier(Minifier::Language language,
+                                   std::string &error) {
+  static const libecap::Name contentEncoding("Content-Encoding");
+  if (language == minifier()) return true;
+  if (vb_size) {
+    error = "minifier cannot be changed after content has been received";
+    return false;
+  }
+  if (language != Minifier::NONE && adaptedx &&
+      adaptedx->header().hasAny(contentEncoding)) {
+    std::string value =
+      adaptedx->header().value(contentEncoding).toString();
+    for (std::string::size_type i = 0; i < value.size(); ++i)
+      value[i] = tolower(value[i]);
+    if (value != "identity") {
+      error = "cannot minify " + value + " encoded content";
+      return false;
+    }
+  }
+  delete body_minifier;
+  body_minifier = Minifier::create(language);
+  return true;
+}
+
+const std::vector<Adapter::BodyDigest> &Adapter::Xaction::digests() const {
+  return body_digests;
+}
+
+// A digest is added before the content it digests: it has been received
+// (vb), or consumed by the host (ab)...
+bool Adapter::Xaction::addDigest(BodyDigest::Side side,
+                                 BodyDigest::Algorithm algorithm,
+                                 std::string &error) {
+  BodyDigest digest(side, algorithm);
+  for (std::vector<BodyDigest>::const_iterator it = body_digests.begin();
+       it != body_digests.end(); ++it) {
+    if (it->name() == digest.name()) return true;
+  }
+  if (side == BodyDigest::VIRGIN ? vb_size != 0 : ab_size != 0) {
+    error = "too late for " + digest.name() + ": the " +
+            BodyDigest::sides[side] + " content has already gone through";
+    return false;
+  }
+  body_digests.push_back(digest);
+  return true;
+}
+
+bool Adapter::Xaction::coroutine() const {
+  return has_coroutine;
+}
+
+void Adapter::Xaction::setCoroutine() {
+  has_coroutine = true;
+}
+
+std::string Adapter::Xaction::coroutineName() const {
+  return TCLECAP_COROUTINE_PREFIX "_" + std::to_string(serial);
+}
+
+Adapter::NativeBinding *Adapter::Xaction::native() const {
+  return native_binding;
+}
+
+// Lets a native processor adapt the transaction. Returns TCL_BREAK if it
+// does not, and the transaction is left to Tcl.
+int Adapter::Xaction::startNative(const NativeProcessorPtr &processor) {
+  native_binding = new NativeBinding(processor, this);
+  int code = native_binding->start();
+  if (code == TCL_BREAK) {
+    delete native_binding;
+    native_binding = NULL;
+    return code;
+  }
+  setProcessor(processor->name());
+  return code;
+}
+
 // tells the host that we are not interested in [more] vb
 // if the host does not know that already
 void Adapter::Xaction::stopVb() {
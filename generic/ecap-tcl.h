@@ -1,8 +1,13 @@
+#include <atomic>
 #include <cerrno>
 #include <cstring>
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
 #define HAVE_CONFIG_H
 #include <libecap/common/libecap.h>
 #include <libecap/common/registry.h>
@@ -19,6 +24,22 @@
 #include <tcl.h>
 #include "tpool.h"
 #include "cmds.h"
+#include "stats.h"
+#include "breaker.h"
+#include "shared.h"
+#include "rules.h"
+#include "html.h"
+#include "json.h"
+#include "pool.h"
+#include "cache.h"
+#include "profile.h"
+#include "workerpool.h"
+#include "native.h"
+#include "log.h"
+#include "digest.h"
+#include "minify.h"
+#include "re.h"
+#include "shm.h"
 #include "ecap-tcl-identity.h"
 
 //#if LIBECAP_VERSION == 1.0.0 || LIBECAP_VERSION == 1.0.1
@@ -28,15 +49,49 @@
 //#endif
 #define HAVE_ECAP_VERSION 100
 
+/* A return code (beyond the Tcl ones), for calls that exceeded their time
+ * budget (or command limit), and have been cancelled. */
+#define ECAPTCL_TIMEOUT 5
+/* A return code for calls that asked for the message to be blocked, with
+ * ::ecap-tcl::action block. */
+#define ECAPTCL_BLOCK   6
+/* A return code for calls whose hook has returned, but which go on until
+ * ::ecap-tcl::resume is called (see ::ecap-tcl::action suspend). */
+#define ECAPTCL_SUSPEND 7
+
 namespace Adapter { // not required, but adds clarity
 
 using libecap::size_type;
 
 class Xaction;
+struct _TclCallClientData;
+
+/* The Tcl commands called by the adapter. The order must follow
+ * TclHookNames. */
+enum TclHook {
+  HOOK_WANTS_URL, HOOK_HEADERS_ADAPT, HOOK_ACTION_START, HOOK_CONTENT_ADAPT,
+  HOOK_TAGS_ADAPT, HOOK_JSON_ADAPT, HOOK_CONTENT_DONE, HOOK_ACTION_STOP,
+  HOOK_NUMBER
+};
+extern const char *const TclHookNames[];
+
+/* The coroutine of a transaction is named by this prefix and its serial
+ * number (tokens are reused, with the transactions, see XactionBlocks) */
+#define TCLECAP_COROUTINE_PREFIX "::ecap-tcl::coroutine"
+
+/* The default size of cache_dir */
+static const size_type DefaultCacheDiskSize = 1024 * 1024 * 1024;
+
+/* The default size of the shared memory segment (shm_name) */
+static const size_type DefaultShmSize = 64 * 1024 * 1024;
+
+/* What to do with a transaction, when a call exceeds its time budget */
+enum TimeoutFallback { FALLBACK_VIRGIN, FALLBACK_PARTIAL, FALLBACK_BLOCK };
 
 class Service: public libecap::adapter::Service {
   public:
     Service(const std::string &uri_suffix);
+    virtual ~Service();
     // About
     virtual std::string uri() const; // unique across all vendors
     virtual std::string tag() const; // changes with version and config
@@ -52,6 +107,12 @@ class Service: public libecap::adapter::Service {
     virtual void stop();   // no more makeXaction() calls until start()
     virtual void retire(); // no more makeXaction() calls
 
+    // Asynchronous support (used for flushing coalesced chunks, and for
+    // completing suspended calls)
+    virtual bool makesAsyncXactions() const;
+    virtual void suspend(timeval &timeout);
+    virtual void resume();
+
     // Scope (XXX: this may be changed to look at the whole header)
     virtual bool wantsUrl(const char *url) const;
 
@@ -72,24 +133,147 @@ class Service: public libecap::adapter::Service {
     std::string service_thread_init_script;
     std::string service_thread_retire_script;
     std::string threads_number;
+    size_type   min_chunk_bytes = 0;   // Coalesce vb until this size...
+    unsigned int max_chunk_delay = 0;  // ...or this many msecs have passed
+    std::map<std::string, size_type> mime_min_chunk_bytes;
+    unsigned int call_timeout = 0;  // msecs, 0: no time budget
+    std::string  call_timeouts;     // per hook budgets, i.e. contentDone:500
+    unsigned int hook_timeout[HOOK_NUMBER] = {0}; // resolved budgets
+    unsigned int call_command_limit = 0;
+    TimeoutFallback timeout_fallback = FALLBACK_PARTIAL;
+    unsigned int shed_queue_depth = 0; // 0: never shed by depth
+    std::string  url_rules; // a file of rules, deciding wantsUrl natively
+    size_type    cache_size = 0;      // 0: adapted responses are not cached
+    std::string  cache_dir;           // entries evicted from memory go there
+    size_type    cache_disk_size = DefaultCacheDiskSize;
+    unsigned int profile_interval = 0; // msecs, 0: the profiler is not run
+    std::string  profile_dir;          // where the folded stacks are written
+    std::string  native_processors;    // shared objects, comma separated
+    // The interpreters of the threads are replaced after serving this many
+    // transactions, or bytes of content, or after this many seconds, or
+    // (the heaviest first) while the RSS of the process exceeds recycle_rss
+    unsigned int recycle_xactions = 0;
+    size_type    recycle_bytes = 0;
+    unsigned int recycle_age = 0;
+    size_type    recycle_rss = 0;
+    std::string  log_target;        // a file, syslog[:socket], empty: stderr
+    int          log_level = Logger::LEVEL_INFO;
+    // The digests computed for every transaction (content_digests)
+    std::vector<BodyDigest> content_digests;
+    // The MIME types whose content is minified natively (minify)
+    std::map<std::string, Minifier::Language> minify_types;
+    // The shared memory segment of the processes of the host (empty: none)
+    std::string  shm_name;
+    size_type    shm_size = DefaultShmSize;
+    unsigned int shm_decision_ttl = 0; // secs, 0: decisions are not shared
+    // The interpreters service their events, and calls may be suspended
+    bool         event_loop = false;
+
+    mutable Stats stats;
+    mutable Breakers breakers;
+    mutable ResponseCache cache;
+    mutable SharedSegment shm;
 
+    // The pools of worker threads, the default pool (threads_number) first
+    std::vector<WorkerPoolPtr> pools;
+    WorkerPoolPtr poolFor(const std::string &mime) const; // binds transactions
+    WorkerPoolPtr poolNamed(const std::string &name) const;
+    // The processor that handles a MIME type (registered by the library, or
+    // learned from the last transaction of the MIME type)
+    void learnProcessor(const std::string &mime,
+                        const std::string &processor) const;
+    std::string processorOf(const std::string &mime) const;
+    // The MIME types whose processor adapts headers (registered with
+    // -headers): if there are any, ::ecap-tcl::headersAdapt is only called
+    // for them
+    void learnHeadersAdapter(const std::string &mime) const;
+    bool adaptsHeaders(const std::string &mime) const;
+
+    int  headersAdapt(Xaction *action, std::string &result) const;
     int  actionStart(Xaction *action) const;
     int  actionStop(Xaction *action) const;
     int  contentAdapt(Xaction *action,
                       std::string &chunk) const; // converts vb to ab
-    int  contentDone(Xaction *action, bool atEnd, std::string &chunk) const;
+    // passes the items found by a body scanner (tagsAdapt or jsonAdapt)
+    int  scanAdapt(Xaction *action, TclHook hook,
+                   const std::vector<std::string> &items,
+                   std::vector<std::string> &result) const;
+    int  contentDone(Xaction *action, bool atEnd, std::string &chunk,
+                     const std::string *body = NULL) const;
+
+    bool shed(Xaction *action) const; // bypass adaptation?
+    void blockUrl(const std::string &url) const;
+    bool takeBlockedUrl(const std::string &url) const;
+    size_type minChunkBytes(const std::string &mime) const;
+    Minifier::Language minifyLanguage(const std::string &mime) const;
+    void scheduleFlush(Xaction *action) const;
+    void cancelFlush(Xaction *action) const;
+    // A transaction whose contentDone call is suspended, until it completes
+    void waitSuspended(Xaction *action) const;
+    void cancelSuspended(Xaction *action) const;
+    // A transaction bound to a thread has ended (see recycle_*)
+    void releaseThread(WorkerPool *pool, TPoolThread *thread,
+                       size_type bytes) const;
+    // The coroutine of a transaction that ended without actionStop stays
+    // in its interpreter, until the next actionStart there deletes it.
+    void staleCoroutine(Tcl_Interp *interp, const std::string &name) const;
+    void dropStaleCoroutines(Tcl_Interp *interp) const;
 
   protected:
+    int  evalCall(struct _TclCallClientData *data) const;
+    int  dispatchCall(struct _TclCallClientData *data,
+                      WorkerPool *pool) const;
     void setThreadsNumber(const std::string &value);
+    void setPoolOption(const std::string &option, const std::string &value);
+    void resetPools(void);
+    void setMimeMinChunkBytes(const std::string &value);
+    void setHookTimeouts(void);
+    void setTimeoutFallback(const std::string &value);
+    void setContentDigests(const std::string &value);
+    void setMinifyTypes(const std::string &value);
+    void loadUrlRules(void);
+    void configureCache(void);
+    void attachShm(void);
+    void writeProfile(void) const;
+    void loadNatives(void);
+    void startLog(void);
+    void startProfile(void);
+    void noteNativeCall(Xaction *action, TclHook hook,
+                        const Tcl_Time &begin) const;
+    void detectHooks(void);
     void initPool(void);
+    void initPool(WorkerPool *pool, const std::string &script);
     void freePool(void);
+    void freePool(WorkerPool *pool);
     void evalScript(const std::string &path);
   private:
-    unsigned int nthread = 0;   // Number of threads
-    TPool *pool = NULL;         // Thread pool
-    mutable
-    TPoolThread *thread = NULL; // The thread associated with this service
+    // The processors of the MIME types (see learnProcessor())
+    mutable Tcl_Mutex processors_lock = NULL;
+    mutable std::map<std::string, std::string> processors;
+    mutable std::set<std::string> headers_adapters;
     mutable unsigned int size = 0;
+    // Transactions holding coalesced vb, waiting for max_chunk_delay
+    mutable std::set<Xaction *> flushing;
+    // Transactions whose call is suspended (see waitSuspended())
+    mutable std::set<Xaction *> suspended;
+    bool pollsEvents() const;
+    // The coroutines of ended transactions, by interpreter
+    mutable Tcl_Mutex coroutines_lock = NULL;
+    mutable std::map<Tcl_Interp *, std::vector<std::string> >
+      stale_coroutines;
+    // URLs blocked by wantsUrl, waiting for their transaction to start: the
+    // serials of their blocks, and the URL of each serial (the oldest first
+    // forgotten)
+    mutable std::map<std::string, std::deque<unsigned long> > blocked_urls;
+    mutable std::map<unsigned long, std::string> blocked_serials;
+    mutable unsigned long blocked_serial = 0;
+    // The rule set consulted by wantsUrl, before calling Tcl
+    const UrlRulesPtr *wants_url_rules = NULL;
+    // Has startLog() started the (shared) log, for stop() to stop it?
+    bool logging = false;
+    // The RSS of the process, read at most once per second
+    mutable size_type rss = 0;
+    mutable Tcl_Time  rss_checked = {0, 0};
 };
 
 #define ACTION_TOKEN_SIZE 2*sizeof(void*)+4
@@ -98,6 +282,10 @@ class Xaction: public libecap::adapter::Xaction {
     Xaction(libecap::shared_ptr<Service> s, libecap::host::Xaction *x);
     virtual ~Xaction();
 
+    // the memory of transactions is recycled (see pool.h)
+    static void *operator new(size_t size);
+    static void  operator delete(void *block, size_t size);
+
     // meta-information for the host transaction
     virtual const libecap::Area option(const libecap::Name &name) const;
     virtual void visitEachOption(libecap::NamedValueVisitor &visitor) const;
@@ -123,45 +311,215 @@ class Xaction: public libecap::adapter::Xaction {
     // libecap::Callable API, via libecap::host::Xaction
     virtual bool callable() const;
 
+    // called by the host, after Service::resume() asked it to
+    virtual void resume();
+
     libecap::host::Xaction *host() const;
     void storeUri();
     const libecap::Area getUri() const;
+    void storeMime();
+    const std::string &mime() const;
+
+    // coalescing of virgin body chunks
+    bool flushDue(const Tcl_Time &now) const;
+    Tcl_WideInt flushDeadline() const;
+
+    // whole-body mode: vb is buffered, and passed only to contentDone
+    bool wholeBody() const;
+    bool setWholeBody(bool whole);
+
+    // tags and json modes: vb is scanned, and only some HTML tags (or JSON
+    // values) are passed to Tcl, with hook HOOK_TAGS_ADAPT (HOOK_JSON_ADAPT)
+    const BodyScanner *scanner() const;
+    TclHook scannerHook() const;
+    bool setScanner(TclHook hook, const std::vector<std::string> &names,
+                    std::string &error);
+
+    // keeps a call that timed out, until it finishes (or is cancelled)
+    void holdCall(struct _TclCallClientData *data);
+    // keeps the suspended contentDone call, until ::ecap-tcl::resume
+    // completes it (or its time budget has passed)
+    void suspendCall(struct _TclCallClientData *data);
+    bool suspendedDue(const Tcl_Time &now) const;
+
+    // the processor handling the transaction (for its circuit breaker)
+    const std::string &processor() const;
+    void setProcessor(const std::string &name);
+    void processorFailed(const std::string &reason);
+
+    // timing, sizes and annotations, exported as meta-information
+    void noteCall(TclHook hook, Tcl_WideInt wait, Tcl_WideInt elapsed);
+    void setMeta(const std::string &name, const std::string &value);
+    bool unsetMeta(const std::string &name);
+
+    // the native processor adapting the transaction (NULL: Tcl)
+    NativeBinding *native() const;
+    int startNative(const NativeProcessorPtr &processor);
+
+    // the coroutine adapting the transaction, resumed by the calls after
+    // actionStart (see ::ecap-tcl::action coroutine)
+    bool coroutine() const;
+    void setCoroutine();
+    std::string coroutineName() const;
+
+    // the digests of the virgin and adapted content (content_digests, and
+    // the ones added by Tcl, before the content they digest)
+    const std::vector<BodyDigest> &digests() const;
+    bool addDigest(BodyDigest::Side side, BodyDigest::Algorithm algorithm,
+                   std::string &error);
+
+    // the minifier of the adapted content (minify, or set by Tcl before the
+    // content goes through)
+    Minifier::Language minifier() const;
+    bool setMinifier(Minifier::Language language, std::string &error);
+
+    WorkerPool  *pool() const;  // The pool serving this transaction...
+    TPoolThread *thread = NULL; // ... and its thread
+    unsigned long thread_generation = 0; // see WorkerPool::generation
+    unsigned long breaker_probe = 0; // see Breakers::bypass()
 
     char token[ACTION_TOKEN_SIZE];
     libecap::Message &adapted() const;
 
   protected:
     void stopVb(); // stops receiving vb (if we are receiving it)
+    void flushPending(StatsCounter reason); // passes coalesced vb to Tcl
+    // appends adapted content to buffer (minified, if there is a minifier)
+    void bufferAb(std::string &chunk, bool atEnd = false);
+    void minify(std::string &chunk, bool atEnd);
+    bool minifying() const;
+    void takeBuffer(std::string &s, size_type size); // see BufferPool
+    void recycle(std::string &s);
+    void digest(BodyDigest::Side side, const char *data, size_type size);
+    void makeVb();
+    size_type announcedVbSize() const; // Content-Length, 0 if unknown
+    int  adaptChunk(std::string &chunk); // passes vb to Tcl
+    // applies the timeout fallback, if needed
+    bool checkCode(int code, std::string *chunk = NULL);
+    void timedOut(std::string *chunk);
+    void blocked(); // blocks the message, as asked by Tcl
+    void headersOnly(); // sends the adapted headers with the virgin body
+    void adapt(); // starts adapting the message (with Tcl)
+    // the cache of adapted responses
+    bool cacheable(); // sets cache_key
+    bool lookupCache(); // true: served from the cache, or waiting for it
+    void useCached();
+    void storeCache(bool atEnd);
+    void releaseCache(); // abandons the response, if adapting it
+    void resumeWaiters(std::vector<Xaction *> &waiters);
+    void finishTcl(); // calls actionStop, if possible
+    BreakerOutcome outcome() const;
+    bool builtinMeta(int option, std::string &value) const;
+    bool callRunning() const;
+    void releaseHeldCall(bool cancel);
+    void releaseSuspended(); // the host no longer waits for it
+    void resumeContentDone(); // the suspended call is over
+    void finishContent(bool atEnd, std::string &chunk); // after contentDone
     libecap::host::Xaction *lastHostCall(); // clears hostx
 
   private:
     libecap::shared_ptr<const Service> service; // configuration access
     libecap::host::Xaction *hostx; // Host transaction rep
     libecap::Area uri;
+    std::string mime_type; // lower case, without parameters
+    WorkerPoolPtr worker_pool; // bound when the transaction starts
+    NativeBinding *native_binding = NULL;
+    bool        has_coroutine = false;
+    unsigned long serial; // names its coroutine
 
     std::string buffer; // for content adaptation
+    std::string pending; // vb not yet passed to Tcl (coalescing/whole body)
+    std::string virgin_copy; // consumed vb, kept for timeout_fallback=virgin
+    bool        keep_virgin = false;
+    size_type   min_chunk_bytes = 0;
+    Tcl_Time    pending_since;
+    size_type   vb_size = 0; // vb bytes received so far
+    bool        whole_body = false;
+    BodyScanner *body_scanner = NULL; // tags and json modes
+    TclHook     scanner_hook = HOOK_TAGS_ADAPT;
+    Minifier   *body_minifier = NULL; // minify
+    bool        failed = false;  // a call timed out: no more Tcl calls
+    bool        passthrough = false; // remaining vb is copied unmodified
+    std::string processor_name;
+    std::string failure_reason;
+    bool        headers_only = false; // vb is copied unmodified, no Tcl
+    bool        vb_direct = false; // ab is read from vb, without a copy
+    bool        vb_ended = false;  // vb_direct: all vb has been received
+    bool        handled = false;   // a processor adapts the transaction
+    bool        tcl_error = false; // a call (or the processor) failed
+    Tcl_WideInt hook_usecs[HOOK_NUMBER] = {0}; // time spent in Tcl
+    unsigned int hook_calls[HOOK_NUMBER] = {0};
+    Tcl_WideInt queue_usecs = 0; // time spent waiting for a thread
+    size_type   ab_size = 0; // ab bytes consumed by the host
+    std::vector<BodyDigest> body_digests;
+    std::map<std::string, std::string> meta; // set by Tcl
+    struct _TclCallClientData *held_call = NULL;
+    struct _TclCallClientData *suspended_call = NULL;
+    Tcl_WideInt suspended_deadline = 0; // msecs, 0: no time budget
+    bool        suspended_at_end = false;
     libecap::shared_ptr<libecap::Message> adaptedx;
+    std::string cache_key;           // the key of the response in the cache
+    bool        cache_owner = false; // adapting the response for the cache
+    bool        cache_waiting = false; // for another transaction adapting it
+    std::string cache_body;          // the adapted body, for the cache
+    bool        cache_overflow = false; // too large for the cache
+    CachedResponsePtr cached;        // a hit, being sent
+    size_type   cached_offset = 0;   // ab consumed by the host, for a hit
 
     typedef enum { opUndecided, opOn, opComplete, opNever } OperationState;
     OperationState receivingVb;
     OperationState sendingAb;
+    bool tcl_started = false; // a Tcl hook has been called
     bool tcl_action_start = false;
 };
 
-enum TclObjMethod   { string, bytes, bytearray, boolean };
-enum TclResultValue { result_string, result_boolean };
+enum TclObjMethod   { string, bytes, bytearray, boolean, list };
+enum TclResultValue { result_string, result_boolean, result_list };
 
+/* A call to a Tcl command. The call is shared (reference counted) between
+ * the host thread and the worker evaluating it, as the host may abandon a
+ * call that exceeded its time budget. The lock guards action and the state
+ * flags, after the call has been handed to the worker. */
 typedef struct _TclCallClientData {
+  _TclCallClientData(TclHook h, Xaction *a);
+
   unsigned int   objc;
-  const char    *token[3];
-  TclObjMethod   init[3];
-  size_t         size[3];
+  const char    *token[4];
+  TclObjMethod   init[4];
+  size_t         size[4];
   int            code;
   std::string    result;
   int            result_boolean = false;
+  std::vector<std::string> result_items;
+  const std::vector<std::string> *items = NULL; // the argument of type list
   TclResultValue expects = result_string;
+  TclHook        hook;
+  unsigned int   timeout  = 0; // msecs, 0: no time limit
+  unsigned int   commands = 0; // 0: no command limit
 
   Xaction      *action;
+  std::string   coroutine; // actionStart, or resuming: the coroutine name
+
+  Tcl_Mutex     lock      = NULL;
+  int           refCount  = 1;
+  bool          running   = false; // being evaluated by interp
+  bool          abandoned = false; // the host no longer waits for it
+  bool          cancelled = false; // Tcl_CancelEval() has been called
+  bool          blocked   = false; // ::ecap-tcl::action block was called
+  bool          suspended = false; // ::ecap-tcl::action suspend was called
+  bool          completed = false; // ... and ::ecap-tcl::resume, since
+  Tcl_WideInt   started   = 0;     // usecs, when the evaluation started
+  Tcl_Interp   *interp    = NULL;
 } TclCallClientData;
 
+void releaseCall(TclCallClientData *data);
+void cancelCall(TclCallClientData *data);
+// The calls suspended in an interpreter, by handle: suspendCall() returns
+// the handle of the call, which resumeCall() completes with the code and
+// result of its hook (returning false if there is no such call, and
+// setting delivered if the host still waits for it).
+std::string suspendCall(Tcl_Interp *interp, TclCallClientData *data);
+bool resumeCall(Tcl_Interp *interp, const std::string &handle, int code,
+                Tcl_Obj *result, bool &delivered);
+
 } // namespace Adapter
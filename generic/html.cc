@@ -0,0 +1,243 @@
+/*
+ * html.cc: A streaming HTML tokenizer of the eCAP Tcl adapter.
+ */
+
+#include <cctype>
+#include <cstring>
+#include <strings.h>
+#include "html.h"
+
+/* The longest construct (tag, comment...) held between chunks: anything
+ * longer is not a tag, and is copied as text. */
+static const size_t MaxHeld = 64 * 1024;
+
+/* The elements whose content is text, up to their end tag */
+static const char *const RawTextElements[] = {
+  "script", "style", "textarea", "title", "xmp", "iframe", "noembed",
+  "noframes", NULL
+};
+
+/* What starts with a <... */
+enum HtmlConstruct { CONSTRUCT_TEXT, CONSTRUCT_OTHER, CONSTRUCT_START_TAG,
+                     CONSTRUCT_END_TAG };
+
+static inline bool isSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}; /* isSpace */
+
+static inline bool isNameEnd(char c) {
+  return isSpace(c) || c == '/' || c == '>';
+}; /* isNameEnd */
+
+// Returns the size of the tag starting at lt (0: it does not end in the
+// data). The > of quoted attribute values does not end the tag.
+static size_t tagEnd(const char *lt, const char *p, const char *end) {
+  bool equals = false;
+  while (p < end) {
+    char c = *p;
+    if (c == '>') return p + 1 - lt;
+    if ((c == '"' || c == '\'') && equals) {
+      p = (const char *) memchr(p + 1, c, end - p - 1);
+      if (p == NULL) return 0;
+      equals = false;
+    } else if (c == '=') {
+      equals = true;
+    } else if (!isSpace(c)) {
+      equals = false;
+    }
+    p++;
+  }
+  return 0;
+}; /* tagEnd */
+
+// Checks the name is one the scanner can match: a letter, then anything
+// but what ends a name (after a / for end tags)
+bool Adapter::HtmlTokenizer::subscribe(const std::string &name,
+                                       std::string &error) {
+  std::string::size_type start = !name.empty() && name[0] == '/' ? 1 : 0;
+  if (start == name.size() || !isalpha((unsigned char) name[start])) {
+    error = "invalid HTML tag name (expected a letter first): " + name;
+    return false;
+  }
+  for (std::string::size_type i = start + 1; i < name.size(); ++i) {
+    if (isNameEnd(name[i])) {
+      error = "invalid HTML tag name (space, / or > inside): " + name;
+      return false;
+    }
+  }
+  std::string lower(name);
+  for (std::string::size_type i = 0; i < lower.size(); ++i)
+    lower[i] = tolower(lower[i]);
+  for (std::vector<std::string>::const_iterator it = names.begin();
+       it != names.end(); ++it) {
+    if (*it == lower) return true;
+  }
+  names.push_back(lower);
+  return true;
+}
+
+void Adapter::HtmlTokenizer::feed(const char *data, size_t size,
+                                  std::string &out, BodyItems &items) {
+  size_t used;
+  if (held.empty()) {
+    used = scan(data, size, out, items);
+    held.assign(data + used, size - used);
+  } else {
+    // Resume the construct held from the previous chunk...
+    std::string input;
+    input.swap(held);
+    input.append(data, size);
+    used = scan(input.data(), input.size(), out, items);
+    held.assign(input, used, std::string::npos);
+  }
+}
+
+void Adapter::HtmlTokenizer::finish(std::string &out) {
+  out += held;
+  std::string().swap(held);
+  raw_text.clear();
+}
+
+// Returns the number of bytes consumed: the rest is an unfinished construct.
+// Text is located with memchr(), which the C library vectorises.
+size_t Adapter::HtmlTokenizer::scan(const char *data, size_t size,
+                                    std::string &out, BodyItems &items) {
+  const char *p = data, *end = data + size, *lt, *close;
+  HtmlConstruct construct;
+  size_t length;
+  bool partial;
+
+  while (p < end) {
+    lt = (const char *) memchr(p, '<', end - p);
+    if (lt == NULL) {
+      out.append(p, end - p);
+      return size;
+    }
+    if (!raw_text.empty()) {
+      // Inside a script (or similar): only its end tag matters...
+      if (!rawTextEnd(lt, end, partial)) {
+        if (partial && (size_t) (end - lt) <= MaxHeld) {
+          out.append(p, lt - p);
+          return lt - data;
+        }
+        out.append(p, lt + 1 - p);
+        p = lt + 1;
+        continue;
+      }
+      raw_text.clear();
+    }
+    out.append(p, lt - p);
+    p = lt;
+
+    // Find the end of the construct...
+    length = 0;
+    construct = CONSTRUCT_OTHER;
+    if (lt + 1 >= end) {
+      // Unfinished
+    } else if (lt[1] == '!') {
+      if (end - lt >= 4 && lt[2] == '-' && lt[3] == '-') {
+        // A comment, up to -->
+        for (close = lt + 4; close < end; close++) {
+          close = (const char *) memchr(close, '>', end - close);
+          if (close == NULL) break;
+          if (close - lt >= 6 && close[-1] == '-' && close[-2] == '-') {
+            length = close + 1 - lt;
+            break;
+          }
+        }
+      } else if (end - lt >= 4 || (lt + 2 < end && lt[2] != '-')) {
+        // A declaration (i.e. <!DOCTYPE html>), up to >
+        close = (const char *) memchr(lt + 2, '>', end - lt - 2);
+        if (close) length = close + 1 - lt;
+      }
+    } else if (lt[1] == '?') {
+      close = (const char *) memchr(lt + 2, '>', end - lt - 2);
+      if (close) length = close + 1 - lt;
+    } else if (lt[1] == '/') {
+      if (lt + 2 >= end) {
+        // Unfinished
+      } else if (isalpha((unsigned char) lt[2])) {
+        construct = CONSTRUCT_END_TAG;
+        length = tagEnd(lt, lt + 2, end);
+      } else {
+        close = (const char *) memchr(lt + 2, '>', end - lt - 2);
+        if (close) length = close + 1 - lt;
+      }
+    } else if (isalpha((unsigned char) lt[1])) {
+      construct = CONSTRUCT_START_TAG;
+      length = tagEnd(lt, lt + 1, end);
+    } else {
+      construct = CONSTRUCT_TEXT;
+      length = 1;
+    }
+    if (length == 0) {
+      if ((size_t) (end - lt) <= MaxHeld) return lt - data;
+      // Too long to be anything: it is text
+      construct = CONSTRUCT_TEXT;
+      length = 1;
+    }
+
+    if (construct == CONSTRUCT_START_TAG || construct == CONSTRUCT_END_TAG) {
+      const char *name = lt + (construct == CONSTRUCT_END_TAG ? 2 : 1);
+      size_t name_size = 0;
+      while (name + name_size < lt + length && !isNameEnd(name[name_size]))
+        name_size++;
+      if (construct == CONSTRUCT_START_TAG) {
+        for (int i = 0; RawTextElements[i]; i++) {
+          if (strlen(RawTextElements[i]) == name_size &&
+              strncasecmp(RawTextElements[i], name, name_size) == 0) {
+            raw_text = RawTextElements[i];
+            break;
+          }
+        }
+      }
+      if (isSubscribed(name, name_size, construct == CONSTRUCT_END_TAG)) {
+        items.offsets.push_back(out.size());
+        items.values.push_back(std::string(lt, length));
+        p = lt + length;
+        continue;
+      }
+    }
+    out.append(lt, length);
+    p = lt + length;
+  }
+  return size;
+}
+
+// Returns true if the end tag of raw_text starts at lt. partial is set if
+// the data ends before this can be decided.
+bool Adapter::HtmlTokenizer::rawTextEnd(const char *lt, const char *end,
+                                        bool &partial) const {
+  size_t need = raw_text.size() + 3, i;
+  partial = false;
+  for (i = 0; i < need; i++) {
+    if (lt + i >= end) {
+      partial = true;
+      return false;
+    }
+    char c = tolower((unsigned char) lt[i]);
+    if (i == 0) {
+      if (c != '<') return false;
+    } else if (i == 1) {
+      if (c != '/') return false;
+    } else if (i < need - 1) {
+      if (c != raw_text[i - 2]) return false;
+    }
+  }
+  return isNameEnd(lt[need - 1]);
+}
+
+bool Adapter::HtmlTokenizer::isSubscribed(const char *name, size_t size,
+                                          bool closing) const {
+  for (std::vector<std::string>::const_iterator it = names.begin();
+       it != names.end(); ++it) {
+    if (closing) {
+      if (it->size() == size + 1 && (*it)[0] == '/' &&
+          strncasecmp(it->data() + 1, name, size) == 0) return true;
+    } else if (it->size() == size &&
+               strncasecmp(it->data(), name, size) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,39 @@
+/*
+ * html.h: A streaming HTML tokenizer of the eCAP Tcl adapter, for the "tags"
+ * content mode: text, comments and the tags nobody asked for are copied
+ * through, and only the tags a processor subscribed to are passed to Tcl,
+ * which may replace or drop them.
+ */
+#ifndef ECAPTCL_HTML_H
+#define ECAPTCL_HTML_H
+
+#include "scanner.h"
+
+namespace Adapter {
+
+class HtmlTokenizer: public BodyScanner {
+  public:
+    // Subscribes to the start tags of an element (i.e. "a"), or to its end
+    // tags (i.e. "/a"). Names are not case sensitive. Returns false,
+    // leaving an error message in error, for a name no tag can have (i.e.
+    // "", "/" or "a b").
+    virtual bool subscribe(const std::string &name, std::string &error);
+
+    // A tag that does not end in the chunk is held, until the next one.
+    virtual void feed(const char *data, size_t size, std::string &out,
+                      BodyItems &items);
+    virtual void finish(std::string &out);
+
+  private:
+    size_t scan(const char *data, size_t size, std::string &out,
+                BodyItems &items);
+    bool   rawTextEnd(const char *p, const char *end, bool &partial) const;
+    bool   isSubscribed(const char *name, size_t size, bool closing) const;
+
+    std::string held;     // the start of a construct, split between chunks
+    std::string raw_text; // the element whose content is not parsed (script)
+};
+
+} // namespace Adapter
+
+#endif /* ECAPTCL_HTML_H */
@@ -0,0 +1,316 @@
+/*
+ * json.cc: A streaming JSON scanner of the eCAP Tcl adapter.
+ */
+
+#include <cctype>
+#include <cstdlib>
+#include <sstream>
+#include "json.h"
+
+/* The largest value collected for Tcl: a larger one is copied unmodified */
+static const size_t MaxCapture = 1024 * 1024;
+
+static inline bool isSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}; /* isSpace */
+
+static inline bool isLiteralStart(char c) {
+  return c == '-' || (c >= '0' && c <= '9') || c == 't' || c == 'f' ||
+         c == 'n';
+}; /* isLiteralStart */
+
+static inline bool isLiteralChar(char c) {
+  return isalnum((unsigned char) c) || c == '+' || c == '-' || c == '.';
+}; /* isLiteralChar */
+
+static inline bool isIdentifier(const std::string &key) {
+  if (key.empty() || isdigit((unsigned char) key[0])) return false;
+  for (std::string::size_type i = 0; i < key.size(); ++i) {
+    if (!isalnum((unsigned char) key[i]) && key[i] != '_' && key[i] != '$')
+      return false;
+  }
+  return true;
+}; /* isIdentifier */
+
+Adapter::JsonScanner::JsonScanner() {
+}
+
+// Parses a path: $, followed by .key, .*, [n], [*], ['key'] or ["key"]
+bool Adapter::JsonScanner::subscribe(const std::string &path,
+                                     std::string &error) {
+  std::string::size_type i = 1, start, close;
+  Path pattern;
+  if (path.empty() || path[0] != '$') {
+    error = "invalid JSON path (expected $ first): " + path;
+    return false;
+  }
+  while (i < path.size()) {
+    Step step;
+    step.index = 0;
+    if (path[i] == '.') {
+      start = ++i;
+      while (i < path.size() && path[i] != '.' && path[i] != '[') i++;
+      if (i == start) {
+        error = "invalid JSON path (empty key): " + path;
+        return false;
+      }
+      step.key = path.substr(start, i - start);
+      step.kind = step.key == "*" ? STEP_ANY : STEP_KEY;
+    } else if (path[i] == '[' && i + 1 < path.size() &&
+               (path[i+1] == '\'' || path[i+1] == '"')) {
+      close = path.find(path[i+1], i + 2);
+      if (close == std::string::npos || close + 1 >= path.size() ||
+          path[close + 1] != ']') {
+        error = "invalid JSON path (unterminated key): " + path;
+        return false;
+      }
+      step.kind = STEP_KEY;
+      step.key = path.substr(i + 2, close - i - 2);
+      i = close + 2;
+    } else if (path[i] == '[') {
+      close = path.find(']', i);
+      if (close == std::string::npos) {
+        error = "invalid JSON path (missing ]): " + path;
+        return false;
+      }
+      std::string index = path.substr(i + 1, close - i - 1);
+      if (index == "*") {
+        step.kind = STEP_ANY;
+      } else if (!index.empty() &&
+                 index.find_first_not_of("0123456789") == std::string::npos) {
+        step.kind = STEP_INDEX;
+        step.index = strtoul(index.c_str(), NULL, 10);
+      } else {
+        error = "invalid JSON path (invalid index \"" + index + "\"): " + path;
+        return false;
+      }
+      i = close + 1;
+    } else {
+      error = "invalid JSON path (expected . or [): " + path;
+      return false;
+    }
+    pattern.push_back(step);
+  }
+  for (std::vector<std::string>::const_iterator it = names.begin();
+       it != names.end(); ++it) {
+    if (*it == path) return true;
+  }
+  names.push_back(path);
+  patterns.push_back(pattern);
+  if (pattern.size() > max_depth) max_depth = pattern.size();
+  return true;
+}
+
+bool Adapter::JsonScanner::matches() const {
+  if (stack.size() > max_depth) return false;
+  for (std::vector<Path>::const_iterator it = patterns.begin();
+       it != patterns.end(); ++it) {
+    if (it->size() != stack.size()) continue;
+    size_t i;
+    for (i = 0; i < stack.size(); i++) {
+      const Step &step = (*it)[i];
+      const Level &level = stack[i];
+      if (step.kind == STEP_ANY) continue;
+      if (step.kind == STEP_KEY && (level.array || level.key != step.key))
+        break;
+      if (step.kind == STEP_INDEX && (!level.array ||
+                                      level.index != step.index)) break;
+    }
+    if (i == stack.size()) return true;
+  }
+  return false;
+}
+
+std::string Adapter::JsonScanner::currentPath() const {
+  std::ostringstream path;
+  path << '$';
+  for (std::vector<Level>::const_iterator it = stack.begin();
+       it != stack.end(); ++it) {
+    if (it->array) {
+      path << '[' << it->index << ']';
+    } else if (isIdentifier(it->key)) {
+      path << '.' << it->key;
+    } else {
+      path << "[\"" << it->key << "\"]";
+    }
+  }
+  return path.str();
+}
+
+// A value starts at p: start collecting it, if it has been subscribed to.
+// from is the first byte of the chunk not yet copied.
+void Adapter::JsonScanner::valueStart(const char *p, const char *&from,
+                                      std::string &out) {
+  if (capturing || !matches()) return;
+  out.append(from, p - from);
+  from = p;
+  capturing = true;
+  capture_depth = stack.size();
+  capture_path = currentPath();
+}
+
+// A value ends before p: pass it to Tcl, if it is the one being collected.
+void Adapter::JsonScanner::valueEnd(const char *p, const char *&from,
+                                    std::string &out, BodyItems &items) {
+  if (!capturing || stack.size() != capture_depth) return;
+  capture.append(from, p - from);
+  from = p;
+  capturing = false;
+  items.offsets.push_back(out.size());
+  items.values.push_back(std::string());
+  items.values.back().swap(capture);
+  items.labels.push_back(capture_path);
+}
+
+void Adapter::JsonScanner::feed(const char *data, size_t size,
+                                std::string &out, BodyItems &items) {
+  const char *p = data, *end = data + size, *from = data, *q;
+  char c;
+
+  while (p < end && !invalid) {
+    c = *p;
+    switch (state) {
+      case JSON_STRING:
+      case JSON_KEY:
+        // Up to the closing quote, skipping escaped characters...
+        for (q = p; q < end; q++) {
+          if (escape) {
+            escape = false;
+          } else if (*q == '\\') {
+            escape = true;
+          } else if (*q == '"') {
+            break;
+          }
+        }
+        if (state == JSON_KEY) key.append(p, q - p);
+        if (q == end) {
+          p = end;
+          continue;
+        }
+        p = q + 1;
+        if (state == JSON_KEY) {
+          state = JSON_COLON;
+        } else {
+          state = JSON_AFTER_VALUE;
+          valueEnd(p, from, out, items);
+        }
+        continue;
+      case JSON_LITERAL:
+        if (isLiteralChar(c)) {
+          p++;
+          continue;
+        }
+        // The delimiter is not a part of the value: look at it again
+        state = JSON_AFTER_VALUE;
+        valueEnd(p, from, out, items);
+        continue;
+      default:
+        break;
+    }
+    if (isSpace(c)) {
+      p++;
+      continue;
+    }
+    switch (state) {
+      case JSON_FIRST_VALUE:
+        if (c == ']') break;
+        state = JSON_VALUE;
+        // fall through
+      case JSON_VALUE:
+        valueStart(p, from, out);
+        if (c == '{' || c == '[') {
+          Level level;
+          level.array = c == '[';
+          level.index = 0;
+          stack.push_back(level);
+          state = level.array ? JSON_FIRST_VALUE : JSON_FIRST_KEY;
+        } else if (c == '"') {
+          state = JSON_STRING;
+        } else if (isLiteralStart(c)) {
+          state = JSON_LITERAL;
+        } else {
+          invalid = true;
+          continue;
+        }
+        p++;
+        continue;
+      case JSON_FIRST_KEY:
+        if (c == '}') break;
+        // fall through
+      case JSON_KEY_START:
+        if (c != '"') {
+          invalid = true;
+          continue;
+        }
+        key.clear();
+        state = JSON_KEY;
+        p++;
+        continue;
+      case JSON_COLON:
+        if (c != ':' || stack.empty()) {
+          invalid = true;
+          continue;
+        }
+        stack.back().key.swap(key);
+        state = JSON_VALUE;
+        p++;
+        continue;
+      case JSON_AFTER_VALUE:
+        if (stack.empty()) {
+          // Another document (i.e. JSON lines)
+          state = JSON_VALUE;
+          continue;
+        }
+        if (c == ',') {
+          if (stack.back().array) {
+            stack.back().index++;
+            state = JSON_VALUE;
+          } else {
+            state = JSON_KEY_START;
+          }
+          p++;
+          continue;
+        }
+        if (c == (stack.back().array ? ']' : '}')) break;
+        invalid = true;
+        continue;
+      default:
+        break;
+    }
+    // The end of a container...
+    p++;
+    stack.pop_back();
+    state = JSON_AFTER_VALUE;
+    valueEnd(p, from, out, items);
+  }
+
+  if (invalid) {
+    // Not JSON (or not any more): the rest is copied unmodified
+    if (capturing) {
+      out += capture;
+      std::string().swap(capture);
+      capturing = false;
+    }
+    out.append(from, end - from);
+    return;
+  }
+  if (capturing) {
+    capture.append(from, end - from);
+    if (capture.size() > MaxCapture) {
+      // Too large: the value is copied unmodified
+      out += capture;
+      std::string().swap(capture);
+      capturing = false;
+    }
+  } else {
+    out.append(from, end - from);
+  }
+}
+
+void Adapter::JsonScanner::finish(std::string &out) {
+  out += capture;
+  std::string().swap(capture);
+  capturing = false;
+  stack.clear();
+  state = JSON_VALUE;
+}
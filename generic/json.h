@@ -0,0 +1,75 @@
+/*
+ * json.h: A streaming JSON scanner of the eCAP Tcl adapter, for the "json"
+ * content mode: processors subscribe to JSON paths, and only the values
+ * at these paths are passed to Tcl (as JSON text), while the rest of the
+ * document is copied through. Memory stays flat: only the key of each
+ * level, and the values being collected, are kept.
+ * The paths supported are made of keys and indices, with wildcards:
+ *   $  $.items  $.items[*].url  $['a key'][0]  $.*.id
+ */
+#ifndef ECAPTCL_JSON_H
+#define ECAPTCL_JSON_H
+
+#include "scanner.h"
+
+namespace Adapter {
+
+class JsonScanner: public BodyScanner {
+  public:
+    JsonScanner();
+
+    virtual bool subscribe(const std::string &path, std::string &error);
+    // The label of each value is its path, i.e. $.items[3].url
+    virtual void feed(const char *data, size_t size, std::string &out,
+                      BodyItems &items);
+    virtual void finish(std::string &out);
+
+  private:
+    enum StepKind { STEP_KEY, STEP_INDEX, STEP_ANY };
+    struct Step {
+      StepKind    kind;
+      std::string key;
+      size_t      index;
+    };
+    typedef std::vector<Step> Path;
+
+    struct Level {
+      bool        array;
+      std::string key;   // objects: the key of the current member
+      size_t      index; // arrays: the index of the current element
+    };
+
+    enum State {
+      JSON_VALUE,       // a value is expected
+      JSON_FIRST_VALUE, // a value or ] is expected
+      JSON_FIRST_KEY,   // a key or } is expected
+      JSON_KEY_START,   // a key is expected
+      JSON_KEY,         // in a key
+      JSON_COLON,       // : is expected
+      JSON_STRING,      // in a string value
+      JSON_LITERAL,     // in a number, true, false or null
+      JSON_AFTER_VALUE  // , or the end of the container is expected
+    };
+
+    bool matches() const;
+    std::string currentPath() const;
+    void valueStart(const char *p, const char *&from, std::string &out);
+    void valueEnd(const char *p, const char *&from, std::string &out,
+                  BodyItems &items);
+
+    std::vector<Path>  patterns;
+    size_t             max_depth = 0;
+    std::vector<Level> stack;
+    State              state = JSON_VALUE;
+    bool               escape = false;  // after a \ in a string
+    std::string        key;             // the key being read
+    bool               invalid = false; // not JSON: copy everything
+    bool               capturing = false;
+    size_t             capture_depth = 0;
+    std::string        capture;         // the value being collected
+    std::string        capture_path;
+};
+
+} // namespace Adapter
+
+#endif /* ECAPTCL_JSON_H */
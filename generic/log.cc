@@ -0,0 +1,360 @@
+/*
+ * log.cc: The log of the eCAP Tcl adapter.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "log.h"
+#include "workerpool.h"
+#include "cmds.h"
+
+#define TCLECAP_INTERP_KEY_LOG "::ecap-tcl::log"
+
+namespace Adapter {
+
+const char *const Logger::levels[] = {
+  "debug", "info", "notice", "warning", "error", NULL
+};
+
+Tcl_Mutex                  Logger::control = NULL;
+Tcl_Mutex                  Logger::lock = NULL;
+Tcl_Condition              Logger::wake = NULL;
+Tcl_ThreadId               Logger::thread;
+bool                       Logger::writing = false;
+unsigned int               Logger::users = 0;
+std::vector<LogRing *>     Logger::rings;
+std::string                Logger::target;
+int                        Logger::fd = -1;
+bool                       Logger::syslog = false;
+std::atomic<int>           Logger::threshold(Logger::LEVEL_INFO);
+std::atomic<unsigned long> Logger::filtered(0);
+std::atomic<unsigned long> Logger::written(0);
+std::atomic<unsigned long> Logger::dropped(0);
+std::atomic<unsigned long> Logger::errors(0);
+
+/* How often (msecs) the writer drains the rings */
+static const unsigned long LogInterval = 100;
+/* The severities of the levels, for syslog */
+static const int LogSeverities[] = {7, 6, 5, 4, 3};
+static const char *const DefaultSyslogSocket = "/dev/log";
+
+struct LogRecord {
+  Tcl_Time    time;
+  int         level;
+  std::string message;
+  std::string fields; // a Tcl list, formatted by the writer
+};
+
+// A single producer (the thread of the interpreter), single consumer (the
+// writer) ring. The producer owns the records from tail to head + size, the
+// consumer from tail to head.
+struct LogRing {
+  static const unsigned long SIZE = 1024;
+  LogRecord                  records[SIZE];
+  std::atomic<unsigned long> head{0};
+  std::atomic<unsigned long> tail{0};
+  std::atomic<unsigned long> dropped{0};
+  std::atomic<bool>          closed{false}; // the interpreter was deleted
+  std::string                worker;
+};
+
+static unsigned int WorkerCount = 0;
+
+/* Message texts and field values are kept on a single line */
+static void appendText(std::string &line, const char *text, bool quote) {
+  quote = quote && (*text == '\0' || strpbrk(text, " \t\"=") != NULL);
+  if (quote) line += '"';
+  for (; *text; text++) {
+    switch (*text) {
+      case '\n': line += "\\n"; break;
+      case '\r': line += "\\r"; break;
+      case '"':  if (quote) line += '\\';
+                 line += '"'; break;
+      default:   line += *text;
+    }
+  }
+  if (quote) line += '"';
+}; /* appendText */
+
+} // namespace Adapter
+
+int Adapter::Logger::levelOf(const std::string &name) {
+  for (int level = 0; levels[level]; level++) {
+    if (name == levels[level]) return level;
+  }
+  return -1;
+}
+
+bool Adapter::Logger::start(const std::string &path, int level,
+                            std::string &error) {
+  int descriptor = -1;
+  bool datagrams = false;
+  if (path == "syslog" || path.compare(0, 7, "syslog:") == 0) {
+    struct sockaddr_un address;
+    std::string socket_path = path.size() > 7 ? path.substr(7) :
+                                                DefaultSyslogSocket;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+      error = path + ": path too long";
+      return false;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+    descriptor = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (descriptor < 0 || connect(descriptor, (struct sockaddr *) &address,
+                                  sizeof(address)) < 0) {
+      error = path + ": " + strerror(errno);
+      if (descriptor >= 0) close(descriptor);
+      return false;
+    }
+    datagrams = true;
+  } else if (!path.empty()) {
+    descriptor = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                      0644);
+    if (descriptor < 0) {
+      error = path + ": " + strerror(errno);
+      return false;
+    }
+  }
+  Tcl_MutexLock(&control);
+  halt();
+  users++;
+  Tcl_MutexLock(&lock);
+  if (fd >= 0) close(fd);
+  fd = descriptor;
+  syslog = datagrams;
+  target = path;
+  threshold = level;
+  writing = true;
+  Tcl_MutexUnlock(&lock);
+  if (Tcl_CreateThread(&thread, writer, NULL, TCL_THREAD_STACK_DEFAULT,
+                       TCL_THREAD_JOINABLE) != TCL_OK) {
+    // Not started: the messages wait in the rings for the next start()...
+    Tcl_MutexLock(&lock);
+    writing = false;
+    Tcl_MutexUnlock(&lock);
+    users--;
+    Tcl_MutexUnlock(&control);
+    error = "cannot create the thread of log_target";
+    return false;
+  }
+  Tcl_MutexUnlock(&control);
+  return true;
+}
+
+void Adapter::Logger::stop() {
+  Tcl_MutexLock(&control);
+  if (users && --users == 0) halt();
+  Tcl_MutexUnlock(&control);
+}
+
+// Stops the writer (control must be held)
+void Adapter::Logger::halt() {
+  int result;
+  bool stopping;
+  Tcl_MutexLock(&lock);
+  stopping = writing;
+  writing = false;
+  Tcl_ConditionNotify(&wake);
+  Tcl_MutexUnlock(&lock);
+  // The writer drains the rings before returning...
+  if (stopping) Tcl_JoinThread(thread, &result);
+}
+
+Tcl_ThreadCreateType Adapter::Logger::writer(ClientData clientData) {
+  Tcl_Time wait = {0, (long) LogInterval * 1000};
+  Tcl_MutexLock(&lock);
+  while (writing) {
+    Tcl_ConditionWait(&wake, &lock, &wait);
+    Tcl_MutexUnlock(&lock);
+    drain();
+    Tcl_MutexLock(&lock);
+  }
+  Tcl_MutexUnlock(&lock);
+  drain();
+  TCL_THREAD_CREATE_RETURN;
+}
+
+// Formats and writes the messages of all rings, and frees the rings of the
+// deleted interpreters. Called by the writer only.
+void Adapter::Logger::drain() {
+  std::vector<LogRing *> current, finished;
+  std::string lines, line;
+  char stamp[64];
+  struct tm tm;
+  time_t seconds;
+  int count, i;
+  const char **items;
+
+  Tcl_MutexLock(&lock);
+  current = rings;
+  Tcl_MutexUnlock(&lock);
+  for (std::vector<LogRing *>::const_iterator it = current.begin();
+       it != current.end(); ++it) {
+    LogRing *ring = *it;
+    // Closed first: then no message can follow the ones we see...
+    bool closed = ring->closed.load(std::memory_order_acquire);
+    unsigned long tail = ring->tail.load(std::memory_order_relaxed);
+    unsigned long head = ring->head.load(std::memory_order_acquire);
+    for (; tail != head; tail++) {
+      LogRecord &record = ring->records[tail % LogRing::SIZE];
+      seconds = record.time.sec;
+      localtime_r(&seconds, &tm);
+      line.clear();
+      if (syslog) {
+        strftime(stamp, sizeof(stamp), "%b %e %H:%M:%S", &tm);
+        snprintf(stamp + strlen(stamp), sizeof(stamp) - strlen(stamp),
+                 " ecap-tcl[%d]: ", (int) getpid());
+        line += '<';
+        line += std::to_string(8 + LogSeverities[record.level]);
+        line += '>';
+        line += stamp;
+      } else {
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        snprintf(stamp + strlen(stamp), sizeof(stamp) - strlen(stamp),
+                 ".%03ld ", record.time.usec / 1000);
+        line += stamp;
+      }
+      line += levels[record.level];
+      line += ' ';
+      line += ring->worker;
+      line += ' ';
+      appendText(line, record.message.c_str(), false);
+      if (!record.fields.empty() &&
+          Tcl_SplitList(NULL, record.fields.c_str(), &count, &items)
+            == TCL_OK) {
+        for (i = 0; i + 1 < count; i += 2) {
+          line += ' ';
+          appendText(line, items[i], false);
+          line += '=';
+          appendText(line, items[i + 1], true);
+        }
+        Tcl_Free((char *) items);
+      }
+      if (syslog) {
+        if (send(fd, line.data(), line.size(), 0) < 0) errors++;
+      } else {
+        lines += line;
+        lines += '\n';
+      }
+      written++;
+      // The record may be reused...
+      ring->tail.store(tail + 1, std::memory_order_release);
+    }
+    if (closed) finished.push_back(ring);
+  }
+  if (!lines.empty()) {
+    int out = fd >= 0 ? fd : 2;
+    const char *data = lines.data();
+    size_t size = lines.size();
+    while (size) {
+      ssize_t done = ::write(out, data, size);
+      if (done < 0 && errno == EINTR) continue;
+      if (done <= 0) {
+        errors++;
+        break;
+      }
+      data += done;
+      size -= done;
+    }
+  }
+  if (finished.empty()) return;
+  Tcl_MutexLock(&lock);
+  for (std::vector<LogRing *>::const_iterator it = finished.begin();
+       it != finished.end(); ++it) {
+    for (std::vector<LogRing *>::iterator r = rings.begin();
+         r != rings.end(); ++r) {
+      if (*r == *it) {
+        rings.erase(r);
+        break;
+      }
+    }
+    dropped += (*it)->dropped;
+    delete *it;
+  }
+  Tcl_MutexUnlock(&lock);
+}
+
+// The ring of an interpreter, created by its first message
+Adapter::LogRing *Adapter::Logger::ringOf(Tcl_Interp *interp) {
+  LogRing *ring = (LogRing *)
+    Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_LOG, NULL);
+  if (ring != NULL) return ring;
+  ring = new LogRing;
+  // Thread interpreters are numbered by their first message...
+  if (Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_POOL, NULL) == NULL) {
+    ring->worker = "main";
+  }
+  Tcl_MutexLock(&lock);
+  if (ring->worker.empty()) {
+    ring->worker = "worker-" + std::to_string(++WorkerCount);
+  }
+  rings.push_back(ring);
+  Tcl_MutexUnlock(&lock);
+  Tcl_SetAssocData(interp, TCLECAP_INTERP_KEY_LOG, detach, ring);
+  return ring;
+}
+
+// The interpreter is being deleted: the writer frees its ring, once
+// drained.
+void Adapter::Logger::detach(ClientData clientData, Tcl_Interp *interp) {
+  LogRing *ring = (LogRing *) clientData;
+  ring->closed.store(true, std::memory_order_release);
+}
+
+void Adapter::Logger::log(Tcl_Interp *interp, int level, Tcl_Obj *message,
+                          Tcl_Obj *fields) {
+  LogRing *ring = ringOf(interp);
+  unsigned long head = ring->head.load(std::memory_order_relaxed);
+  const char *text;
+  int length;
+  if (head - ring->tail.load(std::memory_order_acquire) >= LogRing::SIZE) {
+    // Full: the writer is behind...
+    ring->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  LogRecord &record = ring->records[head % LogRing::SIZE];
+  Tcl_GetTime(&record.time);
+  record.level = level;
+  text = Tcl_GetStringFromObj(message, &length);
+  record.message.assign(text, length);
+  if (fields) {
+    text = Tcl_GetStringFromObj(fields, &length);
+    record.fields.assign(text, length);
+  } else {
+    record.fields.clear();
+  }
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+Tcl_Obj *Adapter::Logger::toDict() {
+  Tcl_Obj *dict = Tcl_NewDictObj();
+  unsigned long lost = dropped;
+  std::string path;
+  Tcl_MutexLock(&lock);
+  for (std::vector<LogRing *>::const_iterator it = rings.begin();
+       it != rings.end(); ++it) {
+    lost += (*it)->dropped;
+  }
+  path = target;
+  Tcl_MutexUnlock(&lock);
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("level", -1),
+                 Tcl_NewStringObj(levels[threshold.load()], -1));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("target", -1),
+                 Tcl_NewStringObj(path.data(), path.size()));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("messages", -1),
+                 Tcl_NewWideIntObj(written.load()));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("dropped", -1),
+                 Tcl_NewWideIntObj(lost));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("filtered", -1),
+                 Tcl_NewWideIntObj(filtered.load()));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("errors", -1),
+                 Tcl_NewWideIntObj(errors.load()));
+  return dict;
+}
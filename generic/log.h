@@ -0,0 +1,86 @@
+/*
+ * log.h: The log of the eCAP Tcl adapter (::ecap-tcl::log). Each
+ * interpreter writes its messages to its own ring buffer, with a single
+ * producer (the thread of the interpreter) and a single consumer (the
+ * writer thread), so a worker never takes a lock, or waits for the output:
+ * when its ring is full, the message is dropped (and counted). The writer
+ * thread drains the rings every interval, formats the messages, and writes
+ * them to a file, to a syslog socket, or to stderr.
+ * Messages below the level of the log are discarded before anything is
+ * copied or formatted.
+ */
+#ifndef ECAPTCL_LOG_H
+#define ECAPTCL_LOG_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <tcl.h>
+
+namespace Adapter {
+
+struct LogRing;
+
+class Logger {
+  public:
+    enum Level {
+      LEVEL_DEBUG, LEVEL_INFO, LEVEL_NOTICE, LEVEL_WARNING, LEVEL_ERROR,
+      LEVELS_NUMBER
+    };
+    static const char *const levels[];
+
+    // The level of a name (-1: unknown)
+    static int levelOf(const std::string &name);
+
+    // (Re)opens the target (a path, syslog or syslog:<socket path>, empty:
+    // stderr), and starts the writer. Returns false, leaving an error
+    // message in error. The log is shared by the services of the process
+    // (the last one started sets the target): each successful start() must
+    // be matched by a stop(), and the last stop() writes what the rings
+    // hold, and stops the writer.
+    static bool start(const std::string &target, int level,
+                      std::string &error);
+    static void stop();
+
+    static bool enabled(int level) {
+      return level >= threshold.load(std::memory_order_relaxed);
+    }
+    // Queues a message (fields: a dict, or NULL) in the ring of interp.
+    // Must be called in the thread of interp.
+    static void log(Tcl_Interp *interp, int level, Tcl_Obj *message,
+                    Tcl_Obj *fields);
+    static void noteFiltered() {
+      filtered.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Returns a (zero reference count) dict with the state of the log
+    static Tcl_Obj *toDict();
+
+  private:
+    static void detach(ClientData clientData, Tcl_Interp *interp);
+    static LogRing *ringOf(Tcl_Interp *interp);
+    static Tcl_ThreadCreateType writer(ClientData clientData);
+    static void halt();
+    static void drain();
+    static void write(const std::string &line, int level);
+
+    static Tcl_Mutex                  control; // serialises start/stop
+    static Tcl_Mutex                  lock;    // guards the rest
+    static Tcl_Condition              wake;
+    static Tcl_ThreadId               thread;
+    static bool                       writing;
+    static unsigned int               users;   // the services started
+    static std::vector<LogRing *>     rings;
+    static std::string                target;
+    static int                        fd;      // -1: stderr
+    static bool                       syslog;
+    static std::atomic<int>           threshold;
+    static std::atomic<unsigned long> filtered;
+    static std::atomic<unsigned long> written;
+    static std::atomic<unsigned long> dropped; // by the deleted rings
+    static std::atomic<unsigned long> errors;
+};
+
+} // namespace Adapter
+
+#endif /* ECAPTCL_LOG_H */
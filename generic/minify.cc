@@ -0,0 +1,802 @@
+/*
+ * minify.cc: The native minifiers of the eCAP Tcl adapter. Each one is a
+ * state machine, fed the content a character at a time, so a construct may
+ * be split between chunks.
+ */
+
+#include <cctype>
+#include <cstring>
+#include <vector>
+#include "minify.h"
+
+/* The order must follow enum Language... */
+const char *const Adapter::Minifier::languages[] = {
+  "none", "html", "css", "js", NULL
+};
+
+/* The elements whose content is copied as it is, up to their end tag */
+static const char *const VerbatimElements[] = {
+  "pre", "textarea", "listing", "plaintext", "title", "xmp", "iframe",
+  "noembed", "noframes", NULL
+};
+
+/* The types of script elements minified as JavaScript */
+static const char *const ScriptTypes[] = {
+  "", "text/javascript", "application/javascript", "module",
+  "text/ecmascript", "application/ecmascript", "application/x-javascript",
+  "text/x-javascript", "text/jscript", NULL
+};
+
+/* JavaScript keywords after which a / starts a regular expression */
+static const char *const RegexKeywords[] = {
+  "return", "typeof", "instanceof", "in", "of", "new", "delete", "void",
+  "throw", "case", "do", "else", "yield", "await", NULL
+};
+
+static inline bool isSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}; /* isSpace */
+
+// strchr() finds the terminating NUL too...
+static inline bool oneOf(const char *set, char c) {
+  return c && strchr(set, c);
+}; /* oneOf */
+
+static bool isListed(const char *const names[], const std::string &name) {
+  for (int i = 0; names[i]; i++) {
+    if (name == names[i]) return true;
+  }
+  return false;
+}; /* isListed */
+
+// Characters of CSS identifiers (and numbers)
+static inline bool isCssWord(char c) {
+  return isalnum((unsigned char) c) || c == '-' || c == '_';
+}; /* isCssWord */
+
+// Characters of JavaScript identifiers, numbers and private names (and of
+// escapes, and non ASCII characters, which may be either)
+static inline bool isJsWord(char c) {
+  return isalnum((unsigned char) c) || c == '_' || c == '$' || c == '\\' ||
+         c == '#' || (unsigned char) c >= 0x80;
+}; /* isJsWord */
+
+// The type attribute of a start tag (as minified, in lower case), without
+// parameters: "" if there is none
+static std::string typeOf(const std::string &attributes) {
+  for (size_t at = attributes.find("type="); at != std::string::npos;
+       at = attributes.find("type=", at + 1)) {
+    if (at && !oneOf(" \"'", attributes[at - 1])) continue; // data-type=
+    size_t start = at + 5, end;
+    if (start < attributes.size() &&
+        (attributes[start] == '"' || attributes[start] == '\'')) {
+      end = attributes.find(attributes[start], start + 1);
+      start++;
+    } else {
+      end = attributes.find(' ', start);
+    }
+    std::string type = attributes.substr(start, end == std::string::npos ?
+                                                std::string::npos :
+                                                end - start);
+    type = type.substr(0, type.find(';'));
+    while (!type.empty() && isSpace(type[type.size() - 1]))
+      type.erase(type.size() - 1);
+    while (!type.empty() && isSpace(type[0])) type.erase(0, 1);
+    return type;
+  }
+  return "";
+}; /* typeOf */
+
+namespace Adapter {
+
+// Comments are removed (but /*! ... */), and whitespace is removed where
+// it separates nothing: around { } ; , > and after : and (. Whitespace
+// before : and ( is kept (a :hover, and (...) in media queries), and so is
+// the whitespace around + and - (calc()). A ; before } is removed.
+class CssMinifier: public Minifier {
+  public:
+    CssMinifier(): Minifier(CSS) {}
+
+  protected:
+    virtual void minify(const char *data, size_t size, std::string &out);
+    virtual void flush(std::string &out);
+
+  private:
+    enum State {
+      CODE, ESCAPE, SLASH, COMMENT_OPEN, COMMENT, COMMENT_STAR, STRING,
+      STRING_ESCAPE, URL, URL_STRING
+    };
+    void token(char c, std::string &out);
+
+    State state = CODE;
+    char  quote = 0;
+    char  last = 0;          // the last character of code sent out
+    bool  space = false;     // whitespace before the next one
+    bool  comment = false;   // a comment (it is not whitespace) before it
+    bool  semicolon = false; // a ; held (it is not needed before a })
+    bool  keep = false;      // the comment is kept
+    std::string word;        // the identifier before a (, for url(
+};
+
+// Comments are removed (but /*! ... */), and whitespace is removed where
+// it separates nothing. Line breaks are kept where automatic semicolon
+// insertion may depend on them: unless the line ends with a character
+// that needs more (i.e. an operator), or the next one starts with one that
+// continues it (i.e. a closing bracket). A / starts a regular expression
+// where an operand is expected (after an operator or a keyword).
+class JsMinifier: public Minifier {
+  public:
+    JsMinifier(): Minifier(JS) {}
+
+  protected:
+    virtual void minify(const char *data, size_t size, std::string &out);
+    virtual void flush(std::string &out);
+
+  private:
+    enum State {
+      CODE, SLASH, COMMENT_OPEN, COMMENT, COMMENT_STAR, LINE_COMMENT,
+      STRING, STRING_ESCAPE, REGEX, REGEX_ESCAPE, REGEX_CLASS,
+      REGEX_CLASS_ESCAPE, TEMPLATE, TEMPLATE_ESCAPE, TEMPLATE_DOLLAR
+    };
+    void token(char c, std::string &out);
+    bool regexAllowed() const;
+
+    State state = CODE;
+    char  quote = 0;
+    char  last = 0;          // the last character of code sent out...
+    char  before_last = 0;   // ... and the one before it (++ and --)
+    bool  space = false;     // whitespace (or a comment) before the next one
+    bool  newline = false;   // the whitespace has a line break
+    bool  keep = false;      // the comment is kept
+    std::string word;        // the identifier before a /, for keywords
+    std::vector<int> braces; // the { open in each ${ of template literals
+};
+
+// Comments are removed (but conditional comments), and runs of whitespace
+// in text are collapsed to a single character (a line break, if there was
+// one), which keeps inline elements apart. Tags lose the whitespace between
+// their attributes, but a single space. The content of pre, textarea (and
+// of the other elements in VerbatimElements) is copied as it is, and the
+// content of script and style elements goes through a JavaScript and CSS
+// minifier (unless their type is something else), up to their end tag.
+class HtmlMinifier: public Minifier {
+  public:
+    HtmlMinifier(): Minifier(HTML) {}
+    virtual ~HtmlMinifier() { delete embedded; }
+
+  protected:
+    virtual void minify(const char *data, size_t size, std::string &out);
+    virtual void flush(std::string &out);
+
+  private:
+    enum State {
+      TEXT, LT, BANG, BANG_DASH, COMMENT_OPEN, COMMENT, KEPT_COMMENT, DECL,
+      TAG_NAME, TAG, ATTRIBUTE_VALUE, RAW_TEXT
+    };
+    void text(std::string &out); // sends out the whitespace of the text
+    void startContent();         // after the > of a tag
+    size_t rawText(const char *data, size_t size, std::string &out);
+
+    State state = TEXT;
+    bool  space = false;        // whitespace in text...
+    bool  newline = false;      // ... with a line break
+    bool  tag_space = false;    // whitespace in a tag
+    bool  equals = false;       // after the = of an attribute
+    bool  closing = false;      // an end tag
+    bool  recording = false;    // the attributes of script and style
+    char  quote = 0;
+    int   dashes = 0;           // before the > of a comment
+    std::string name;           // of the tag, in lower case
+    std::string attributes;     // of a script or style start tag
+    std::string end_tag;        // i.e. </pre, ending the raw text
+    size_t      matched = 0;    // characters of end_tag found
+    std::string held;           // from embedded, while it may be end_tag
+    Minifier   *embedded = NULL; // minifies the content of script and style
+};
+
+} // namespace Adapter
+
+int Adapter::Minifier::languageOf(const std::string &name) {
+  for (int i = 0; languages[i]; i++) {
+    if (name == languages[i]) return i;
+  }
+  return -1;
+}
+
+Adapter::Minifier::Language
+Adapter::Minifier::languageOfMime(const std::string &mime) {
+  static const char *const scripts[] = {
+    "text/javascript", "application/javascript", "application/x-javascript",
+    "text/ecmascript", "application/ecmascript", NULL
+  };
+  if (mime == "text/html") return HTML;
+  if (mime == "text/css") return CSS;
+  if (isListed(scripts, mime)) return JS;
+  return NONE;
+}
+
+Adapter::Minifier *Adapter::Minifier::create(Language language) {
+  switch (language) {
+    case HTML: return new HtmlMinifier;
+    case CSS:  return new CssMinifier;
+    case JS:   return new JsMinifier;
+    case NONE:
+    case LANGUAGES_NUMBER:
+      break;
+  }
+  return NULL;
+}
+
+void Adapter::Minifier::feed(const char *data, size_t size,
+                             std::string &out) {
+  size_t before = out.size();
+  minify(data, size, out);
+  bytes_in += size;
+  bytes_out += out.size() - before;
+}
+
+void Adapter::Minifier::finish(std::string &out) {
+  size_t before = out.size();
+  flush(out);
+  bytes_out += out.size() - before;
+}
+
+/*
+ * CSS
+ */
+
+void Adapter::CssMinifier::minify(const char *data, size_t size,
+                                  std::string &out) {
+  size_t i = 0;
+  while (i < size) {
+    char c = data[i];
+    switch (state) {
+      case CODE:
+        if (isSpace(c)) {
+          space = true;
+        } else if (c == '/') {
+          state = SLASH;
+        } else if (c == ';') {
+          if (semicolon) out += ';';
+          semicolon = true;
+          space = false;
+          last = c;
+          word.clear();
+        } else if (c == '"' || c == '\'') {
+          token(c, out);
+          quote = c;
+          state = STRING;
+        } else if (c == '\\') {
+          token(c, out);
+          state = ESCAPE;
+        } else {
+          bool url = c == '(' && word == "url";
+          token(c, out);
+          // An unquoted URL may have anything but a )...
+          if (url) state = URL;
+        }
+        break;
+      case ESCAPE:
+        out += c;
+        last = c;
+        state = CODE;
+        break;
+      case SLASH:
+        if (c == '*') {
+          state = COMMENT_OPEN;
+          break;
+        }
+        token('/', out);
+        state = CODE;
+        continue;
+      case COMMENT_OPEN:
+        keep = c == '!';
+        if (keep) {
+          token('/', out);
+          out += '*';
+        }
+        state = COMMENT;
+        continue;
+      case COMMENT:
+        if (keep) out += c;
+        if (c == '*') state = COMMENT_STAR;
+        break;
+      case COMMENT_STAR:
+        if (keep) out += c;
+        if (c == '/') {
+          if (keep) last = c;
+          else comment = true;
+          state = CODE;
+        } else if (c != '*') {
+          state = COMMENT;
+        }
+        break;
+      case STRING:
+        out += c;
+        if (c == '\\') state = STRING_ESCAPE;
+        else if (c == quote) state = CODE;
+        break;
+      case STRING_ESCAPE:
+        out += c;
+        state = STRING;
+        break;
+      case URL:
+        out += c;
+        if (c == '"' || c == '\'') {
+          quote = c;
+          state = URL_STRING;
+        } else if (c == ')') {
+          last = c;
+          state = CODE;
+        }
+        break;
+      case URL_STRING:
+        out += c;
+        if (c == quote) state = URL;
+        break;
+    }
+    i++;
+  }
+}
+
+void Adapter::CssMinifier::flush(std::string &out) {
+  if (state == SLASH) token('/', out);
+  if (semicolon) out += ';';
+  semicolon = false;
+}
+
+void Adapter::CssMinifier::token(char c, std::string &out) {
+  bool separated = space;
+  if (semicolon) {
+    if (c != '}') out += ';';
+    semicolon = false;
+  } else if (space && last && !oneOf("{};,>:(", last) &&
+             !oneOf("{};,>)!", c)) {
+    out += ' ';
+  } else if (comment && isCssWord(last) && isCssWord(c)) {
+    // a/**/b is not the identifier ab
+    out += ' ';
+  }
+  space = comment = false;
+  if (!isCssWord(c)) {
+    word.clear();
+  } else {
+    if (separated || !isCssWord(last)) word.clear();
+    if (word.size() < 8) word += tolower((unsigned char) c);
+  }
+  out += c;
+  last = c;
+}
+
+/*
+ * JavaScript
+ */
+
+void Adapter::JsMinifier::minify(const char *data, size_t size,
+                                 std::string &out) {
+  size_t i = 0;
+  while (i < size) {
+    char c = data[i];
+    switch (state) {
+      case CODE:
+        if (isSpace(c)) {
+          space = true;
+          if (c == '\n' || c == '\r') newline = true;
+        } else if (c == '/') {
+          state = SLASH;
+        } else if (c == '"' || c == '\'' || c == '`') {
+          token(c, out);
+          quote = c;
+          state = c == '`' ? TEMPLATE : STRING;
+        } else {
+          bool closes = false;
+          if (c == '{' && !braces.empty()) {
+            braces.back()++;
+          } else if (c == '}' && !braces.empty()) {
+            // The end of the ${...} of a template literal?
+            closes = braces.back() == 0;
+            if (closes) braces.pop_back();
+            else braces.back()--;
+          }
+          token(c, out);
+          if (closes) state = TEMPLATE;
+        }
+        break;
+      case SLASH:
+        if (c == '/') {
+          state = LINE_COMMENT;
+          break;
+        }
+        if (c == '*') {
+          state = COMMENT_OPEN;
+          break;
+        }
+        state = regexAllowed() ? REGEX : CODE;
+        token('/', out);
+        continue;
+      case COMMENT_OPEN:
+        keep = c == '!';
+        if (keep) {
+          token('/', out);
+          out += '*';
+        }
+        state = COMMENT;
+        continue;
+      case COMMENT:
+      case COMMENT_STAR:
+        if (keep) {
+          out += c;
+        } else if (c == '\n' || c == '\r') {
+          // A comment with a line break is a line break...
+          newline = true;
+        }
+        if (c == '/' && state == COMMENT_STAR) {
+          if (keep) last = c;
+          else space = true;
+          state = CODE;
+        } else {
+          state = c == '*' ? COMMENT_STAR : COMMENT;
+        }
+        break;
+      case LINE_COMMENT:
+        if (c == '\n' || c == '\r') {
+          state = CODE;
+          continue;
+        }
+        break;
+      case STRING:
+        out += c;
+        if (c == '\\') state = STRING_ESCAPE;
+        else if (c == quote) state = CODE;
+        break;
+      case STRING_ESCAPE:
+        out += c;
+        state = STRING;
+        break;
+      case REGEX:
+      case REGEX_CLASS:
+        out += c;
+        last = c;
+        if (c == '\\') {
+          state = state == REGEX ? REGEX_ESCAPE : REGEX_CLASS_ESCAPE;
+        } else if (c == '\n' || c == '\r') {
+          // Not a regular expression, after all: there is no harm done
+          state = CODE;
+        } else if (state == REGEX_CLASS) {
+          if (c == ']') state = REGEX;
+        } else if (c == '[') {
+          state = REGEX_CLASS;
+        } else if (c == '/') {
+          state = CODE;
+        }
+        break;
+      case REGEX_ESCAPE:
+      case REGEX_CLASS_ESCAPE:
+        out += c;
+        last = c;
+        state = state == REGEX_ESCAPE ? REGEX : REGEX_CLASS;
+        break;
+      case TEMPLATE:
+        out += c;
+        if (c == '\\') {
+          state = TEMPLATE_ESCAPE;
+        } else if (c == '$') {
+          state = TEMPLATE_DOLLAR;
+        } else if (c == '`') {
+          last = c;
+          state = CODE;
+        }
+        break;
+      case TEMPLATE_ESCAPE:
+        out += c;
+        state = TEMPLATE;
+        break;
+      case TEMPLATE_DOLLAR:
+        state = TEMPLATE;
+        if (c != '{') continue;
+        // The expression is code, up to its }...
+        out += c;
+        last = c;
+        word.clear();
+        braces.push_back(0);
+        state = CODE;
+        break;
+    }
+    i++;
+  }
+}
+
+void Adapter::JsMinifier::flush(std::string &out) {
+  if (state == SLASH) token('/', out);
+  state = CODE;
+}
+
+bool Adapter::JsMinifier::regexAllowed() const {
+  if (!last || oneOf("(,=:[!&|?{};*%<>~^", last)) return true;
+  // a + /x/, but not a++ / 2
+  if (last == '+' || last == '-') return before_last != last;
+  for (int i = 0; RegexKeywords[i]; i++) {
+    if (word == RegexKeywords[i]) return true;
+  }
+  return false;
+}
+
+void Adapter::JsMinifier::token(char c, std::string &out) {
+  bool separated = space;
+  if (space && last) {
+    if (newline && !oneOf("{([,;:=&|?<>*%~^!", last) &&
+        !oneOf(")]},;.?:", c)) {
+      out += '\n';
+    } else if ((isJsWord(last) && isJsWord(c)) ||
+               // a + +b, a - -b, a / /x/
+               (last == c && oneOf("+-/", c)) ||
+               // a < !--b (an HTML comment), a < /script/ (an end tag)
+               (last == '<' && oneOf("!/", c)) ||
+               // 1 .toString()
+               (isdigit((unsigned char) last) && c == '.')) {
+      out += ' ';
+    }
+  }
+  space = newline = false;
+  if (!isJsWord(c)) {
+    word.clear();
+  } else {
+    if (separated || !isJsWord(last)) word.clear();
+    if (word.size() < 12) word += c;
+  }
+  out += c;
+  before_last = last;
+  last = c;
+}
+
+/*
+ * HTML
+ */
+
+void Adapter::HtmlMinifier::minify(const char *data, size_t size,
+                                   std::string &out) {
+  size_t i = 0;
+  while (i < size) {
+    char c = data[i];
+    switch (state) {
+      case TEXT:
+        if (isSpace(c)) {
+          space = true;
+          if (c == '\n') newline = true;
+        } else if (c == '<') {
+          state = LT;
+        } else {
+          text(out);
+          out += c;
+        }
+        break;
+      case LT:
+        if (isalpha((unsigned char) c) || c == '/') {
+          text(out);
+          out += '<';
+          out += c;
+          closing = c == '/';
+          name.clear();
+          if (!closing) name += tolower((unsigned char) c);
+          state = TAG_NAME;
+          break;
+        }
+        if (c == '!') {
+          state = BANG;
+          break;
+        }
+        text(out);
+        out += '<';
+        if (c == '?') {
+          out += c;
+          state = DECL;
+          break;
+        }
+        // Not markup (i.e. a < b)...
+        state = TEXT;
+        continue;
+      case BANG:
+        if (c == '-') {
+          state = BANG_DASH;
+          break;
+        }
+        text(out);
+        out += "<!";
+        state = DECL;
+        continue;
+      case BANG_DASH:
+        if (c == '-') {
+          state = COMMENT_OPEN;
+          break;
+        }
+        text(out);
+        out += "<!-";
+        state = DECL;
+        continue;
+      case COMMENT_OPEN:
+        // Conditional comments (<!--[if IE]>) and <!--! ... --> are kept
+        dashes = 2; // <!--> ends the comment
+        if (c == '[' || c == '!') {
+          text(out);
+          out += "<!--";
+          state = KEPT_COMMENT;
+        } else {
+          state = COMMENT;
+        }
+        continue;
+      case COMMENT:
+      case KEPT_COMMENT:
+        if (state == KEPT_COMMENT) out += c;
+        if (c == '-') {
+          dashes++;
+        } else if (c == '>' && dashes >= 2) {
+          state = TEXT;
+        } else {
+          dashes = 0;
+        }
+        break;
+      case DECL:
+        out += c;
+        if (c == '>') state = TEXT;
+        break;
+      case TAG_NAME:
+        if (isalnum((unsigned char) c) || c == '-' || c == ':') {
+          out += c;
+          if (name.size() < 16) name += tolower((unsigned char) c);
+          break;
+        }
+        tag_space = equals = false;
+        recording = !closing && (name == "script" || name == "style");
+        attributes.clear();
+        state = TAG;
+        continue;
+      case TAG:
+        if (isSpace(c)) {
+          tag_space = true;
+          break;
+        }
+        if (c == '>') {
+          out += c;
+          startContent();
+          break;
+        }
+        if (c == '=') {
+          tag_space = false;
+          equals = true;
+        } else {
+          if (tag_space && !equals) {
+            out += ' ';
+            if (recording) attributes += ' ';
+          }
+          tag_space = false;
+          if ((c == '"' || c == '\'') && equals) {
+            quote = c;
+            state = ATTRIBUTE_VALUE;
+          }
+          equals = false;
+        }
+        out += c;
+        if (recording && attributes.size() < 1024)
+          attributes += tolower((unsigned char) c);
+        break;
+      case ATTRIBUTE_VALUE:
+        out += c;
+        if (recording && attributes.size() < 1024)
+          attributes += tolower((unsigned char) c);
+        if (c == quote) state = TAG;
+        break;
+      case RAW_TEXT:
+        i += rawText(data + i, size - i, out);
+        continue;
+    }
+    i++;
+  }
+}
+
+void Adapter::HtmlMinifier::flush(std::string &out) {
+  switch (state) {
+    case LT:
+      text(out);
+      out += '<';
+      break;
+    case BANG:
+      text(out);
+      out += "<!";
+      break;
+    case BANG_DASH:
+      text(out);
+      out += "<!-";
+      break;
+    case RAW_TEXT:
+      if (embedded) {
+        embedded->feed(held.data(), held.size(), out);
+        embedded->finish(out);
+        delete embedded;
+        embedded = NULL;
+      }
+      break;
+    default:
+      break;
+  }
+  held.clear();
+  text(out);
+  state = TEXT;
+}
+
+void Adapter::HtmlMinifier::text(std::string &out) {
+  if (!space) return;
+  out += newline ? '\n' : ' ';
+  space = newline = false;
+}
+
+void Adapter::HtmlMinifier::startContent() {
+  Language language = NONE;
+  state = TEXT;
+  if (closing) return;
+  if (name == "script") {
+    if (isListed(ScriptTypes, typeOf(attributes))) language = JS;
+  } else if (name == "style") {
+    std::string type = typeOf(attributes);
+    if (type.empty() || type == "text/css") language = CSS;
+  } else if (!isListed(VerbatimElements, name)) {
+    return;
+  }
+  // script and style of other types are copied as they are...
+  state = RAW_TEXT;
+  end_tag = "</" + name;
+  matched = 0;
+  held.clear();
+  embedded = create(language);
+}
+
+// Copies the content of a raw text element (or passes it to embedded) up
+// to its end tag, where the state becomes TAG. The start of what may be
+// the end tag is held from embedded until it is known. Returns the size of
+// the data consumed.
+size_t Adapter::HtmlMinifier::rawText(const char *data, size_t size,
+                                      std::string &out) {
+  size_t i = 0;
+  while (i < size) {
+    char c = data[i];
+    if (matched == end_tag.size()) {
+      // </pre is the end tag if the name ends there (not i.e. </prefix)
+      if (isSpace(c) || c == '/' || c == '>') {
+        if (embedded) {
+          embedded->finish(out);
+          delete embedded;
+          embedded = NULL;
+          out += held;
+        }
+        held.clear();
+        name = end_tag.substr(2);
+        closing = true;
+        recording = tag_space = equals = false;
+        state = TAG;
+        return i;
+      }
+      if (embedded) embedded->feed(held.data(), held.size(), out);
+      held.clear();
+      matched = 0;
+    }
+    if (!matched && c != '<') {
+      const char *lt = (const char *) memchr(data + i, '<', size - i);
+      size_t n = lt ? lt - (data + i) : size - i;
+      if (embedded) embedded->feed(data + i, n, out);
+      else out.append(data + i, n);
+      i += n;
+      continue;
+    }
+    if (tolower((unsigned char) c) == end_tag[matched]) {
+      if (embedded) held += c;
+      else out += c;
+      matched++;
+      i++;
+      continue;
+    }
+    // Not the end tag, after all: c may start it (<</pre>)...
+    if (embedded) embedded->feed(held.data(), held.size(), out);
+    held.clear();
+    matched = 0;
+  }
+  return i;
+}
@@ -0,0 +1,61 @@
+/*
+ * minify.h: The native minifiers of the eCAP Tcl adapter (minify, and
+ * ::ecap-tcl::action content minify). A minifier removes comments and
+ * collapses whitespace in HTML, CSS or JavaScript, as the adapted content
+ * goes to the host, without buffering the body: only what may start a
+ * construct (i.e. "<!-" or "/") is held until the next chunk.
+ * Minifying never changes what the content means: strings, regular
+ * expressions and template literals are copied as they are, and so is the
+ * content of pre, textarea (and similar) elements; the content of script and
+ * style elements is minified as JavaScript and CSS.
+ */
+#ifndef ECAPTCL_MINIFY_H
+#define ECAPTCL_MINIFY_H
+
+#include <string>
+
+namespace Adapter {
+
+class Minifier {
+  public:
+    enum Language { NONE, HTML, CSS, JS, LANGUAGES_NUMBER };
+    static const char *const languages[];
+
+    // The index of a name in languages, -1: unknown
+    static int languageOf(const std::string &name);
+    // The language of a MIME type (lower case, without parameters), NONE if
+    // it has to be configured (i.e. application/json:js)
+    static Language languageOfMime(const std::string &mime);
+    // Returns NULL for NONE
+    static Minifier *create(Language language);
+
+    virtual ~Minifier() {}
+
+    Language language() const { return minifier_language; }
+
+    // Appends the minified chunk to out
+    void feed(const char *data, size_t size, std::string &out);
+    // At the end of the content: appends to out anything held.
+    void finish(std::string &out);
+
+    size_t bytesIn() const { return bytes_in; }
+    size_t bytesOut() const { return bytes_out; }
+
+  protected:
+    Minifier(Language l): minifier_language(l) {}
+
+    virtual void minify(const char *data, size_t size, std::string &out) = 0;
+    virtual void flush(std::string &out) = 0;
+
+  private:
+    Minifier(const Minifier &);
+    Minifier &operator =(const Minifier &);
+
+    Language minifier_language;
+    size_t   bytes_in = 0;
+    size_t   bytes_out = 0;
+};
+
+} // namespace Adapter
+
+#endif /* ECAPTCL_MINIFY_H */
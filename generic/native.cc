@@ -0,0 +1,276 @@
+/*
+ * native.cc: The native (C++) processors of the eCAP Tcl adapter.
+ */
+
+#include <sstream>
+#include <strings.h>
+#include "ecap-tcl.h"
+
+std::shared_ptr<const Adapter::NativeProcessors>
+  Adapter::NativeProcessors::installed;
+
+void Adapter::NativeProcessors::add(const NativeProcessorPtr &processor,
+                                    const std::string &mime) {
+  if (!processor) return;
+  std::string type(mime);
+  for (std::string::size_type i = 0; i < type.size(); ++i)
+    type[i] = tolower(type[i]);
+  mimes[type] = processor;
+  for (std::vector<NativeProcessorPtr>::const_iterator it =
+         processors.begin(); it != processors.end(); ++it) {
+    if (*it == processor) return;
+  }
+  processors.push_back(processor);
+}
+
+bool Adapter::NativeProcessors::load(Tcl_Interp *interp,
+                                     const std::string &paths,
+                                     std::string &error) {
+  static const char *const symbols[] = {ECAPTCL_NATIVE_INIT, NULL};
+  std::istringstream list(paths);
+  std::string path;
+  while (std::getline(list, path, ',')) {
+    if (path.empty()) continue;
+    EcapTcl_NativeInitProc *init[1] = {NULL};
+    Tcl_LoadHandle handle;
+    Tcl_Obj *pathObj = Tcl_NewStringObj(path.data(), path.size());
+    int status;
+    Tcl_IncrRefCount(pathObj);
+    // The shared object is never unloaded: its processors live as long as
+    // the transactions using them...
+    status = Tcl_LoadFile(interp, pathObj, symbols, 0, (void *) init,
+                          &handle);
+    Tcl_DecrRefCount(pathObj);
+    if (status != TCL_OK) {
+      error = path + ": " + Tcl_GetStringResult(interp);
+      Tcl_ResetResult(interp);
+      return false;
+    }
+    const char *message = init[0](ECAPTCL_NATIVE_API_VERSION, this);
+    if (message != NULL) {
+      error = path + ": " + message;
+      return false;
+    }
+  }
+  return true;
+}
+
+Adapter::NativeProcessorPtr
+Adapter::NativeProcessors::processorFor(const std::string &mime) const {
+  std::map<std::string, NativeProcessorPtr>::const_iterator it;
+  if (mimes.empty() || mime.empty()) return NativeProcessorPtr();
+  it = mimes.find(mime);
+  if (it != mimes.end()) return it->second;
+  std::string::size_type slash = mime.find('/');
+  if (slash == std::string::npos) return NativeProcessorPtr();
+  it = mimes.find(mime.substr(0, slash) + "/*");
+  return it != mimes.end() ? it->second : NativeProcessorPtr();
+}
+
+Adapter::NativeProcessorPtr
+Adapter::NativeProcessors::processorNamed(const std::string &name) const {
+  for (std::vector<NativeProcessorPtr>::const_iterator it =
+         processors.begin(); it != processors.end(); ++it) {
+    if ((*it)->name() == name) return *it;
+  }
+  return NativeProcessorPtr();
+}
+
+EcapTcl::NativeVerdict
+Adapter::NativeProcessors::wantsUrl(const char *url) const {
+  for (std::vector<NativeProcessorPtr>::const_iterator it =
+         processors.begin(); it != processors.end(); ++it) {
+    EcapTcl::NativeVerdict verdict = (*it)->wantsUrl(url);
+    if (verdict != EcapTcl::NATIVE_UNDECIDED) return verdict;
+  }
+  return EcapTcl::NATIVE_UNDECIDED;
+}
+
+Tcl_Obj *Adapter::NativeProcessors::toDict() const {
+  Tcl_Obj *dict = Tcl_NewDictObj(), *types;
+  for (std::vector<NativeProcessorPtr>::const_iterator it =
+         processors.begin(); it != processors.end(); ++it) {
+    std::string name = (*it)->name();
+    types = Tcl_NewListObj(0, NULL);
+    for (std::map<std::string, NativeProcessorPtr>::const_iterator m =
+           mimes.begin(); m != mimes.end(); ++m) {
+      if (m->second != *it) continue;
+      Tcl_ListObjAppendElement(NULL, types,
+        Tcl_NewStringObj(m->first.data(), m->first.size()));
+    }
+    Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj(name.data(), name.size()),
+                   types);
+  }
+  return dict;
+}
+
+Adapter::NativeProcessorsPtr Adapter::NativeProcessors::current() {
+  NativeProcessorsPtr set = std::atomic_load(&installed);
+  if (!set) {
+    // Nothing loaded yet: an empty set...
+    static const NativeProcessorsPtr empty =
+      std::make_shared<const NativeProcessors>();
+    return empty;
+  }
+  return set;
+}
+
+void Adapter::NativeProcessors::install(const NativeProcessorsPtr &set) {
+  std::atomic_store(&installed, set);
+}
+
+Adapter::NativeBinding::NativeBinding(const NativeProcessorPtr &processor,
+                                      Xaction *anAction):
+    native_processor(processor), action(anAction),
+    message_uri(anAction->getUri().toString()),
+    message_mime(anAction->mime()) {
+}
+
+Adapter::NativeBinding::NativeBinding(const NativeProcessorPtr &processor,
+                                      const std::string &mime):
+    native_processor(processor), action(NULL), message_mime(mime) {
+}
+
+Adapter::NativeBinding::~NativeBinding() {
+  delete native_action;
+}
+
+// The code of a call: a processor may fail by returning false, by
+// reporting it, or by throwing an exception.
+int Adapter::NativeBinding::outcome(bool ok) {
+  if (blocked) return ECAPTCL_BLOCK;
+  if (!ok && !call_failed) failed("");
+  return call_failed ? TCL_ERROR : TCL_OK;
+}
+
+int Adapter::NativeBinding::start() {
+  starting = true;
+  call_failed = false;
+  try {
+    native_action = native_processor->actionStart(*this);
+  } catch (const std::exception &e) {
+    failed(e.what());
+  } catch (...) {
+    failed("unknown exception");
+  }
+  starting = false;
+  if (native_action == NULL && !call_failed && !blocked) return TCL_BREAK;
+  return outcome(true);
+}
+
+int Adapter::NativeBinding::contentAdapt(std::string &chunk) {
+  bool ok = false;
+  if (native_action == NULL) return TCL_ERROR;
+  call_failed = false;
+  try {
+    // The chunk is left unmodified, if the processor fails (the buffer of
+    // the output is reused by the next call)...
+    output.clear();
+    ok = native_action->contentAdapt(*this, chunk.data(), chunk.size(),
+                                     output);
+    if (ok) chunk.swap(output);
+  } catch (const std::exception &e) {
+    failed(e.what());
+  } catch (...) {
+    failed("unknown exception");
+  }
+  return outcome(ok);
+}
+
+int Adapter::NativeBinding::contentDone(bool atEnd, std::string &chunk) {
+  bool ok = false;
+  if (native_action == NULL) return TCL_ERROR;
+  call_failed = false;
+  try {
+    output.clear();
+    ok = native_action->contentDone(*this, atEnd, chunk.data(), chunk.size(),
+                                    output);
+    if (ok) chunk.swap(output);
+  } catch (const std::exception &e) {
+    failed(e.what());
+  } catch (...) {
+    failed("unknown exception");
+  }
+  return outcome(ok);
+}
+
+int Adapter::NativeBinding::stop() {
+  if (native_action == NULL) return TCL_OK;
+  call_failed = false;
+  try {
+    native_action->actionStop(*this);
+  } catch (const std::exception &e) {
+    failed(e.what());
+  } catch (...) {
+    failed("unknown exception");
+  }
+  delete native_action;
+  native_action = NULL;
+  blocked = false; // the message has been sent
+  return outcome(true);
+}
+
+const std::string &Adapter::NativeBinding::uri() const {
+  return message_uri;
+}
+
+const std::string &Adapter::NativeBinding::mime() const {
+  return message_mime;
+}
+
+bool Adapter::NativeBinding::header(const std::string &name,
+                                    std::string &value) const {
+  if (action == NULL) {
+    std::map<std::string, std::string>::const_iterator it =
+      headers.find(name);
+    if (it == headers.end()) return false;
+    value = it->second;
+    return true;
+  }
+  const libecap::Name header(name);
+  if (!action->adapted().header().hasAny(header)) return false;
+  value = action->adapted().header().value(header).toString();
+  return true;
+}
+
+void Adapter::NativeBinding::setHeader(const std::string &name,
+                                       const std::string &value) {
+  if (action == NULL) {
+    headers[name] = value;
+    return;
+  }
+  const libecap::Name header(name);
+  action->adapted().header().removeAny(header);
+  action->adapted().header().add(header,
+    libecap::Area::FromTempString(value));
+}
+
+void Adapter::NativeBinding::removeHeader(const std::string &name) {
+  if (action == NULL) {
+    headers.erase(name);
+    return;
+  }
+  action->adapted().header().removeAny(libecap::Name(name));
+}
+
+void Adapter::NativeBinding::setMeta(const std::string &name,
+                                     const std::string &value) {
+  // The names of the adapter are reserved (see ::ecap-tcl::action meta)...
+  if (action && strncasecmp(name.c_str(), "X-Ecap-Tcl", 10) != 0) {
+    action->setMeta(name, value);
+  }
+}
+
+bool Adapter::NativeBinding::wholeBody() {
+  return starting && action && action->setWholeBody(true);
+}
+
+void Adapter::NativeBinding::block() {
+  blocked = true;
+}
+
+void Adapter::NativeBinding::failed(const std::string &reason) {
+  failure = reason.empty() ? native_processor->name() + " failed" : reason;
+  call_failed = true;
+  if (action) action->processorFailed(failure);
+}
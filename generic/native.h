@@ -0,0 +1,114 @@
+/*
+ * native.h: The native (C++) processors of the eCAP Tcl adapter, loaded
+ * from the shared objects named by native_processors (see
+ * ecap-tcl-native.h, the interface of the processors). The processors are
+ * registered by MIME type, and are tried before the Tcl processors: a
+ * transaction adapted by a native processor makes no Tcl call.
+ * Like the tables of shared.h, the set of processors is immutable, and is
+ * replaced as a whole (when the service starts), so the host thread and
+ * the interpreters (see ::ecap-tcl::native) use it without locking.
+ */
+#ifndef ECAPTCL_NATIVE_H
+#define ECAPTCL_NATIVE_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <tcl.h>
+#include "ecap-tcl-native.h"
+
+namespace Adapter {
+
+class Xaction;
+
+typedef std::shared_ptr<EcapTcl::NativeProcessor> NativeProcessorPtr;
+
+class NativeProcessors: public EcapTcl::NativeRegistry {
+  public:
+    virtual void add(const NativeProcessorPtr &processor,
+                     const std::string &mime);
+
+    // Loads the shared objects of a comma separated list of paths, and
+    // registers their processors. Returns false, leaving an error message
+    // in error.
+    bool load(Tcl_Interp *interp, const std::string &paths,
+              std::string &error);
+
+    // The processor of a MIME type (or type/*), or of a name
+    NativeProcessorPtr processorFor(const std::string &mime) const;
+    NativeProcessorPtr processorNamed(const std::string &name) const;
+    // The verdict of the first processor having one
+    EcapTcl::NativeVerdict wantsUrl(const char *url) const;
+    size_t size() const { return processors.size(); }
+    // Returns a (zero reference count) dict: the MIME types of each
+    // processor
+    Tcl_Obj *toDict() const;
+
+    // The processors in use (never NULL), and their replacement
+    static std::shared_ptr<const NativeProcessors> current();
+    static void install(const std::shared_ptr<const NativeProcessors> &set);
+
+  private:
+    std::map<std::string, NativeProcessorPtr> mimes;
+    std::vector<NativeProcessorPtr>           processors; // each once
+
+    static std::shared_ptr<const NativeProcessors> installed;
+};
+
+typedef std::shared_ptr<const NativeProcessors> NativeProcessorsPtr;
+
+// The adaptation of a message by a native processor: the message of a
+// transaction, or a detached one (only a MIME type, and headers nobody
+// sees), adapted by ::ecap-tcl::native adapt.
+// The calls return TCL_OK, TCL_ERROR (the processor failed: error has the
+// reason), TCL_BREAK (start: the processor does not adapt the message) or
+// ECAPTCL_BLOCK.
+class NativeBinding: public EcapTcl::NativeMessage {
+  public:
+    NativeBinding(const NativeProcessorPtr &processor, Xaction *action);
+    NativeBinding(const NativeProcessorPtr &processor,
+                  const std::string &mime);
+    virtual ~NativeBinding();
+
+    int start();
+    int contentAdapt(std::string &chunk);
+    int contentDone(bool atEnd, std::string &chunk);
+    int stop();
+
+    const NativeProcessorPtr &processor() const { return native_processor; }
+    const std::string &error() const { return failure; }
+
+    // EcapTcl::NativeMessage
+    virtual const std::string &uri() const;
+    virtual const std::string &mime() const;
+    virtual bool header(const std::string &name, std::string &value) const;
+    virtual void setHeader(const std::string &name, const std::string &value);
+    virtual void removeHeader(const std::string &name);
+    virtual void setMeta(const std::string &name, const std::string &value);
+    virtual bool wholeBody();
+    virtual void block();
+    virtual void failed(const std::string &reason);
+
+  private:
+    NativeBinding(const NativeBinding &);
+    NativeBinding &operator =(const NativeBinding &);
+
+    int outcome(bool ok);
+
+    NativeProcessorPtr     native_processor;
+    EcapTcl::NativeAction *native_action = NULL;
+    Xaction               *action;   // NULL: a detached message...
+    std::string            message_uri;
+    std::string            message_mime;
+    std::map<std::string, std::string> headers; // ... and its headers
+    std::string            failure;
+    std::string            output;   // of the content calls
+    bool                   starting = false;
+    bool                   call_failed = false;
+    bool                   blocked = false;
+};
+
+} // namespace Adapter
+
+#endif /* ECAPTCL_NATIVE_H */
@@ -0,0 +1,133 @@
+/*
+ * pool.cc: Memory recycled by the eCAP Tcl adapter.
+ */
+
+#include <new>
+#include <vector>
+#include "pool.h"
+
+/* The buffers kept per thread, and their sizes: a smaller buffer is not
+ * worth keeping, and a larger one would inflate the resident memory. The
+ * buffers are kept by size class (powers of two from MinPooledBytes), and
+ * up to MaxPooledTotal bytes per thread. */
+static const size_t MinPooledBytes   = 1024;
+static const size_t MaxPooledBytes   = 1024 * 1024;
+static const size_t PooledClasses    = 11; // 1KB to 1MB
+static const size_t MaxClassBuffers  = 16;
+static const size_t MaxPooledTotal   = 4 * 1024 * 1024;
+
+typedef std::vector<std::string> BufferList;
+
+struct ThreadBuffers {
+  BufferList classes[PooledClasses]; // class k: at least MinPooledBytes << k
+  size_t     bytes = 0;
+};
+
+typedef struct ThreadSpecificData {
+  ThreadBuffers *buffers;
+} ThreadSpecificData;
+static Tcl_ThreadDataKey dataKey;
+
+static void deleteBuffers(ClientData clientData) {
+  ThreadSpecificData *tsdPtr = (ThreadSpecificData *) clientData;
+  delete tsdPtr->buffers;
+  tsdPtr->buffers = NULL;
+}; /* deleteBuffers */
+
+static ThreadBuffers &threadBuffers() {
+  ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
+    Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
+  if (tsdPtr->buffers == NULL) {
+    tsdPtr->buffers = new ThreadBuffers;
+    Tcl_CreateThreadExitHandler(deleteBuffers, tsdPtr);
+  }
+  return *tsdPtr->buffers;
+}; /* threadBuffers */
+
+/* The class of a buffer: the largest whose size it holds */
+static size_t classOf(size_t capacity) {
+  size_t k = 0;
+  while (k + 1 < PooledClasses && (MinPooledBytes << (k + 1)) <= capacity) k++;
+  return k;
+}; /* classOf */
+
+// A buffer is taken from the class of size (if it is large enough), or
+// from the next two: a small request never takes a large buffer.
+bool Adapter::BufferPool::take(std::string &s, size_t size) {
+  ThreadBuffers &buffers = threadBuffers();
+  if (size <= MaxPooledBytes) {
+    size_t k = classOf(size);
+    for (size_t c = k; c < PooledClasses && c <= k + 2; c++) {
+      BufferList &list = buffers.classes[c];
+      // The most recently given buffers first, as their memory is warm...
+      for (BufferList::size_type i = list.size(); i > 0; i--) {
+        if (list[i - 1].capacity() < size) continue;
+        s.swap(list[i - 1]);
+        if (i < list.size()) list[i - 1].swap(list.back());
+        list.pop_back();
+        buffers.bytes -= s.capacity();
+        return true;
+      }
+    }
+  }
+  s.reserve(size);
+  return false;
+}
+
+bool Adapter::BufferPool::give(std::string &s) {
+  ThreadBuffers &buffers = threadBuffers();
+  size_t capacity = s.capacity();
+  BufferList *list = NULL;
+  if (capacity >= MinPooledBytes && capacity <= MaxPooledBytes &&
+      buffers.bytes + capacity <= MaxPooledTotal) {
+    list = &buffers.classes[classOf(capacity)];
+    if (list->size() >= MaxClassBuffers) list = NULL;
+  }
+  if (list == NULL) {
+    std::string().swap(s);
+    return false;
+  }
+  s.clear();
+  list->push_back(std::string());
+  list->back().swap(s);
+  buffers.bytes += capacity;
+  return true;
+}
+
+size_t Adapter::BufferPool::size() {
+  ThreadBuffers &buffers = threadBuffers();
+  size_t count = 0;
+  for (size_t k = 0; k < PooledClasses; k++) {
+    count += buffers.classes[k].size();
+  }
+  return count;
+}
+
+Adapter::BlockPool::BlockPool(size_t size, size_t max):
+  block_size(size < sizeof(Block) ? sizeof(Block) : size), max_blocks(max) {
+}
+
+void *Adapter::BlockPool::take() {
+  Block *block;
+  Tcl_MutexLock(&lock);
+  if ((block = free) != NULL) {
+    free = block->next;
+    count--;
+  }
+  Tcl_MutexUnlock(&lock);
+  if (block) return block;
+  return ::operator new(block_size);
+}
+
+void Adapter::BlockPool::give(void *block) {
+  if (block == NULL) return;
+  Tcl_MutexLock(&lock);
+  if (count < max_blocks) {
+    ((Block *) block)->next = free;
+    free = (Block *) block;
+    count++;
+    block = NULL;
+  }
+  Tcl_MutexUnlock(&lock);
+  if (block) ::operator delete(block);
+}
@@ -0,0 +1,52 @@
+/*
+ * pool.h: Memory recycled by the eCAP Tcl adapter, instead of going back to
+ * the allocator after each transaction: the blocks of the transactions
+ * themselves, and the buffers of their content (vb coalesced or buffered,
+ * and ab waiting for the host). A thread keeps its own buffers, so taking
+ * and giving back a buffer does not lock.
+ */
+#ifndef ECAPTCL_POOL_H
+#define ECAPTCL_POOL_H
+
+#include <string>
+#include <tcl.h>
+
+namespace Adapter {
+
+class BufferPool {
+  public:
+    // Gives s (which must be empty) a buffer of at least size bytes, reusing
+    // one of the buffers of the calling thread if possible. Returns false
+    // if the buffer had to be allocated.
+    static bool take(std::string &s, size_t size);
+    // Keeps the memory of s (which is left empty) for the next take().
+    // Returns false if it has been freed instead (too small or too large,
+    // or the pool of the thread is full).
+    static bool give(std::string &s);
+    // The buffers kept by the calling thread
+    static size_t size();
+};
+
+/* A free list of blocks of a single size, shared by all threads. The
+ * blocks are never returned to the allocator (up to max blocks are kept),
+ * so the pool can be used by objects outliving static destruction. */
+class BlockPool {
+  public:
+    BlockPool(size_t size, size_t max);
+
+    void *take();
+    void  give(void *block);
+
+  private:
+    struct Block {Block *next;};
+
+    const size_t block_size;
+    const size_t max_blocks;
+    Tcl_Mutex    lock = NULL;
+    Block       *free = NULL;
+    size_t       count = 0;
+};
+
+} // namespace Adapter
+
+#endif /* ECAPTCL_POOL_H */
@@ -0,0 +1,472 @@
+/*
+ * profile.cc: A sampling profiler of the Tcl processors of the eCAP Tcl
+ * adapter.
+ */
+
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <unordered_map>
+#include "profile.h"
+
+#define TCLECAP_INTERP_KEY_PROFILE "::ecap-tcl::profile"
+
+namespace Adapter {
+
+Tcl_Mutex                    Profiler::control = NULL;
+Tcl_Mutex                    Profiler::lock = NULL;
+Tcl_Condition                Profiler::wake = NULL;
+Tcl_ThreadId                 Profiler::thread;
+std::atomic<bool>            Profiler::sampling(false);
+unsigned long                Profiler::every = 10;
+std::vector<ProfileWorker *> Profiler::workers;
+
+/* The keys of the dicts returned by info frame */
+enum FrameKey {
+  FRAME_PROC, FRAME_METHOD, FRAME_CLASS, FRAME_LAMBDA, FRAME_LEVEL,
+  FRAME_KEYS
+};
+static const char *const FrameKeys[] = {
+  "proc", "method", "class", "lambda", "level", NULL
+};
+
+typedef std::unordered_map<std::string, unsigned long> FoldedStacks;
+
+struct ProfileWorker {
+  std::string       name;
+  Tcl_Interp       *interp;  // NULL for the retired worker
+  Tcl_AsyncHandler  async;
+  std::atomic<bool> busy;
+  // Used only by the thread of the interpreter...
+  Tcl_Obj          *command = NULL;
+  Tcl_Obj          *keys[FRAME_KEYS];
+  // ... and guarded by lock
+  Tcl_Mutex         lock = NULL;
+  FoldedStacks      stacks;
+  unsigned long     samples = 0;
+  Tcl_WideInt       usecs = 0;        // the time spent taking samples
+};
+
+static unsigned int WorkerCount = 0;
+
+/* The worker that keeps the samples of the deleted interpreters */
+static const char RetiredWorker[] = "retired";
+
+/* Frames are separated by ; and a stack ends at a space or a new line */
+static void appendFrame(std::string &stack, const char *frame) {
+  if (!stack.empty()) stack += ';';
+  for (; *frame; frame++) {
+    if (*frame == ';' || isspace((unsigned char) *frame)) {
+      stack += '_';
+    } else {
+      stack += *frame;
+    }
+  }
+}; /* appendFrame */
+
+static const char *dictString(ProfileWorker *worker, Tcl_Obj *dict,
+                              FrameKey key) {
+  Tcl_Obj *value = NULL;
+  if (Tcl_DictObjGet(NULL, dict, worker->keys[key], &value) != TCL_OK ||
+      value == NULL) return NULL;
+  return Tcl_GetString(value);
+}; /* dictString */
+
+// Evaluates a command, returning its result (NULL: an error)
+static Tcl_Obj *evalWords(Tcl_Interp *interp, int objc,
+                          const char *const words[]) {
+  Tcl_Obj *objv[4];
+  int i, code;
+  for (i = 0; i < objc; i++) {
+    objv[i] = Tcl_NewStringObj(words[i], -1);
+    Tcl_IncrRefCount(objv[i]);
+  }
+  code = Tcl_EvalObjv(interp, objc, objv, 0);
+  for (i = 0; i < objc; i++) Tcl_DecrRefCount(objv[i]);
+  return code == TCL_OK ? Tcl_GetObjResult(interp) : NULL;
+}; /* evalWords */
+
+// The proc, method or lambda running at the current level. info frame
+// misses it while it runs only byte-compiled commands (i.e. a loop doing
+// arithmetic): info frame describes commands, and the commands that called
+// it belong to its caller.
+static bool currentFrame(Tcl_Interp *interp, std::string &label) {
+  static const char *const selfClass[]  = {"::self", "class"};
+  static const char *const selfMethod[] = {"::self", "method"};
+  static const char *const infoLevel[]  = {"::info", "level", "0"};
+  Tcl_Obj *result, *word = NULL, *method = NULL;
+  if ((result = evalWords(interp, 2, selfClass)) != NULL) {
+    label = Tcl_GetString(result);
+    if ((result = evalWords(interp, 2, selfMethod)) == NULL) return false;
+    label += "::";
+    label += Tcl_GetString(result);
+    return true;
+  }
+  // Not a method (or a method entering or leaving): the call...
+  if ((result = evalWords(interp, 3, infoLevel)) == NULL ||
+      Tcl_ListObjIndex(NULL, result, 0, &word) != TCL_OK || word == NULL) {
+    return false;
+  }
+  Tcl_ListObjIndex(NULL, result, 1, &method);
+  std::string name(method ? Tcl_GetString(method) : "");
+  label = Tcl_GetString(word);
+  if (label == "apply" || label == "::apply") {
+    label = "apply";
+    return true;
+  }
+  // ... of a method, through its object (named after the class)...
+  const char *const objectClass[] = {"::info", "object", "class",
+                                     label.c_str()};
+  if (!name.empty() && (result = evalWords(interp, 4, objectClass)) != NULL) {
+    label = Tcl_GetString(result);
+    label += "::" + name;
+    return true;
+  }
+  // ... or of a proc, fully qualified, as info frame names procs
+  const char *const namespaceWhich[] = {"::namespace", "which", label.c_str()};
+  if ((result = evalWords(interp, 3, namespaceWhich)) != NULL &&
+      Tcl_GetCharLength(result) > 0) {
+    label = Tcl_GetString(result);
+  }
+  return true;
+}; /* currentFrame */
+
+// The procs, methods and lambdas of the stack of interp, from the outermost.
+// A proc evaluating scripts (i.e. with eval or uplevel) has several frames,
+// at the same level: they are counted once. info frame is evaluated as a
+// script (the last frame, describing the current level): evaluated with
+// Tcl_EvalObjv by an asynchronous handler, while a command called with
+// Tcl_EvalObjv runs (i.e. a hook), it crashes Tcl 8.6. In a coroutine, it
+// crashes anyway: only the current level is taken.
+static void collectFrames(Tcl_Interp *interp, ProfileWorker *worker,
+                          std::string &stack) {
+  static const char *const infoCoroutine[] = {"::info", "coroutine"};
+  Tcl_Obj *frame, *value;
+  const char *name, *owner;
+  std::string label, previous;
+  char query[32];
+  int depth, level, frame_level, previous_level = -1;
+
+  if ((value = evalWords(interp, 2, infoCoroutine)) == NULL ||
+      Tcl_GetCharLength(value) > 0) {
+    if (currentFrame(interp, label)) appendFrame(stack, label.c_str());
+    return;
+  }
+  if (Tcl_EvalEx(interp, "::info frame", -1, 0) != TCL_OK ||
+      Tcl_GetIntFromObj(NULL, Tcl_GetObjResult(interp), &depth) != TCL_OK) {
+    return;
+  }
+  for (level = 1; level <= depth; level++) {
+    snprintf(query, sizeof(query), "::info frame %d", level);
+    if (Tcl_EvalEx(interp, query, -1, 0) != TCL_OK) break;
+    frame = Tcl_GetObjResult(interp);
+    if ((name = dictString(worker, frame, FRAME_PROC)) != NULL) {
+      label = name;
+    } else if ((name = dictString(worker, frame, FRAME_METHOD)) != NULL) {
+      owner = dictString(worker, frame, FRAME_CLASS);
+      label = owner ? std::string(owner) + "::" + name : name;
+    } else if (dictString(worker, frame, FRAME_LAMBDA) != NULL) {
+      label = "apply";
+    } else {
+      continue;
+    }
+    frame_level = -1;
+    if (Tcl_DictObjGet(NULL, frame, worker->keys[FRAME_LEVEL],
+                       &value) == TCL_OK && value != NULL) {
+      Tcl_GetIntFromObj(NULL, value, &frame_level);
+    }
+    if (label == previous && frame_level == previous_level) continue;
+    previous = label;
+    previous_level = frame_level;
+    appendFrame(stack, label.c_str());
+  }
+  // The commands of the current level have no frame (yet)...
+  if (previous_level != 0 && currentFrame(interp, label)) {
+    appendFrame(stack, label.c_str());
+  }
+}; /* collectFrames */
+
+// Called by the thread of the interpreter, at a safe point, after the
+// sampler has marked the handler. The result of the interpreter is kept.
+static int takeSample(ClientData clientData, Tcl_Interp *interp, int code) {
+  ProfileWorker *worker = (ProfileWorker *) clientData;
+  Tcl_InterpState state;
+  Tcl_Time begin, end;
+  std::string stack;
+
+  if (interp == NULL || interp != worker->interp || !worker->busy) {
+    return code;
+  }
+  Tcl_GetTime(&begin);
+  state = Tcl_SaveInterpState(interp, code);
+  collectFrames(interp, worker, stack);
+  code = Tcl_RestoreInterpState(interp, state);
+  if (stack.empty() && worker->command) {
+    appendFrame(stack, Tcl_GetString(worker->command));
+  }
+  Tcl_GetTime(&end);
+  Tcl_MutexLock(&worker->lock);
+  if (!stack.empty()) worker->stacks[stack]++;
+  worker->samples++;
+  worker->usecs += ((Tcl_WideInt) end.sec - begin.sec) * 1000000 +
+                   end.usec - begin.usec;
+  Tcl_MutexUnlock(&worker->lock);
+  return code;
+}; /* takeSample */
+
+static void formatStacks(const FoldedStacks &stacks, std::string &out) {
+  // Sorted, as flamegraph.pl expects (and for stable output)...
+  std::map<std::string, unsigned long> sorted(stacks.begin(), stacks.end());
+  char count[32];
+  for (std::map<std::string, unsigned long>::const_iterator it =
+       sorted.begin(); it != sorted.end(); ++it) {
+    snprintf(count, sizeof(count), " %lu\n", it->second);
+    out += it->first;
+    out += count;
+  }
+}; /* formatStacks */
+
+} // namespace Adapter
+
+void Adapter::Profiler::attach(Tcl_Interp *interp, bool main) {
+  ProfileWorker *worker;
+  char name[32];
+  int key;
+  if (Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_PROFILE, NULL)) return;
+  worker = new ProfileWorker;
+  worker->interp = interp;
+  worker->busy = false;
+  worker->async = Tcl_AsyncCreate(takeSample, worker);
+  for (key = 0; key < FRAME_KEYS; key++) {
+    worker->keys[key] = Tcl_NewStringObj(FrameKeys[key], -1);
+    Tcl_IncrRefCount(worker->keys[key]);
+  }
+  Tcl_MutexLock(&lock);
+  if (main) {
+    worker->name = "main";
+  } else {
+    snprintf(name, sizeof(name), "worker-%u", ++WorkerCount);
+    worker->name = name;
+  }
+  workers.push_back(worker);
+  Tcl_MutexUnlock(&lock);
+  Tcl_SetAssocData(interp, TCLECAP_INTERP_KEY_PROFILE, detach, worker);
+}
+
+// The interpreter is being deleted: the worker is dropped, and its samples
+// are kept in the "retired" worker (the threads replaced by recycle_* keep
+// coming, the list of workers must not grow with them).
+void Adapter::Profiler::detach(ClientData clientData, Tcl_Interp *interp) {
+  ProfileWorker *worker = (ProfileWorker *) clientData, *retired = NULL;
+  int key;
+  Tcl_MutexLock(&lock);
+  for (std::vector<ProfileWorker *>::iterator it = workers.begin();
+       it != workers.end(); ) {
+    if (*it == worker) {
+      it = workers.erase(it);
+      continue;
+    }
+    if ((*it)->name == RetiredWorker) retired = *it;
+    ++it;
+  }
+  if (retired == NULL) {
+    retired = new ProfileWorker;
+    retired->name = RetiredWorker;
+    retired->interp = NULL;
+    retired->async = NULL;
+    retired->busy = false;
+    workers.push_back(retired);
+  }
+  Tcl_MutexLock(&retired->lock);
+  for (FoldedStacks::const_iterator stack = worker->stacks.begin();
+       stack != worker->stacks.end(); ++stack) {
+    retired->stacks[stack->first] += stack->second;
+  }
+  retired->samples += worker->samples;
+  retired->usecs += worker->usecs;
+  Tcl_MutexUnlock(&retired->lock);
+  Tcl_MutexUnlock(&lock);
+  Tcl_AsyncDelete(worker->async);
+  for (key = 0; key < FRAME_KEYS; key++) Tcl_DecrRefCount(worker->keys[key]);
+  Tcl_MutexFinalize(&worker->lock);
+  delete worker;
+}
+
+bool Adapter::Profiler::start(unsigned long interval, std::string &error) {
+  bool started;
+  Tcl_MutexLock(&control);
+  Tcl_MutexLock(&lock);
+  every = interval ? interval : 1;
+  started = sampling;
+  sampling = true;
+  // A running sampler picks the new interval...
+  Tcl_ConditionNotify(&wake);
+  Tcl_MutexUnlock(&lock);
+  if (!started && Tcl_CreateThread(&thread, sampler, NULL,
+                                   TCL_THREAD_STACK_DEFAULT,
+                                   TCL_THREAD_JOINABLE) != TCL_OK) {
+    Tcl_MutexLock(&lock);
+    sampling = false;
+    Tcl_MutexUnlock(&lock);
+    Tcl_MutexUnlock(&control);
+    error = "cannot create the thread of the profiler";
+    return false;
+  }
+  Tcl_MutexUnlock(&control);
+  return true;
+}
+
+void Adapter::Profiler::stop() {
+  int result;
+  Tcl_MutexLock(&control);
+  Tcl_MutexLock(&lock);
+  if (!sampling) {
+    Tcl_MutexUnlock(&lock);
+    Tcl_MutexUnlock(&control);
+    return;
+  }
+  sampling = false;
+  Tcl_ConditionNotify(&wake);
+  Tcl_MutexUnlock(&lock);
+  Tcl_JoinThread(thread, &result);
+  Tcl_MutexUnlock(&control);
+}
+
+bool Adapter::Profiler::running() {
+  return sampling;
+}
+
+// Marks the handlers of the busy workers, every interval (give or take a
+// tenth, so samples do not keep falling on the same point of periodic work).
+Tcl_ThreadCreateType Adapter::Profiler::sampler(ClientData clientData) {
+  unsigned long random = (unsigned long) (size_t) &random, usecs;
+  Tcl_Time wait;
+  Tcl_MutexLock(&lock);
+  while (sampling) {
+    random = random * 6364136223846793005UL + 1442695040888963407UL;
+    usecs = every * 1000;
+    usecs += (random >> 33) % (usecs / 5 + 1) - usecs / 10;
+    wait.sec  = usecs / 1000000;
+    wait.usec = usecs % 1000000;
+    Tcl_ConditionWait(&wake, &lock, &wait);
+    if (!sampling) break;
+    for (std::vector<ProfileWorker *>::const_iterator it = workers.begin();
+         it != workers.end(); ++it) {
+      if ((*it)->async && (*it)->busy) Tcl_AsyncMark((*it)->async);
+    }
+  }
+  Tcl_MutexUnlock(&lock);
+  TCL_THREAD_CREATE_RETURN;
+}
+
+bool Adapter::Profiler::enter(Tcl_Interp *interp, Tcl_Obj *command) {
+  ProfileWorker *worker = (ProfileWorker *)
+    Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_PROFILE, NULL);
+  if (worker == NULL) return false;
+  worker->command = command;
+  worker->busy = true;
+  return true;
+}
+
+void Adapter::Profiler::leave(Tcl_Interp *interp) {
+  ProfileWorker *worker = (ProfileWorker *)
+    Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_PROFILE, NULL);
+  if (worker == NULL) return;
+  worker->busy = false;
+  worker->command = NULL;
+}
+
+void Adapter::Profiler::reset() {
+  Tcl_MutexLock(&lock);
+  for (std::vector<ProfileWorker *>::const_iterator it = workers.begin();
+       it != workers.end(); ++it) {
+    Tcl_MutexLock(&(*it)->lock);
+    FoldedStacks().swap((*it)->stacks);
+    (*it)->samples = 0;
+    (*it)->usecs = 0;
+    Tcl_MutexUnlock(&(*it)->lock);
+  }
+  Tcl_MutexUnlock(&lock);
+}
+
+bool Adapter::Profiler::folded(const std::string &name, std::string &stacks) {
+  FoldedStacks merged;
+  bool found = name.empty();
+  Tcl_MutexLock(&lock);
+  for (std::vector<ProfileWorker *>::const_iterator it = workers.begin();
+       it != workers.end(); ++it) {
+    if (!name.empty() && (*it)->name != name) continue;
+    found = true;
+    Tcl_MutexLock(&(*it)->lock);
+    for (FoldedStacks::const_iterator stack = (*it)->stacks.begin();
+         stack != (*it)->stacks.end(); ++stack) {
+      merged[stack->first] += stack->second;
+    }
+    Tcl_MutexUnlock(&(*it)->lock);
+  }
+  Tcl_MutexUnlock(&lock);
+  formatStacks(merged, stacks);
+  return found;
+}
+
+bool Adapter::Profiler::write(const std::string &dir,
+                              std::vector<std::string> &files,
+                              std::string &error) {
+  std::vector<std::pair<std::string, std::string> > outputs;
+  Tcl_MutexLock(&lock);
+  for (std::vector<ProfileWorker *>::const_iterator it = workers.begin();
+       it != workers.end(); ++it) {
+    Tcl_MutexLock(&(*it)->lock);
+    if (!(*it)->stacks.empty()) {
+      outputs.push_back(std::make_pair(dir + "/" + (*it)->name + ".folded",
+                                       std::string()));
+      formatStacks((*it)->stacks, outputs.back().second);
+    }
+    Tcl_MutexUnlock(&(*it)->lock);
+  }
+  Tcl_MutexUnlock(&lock);
+  // ... and written without holding the locks
+  for (std::vector<std::pair<std::string, std::string> >::const_iterator it =
+       outputs.begin(); it != outputs.end(); ++it) {
+    std::ofstream file(it->first.c_str(), std::ios::out | std::ios::trunc);
+    if (file) file << it->second;
+    if (file) file.close();
+    if (!file) {
+      // ... the other files are still written
+      if (error.empty()) {
+        error = "couldn't write \"" + it->first + "\": " + strerror(errno);
+      }
+      continue;
+    }
+    files.push_back(it->first);
+  }
+  return error.empty();
+}
+
+Tcl_Obj *Adapter::Profiler::toDict() {
+  Tcl_Obj *dict = Tcl_NewDictObj(), *list = Tcl_NewDictObj(), *worker;
+  Tcl_MutexLock(&lock);
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("running", -1),
+                 Tcl_NewBooleanObj(sampling));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("interval", -1),
+                 Tcl_NewWideIntObj(every));
+  for (std::vector<ProfileWorker *>::const_iterator it = workers.begin();
+       it != workers.end(); ++it) {
+    worker = Tcl_NewDictObj();
+    Tcl_MutexLock(&(*it)->lock);
+    Tcl_DictObjPut(NULL, worker, Tcl_NewStringObj("samples", -1),
+                   Tcl_NewWideIntObj((*it)->samples));
+    Tcl_DictObjPut(NULL, worker, Tcl_NewStringObj("stacks", -1),
+                   Tcl_NewWideIntObj((*it)->stacks.size()));
+    Tcl_DictObjPut(NULL, worker, Tcl_NewStringObj("usecs", -1),
+                   Tcl_NewWideIntObj((*it)->usecs));
+    Tcl_MutexUnlock(&(*it)->lock);
+    Tcl_DictObjPut(NULL, list, Tcl_NewStringObj((*it)->name.c_str(), -1),
+                   worker);
+  }
+  Tcl_MutexUnlock(&lock);
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("workers", -1), list);
+  return dict;
+}
@@ -0,0 +1,73 @@
+/*
+ * profile.h: A sampling profiler of the Tcl processors. While it runs, a
+ * thread wakes up every interval, and asks each interpreter busy with a
+ * call for its stack of procs and methods: the interpreter takes the sample
+ * itself, at its next safe point (through an asynchronous handler), so it
+ * is never stopped in an inconsistent state. Idle interpreters are not
+ * sampled, and nothing is done between samples.
+ * The stacks are counted per worker (the interpreter of a thread of the
+ * pool, or the main interpreter), and written as folded stacks, the input
+ * of flamegraph.pl: the frames from the outermost, separated by ;, a space
+ * and the number of samples.
+ */
+#ifndef ECAPTCL_PROFILE_H
+#define ECAPTCL_PROFILE_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <tcl.h>
+
+namespace Adapter {
+
+struct ProfileWorker;
+
+class Profiler {
+  public:
+    // Makes interp a worker (the profiler samples only workers), named
+    // after its thread. Must be called in the thread of interp.
+    static void attach(Tcl_Interp *interp, bool main);
+
+    // Starts sampling every interval milliseconds (or changes the interval).
+    // Returns false, leaving an error message in error.
+    static bool start(unsigned long interval, std::string &error);
+    static void stop();
+    static bool running();
+
+    // A call of interp begins (command is its first word, the root of the
+    // samples taken outside any proc) and ends: interp is sampled only in
+    // between. enter() returns false if interp is not sampled (then leave()
+    // must not be called).
+    static bool enter(Tcl_Interp *interp, Tcl_Obj *command);
+    static void leave(Tcl_Interp *interp);
+
+    // Drops all samples
+    static void reset();
+    // The folded stacks of a worker (no worker: of all workers, merged).
+    // Returns false if there is no such worker.
+    static bool folded(const std::string &worker, std::string &stacks);
+    // Writes the folded stacks of each worker to dir/<worker>.folded.
+    // Returns false (having written the files it could), leaving the first
+    // error message in error.
+    static bool write(const std::string &dir,
+                      std::vector<std::string> &files, std::string &error);
+    // Returns a (zero reference count) dict with the state of the profiler,
+    // and the number of samples of each worker
+    static Tcl_Obj *toDict();
+
+  private:
+    static void detach(ClientData clientData, Tcl_Interp *interp);
+    static Tcl_ThreadCreateType sampler(ClientData clientData);
+
+    static Tcl_Mutex                    control; // serialises start/stop
+    static Tcl_Mutex                    lock;    // guards the rest
+    static Tcl_Condition                wake;
+    static Tcl_ThreadId                 thread;
+    static std::atomic<bool>            sampling;
+    static unsigned long                every;
+    static std::vector<ProfileWorker *> workers;
+};
+
+} // namespace Adapter
+
+#endif /* ECAPTCL_PROFILE_H */
@@ -0,0 +1,177 @@
+/*
+ * re.cc: Regular expressions of the eCAP Tcl adapter (::ecap-tcl::re).
+ */
+
+#include "re.h"
+
+#ifdef HAVE_PCRE2
+
+#include <cstdio>
+#include <map>
+
+#define TCLECAP_INTERP_KEY_RE "::ecap-tcl::re"
+
+namespace Adapter {
+
+typedef std::map<std::string, Regex *> RegexMap;
+
+static void deleteCache(ClientData clientData, Tcl_Interp *interp) {
+  RegexMap *cache = (RegexMap *) clientData;
+  for (RegexMap::iterator it = cache->begin(); it != cache->end(); ++it) {
+    delete it->second;
+  }
+  delete cache;
+}; /* deleteCache */
+
+static RegexMap *interpCache(Tcl_Interp *interp) {
+  RegexMap *cache = (RegexMap *)
+    Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_RE, NULL);
+  if (cache == NULL) {
+    cache = new RegexMap;
+    Tcl_SetAssocData(interp, TCLECAP_INTERP_KEY_RE, deleteCache, cache);
+  }
+  return cache;
+}; /* interpCache */
+
+static std::string errorMessage(int code) {
+  PCRE2_UCHAR buffer[256];
+  if (pcre2_get_error_message(code, buffer, sizeof(buffer)) < 0) {
+    return "unknown PCRE2 error";
+  }
+  return (const char *) buffer;
+}; /* errorMessage */
+
+} // namespace Adapter
+
+Adapter::Regex *Adapter::Regex::compile(const std::string &pattern,
+                                        uint32_t options,
+                                        std::string &error) {
+  int code;
+  PCRE2_SIZE offset;
+  pcre2_code *compiled = pcre2_compile((PCRE2_SPTR) pattern.data(),
+    pattern.size(), options, &code, &offset, NULL);
+  if (compiled == NULL) {
+    char at[32];
+    snprintf(at, sizeof(at), " at offset %lu", (unsigned long) offset);
+    error = errorMessage(code) + at;
+    return NULL;
+  }
+  return new Regex(pattern, options, compiled);
+}
+
+Adapter::Regex::Regex(const std::string &p, uint32_t o, pcre2_code *c):
+    pattern(p), options(o), code(c) {
+  // The JIT is not available on every platform: PCRE2 then interprets the
+  // pattern...
+  jit = pcre2_jit_compile(code, PCRE2_JIT_COMPLETE |
+                                PCRE2_JIT_PARTIAL_HARD) == 0;
+  pcre2_pattern_info(code, PCRE2_INFO_CAPTURECOUNT, &capture_count);
+  pcre2_pattern_info(code, PCRE2_INFO_MAXLOOKBEHIND, &lookbehind);
+  data = pcre2_match_data_create_from_pattern(code, NULL);
+  ovector = pcre2_get_ovector_pointer(data);
+}
+
+Adapter::Regex::~Regex() {
+  pcre2_match_data_free(data);
+  pcre2_code_free(code);
+}
+
+int Adapter::Regex::match(const char *subject, size_t length, size_t offset,
+                          bool partial, std::string &error) {
+  int code = pcre2_match(this->code, (PCRE2_SPTR) subject, length, offset,
+                         partial ? PCRE2_PARTIAL_HARD : 0, data, NULL);
+  if (code >= 0) return 1;
+  if (code == PCRE2_ERROR_NOMATCH) return 0;
+  if (code == PCRE2_ERROR_PARTIAL) return -1;
+  error = errorMessage(code);
+  return -2;
+}
+
+size_t Adapter::Regex::holdFrom(const char *subject, size_t from) const {
+  size_t hold = ovector[0];
+  // lookbehind counts characters: 4 bytes each, at most, in UTF-8...
+  size_t behind = (options & PCRE2_UTF) ? 4 * lookbehind : lookbehind;
+  hold = hold - from > behind ? hold - behind : from;
+  if (options & PCRE2_UTF) {
+    while (hold > from && (subject[hold] & 0xc0) == 0x80) hold--;
+  }
+  return hold;
+}
+
+void Adapter::Regex::expand(const char *subject,
+                            const std::string &replacement,
+                            std::string &out) const {
+  for (size_t i = 0; i < replacement.size(); i++) {
+    unsigned int capture;
+    char c = replacement[i];
+    if (c == '&') {
+      capture = 0;
+    } else if (c == '\\' && i + 1 < replacement.size()) {
+      c = replacement[++i];
+      if (c == '\\' || c == '&') {
+        out += c;
+        continue;
+      }
+      if (c < '0' || c > '9') {
+        out += '\\';
+        out += c;
+        continue;
+      }
+      capture = c - '0';
+    } else {
+      out += c;
+      continue;
+    }
+    if (capture <= capture_count && start(capture) != PCRE2_UNSET) {
+      out.append(subject + start(capture), end(capture) - start(capture));
+    }
+  }
+}
+
+size_t Adapter::Regex::charLength(const char *subject, size_t length) const {
+  size_t size = 1;
+  if (options & PCRE2_UTF) {
+    unsigned char lead = (unsigned char) *subject;
+    if (lead >= 0xf0) size = 4;
+    else if (lead >= 0xe0) size = 3;
+    else if (lead >= 0xc0) size = 2;
+  }
+  return size < length ? size : length;
+}
+
+Adapter::Regex *Adapter::RegexCache::find(Tcl_Interp *interp,
+                                          const std::string &name) {
+  RegexMap *cache = interpCache(interp);
+  RegexMap::const_iterator it = cache->find(name);
+  return it == cache->end() ? NULL : it->second;
+}
+
+void Adapter::RegexCache::store(Tcl_Interp *interp, const std::string &name,
+                                Regex *regex) {
+  Regex *&slot = (*interpCache(interp))[name];
+  delete slot;
+  slot = regex;
+}
+
+bool Adapter::RegexCache::remove(Tcl_Interp *interp,
+                                 const std::string &name) {
+  RegexMap *cache = interpCache(interp);
+  RegexMap::iterator it = cache->find(name);
+  if (it == cache->end()) return false;
+  delete it->second;
+  cache->erase(it);
+  return true;
+}
+
+Tcl_Obj *Adapter::RegexCache::names(Tcl_Interp *interp) {
+  RegexMap *cache = interpCache(interp);
+  Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+  for (RegexMap::const_iterator it = cache->begin(); it != cache->end();
+       ++it) {
+    Tcl_ListObjAppendElement(NULL, list,
+      Tcl_NewStringObj(it->first.data(), it->first.size()));
+  }
+  return list;
+}
+
+#endif /* HAVE_PCRE2 */
@@ -0,0 +1,82 @@
+/*
+ * re.h: Regular expressions of the eCAP Tcl adapter (::ecap-tcl::re),
+ * compiled by PCRE2 (and JIT compiled, where PCRE2 supports it), for
+ * matching large bodies. Each interpreter keeps its compiled patterns by
+ * name: a pattern is compiled once (i.e. by service_thread_init_script),
+ * and reused by every transaction. Matching supports partial matches, so a
+ * pattern can be applied to the chunks of a body, holding back the end of
+ * a chunk that may start a match until the next chunk arrives.
+ * Only available if configure has found PCRE2 (HAVE_PCRE2).
+ */
+#ifndef ECAPTCL_RE_H
+#define ECAPTCL_RE_H
+
+#ifdef HAVE_PCRE2
+
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+#include <string>
+#include <tcl.h>
+
+namespace Adapter {
+
+class Regex {
+  public:
+    // Compiles a pattern (options: PCRE2_CASELESS, etc.). Returns NULL,
+    // leaving an error message in error.
+    static Regex *compile(const std::string &pattern, uint32_t options,
+                          std::string &error);
+    ~Regex();
+
+    // Finds the first match in subject, from offset: 1 (a match), 0 (no
+    // match) or, with partial, -1 (the end of subject may start a match,
+    // see holdFrom()). Returns -2 on errors, leaving a message in error.
+    int match(const char *subject, size_t length, size_t offset,
+              bool partial, std::string &error);
+    // The start and end of capture i of the last match (PCRE2_UNSET, if
+    // the capture is unset), and of the whole match (i = 0)
+    size_t start(unsigned int i) const { return ovector[2 * i]; }
+    size_t end(unsigned int i) const { return ovector[2 * i + 1]; }
+    unsigned int captures() const { return capture_count; }
+    // Where the subject must be held back from (not before from), after a
+    // partial match: including the text the pattern looks behind at
+    size_t holdFrom(const char *subject, size_t from) const;
+    // Appends the replacement of the last match, where & and \0 stand for
+    // the match, and \1 to \9 for its captures (as in regsub)
+    void expand(const char *subject, const std::string &replacement,
+                std::string &out) const;
+    // The length of the character at subject (for empty matches)
+    size_t charLength(const char *subject, size_t length) const;
+
+    const std::string pattern;
+    const uint32_t    options;
+    bool              jit = false;
+
+  private:
+    Regex(const std::string &p, uint32_t o, pcre2_code *c);
+    Regex(const Regex &);
+    Regex &operator =(const Regex &);
+
+    pcre2_code       *code;
+    pcre2_match_data *data;
+    PCRE2_SIZE       *ovector;
+    uint32_t          capture_count = 0;
+    uint32_t          lookbehind = 0;
+};
+
+// The compiled patterns of an interpreter, by name
+class RegexCache {
+  public:
+    static Regex *find(Tcl_Interp *interp, const std::string &name);
+    static void store(Tcl_Interp *interp, const std::string &name,
+                      Regex *regex); // replaces (and deletes) the old one
+    static bool remove(Tcl_Interp *interp, const std::string &name);
+    // Returns a (zero reference count) list of the names
+    static Tcl_Obj *names(Tcl_Interp *interp);
+};
+
+} // namespace Adapter
+
+#endif /* HAVE_PCRE2 */
+
+#endif /* ECAPTCL_RE_H */
@@ -0,0 +1,234 @@
+/*
+ * rules.cc: A native URL matcher of the eCAP Tcl adapter.
+ */
+
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include "rules.h"
+
+Tcl_Mutex Adapter::UrlRuleSets::lock = NULL;
+std::map<std::string, Adapter::UrlRulesPtr> Adapter::UrlRuleSets::sets;
+
+// Splits a URL (or a rule) into its host (lower case, without user, port or
+// final dot), followed by its path (without query or fragment). Returns the
+// size of the host (0: there is none). Accepts a scheme://, or none.
+static size_t splitUrl(const char *url, size_t size, std::string &key) {
+  const char *p = url, *end = url + size, *q, *authority_end, *host_end;
+  for (q = p; q < end && *q != ':' && *q != '/' && *q != '?' && *q != '#';
+       q++);
+  if (end - q >= 3 && q[0] == ':' && q[1] == '/' && q[2] == '/') p = q + 3;
+  for (q = p; q < end && *q != '/' && *q != '?' && *q != '#'; q++);
+  authority_end = q;
+  for (q = authority_end; q > p; q--) {
+    if (q[-1] == '@') {p = q; break;}
+  }
+  if (p < authority_end && *p == '[') {
+    // An IPv6 address
+    host_end = (const char *) memchr(p, ']', authority_end - p);
+    host_end = host_end ? host_end + 1 : authority_end;
+  } else {
+    host_end = (const char *) memchr(p, ':', authority_end - p);
+    if (host_end == NULL) host_end = authority_end;
+  }
+  while (host_end > p && host_end[-1] == '.') host_end--;
+  key.clear();
+  key.reserve((host_end - p) + (end - authority_end));
+  for (q = p; q < host_end; q++) key += tolower((unsigned char) *q);
+  size_t host_size = key.size();
+  if (authority_end < end && *authority_end == '/') {
+    for (q = authority_end; q < end && *q != '?' && *q != '#'; q++);
+    key.append(authority_end, q - authority_end);
+  }
+  return host_size;
+}; /* splitUrl */
+
+Adapter::UrlRules::UrlRules(): nodes(1) {
+}
+
+Adapter::SharedSlice Adapter::UrlRules::intern(const char *start,
+                                               size_t size) {
+  // The strings of a deque never move: the slices stay valid
+  keys.push_back(std::string(start, size));
+  SharedSlice slice = {keys.back().data(), size};
+  return slice;
+}
+
+bool Adapter::UrlRules::add(const std::string &pattern,
+                            const std::string &value, std::string &error) {
+  std::string key;
+  size_t skip = 0, host_size;
+  unsigned int index = values.size();
+
+  if (pattern.compare(0, 2, "*.") == 0) {
+    skip = 2;
+  } else if (!pattern.empty() && pattern[0] == '.') {
+    skip = 1;
+  }
+  host_size = splitUrl(pattern.data() + skip, pattern.size() - skip, key);
+  if (host_size == 0) {
+    error = "invalid rule (no host): " + pattern;
+    return false;
+  }
+  values.push_back(value);
+  if (skip) {
+    if (key.size() > host_size) {
+      error = "invalid rule (a domain rule cannot have a path): " + pattern;
+      values.pop_back();
+      return false;
+    }
+    // Insert the labels in the trie, from the right...
+    const char *begin = key.data(), *last = begin + host_size, *first;
+    unsigned int node = 0;
+    for (;;) {
+      for (first = last; first > begin && first[-1] != '.'; first--);
+      SharedSlice label = {first, (size_t) (last - first)};
+      SliceMap::iterator it = nodes[node].children.find(label);
+      if (it == nodes[node].children.end()) {
+        unsigned int child = nodes.size();
+        nodes.push_back(Node());
+        nodes[node].children[intern(first, last - first)] = child;
+        node = child;
+      } else {
+        node = it->second;
+      }
+      if (first == begin) break;
+      last = first - 1;
+    }
+    if (nodes[node].value < 0) rules++;
+    nodes[node].value = index;
+    return true;
+  }
+  SliceMap *map = &hosts;
+  if (key.size() > host_size) {
+    map = &paths;
+    while (key.size() > host_size && key[key.size() - 1] == '/') {
+      key.resize(key.size() - 1);
+    }
+  }
+  SharedSlice slice = {key.data(), key.size()};
+  SliceMap::iterator it = map->find(slice);
+  if (it == map->end()) {
+    (*map)[intern(key.data(), key.size())] = index;
+    rules++;
+  } else {
+    it->second = index;
+  }
+  return true;
+}
+
+bool Adapter::UrlRules::load(const std::string &path, std::string &error) {
+  std::ifstream file(path.c_str());
+  std::string line, pattern, value;
+  unsigned int number = 0;
+  if (!file) {
+    error = "cannot open rules file: " + path;
+    return false;
+  }
+  while (std::getline(file, line)) {
+    number++;
+    if (!line.empty() && line[line.size() - 1] == '\r') {
+      line.resize(line.size() - 1);
+    }
+    if (line.empty() || line[0] == '#') continue;
+    std::string::size_type sep = line.find_first_of(" \t");
+    pattern = line.substr(0, sep);
+    value = "match";
+    if (sep != std::string::npos) {
+      sep = line.find_first_not_of(" \t", sep);
+      if (sep != std::string::npos) value = line.substr(sep);
+    }
+    if (!add(pattern, value, error)) {
+      std::ostringstream where;
+      where << path << ":" << number << ": ";
+      error = where.str() + error;
+      return false;
+    }
+  }
+  return true;
+}
+
+const std::string *Adapter::UrlRules::matchUrl(const char *url,
+                                               size_t size) const {
+  std::string key;
+  size_t host_size = splitUrl(url, size, key);
+  if (host_size == 0) return NULL;
+  return match(key, host_size);
+}
+
+const std::string *Adapter::UrlRules::matchHost(const char *host,
+                                                size_t size) const {
+  std::string key;
+  size_t host_size = splitUrl(host, size, key);
+  if (host_size == 0) return NULL;
+  key.resize(host_size);
+  return match(key, host_size);
+}
+
+// Looks up the path rules (from the whole path, up to the host, one path
+// segment at a time), then the host rules, then the domain trie.
+const std::string *Adapter::UrlRules::match(const std::string &key,
+                                            size_t host_size) const {
+  SliceMap::const_iterator it;
+  if (!paths.empty()) {
+    size_t n = key.size();
+    if (n > host_size && key[n - 1] == '/') n--;
+    for (;;) {
+      SharedSlice slice = {key.data(), n};
+      if ((it = paths.find(slice)) != paths.end()) return &values[it->second];
+      if (n == host_size) break;
+      do n--; while (n > host_size && key[n] != '/');
+    }
+  }
+  if (!hosts.empty()) {
+    SharedSlice slice = {key.data(), host_size};
+    if ((it = hosts.find(slice)) != hosts.end()) return &values[it->second];
+  }
+  return matchDomain(key.data(), host_size);
+}
+
+const std::string *Adapter::UrlRules::matchDomain(const char *host,
+                                                  size_t size) const {
+  const char *last = host + size, *first;
+  unsigned int node = 0;
+  int value = -1;
+  if (nodes[0].children.empty()) return NULL;
+  for (;;) {
+    for (first = last; first > host && first[-1] != '.'; first--);
+    SharedSlice label = {first, (size_t) (last - first)};
+    SliceMap::const_iterator it = nodes[node].children.find(label);
+    if (it == nodes[node].children.end()) break;
+    node = it->second;
+    // The longest matching domain wins...
+    if (nodes[node].value >= 0) value = nodes[node].value;
+    if (first == host) break;
+    last = first - 1;
+  }
+  return value < 0 ? NULL : &values[value];
+}
+
+const Adapter::UrlRulesPtr *Adapter::UrlRuleSets::slot(
+                                              const std::string &name) {
+  UrlRulesPtr *rules;
+  Tcl_MutexLock(&lock);
+  rules = &sets[name];
+  Tcl_MutexUnlock(&lock);
+  return rules;
+}
+
+Adapter::UrlRulesPtr Adapter::UrlRuleSets::get(const std::string &name) {
+  const UrlRulesPtr *rules = NULL;
+  Tcl_MutexLock(&lock);
+  std::map<std::string, UrlRulesPtr>::const_iterator it = sets.find(name);
+  if (it != sets.end()) rules = &it->second;
+  Tcl_MutexUnlock(&lock);
+  return rules ? std::atomic_load(rules) : UrlRulesPtr();
+}
+
+void Adapter::UrlRuleSets::set(const std::string &name, UrlRulesPtr rules) {
+  UrlRulesPtr *current;
+  Tcl_MutexLock(&lock);
+  current = &sets[name];
+  Tcl_MutexUnlock(&lock);
+  std::atomic_store(current, rules);
+}
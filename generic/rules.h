@@ -0,0 +1,77 @@
+/*
+ * rules.h: A native URL matcher of the eCAP Tcl adapter, for large lists of
+ * host, domain and path rules. A rule is one of:
+ *   example.com        the host example.com
+ *   *.example.com      example.com and all its subdomains (also .example.com)
+ *   example.com/ads/   the URLs of example.com below /ads (path segments)
+ * and has a value, returned by a match. A URL matches its longest path rule,
+ * else its host rule, else its longest domain rule.
+ * The rule sets are compiled once, and shared by the host thread (for
+ * wantsUrl) and all the interpreters: like the tables of shared.h, a rule
+ * set is immutable, and is replaced as a whole.
+ */
+#ifndef ECAPTCL_RULES_H
+#define ECAPTCL_RULES_H
+
+#include <deque>
+#include <vector>
+#include "shared.h"
+
+namespace Adapter {
+
+class UrlRules {
+  public:
+    UrlRules();
+
+    // Return false, leaving an error message in error
+    bool add(const std::string &pattern, const std::string &value,
+             std::string &error);
+    // Loads a file of lines: pattern, white space, value (by default
+    // "match"). Empty lines, and lines starting with # are skipped.
+    bool load(const std::string &path, std::string &error);
+
+    // The value of the matching rule (NULL: none)
+    const std::string *matchUrl(const char *url, size_t size) const;
+    const std::string *matchHost(const char *host, size_t size) const;
+    size_t size() const { return rules; }
+
+  private:
+    typedef std::unordered_map<SharedSlice, unsigned int, SharedSliceHash>
+      SliceMap;
+    // A node of the domain trie, with the labels of a domain from the right
+    struct Node {
+      SliceMap children;
+      int      value = -1;
+    };
+
+    const std::string *match(const std::string &key, size_t host_size) const;
+    const std::string *matchDomain(const char *host, size_t size) const;
+    SharedSlice intern(const char *start, size_t size);
+
+    std::deque<std::string>  keys;   // the memory of the slices of the maps
+    std::vector<std::string> values;
+    std::vector<Node>        nodes;  // nodes[0]: the root of the trie
+    SliceMap                 hosts;
+    SliceMap                 paths;  // host and path, without the final /
+    size_t                   rules = 0;
+};
+
+typedef std::shared_ptr<const UrlRules> UrlRulesPtr;
+
+/* The named rule sets live as long as the process */
+class UrlRuleSets {
+  public:
+    // The slot of a rule set (created empty), which never moves: read it
+    // with std::atomic_load()
+    static const UrlRulesPtr *slot(const std::string &name);
+    static UrlRulesPtr get(const std::string &name);
+    static void set(const std::string &name, UrlRulesPtr rules);
+
+  private:
+    static Tcl_Mutex lock;
+    static std::map<std::string, UrlRulesPtr> sets;
+};
+
+} // namespace Adapter
+
+#endif /* ECAPTCL_RULES_H */
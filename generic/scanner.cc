@@ -0,0 +1,21 @@
+/*
+ * scanner.cc: The body scanners of the eCAP Tcl adapter.
+ */
+
+#include "scanner.h"
+
+void Adapter::BodyScanner::splice(const std::string &out,
+                                  const std::vector<std::string> &values,
+                                  const std::vector<size_t> &offsets,
+                                  std::string &result) {
+  size_t total = out.size(), previous = 0;
+  for (size_t i = 0; i < values.size(); i++) total += values[i].size();
+  result.clear();
+  result.reserve(total);
+  for (size_t i = 0; i < values.size(); i++) {
+    result.append(out, previous, offsets[i] - previous);
+    result += values[i];
+    previous = offsets[i];
+  }
+  result.append(out, previous, std::string::npos);
+}
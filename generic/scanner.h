@@ -0,0 +1,50 @@
+/*
+ * scanner.h: The body scanners of the eCAP Tcl adapter (the "tags" and
+ * "json" content modes). A scanner parses the body natively, as it arrives,
+ * copying it through, except for the items (HTML tags, JSON values) a
+ * processor subscribed to. These are passed to Tcl, in a single call per
+ * chunk, and the replacements Tcl returns are spliced back.
+ */
+#ifndef ECAPTCL_SCANNER_H
+#define ECAPTCL_SCANNER_H
+
+#include <string>
+#include <vector>
+
+namespace Adapter {
+
+/* The items found in a chunk */
+struct BodyItems {
+  std::vector<std::string> values;  // the items, as found in the body
+  std::vector<size_t>      offsets; // where each item belongs in the output
+  std::vector<std::string> labels;  // what each item is (if the scanner says)
+};
+
+class BodyScanner {
+  public:
+    virtual ~BodyScanner() {}
+
+    // Returns false, leaving an error message in error
+    virtual bool subscribe(const std::string &name, std::string &error) = 0;
+    const std::vector<std::string> &subscriptions() const {return names;}
+
+    // Scans a chunk, following the chunks already fed. The content is
+    // appended to out, except for the subscribed items.
+    virtual void feed(const char *data, size_t size, std::string &out,
+                      BodyItems &items) = 0;
+    // At the end of the body: appends to out anything held.
+    virtual void finish(std::string &out) = 0;
+
+    // Builds the adapted chunk: out, with the values inserted at offsets
+    static void splice(const std::string &out,
+                       const std::vector<std::string> &values,
+                       const std::vector<size_t> &offsets,
+                       std::string &result);
+
+  protected:
+    std::vector<std::string> names;
+};
+
+} // namespace Adapter
+
+#endif /* ECAPTCL_SCANNER_H */
@@ -0,0 +1,240 @@
+/*
+ * shared.cc: A key/value store shared by all the interpreters of the eCAP
+ * Tcl adapter.
+ */
+
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shared.h"
+
+#define TCLECAP_INTERP_KEY_SHARED "::ecap-tcl::shared"
+
+namespace Adapter {
+
+Tcl_Mutex SharedStore::lock = NULL;
+std::map<std::string, SharedTable *> SharedStore::tables;
+
+/* The snapshots an interpreter uses, one per table */
+struct SharedCached {
+  SharedTable      *table;
+  unsigned long     generation;
+  SharedSnapshotPtr snapshot;
+};
+typedef std::map<std::string, SharedCached> SharedCache;
+
+static void deleteCache(ClientData clientData, Tcl_Interp *interp) {
+  delete (SharedCache *) clientData;
+}; /* deleteCache */
+
+static SharedCache *interpCache(Tcl_Interp *interp) {
+  SharedCache *cache = (SharedCache *)
+    Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_SHARED, NULL);
+  if (cache == NULL) {
+    cache = new SharedCache;
+    Tcl_SetAssocData(interp, TCLECAP_INTERP_KEY_SHARED, deleteCache, cache);
+  }
+  return cache;
+}; /* interpCache */
+
+static void setPosixError(Tcl_Interp *interp, const char *action,
+                          Tcl_Obj *path) {
+  Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't %s \"%s\": %s", action,
+                   Tcl_GetString(path), Tcl_PosixError(interp)));
+}; /* setPosixError */
+
+} // namespace Adapter
+
+/* FNV-1a */
+size_t Adapter::SharedSliceHash::operator ()(const SharedSlice &s) const {
+  size_t hash = 2166136261u;
+  for (size_t i = 0; i < s.size; i++) {
+    hash ^= (unsigned char) s.start[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+Adapter::SharedSnapshot::SharedSnapshot() {
+}
+
+Adapter::SharedSnapshot::~SharedSnapshot() {
+  if (mapped) munmap(mapped, mapped_size);
+}
+
+bool Adapter::SharedSnapshot::fromDict(Tcl_Interp *interp, Tcl_Obj *dict) {
+  Tcl_DictSearch search;
+  Tcl_Obj *key, *value;
+  int done, size, key_size, value_size;
+  size_t total = 0;
+  const char *str;
+
+  if (Tcl_DictObjSize(interp, dict, &size) != TCL_OK) return false;
+  // Copy all keys and values in storage, which must not grow after...
+  Tcl_DictObjFirst(interp, dict, &search, &key, &value, &done);
+  for (; !done; Tcl_DictObjNext(&search, &key, &value, &done)) {
+    Tcl_GetStringFromObj(key, &key_size);
+    Tcl_GetStringFromObj(value, &value_size);
+    total += key_size + value_size;
+  }
+  Tcl_DictObjDone(&search);
+  storage.reserve(total);
+  index.reserve(size);
+  Tcl_DictObjFirst(interp, dict, &search, &key, &value, &done);
+  for (; !done; Tcl_DictObjNext(&search, &key, &value, &done)) {
+    SharedSlice k, v;
+    str = Tcl_GetStringFromObj(key, &key_size);
+    k.start = storage.data() + storage.size(); k.size = key_size;
+    storage.append(str, key_size);
+    str = Tcl_GetStringFromObj(value, &value_size);
+    v.start = storage.data() + storage.size(); v.size = value_size;
+    storage.append(str, value_size);
+    index[k] = v;
+  }
+  Tcl_DictObjDone(&search);
+  return true;
+}
+
+bool Adapter::SharedSnapshot::fromFile(Tcl_Interp *interp, Tcl_Obj *path,
+                                       bool map) {
+  const char *native = (const char *) Tcl_FSGetNativePath(path);
+  struct stat info;
+  int fd;
+
+  if (native == NULL || (fd = open(native, O_RDONLY)) < 0) {
+    setPosixError(interp, "open", path);
+    return false;
+  }
+  if (fstat(fd, &info) < 0) {
+    setPosixError(interp, "stat", path);
+    close(fd);
+    return false;
+  }
+  if (map && info.st_size > 0) {
+    // The keys and values point into the mapped file: nothing is copied.
+    mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+      mapped = NULL;
+      setPosixError(interp, "map", path);
+      close(fd);
+      return false;
+    }
+    mapped_size = info.st_size;
+  } else {
+    ssize_t count;
+    storage.resize(info.st_size);
+    for (size_t offset = 0; offset < storage.size(); offset += count) {
+      count = read(fd, &storage[offset], storage.size() - offset);
+      if (count < 0 && errno == EINTR) {
+        count = 0;
+      } else if (count < 0) {
+        setPosixError(interp, "read", path);
+        close(fd);
+        return false;
+      } else if (count == 0) {
+        storage.resize(offset); // the file has been truncated meanwhile
+        break;
+      }
+    }
+  }
+  close(fd);
+  indexLines();
+  return true;
+}
+
+// Indexes lines of the form: key, white space, value (the rest of the line).
+// Empty lines, and lines starting with # are skipped.
+void Adapter::SharedSnapshot::indexLines() {
+  const char *p   = mapped ? (const char *) mapped : storage.data();
+  const char *end = p + (mapped ? mapped_size : storage.size());
+  const char *eol, *sep;
+  while (p < end) {
+    eol = (const char *) memchr(p, '\n', end - p);
+    if (eol == NULL) eol = end;
+    const char *line = p, *last = eol;
+    p = eol + 1;
+    if (last > line && last[-1] == '\r') last--;
+    if (last == line || *line == '#') continue;
+    SharedSlice k, v;
+    for (sep = line; sep < last && *sep != ' ' && *sep != '\t'; sep++);
+    k.start = line; k.size = sep - line;
+    while (sep < last && (*sep == ' ' || *sep == '\t')) sep++;
+    v.start = sep; v.size = last - sep;
+    index[k] = v;
+  }
+}
+
+const Adapter::SharedSlice *Adapter::SharedSnapshot::find(const char *key,
+                                                  size_t size) const {
+  SharedSlice k = {key, size};
+  std::unordered_map<SharedSlice, SharedSlice, SharedSliceHash>::
+    const_iterator it = index.find(k);
+  return it == index.end() ? NULL : &it->second;
+}
+
+Adapter::SharedTable::SharedTable(): current(new SharedSnapshot),
+                                     published(0) {
+}
+
+Adapter::SharedSnapshotPtr Adapter::SharedTable::snapshot() const {
+  return std::atomic_load(&current);
+}
+
+void Adapter::SharedTable::swap(SharedSnapshotPtr snapshot) {
+  std::atomic_store(&current, snapshot);
+  // Let the interpreters know that they hold an old snapshot...
+  published.fetch_add(1, std::memory_order_release);
+}
+
+unsigned long Adapter::SharedTable::generation() const {
+  return published.load(std::memory_order_acquire);
+}
+
+Adapter::SharedTable *Adapter::SharedStore::table(const std::string &name,
+                                                  bool create) {
+  SharedTable *table = NULL;
+  Tcl_MutexLock(&lock);
+  std::map<std::string, SharedTable *>::iterator it = tables.find(name);
+  if (it != tables.end()) {
+    table = it->second;
+  } else if (create) {
+    table = tables[name] = new SharedTable;
+  }
+  Tcl_MutexUnlock(&lock);
+  return table;
+}
+
+const Adapter::SharedSnapshot *
+Adapter::SharedStore::snapshot(Tcl_Interp *interp, const std::string &name) {
+  SharedCache *cache = interpCache(interp);
+  SharedCache::iterator it = cache->find(name);
+  if (it == cache->end()) {
+    // The first use of the table by this interpreter...
+    SharedTable *table = SharedStore::table(name, false);
+    if (table == NULL) return NULL;
+    SharedCached cached = {table, table->generation(), table->snapshot()};
+    it = cache->insert(std::make_pair(name, cached)).first;
+  } else {
+    unsigned long generation = it->second.table->generation();
+    if (generation != it->second.generation) {
+      it->second.generation = generation;
+      it->second.snapshot   = it->second.table->snapshot();
+    }
+  }
+  return it->second.snapshot.get();
+}
+
+void Adapter::SharedStore::releaseStale(Tcl_Interp *interp) {
+  SharedCache *cache = (SharedCache *)
+    Tcl_GetAssocData(interp, TCLECAP_INTERP_KEY_SHARED, NULL);
+  if (cache == NULL) return;
+  for (SharedCache::iterator it = cache->begin(); it != cache->end(); ) {
+    if (it->second.table->generation() != it->second.generation) {
+      cache->erase(it++);
+    } else {
+      ++it;
+    }
+  }
+}
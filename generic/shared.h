@@ -0,0 +1,91 @@
+/*
+ * shared.h: A key/value store shared by all the interpreters of the eCAP
+ * Tcl adapter (i.e. for blocklists and rewrite tables), so large tables are
+ * loaded once, and not once per thread of the pool.
+ * A table is an immutable snapshot: an update builds a new snapshot, and
+ * replaces the old one atomically (read-copy-update). Each interpreter
+ * keeps the snapshot it last used, and only checks (without locking)
+ * whether a newer one has been published. A snapshot is released when the
+ * last interpreter using it has moved to a newer one.
+ */
+#ifndef ECAPTCL_SHARED_H
+#define ECAPTCL_SHARED_H
+
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <tcl.h>
+
+namespace Adapter {
+
+/* A part of the memory of a snapshot (a key or a value) */
+struct SharedSlice {
+  const char *start;
+  size_t      size;
+  bool operator ==(const SharedSlice &s) const {
+    return size == s.size && memcmp(start, s.start, size) == 0;
+  }
+};
+
+struct SharedSliceHash {
+  size_t operator ()(const SharedSlice &s) const;
+};
+
+class SharedSnapshot {
+  public:
+    SharedSnapshot();
+    ~SharedSnapshot();
+
+    // Builds the snapshot from a dict, or from a file of lines (key, white
+    // space, value), which is either read or memory-mapped. Return false,
+    // leaving an error message in interp.
+    bool fromDict(Tcl_Interp *interp, Tcl_Obj *dict);
+    bool fromFile(Tcl_Interp *interp, Tcl_Obj *path, bool map);
+
+    const SharedSlice *find(const char *key, size_t size) const;
+    size_t size() const { return index.size(); }
+
+  private:
+    void indexLines();
+
+    std::string storage; // the memory of the snapshot, unless mapped
+    void       *mapped = NULL;
+    size_t      mapped_size = 0;
+    std::unordered_map<SharedSlice, SharedSlice, SharedSliceHash> index;
+};
+
+typedef std::shared_ptr<const SharedSnapshot> SharedSnapshotPtr;
+
+class SharedTable {
+  public:
+    SharedTable();
+    SharedSnapshotPtr snapshot() const;
+    void swap(SharedSnapshotPtr snapshot);
+    unsigned long generation() const;
+
+  private:
+    SharedSnapshotPtr          current;
+    std::atomic<unsigned long> published;
+};
+
+/* The tables live as long as the process: they survive reconfigurations */
+class SharedStore {
+  public:
+    static SharedTable *table(const std::string &name, bool create);
+    // The snapshot of a table, as seen by interp (NULL: no such table)
+    static const SharedSnapshot *snapshot(Tcl_Interp *interp,
+                                          const std::string &name);
+    // Drops the snapshots interp holds, that have been replaced
+    static void releaseStale(Tcl_Interp *interp);
+
+  private:
+    static Tcl_Mutex lock;
+    static std::map<std::string, SharedTable *> tables;
+};
+
+} // namespace Adapter
+
+#endif /* ECAPTCL_SHARED_H */
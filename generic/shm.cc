@@ -0,0 +1,493 @@
+/*
+ * shm.cc: The shared memory segment of the eCAP Tcl adapter.
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shm.h"
+#include "digest.h"
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LONG_LOCK_FREE == 2 &&
+              ATOMIC_LLONG_LOCK_FREE == 2,
+              "the shared memory segment needs lock-free atomics");
+
+/* The beginning of a segment: a segment laid out by another version of the
+ * adapter is not used. */
+static const char SegmentMagic[16] = "ECAPTCL-SHM-2";
+
+/* The smallest segment */
+static const size_t MinSegmentSize = 1024 * 1024;
+
+/* The fraction of the segment holding the decisions */
+static const size_t DecisionFraction = 16;
+
+/* The ring bytes per index slot (the average size of an entry, roughly) */
+static const size_t IndexSlotBytes = 4096;
+
+/* A decision (the index of an entry) is in one of the slots of its bucket */
+static const size_t BucketSlots = 4;
+
+/* A response larger than this fraction of the ring is not stored */
+static const size_t MaxEntryFraction = 8;
+
+/* How long (msecs) a process waits for another one to lay out a segment */
+static const int LayoutWait = 1000;
+
+/* How long (secs) a decision may stay half written before another writer
+ * takes its slot over, even though the process writing it is alive (its
+ * pid may have been reused) */
+static const int64_t StaleWrite = 10;
+
+/* The most processes counted as attached */
+static const int MaxProcesses = 256;
+
+struct Adapter::SharedSegment::Header {
+  char     magic[sizeof(SegmentMagic)];
+  std::atomic<uint32_t> ready;    // laid out
+  uint32_t counters_number;       // STATS_COUNTERS_NUMBER
+  uint64_t size;
+  uint64_t decision_slots;
+  uint64_t index_slots;
+  uint64_t ring_offset;
+  uint64_t ring_size;
+  std::atomic<uint64_t> cursor;   // where the ring is written next
+  std::atomic<int32_t>  pids[MaxProcesses]; // attached, 0: a free slot
+  std::atomic<Tcl_WideInt> counters[STATS_COUNTERS_NUMBER];
+};
+
+// A decision is written between two increments of sequence (odd: being
+// written), and is read again if sequence has changed meanwhile. A writer
+// that finds sequence odd gives up (the decision is not shared), unless the
+// writer of the slot has died, or started more than StaleWrite ago: it then
+// takes the slot over, moving sequence on (still odd), so the writer it has
+// replaced, if it ever resumes, cannot complete the decision (its stores
+// may still land on the new one, hence StaleWrite is long).
+struct Adapter::SharedSegment::DecisionSlot {
+  std::atomic<uint32_t> sequence;
+  std::atomic<uint32_t> verdict;
+  std::atomic<uint64_t> key;      // the hash of the URL, 0: free
+  std::atomic<int64_t>  expires;  // secs
+  std::atomic<int32_t>  writer;   // the pid of its last writer
+  std::atomic<int64_t>  since;    // when it was last written (secs)
+};
+
+// Where the entry of a key is in the ring (the key is a hint, the entry is
+// checked against the whole key)
+struct Adapter::SharedSegment::IndexSlot {
+  std::atomic<uint64_t> key;
+  std::atomic<uint64_t> position; // in the ring (from the start) + 1
+};
+
+// An entry of the ring: followed by the key, the headers (name and value,
+// each ended by a null byte) and the body. A writer that has stalled while
+// the ring went round may write over a newer entry: the digest tells.
+struct RingEntry {
+  uint64_t position; // where it has been written: checks it is still there
+  uint64_t total;    // its size, rounded up to 8 bytes
+  uint64_t body_size;
+  uint32_t key_size;
+  uint32_t headers_size;
+  char     digest[16]; // xxh64 (hex) of the key, the headers and the body
+};
+
+static std::string digestOf(const std::string &key,
+                            const std::string &headers,
+                            const char *body, size_t body_size) {
+  Adapter::BodyDigest digest(Adapter::BodyDigest::ADAPTED,
+                             Adapter::BodyDigest::XXH64);
+  digest.update(key.data(), key.size());
+  digest.update(headers.data(), headers.size());
+  digest.update(body, body_size);
+  return digest.hex();
+}; /* digestOf */
+
+// FNV-1a (never 0, which marks free slots)
+static uint64_t hashOf(const char *data, size_t size) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= (unsigned char) data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash ? hash : 1;
+}; /* hashOf */
+
+// A process that has died without detaching does not count
+static inline bool alive(int32_t pid) {
+  return pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}; /* alive */
+
+static inline uint64_t roundUp(uint64_t size, uint64_t unit) {
+  return (size + unit - 1) / unit * unit;
+}; /* roundUp */
+
+Adapter::SharedSegment::SharedSegment(Stats &s): stats(s) {
+}
+
+Adapter::SharedSegment::~SharedSegment() {
+  detach();
+  Tcl_MutexFinalize(&lock);
+}
+
+bool Adapter::SharedSegment::attach(const std::string &n, size_t s,
+                                    std::string &error) {
+  if (header && n == name) return true;
+  detach();
+  if (n.empty()) return true;
+  std::string path = n[0] == '/' ? n : "/" + n;
+  if (path.size() == 1 || path.find('/', 1) != std::string::npos) {
+    error = "invalid shm_name: " + n;
+    return false;
+  }
+  if (s < MinSegmentSize) {
+    error = "shm_size is too small (1048576 bytes at least)";
+    return false;
+  }
+  bool created = true;
+  int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    created = false;
+    fd = shm_open(path.c_str(), O_RDWR, 0);
+  }
+  if (fd < 0) {
+    error = "cannot open shared memory " + path + ": " + strerror(errno);
+    return false;
+  }
+  if (created && ftruncate(fd, s) < 0) {
+    error = "cannot size shared memory " + path + ": " + strerror(errno);
+    close(fd);
+    shm_unlink(path.c_str());
+    return false;
+  }
+  Tcl_MutexLock(&lock);
+  bool mapped = map(fd, created, s, error);
+  if (mapped) name = n;
+  Tcl_MutexUnlock(&lock);
+  close(fd);
+  if (!mapped) {
+    if (created) shm_unlink(path.c_str());
+    error = path + ": " + error;
+    return false;
+  }
+  // Take the slot of a free (or dead) process...
+  for (int i = 0; i < MaxProcesses; i++) {
+    int32_t pid = header->pids[i].load();
+    if (!alive(pid) &&
+        header->pids[i].compare_exchange_strong(pid, getpid())) {
+      pid_slot = i;
+      break;
+    }
+  }
+  stats.share(header->counters);
+  return true;
+}
+
+// Maps the segment, and lays it out if we have created it; else waits for
+// the process that has created it to lay it out.
+bool Adapter::SharedSegment::map(int fd, bool created, size_t s,
+                                 std::string &error) {
+  struct stat info;
+  int waited = 0;
+  void *address;
+  for (;;) {
+    if (fstat(fd, &info) < 0) {
+      error = strerror(errno);
+      return false;
+    }
+    if (info.st_size > 0 || waited++ == LayoutWait) break;
+    usleep(1000);
+  }
+  if ((size_t) info.st_size < MinSegmentSize) {
+    error = "not laid out (remove it)";
+    return false;
+  }
+  s = info.st_size; // the size set by the process that has created it
+  address = mmap(NULL, s, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (address == MAP_FAILED) {
+    error = strerror(errno);
+    return false;
+  }
+  Header *h = (Header *) address;
+  if (created) {
+    // The memory of a new segment is zeroed: so are its atomics...
+    memcpy(h->magic, SegmentMagic, sizeof(SegmentMagic));
+    h->counters_number = STATS_COUNTERS_NUMBER;
+    h->size = s;
+    uint64_t offset = roundUp(sizeof(Header), 64);
+    h->decision_slots = s / DecisionFraction / sizeof(DecisionSlot) /
+                        BucketSlots * BucketSlots;
+    offset += h->decision_slots * sizeof(DecisionSlot);
+    h->index_slots = (s - offset) / (IndexSlotBytes + sizeof(IndexSlot)) /
+                     BucketSlots * BucketSlots;
+    offset = roundUp(offset + h->index_slots * sizeof(IndexSlot), 64);
+    h->ring_offset = offset;
+    h->ring_size = (s - offset) / 8 * 8;
+    h->ready.store(1, std::memory_order_release);
+  } else {
+    while (h->ready.load(std::memory_order_acquire) == 0 &&
+           waited++ < LayoutWait) {
+      usleep(1000);
+    }
+    if (h->ready.load(std::memory_order_acquire) == 0) {
+      munmap(address, s);
+      error = "not laid out (remove it)";
+      return false;
+    }
+    if (memcmp(h->magic, SegmentMagic, sizeof(SegmentMagic)) != 0 ||
+        h->counters_number != STATS_COUNTERS_NUMBER || h->size != s) {
+      munmap(address, s);
+      error = "laid out by another version of the adapter (remove it)";
+      return false;
+    }
+  }
+  header    = h;
+  size      = s;
+  decisions = (DecisionSlot *) ((char *) address + roundUp(sizeof(Header),
+                                                           64));
+  index     = (IndexSlot *) (decisions + h->decision_slots);
+  ring      = (char *) address + h->ring_offset;
+  return true;
+}
+
+void Adapter::SharedSegment::detach() {
+  if (header == NULL) return;
+  stats.share(NULL);
+  if (pid_slot >= 0) {
+    int32_t pid = getpid();
+    header->pids[pid_slot].compare_exchange_strong(pid, 0);
+    pid_slot = -1;
+  }
+  Tcl_MutexLock(&lock);
+  munmap(header, size);
+  header    = NULL;
+  decisions = NULL;
+  index     = NULL;
+  ring      = NULL;
+  name.clear();
+  size = 0;
+  Tcl_MutexUnlock(&lock);
+}
+
+bool Adapter::SharedSegment::findDecision(const char *url,
+                                          SharedVerdict &verdict) const {
+  if (header == NULL || header->decision_slots == 0) return false;
+  uint64_t hash = hashOf(url, strlen(url));
+  const DecisionSlot *bucket = decisions +
+    hash % (header->decision_slots / BucketSlots) * BucketSlots;
+  int64_t now = time(NULL);
+  for (size_t i = 0; i < BucketSlots; i++) {
+    const DecisionSlot &slot = bucket[i];
+    uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+    if (sequence & 1) continue;
+    uint64_t key     = slot.key.load(std::memory_order_relaxed);
+    int64_t  expires = slot.expires.load(std::memory_order_relaxed);
+    uint32_t value   = slot.verdict.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) != sequence) continue;
+    if (key == hash && expires > now) {
+      verdict = (SharedVerdict) value;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Replaces the decision of the URL, else the one expiring first
+bool Adapter::SharedSegment::storeDecision(const char *url,
+                                           SharedVerdict verdict,
+                                           unsigned int ttl) {
+  if (header == NULL || header->decision_slots == 0) return false;
+  uint64_t hash = hashOf(url, strlen(url));
+  DecisionSlot *bucket = decisions +
+    hash % (header->decision_slots / BucketSlots) * BucketSlots;
+  DecisionSlot *slot = bucket;
+  for (size_t i = 0; i < BucketSlots; i++) {
+    if (bucket[i].key.load(std::memory_order_relaxed) == hash) {
+      slot = bucket + i;
+      break;
+    }
+    if (bucket[i].expires.load(std::memory_order_relaxed) <
+        slot->expires.load(std::memory_order_relaxed)) {
+      slot = bucket + i;
+    }
+  }
+  int64_t now = time(NULL);
+  uint32_t sequence = slot->sequence.load(std::memory_order_relaxed);
+  uint32_t held = sequence + 1; // the odd sequence while this one writes
+  if (sequence & 1) {
+    if (alive(slot->writer.load(std::memory_order_relaxed)) &&
+        now - slot->since.load(std::memory_order_relaxed) < StaleWrite) {
+      return false; // another process is writing it
+    }
+    held = sequence + 2; // left half written: taken over
+  }
+  if (!slot->sequence.compare_exchange_strong(sequence, held,
+                                              std::memory_order_relaxed)) {
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  slot->writer.store(getpid(), std::memory_order_relaxed);
+  slot->since.store(now, std::memory_order_relaxed);
+  slot->key.store(hash, std::memory_order_relaxed);
+  slot->verdict.store(verdict, std::memory_order_relaxed);
+  slot->expires.store(now + ttl, std::memory_order_relaxed);
+  // Fails if the slot has been taken over meanwhile (this one stalled)
+  return slot->sequence.compare_exchange_strong(held, held + 1,
+                                                std::memory_order_release,
+                                                std::memory_order_relaxed);
+}
+
+// An entry is copied out of the ring, then the ring is checked not to have
+// been written over it meanwhile (what has been copied is discarded if it
+// has: the copy may have raced with the writer).
+Adapter::CachedResponsePtr
+Adapter::SharedSegment::findResponse(const std::string &key) const {
+  if (header == NULL || header->index_slots == 0) return CachedResponsePtr();
+  const uint64_t ring_size = header->ring_size;
+  uint64_t hash = hashOf(key.data(), key.size());
+  const IndexSlot *bucket = index +
+    hash % (header->index_slots / BucketSlots) * BucketSlots;
+  for (size_t i = 0; i < BucketSlots; i++) {
+    if (bucket[i].key.load(std::memory_order_relaxed) != hash) continue;
+    uint64_t position = bucket[i].position.load(std::memory_order_acquire);
+    if (position-- == 0) continue;
+    if (header->cursor.load(std::memory_order_relaxed) >
+        position + ring_size) {
+      continue; // overwritten already
+    }
+    RingEntry entry;
+    const char *start = ring + position % ring_size;
+    memcpy(&entry, start, sizeof(entry));
+    if (entry.position != position ||
+        entry.total > ring_size - position % ring_size ||
+        entry.key_size != key.size() || entry.body_size > entry.total ||
+        entry.headers_size > entry.total ||
+        sizeof(entry) + entry.key_size + entry.headers_size +
+          entry.body_size > entry.total) {
+      continue;
+    }
+    const char *data = start + sizeof(entry);
+    if (memcmp(data, key.data(), key.size()) != 0) continue;
+    std::string headers(data + entry.key_size, entry.headers_size);
+    std::string body(data + entry.key_size + entry.headers_size,
+                     entry.body_size);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header->cursor.load(std::memory_order_relaxed) >
+        position + ring_size ||
+        digestOf(key, headers, body.data(), body.size()).compare(0,
+          sizeof(entry.digest), entry.digest, sizeof(entry.digest)) != 0) {
+      continue;
+    }
+    CachedHeaders list;
+    const char *p = headers.data(), *end = p + headers.size();
+    while (p < end) {
+      const char *name_end = (const char *) memchr(p, '\0', end - p);
+      if (name_end == NULL) break;
+      const char *value_end = (const char *)
+        memchr(name_end + 1, '\0', end - name_end - 1);
+      if (value_end == NULL) break;
+      list.push_back(std::make_pair(std::string(p, name_end - p),
+        std::string(name_end + 1, value_end - name_end - 1)));
+      p = value_end + 1;
+    }
+    return CachedResponsePtr(new CachedResponse(list, body));
+  }
+  return CachedResponsePtr();
+}
+
+// Reserves the space of the entry (an entry never wraps around the end of
+// the ring), writes it, then points the index at it.
+bool Adapter::SharedSegment::storeResponse(const std::string &key,
+                                           const CachedResponsePtr &response) {
+  if (header == NULL || header->index_slots == 0) return false;
+  const uint64_t ring_size = header->ring_size;
+  std::string headers;
+  for (CachedHeaders::const_iterator it = response->headers.begin();
+       it != response->headers.end(); ++it) {
+    headers.append(it->first).push_back('\0');
+    headers.append(it->second).push_back('\0');
+  }
+  RingEntry entry;
+  entry.key_size     = key.size();
+  entry.headers_size = headers.size();
+  entry.body_size    = response->bodySize();
+  entry.total = roundUp(sizeof(entry) + key.size() + headers.size() +
+                        response->bodySize(), 8);
+  if (entry.total > ring_size / MaxEntryFraction) return false;
+  memcpy(entry.digest, digestOf(key, headers, response->body(),
+                                response->bodySize()).data(),
+         sizeof(entry.digest));
+
+  uint64_t cursor = header->cursor.load(std::memory_order_relaxed);
+  do {
+    entry.position = cursor;
+    if (cursor % ring_size + entry.total > ring_size) {
+      entry.position += ring_size - cursor % ring_size;
+    }
+  } while (!header->cursor.compare_exchange_weak(cursor,
+             entry.position + entry.total, std::memory_order_relaxed));
+  // The readers who see a byte of the entry see the cursor past it...
+  std::atomic_thread_fence(std::memory_order_release);
+  char *p = ring + entry.position % ring_size;
+  memcpy(p, &entry, sizeof(entry));
+  p += sizeof(entry);
+  memcpy(p, key.data(), key.size());
+  p += key.size();
+  memcpy(p, headers.data(), headers.size());
+  p += headers.size();
+  memcpy(p, response->body(), response->bodySize());
+
+  // Replace the entry of the key, else the oldest one...
+  uint64_t hash = hashOf(key.data(), key.size());
+  IndexSlot *bucket = index +
+    hash % (header->index_slots / BucketSlots) * BucketSlots;
+  IndexSlot *slot = bucket;
+  for (size_t i = 0; i < BucketSlots; i++) {
+    if (bucket[i].key.load(std::memory_order_relaxed) == hash) {
+      slot = bucket + i;
+      break;
+    }
+    if (bucket[i].position.load(std::memory_order_relaxed) <
+        slot->position.load(std::memory_order_relaxed)) {
+      slot = bucket + i;
+    }
+  }
+  slot->position.store(0, std::memory_order_relaxed);
+  slot->key.store(hash, std::memory_order_relaxed);
+  slot->position.store(entry.position + 1, std::memory_order_release);
+  return true;
+}
+
+Tcl_Obj *Adapter::SharedSegment::toDict() const {
+  Tcl_MutexLock(&lock);
+  if (header == NULL) {
+    Tcl_MutexUnlock(&lock);
+    return NULL;
+  }
+  Tcl_Obj *dict = Tcl_NewDictObj();
+  int processes = 0;
+  for (int i = 0; i < MaxProcesses; i++) {
+    if (alive(header->pids[i].load())) processes++;
+  }
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("name", -1),
+                 Tcl_NewStringObj(name.data(), name.size()));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("bytes", -1),
+                 Tcl_NewWideIntObj(size));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("processes", -1),
+                 Tcl_NewWideIntObj(processes));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("decision_slots", -1),
+                 Tcl_NewWideIntObj(header->decision_slots));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("index_slots", -1),
+                 Tcl_NewWideIntObj(header->index_slots));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("ring_bytes", -1),
+                 Tcl_NewWideIntObj(header->ring_size));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("written_bytes", -1),
+                 Tcl_NewWideIntObj(header->cursor.load()));
+  Tcl_MutexUnlock(&lock);
+  return dict;
+}
@@ -0,0 +1,87 @@
+/*
+ * shm.h: A POSIX shared memory segment (shm_name), which the adapters of
+ * all the processes of a host attach to, i.e. the SMP workers of Squid,
+ * each of which loads its own copy of the adapter. The segment holds:
+ *  - the counters of ::ecap-tcl::stats, added up over all the processes;
+ *  - the wantsUrl decisions taken by Tcl (for shm_decision_ttl seconds),
+ *    so a URL is decided once per host, not once per process;
+ *  - the adapted responses of the cache (a ring of entries, the oldest
+ *    overwritten first), so a response adapted by a process is a hit in
+ *    the others.
+ * Nothing in the segment is locked: readers check (with a sequence number,
+ * or the position of the ring and a digest of the entry) that what they
+ * have read has not been overwritten meanwhile, and treat it as a miss if
+ * it has; writers reserve their space with an atomic operation. An entry
+ * of the ring left half written by a process that died fails its digest;
+ * a decision left half written is taken over by the next writer of its
+ * slot (once the writer has died, or has been at it for too long).
+ * The segment outlives the processes (its counters too): it is removed
+ * with shm_unlink (i.e. rm /dev/shm/<name>).
+ * The segment is used by the host thread, and read by ::ecap-tcl::stats.
+ */
+#ifndef ECAPTCL_SHM_H
+#define ECAPTCL_SHM_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <tcl.h>
+#include "stats.h"
+#include "cache.h"
+
+namespace Adapter {
+
+/* A wantsUrl decision */
+enum SharedVerdict { VERDICT_SKIP, VERDICT_ADAPT, VERDICT_BLOCK };
+
+class SharedSegment {
+  public:
+    SharedSegment(Stats &s);
+    ~SharedSegment();
+
+    // Attaches to the segment name, creating it (of size bytes) if it does
+    // not exist. Returns false, leaving an error message in error. The
+    // segment attached before (if another one) is detached.
+    bool attach(const std::string &name, size_t size, std::string &error);
+    void detach();
+    bool attached() const {return header != NULL;}
+
+    bool findDecision(const char *url, SharedVerdict &verdict) const;
+    // Returns false if another process is writing the slot of the URL
+    bool storeDecision(const char *url, SharedVerdict verdict,
+                       unsigned int ttl);
+
+    // Returns a copy of the response of key (an empty pointer: a miss)
+    CachedResponsePtr findResponse(const std::string &key) const;
+    // Returns false if the response is too large for the ring
+    bool storeResponse(const std::string &key,
+                       const CachedResponsePtr &response);
+
+    // Returns a (zero reference count) dict with the sizes of the segment,
+    // or NULL if not attached
+    Tcl_Obj *toDict() const;
+
+  private:
+    struct Header;
+    struct DecisionSlot;
+    struct IndexSlot;
+
+    SharedSegment(const SharedSegment &);
+    SharedSegment &operator =(const SharedSegment &);
+
+    bool map(int fd, bool created, size_t size, std::string &error);
+
+    Stats        &stats;
+    mutable Tcl_Mutex lock = NULL; // attach() and detach() vs. toDict()
+    std::string   name;
+    size_t        size = 0;
+    Header       *header = NULL;
+    DecisionSlot *decisions = NULL;
+    IndexSlot    *index = NULL;
+    char         *ring = NULL;
+    int           pid_slot = -1; // where our pid is in the segment
+};
+
+} // namespace Adapter
+
+#endif /* ECAPTCL_SHM_H */
@@ -0,0 +1,148 @@
+/*
+ * stats.cc: Counters collected by the eCAP Tcl adapter.
+ */
+
+#include "stats.h"
+
+/* The order must follow enum StatsCounter... */
+const char *const Adapter::Stats::names[] = {
+  "xactions",
+  "vb_chunks",
+  "vb_bytes",
+  "adapt_calls",
+  "adapt_bytes",
+  "coalesce_flush_size",
+  "coalesce_flush_timer",
+  "coalesce_flush_end",
+  "whole_body_xactions",
+  "whole_body_bytes",
+  "call_timeouts",
+  "call_limits",
+  "fallback_virgin",
+  "fallback_partial",
+  "fallback_block",
+  "active_xactions",
+  "shed_depth",
+  "shed_breaker",
+  "breaker_opened",
+  "breaker_half_open",
+  "breaker_closed",
+  "headers_only",
+  "blocked",
+  "queue_usecs",
+  "tcl_usecs",
+  "url_rules",
+  "tags_calls",
+  "tags",
+  "json_calls",
+  "json_values",
+  "buffers_allocated",
+  "buffers_reused",
+  "buffers_recycled",
+  "buffers_freed",
+  "cache_hits",
+  "cache_misses",
+  "cache_collapsed",
+  "cache_stores",
+  "native_xactions",
+  "native_calls",
+  "native_usecs",
+  "native_overruns",
+  "coroutine_xactions",
+  "coroutine_resumes",
+  "interps_recycled",
+  "interps_reclaimed_bytes",
+  "digest_bytes",
+  "re_calls",
+  "re_bytes",
+  "shm_decision_hits",
+  "shm_decision_stores",
+  "shm_cache_hits",
+  "shm_cache_stores",
+  "suspended_calls",
+  "resumed_calls",
+  "suspend_timeouts",
+  "minified_xactions",
+  "minify_encoded",
+  "minify_bytes_in",
+  "minify_bytes_saved",
+  NULL
+};
+
+Adapter::Stats::Stats(): lock(NULL) {
+  reset();
+}
+
+Adapter::Stats::~Stats() {
+  Tcl_MutexFinalize(&lock);
+}
+
+void Adapter::Stats::incr(StatsCounter counter, Tcl_WideInt value) {
+  Tcl_MutexLock(&lock);
+  counters[counter] += value;
+  if (host) host[counter].fetch_add(value, std::memory_order_relaxed);
+  Tcl_MutexUnlock(&lock);
+}
+
+Tcl_WideInt Adapter::Stats::get(StatsCounter counter) const {
+  Tcl_WideInt value;
+  Tcl_MutexLock(&lock);
+  value = counters[counter];
+  Tcl_MutexUnlock(&lock);
+  return value;
+}
+
+void Adapter::Stats::reset() {
+  Tcl_MutexLock(&lock);
+  for (int i = 0; i < STATS_COUNTERS_NUMBER; i++) counters[i] = 0;
+  Tcl_MutexUnlock(&lock);
+}
+
+Tcl_Obj *Adapter::Stats::toDict() const {
+  Tcl_WideInt values[STATS_COUNTERS_NUMBER];
+
+  /* Take a consistent snapshot of all counters... */
+  Tcl_MutexLock(&lock);
+  for (int i = 0; i < STATS_COUNTERS_NUMBER; i++) values[i] = counters[i];
+  Tcl_MutexUnlock(&lock);
+  return dictOf(values);
+}
+
+void Adapter::Stats::share(std::atomic<Tcl_WideInt> *h) {
+  Tcl_MutexLock(&lock);
+  host = h;
+  Tcl_MutexUnlock(&lock);
+}
+
+Tcl_Obj *Adapter::Stats::hostDict() const {
+  Tcl_WideInt values[STATS_COUNTERS_NUMBER];
+
+  /* The other processes update the counters meanwhile: each one is read
+   * atomically, but the snapshot is not consistent... */
+  Tcl_MutexLock(&lock);
+  if (host == NULL) {
+    Tcl_MutexUnlock(&lock);
+    return NULL;
+  }
+  for (int i = 0; i < STATS_COUNTERS_NUMBER; i++) {
+    values[i] = host[i].load(std::memory_order_relaxed);
+  }
+  Tcl_MutexUnlock(&lock);
+  return dictOf(values);
+}
+
+Tcl_Obj *Adapter::Stats::dictOf(const Tcl_WideInt values[]) {
+  Tcl_Obj *dict = Tcl_NewDictObj();
+  for (int i = 0; i < STATS_COUNTERS_NUMBER; i++) {
+    Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj(names[i], -1),
+                               Tcl_NewWideIntObj(values[i]));
+  }
+  /* Derived values... */
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("avg_vb_chunk_size", -1),
+    Tcl_NewWideIntObj(values[STATS_VB_CHUNKS] ?
+      values[STATS_VB_BYTES] / values[STATS_VB_CHUNKS] : 0));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("avg_adapt_chunk_size", -1),
+    Tcl_NewWideIntObj(values[STATS_ADAPT_CALLS] ?
+      values[STATS_ADAPT_BYTES] / values[STATS_ADAPT_CALLS] : 0));
+  return dict;
+}
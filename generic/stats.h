@@ -0,0 +1,110 @@
+/*
+ * stats.h: Counters collected by the eCAP Tcl adapter.
+ * The counters are updated by the host thread and by the threads of the
+ * pool, and can be retrieved with the ::ecap-tcl::stats command.
+ * With shm_name, every update is also added to the counters of the shared
+ * memory segment, which add up the counters of all the processes.
+ */
+#ifndef ECAPTCL_STATS_H
+#define ECAPTCL_STATS_H
+
+#include <atomic>
+#include <tcl.h>
+
+namespace Adapter {
+
+enum StatsCounter {
+  STATS_XACTIONS,              // transactions started
+  STATS_VB_CHUNKS,             // virgin body chunks received from the host
+  STATS_VB_BYTES,              // virgin body bytes received from the host
+  STATS_ADAPT_CALLS,           // calls to ::ecap-tcl::contentAdapt
+  STATS_ADAPT_BYTES,           // bytes passed to ::ecap-tcl::contentAdapt
+  STATS_COALESCE_FLUSH_SIZE,   // coalesced chunks flushed by size
+  STATS_COALESCE_FLUSH_TIMER,  // coalesced chunks flushed by timer
+  STATS_COALESCE_FLUSH_END,    // coalesced chunks flushed by body end
+  STATS_WHOLE_BODY_XACTIONS,   // transactions adapted in whole-body mode
+  STATS_WHOLE_BODY_BYTES,      // bytes passed to Tcl in whole-body mode
+  STATS_CALL_TIMEOUTS,         // calls abandoned by the host (and cancelled)
+  STATS_CALL_LIMITS,           // calls that exceeded their Tcl limits
+  STATS_FALLBACK_VIRGIN,       // timed out transactions, passed as virgin
+  STATS_FALLBACK_PARTIAL,      // timed out transactions, partially adapted
+  STATS_FALLBACK_BLOCK,        // timed out transactions, blocked
+  STATS_ACTIVE_XACTIONS,       // transactions being adapted (not a counter)
+  STATS_SHED_DEPTH,            // transactions bypassed, too many active
+  STATS_SHED_BREAKER,          // transactions bypassed, breaker not closed
+  STATS_BREAKER_OPENED,        // breakers that opened
+  STATS_BREAKER_HALF_OPEN,     // breakers that let a probe through
+  STATS_BREAKER_CLOSED,        // breakers that closed after a probe
+  STATS_HEADERS_ONLY,          // transactions with an unmodified body
+  STATS_BLOCKED,               // transactions blocked by Tcl
+  STATS_QUEUE_USECS,           // time calls waited for a thread
+  STATS_TCL_USECS,             // time calls spent in Tcl
+  STATS_URL_RULES,             // wantsUrl calls decided by the url rules
+  STATS_TAGS_CALLS,            // calls to ::ecap-tcl::tagsAdapt
+  STATS_TAGS,                  // tags passed to ::ecap-tcl::tagsAdapt
+  STATS_JSON_CALLS,            // calls to ::ecap-tcl::jsonAdapt
+  STATS_JSON_VALUES,           // values passed to ::ecap-tcl::jsonAdapt
+  STATS_BUFFERS_ALLOCATED,     // content buffers allocated (none pooled)
+  STATS_BUFFERS_REUSED,        // content buffers taken from the pools
+  STATS_BUFFERS_RECYCLED,      // content buffers given back to the pools
+  STATS_BUFFERS_FREED,         // content buffers freed (not worth keeping)
+  STATS_CACHE_HITS,            // responses sent from the cache
+  STATS_CACHE_MISSES,          // cacheable responses adapted
+  STATS_CACHE_COLLAPSED,       // misses waiting for another transaction
+  STATS_CACHE_STORES,          // responses stored in the cache
+  STATS_NATIVE_XACTIONS,       // transactions adapted by native processors
+  STATS_NATIVE_CALLS,          // calls to native processors
+  STATS_NATIVE_USECS,          // time spent in native processors
+  STATS_NATIVE_OVERRUNS,       // native calls beyond their time budget
+  STATS_COROUTINE_XACTIONS,    // transactions adapted by a coroutine
+  STATS_COROUTINE_RESUMES,     // calls resuming a coroutine
+  STATS_INTERPS_RECYCLED,      // thread interpreters replaced (recycle_*)
+  STATS_INTERPS_RECLAIMED,     // RSS bytes released by deleting them
+  STATS_DIGEST_BYTES,          // bytes digested (content_digests)
+  STATS_RE_CALLS,              // ::ecap-tcl::re match and sub calls
+  STATS_RE_BYTES,              // bytes they matched against
+  STATS_SHM_DECISION_HITS,     // wantsUrl calls decided by the segment
+  STATS_SHM_DECISION_STORES,   // wantsUrl decisions stored in the segment
+  STATS_SHM_CACHE_HITS,        // responses sent from the segment
+  STATS_SHM_CACHE_STORES,      // responses stored in the segment
+  STATS_SUSPENDED_CALLS,       // calls suspended by ::ecap-tcl::action suspend
+  STATS_RESUMED_CALLS,         // ... completed by ::ecap-tcl::resume
+  STATS_SUSPEND_TIMEOUTS,      // ... not completed within their time budget
+  STATS_MINIFIED_XACTIONS,     // transactions minified to the end (minify)
+  STATS_MINIFY_ENCODED,        // ... not minified: their content is encoded
+  STATS_MINIFY_BYTES_IN,       // bytes minified...
+  STATS_MINIFY_BYTES_SAVED,    // ... and the bytes removed from them
+  STATS_COUNTERS_NUMBER
+};
+
+class Stats {
+  public:
+    Stats();
+    ~Stats();
+
+    void        incr(StatsCounter counter, Tcl_WideInt value = 1);
+    Tcl_WideInt get(StatsCounter counter) const;
+    void        reset();
+    // Returns a (zero reference count) dict with all counters, plus the
+    // derived values (i.e. averages)
+    Tcl_Obj    *toDict() const;
+    // Adds the updates to host (the counters of a shared memory segment)
+    // too, NULL: no more
+    void        share(std::atomic<Tcl_WideInt> *host);
+    // Returns a (zero reference count) dict with the counters of host, or
+    // NULL if not shared
+    Tcl_Obj    *hostDict() const;
+
+    static const char *const names[];
+
+  private:
+    static Tcl_Obj *dictOf(const Tcl_WideInt values[]);
+
+    mutable Tcl_Mutex lock;
+    Tcl_WideInt       counters[STATS_COUNTERS_NUMBER];
+    std::atomic<Tcl_WideInt> *host = NULL;
+};
+
+} // namespace Adapter
+
+#endif /* ECAPTCL_STATS_H */
@@ -15,53 +15,215 @@
 #include "tcl.h"
 #include "tpool.h"
 
+/*
+ * Wakes thread t (to work, or to exit): it waits on its condition or, when
+ * it services events, in the event loop of its interp. Called with t->lock
+ * held.
+ */
+static int TPoolWakeProc(Tcl_Event *event, int flags) {
+  return 1; /* nothing to do: the thread has woken up */
+}
+
+static void TPoolWake(TPoolThread *t, Tcl_ThreadId id) {
+  Tcl_Event *event;
+
+  Tcl_ConditionNotify(&t->wait);
+  if ( t->events ) {
+    event = (Tcl_Event *) ckalloc(sizeof(Tcl_Event));
+    event->proc = TPoolWakeProc;
+    Tcl_ThreadQueueEvent(id, event, TCL_QUEUE_TAIL);
+    Tcl_ThreadAlert(id);
+  }
+}
+
+/*
+ * A replaced thread exits once it has neither work, nor transactions, nor
+ * callers about to wait for its work. Called with tp->lock and t->lock
+ * held.
+ */
+static void TPoolDrain(TPoolThread *t) {
+  if ( t->retiring != 2 || t->work || t->bound || t->claims ) return;
+  t->retiring = 3;
+  if ( t->id != Tcl_GetCurrentThread() ) TPoolWake(t, t->id);
+}
+
+/*
+ * Joins a thread that has exited, then frees its struct (and, if it had
+ * retired an interp, tells the pool: its memory has been given back).
+ */
+static void TPoolReaper(void *data) {
+  TPoolThread  *t = (TPoolThread *) data;
+  TPool        *tp = t->tp;
+  int           result;
+
+  Tcl_JoinThread(t->id, &result);
+  if ( t->retiring == 3 && tp->joined ) tp->joined(tp->data, t->mark);
+  Tcl_MutexFinalize(&t->lock);
+  Tcl_ConditionFinalize(&t->wait);
+  free(t);
+  // The last use of the pool: TPoolFree() waits for it...
+  Tcl_MutexLock(&tp->lock);
+  tp->reaping--;
+  Tcl_ConditionNotify(&tp->wait);
+  Tcl_MutexUnlock(&tp->lock);
+  Tcl_ExitThread(TCL_OK);
+}
+
+/*
+ * The thread of t is about to exit. If the pool is stopping, TPoolFree()
+ * joins it; otherwise another thread joins it, and frees t. Called with
+ * tp->lock held: t must not be used once it is released.
+ */
+static void TPoolExit(TPoolThread *t) {
+  TPool        *tp = t->tp;
+  TPoolThread **r;
+  Tcl_ThreadId  id;
+
+  if ( tp->stopping && t->retiring == 3 ) return;
+  for ( r = &tp->retired; *r; r = &(*r)->next ) {
+    if ( *r == t ) {
+      *r = t->next;
+      break;
+    }
+  }
+  if ( Tcl_CreateThread(&id, TPoolReaper, t, TCL_THREAD_STACK_DEFAULT,
+                        TCL_THREAD_NOFLAGS) == TCL_OK ) tp->reaping++;
+}
+
+/*
+ * Serves the work of thread t with interp, until it has been replaced
+ * (see TPoolReplacer) and drained, or the pool stops: then the interp is
+ * retired, and the thread exits. Between works, the thread services the
+ * events of its interp (timers, channels, ...), if it has been asked to (see
+ * TPoolEvents), until it is woken to exit. Called with t->lock held.
+ */
+static void TPoolServe(TPoolThread *t, Tcl_Interp *interp) {
+  TPool        *tp = t->tp;
+
+  while ( t->retiring != 3 ) {
+    if ( !t->work ) {
+      if ( t->events ) {
+        Tcl_MutexUnlock(&t->lock);
+        Tcl_DoOneEvent(TCL_ALL_EVENTS);
+        Tcl_MutexLock(&t->lock);
+      } else {
+        Tcl_ConditionWait(&t->wait, &t->lock, NULL /* no timeout */);
+      }
+      continue;
+    }
+
+    Tcl_MutexUnlock(&t->lock);
+
+    t->func(interp, t->data);
+
+    // The pool lock first: TPoolStart() holds it while starting work in
+    // a thread...
+    Tcl_MutexLock(&tp->lock);
+    Tcl_MutexLock(&t->lock);
+
+    t->work = 0;
+    TPoolDrain(t);
+
+    Tcl_ConditionNotify(&t->wait);
+    Tcl_ConditionNotify(&tp->wait);
+    Tcl_MutexUnlock(&tp->lock);
+  }
+  Tcl_MutexUnlock(&t->lock);
+  if ( tp->retire ) {
+    t->mark = tp->retire(interp, tp->data);
+  } else {
+    Tcl_DeleteInterp(interp);
+  }
+  Tcl_MutexLock(&tp->lock);
+  TPoolExit(t);
+  Tcl_MutexUnlock(&tp->lock);
+  Tcl_ExitThread(TCL_OK);
+}
+
 void TPoolWorker(void *data) {
   TPoolThread *t = (TPoolThread *) data;
-  TPool       *tp = t->tp;
   // int i_have_work;
 
   Tcl_MutexLock(&t->lock);
+  t->id = Tcl_GetCurrentThread();
   // Create an interp...
   t->interp = Tcl_CreateInterp();
   if (t->interp == NULL) return;
   if (Tcl_Init(t->interp) != TCL_OK) return;
-  while ( 1 ) {
-    t->work = 0;
-    Tcl_ConditionNotify(&t->wait);
-    Tcl_ConditionWait(&t->wait, &t->lock, NULL /* no timeout */);
-
-    if ( t->work ) {
-      Tcl_MutexUnlock(&t->lock);
-
-      t->func(t->interp, t->data);
-
-      Tcl_MutexLock(&t->lock);
-
-      t->work = 0;
+  Tcl_GetTime(&t->usage.born);
+  t->work = 0;
+  Tcl_ConditionNotify(&t->wait);
+  TPoolServe(t, t->interp);
+}
 
-      Tcl_ConditionNotify(&t->wait);
+/*
+ * Creates and warms a new interp for thread t, while t keeps serving, then
+ * takes the place of t in the pool: new work comes here, and t only serves
+ * the transactions bound to it, until it drains (see TPoolDrain).
+ */
+static void TPoolReplacer(void *data) {
+  TPoolThread *t = (TPoolThread *) data;
+  TPool       *tp = t->tp;
+  TPoolThread *n;
+  Tcl_Interp  *interp;
+  unsigned int i;
+  int          warmed;
+
+  n = calloc(sizeof(TPoolThread), 1);
+  n->tp = tp;
+  n->id = Tcl_GetCurrentThread();
+  interp = Tcl_CreateInterp();
+  warmed = interp != NULL && Tcl_Init(interp) == TCL_OK &&
+           (tp->warm == NULL || tp->warm(interp, tp->data) == TCL_OK);
 
-      Tcl_MutexLock(&tp->lock);
-      Tcl_ConditionNotify(&tp->wait);
-      Tcl_MutexUnlock(&tp->lock);
-    }
+  Tcl_MutexLock(&tp->lock);
+  if ( !warmed || tp->stopping ) {
+    // Keep the old interp (TPoolFree() waits for this)...
+    t->retiring = 0;
+    tp->retiring--;
+    TPoolExit(n);
+    Tcl_ConditionNotify(&tp->wait);
+    Tcl_MutexUnlock(&tp->lock);
+    if ( interp ) Tcl_DeleteInterp(interp);
+    Tcl_ExitThread(TCL_ERROR);
+    return;
+  }
+  Tcl_MutexLock(&n->lock);
+  n->interp = interp;
+  Tcl_GetTime(&n->usage.born);
+  for ( i = 0; i < tp->nthread; i++ ) {
+    if ( tp->thread[i] == t ) tp->thread[i] = n;
   }
+  tp->retiring--;
+  Tcl_MutexLock(&t->lock);
+  n->events   = t->events;
+  t->retiring = 2;
+  t->next     = tp->retired;
+  tp->retired = t;
+  TPoolDrain(t);
+  Tcl_MutexUnlock(&t->lock);
+  // Work may have been waiting for an idle thread...
+  Tcl_ConditionNotify(&tp->wait);
+  Tcl_MutexUnlock(&tp->lock);
+  TPoolServe(n, interp);
 }
 
 TPool *TPoolInit(int n) {
   int    i;
   TPool *tp  = calloc(sizeof(TPool), 1);
-  tp->thread = calloc(sizeof(TPoolThread), n);
+  tp->thread = calloc(sizeof(TPoolThread *), n);
   tp->nthread = n;
 
+  // Joinable: a retired thread is joined (see TPoolReaper)...
   for ( i = 0; i < n; i++ ) {
-    tp->thread[i].work = 1;
-    tp->thread[i].tp   = tp;
-    Tcl_CreateThread(&tp->thread[i].id, TPoolWorker, &tp->thread[i],
-                     TCL_THREAD_STACK_DEFAULT, TCL_THREAD_NOFLAGS);
+    tp->thread[i] = calloc(sizeof(TPoolThread), 1);
+    tp->thread[i]->work = 1;
+    tp->thread[i]->tp   = tp;
+    Tcl_CreateThread(&tp->thread[i]->id, TPoolWorker, tp->thread[i],
+                     TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE);
   }
   for ( i = 0; i < n; i++ ) {
-    TPoolThread *t = &tp->thread[i];
+    TPoolThread *t = tp->thread[i];
 
     Tcl_MutexLock(&t->lock);
     if ( t->work ) {
@@ -73,63 +235,313 @@ TPool *TPoolInit(int n) {
   return tp;
 }
 
+/*
+ * Stops the pool, then frees it: once the replacements under way have given
+ * up, every thread (serving, or replaced and still draining) finishes its
+ * work, retires its interp and exits, and is joined, as are the threads
+ * joining the ones that exited before. No caller may be waiting for work
+ * in the pool.
+ */
 void TPoolFree(TPool *tp) {
-  if (tp && tp->thread) free(tp->thread);
-  if (tp) free(tp);
-}
-
-TPoolThread *TPoolThreadStart(TPool *tp, TPoolWork func, void *data) {
-  int start = tp->next;
+  TPoolThread **stopped, *r;
+  unsigned int  i, n;
+  int           result;
 
+  if ( tp == NULL ) return;
   Tcl_MutexLock(&tp->lock);
+  tp->stopping = 1;
+  while ( tp->retiring ) {
+    Tcl_ConditionWait(&tp->wait, &tp->lock, NULL /* no timeout */);
+  }
+  n = tp->nthread;
+  for ( r = tp->retired; r; r = r->next ) n++;
+  stopped = calloc(sizeof(TPoolThread *), n);
+  n = 0;
+  for ( i = 0; i < tp->nthread; i++ ) stopped[n++] = tp->thread[i];
+  for ( r = tp->retired; r; r = r->next ) stopped[n++] = r;
+  for ( i = 0; i < n; i++ ) {
+    Tcl_MutexLock(&stopped[i]->lock);
+    stopped[i]->retiring = 3;
+    // Out of its event loop (see TPoolEvents), not to enter it again...
+    TPoolWake(stopped[i], stopped[i]->id);
+    stopped[i]->events = 0;
+    Tcl_MutexUnlock(&stopped[i]->lock);
+  }
+  Tcl_MutexUnlock(&tp->lock);
 
-  while ( tp->thread[tp->next].work ) { // Find a thread that will work for us.
-    // TPoolThread *t;
-    tp->next = ((++(tp->next)) % tp->nthread);
+  for ( i = 0; i < n; i++ ) {
+    Tcl_JoinThread(stopped[i]->id, &result);
+    Tcl_MutexFinalize(&stopped[i]->lock);
+    Tcl_ConditionFinalize(&stopped[i]->wait);
+    free(stopped[i]);
+  }
+  free(stopped);
 
-    if ( tp->next == start ) {
-      Tcl_ConditionWait(&tp->wait, &tp->lock, NULL /* no timeout */);
-    }
+  Tcl_MutexLock(&tp->lock);
+  while ( tp->reaping ) {
+    Tcl_ConditionWait(&tp->wait, &tp->lock, NULL /* no timeout */);
   }
   Tcl_MutexUnlock(&tp->lock);
+  Tcl_MutexFinalize(&tp->lock);
+  Tcl_ConditionFinalize(&tp->wait);
+  free(tp->thread);
+  free(tp);
+}
 
-  {
-    TPoolThread *t = &tp->thread[tp->next];
+/*
+ * Deadlines: Tcl_ConditionWait() expects a relative timeout...
+ */
+static void TPoolDeadline(Tcl_Time *deadline, unsigned int ms) {
+  Tcl_GetTime(deadline);
+  deadline->sec  += ms / 1000;
+  deadline->usec += (ms % 1000) * 1000;
+  if (deadline->usec >= 1000000) {
+    deadline->sec++;
+    deadline->usec -= 1000000;
+  }
+}
 
-    Tcl_MutexLock(&t->lock);
+static int TPoolRemaining(const Tcl_Time *deadline, Tcl_Time *remaining) {
+  Tcl_Time now;
+  Tcl_GetTime(&now);
+  remaining->sec  = deadline->sec  - now.sec;
+  remaining->usec = deadline->usec - now.usec;
+  if (remaining->usec < 0) {
+    remaining->sec--;
+    remaining->usec += 1000000;
+  }
+  return remaining->sec > 0 || (remaining->sec == 0 && remaining->usec > 0);
+}
 
-    t->func = func;
-    t->data = data;
-    t->work = 1;
+/*
+ * Finds a thread without work, waiting at most ms milliseconds
+ * (0: wait forever). Returns NULL if no thread became available in time.
+ */
+TPoolThread *TPoolThreadIdle(TPool *tp, unsigned int ms) {
+  int start = tp->next;
+  Tcl_Time deadline, remaining;
 
-    Tcl_ConditionNotify(&t->wait);
+  if (ms) TPoolDeadline(&deadline, ms);
+  Tcl_MutexLock(&tp->lock);
 
-    Tcl_MutexUnlock(&t->lock);
+  while ( tp->thread[tp->next]->work ) { // Find a thread that will work for us.
+    tp->next = (tp->next + 1) % tp->nthread;
 
-    return t;
+    if ( tp->next == start ) {
+      if ( !ms ) {
+        Tcl_ConditionWait(&tp->wait, &tp->lock, NULL /* no timeout */);
+      } else if ( TPoolRemaining(&deadline, &remaining) ) {
+        Tcl_ConditionWait(&tp->wait, &tp->lock, &remaining);
+      } else {
+        Tcl_MutexUnlock(&tp->lock);
+        return NULL;
+      }
+    }
   }
+  Tcl_MutexUnlock(&tp->lock);
+
+  return tp->thread[tp->next];
+}
+
+TPoolThread *TPoolThreadStart(TPool *tp, TPoolWork func, void *data) {
+  return TPoolStartTimeout(tp, NULL, 0, func, data);
 }
 
 TPoolThread *TPoolStartInThreadPosition(TPool *tp, int thread,
                                 TPoolWork func, void *data) {
-  TPoolThread *t = &tp->thread[thread];
+  TPoolThread *t;
+  Tcl_MutexLock(&tp->lock);
+  t = tp->thread[thread];
+  Tcl_MutexUnlock(&tp->lock);
   return TPoolStartInThread(t, func, data);
 }
 
 TPoolThread *TPoolStartInThread(TPoolThread *t,
                                 TPoolWork func, void *data) {
+  return TPoolStartTimeout(t->tp, t, 0, func, data);
+}
+
+/*
+ * Returns the thread where work can start now (t, or any idle thread if t
+ * is NULL), or NULL. Called with the pool lock held.
+ */
+static TPoolThread *TPoolEligible(TPool *tp, TPoolThread *t) {
+  unsigned int i, n;
+
+  if ( t ) return t->work ? NULL : t;
+  for ( i = 0; i < tp->nthread; i++ ) {
+    n = (tp->next + i) % tp->nthread;
+    if ( tp->thread[n]->work ) continue;
+    // A thread being replaced takes no new transactions, unless it is the
+    // only thread of the pool (until its replacement takes its place)...
+    if ( tp->thread[n]->retiring && tp->nthread > 1 ) continue;
+    tp->next = n;
+    return tp->thread[n];
+  }
+  return NULL;
+}
+
+/*
+ * Starts work in thread t (or in any thread, if t is NULL), waiting at most
+ * ms milliseconds (0: wait forever) for the thread to be idle. Returns NULL
+ * if the work could not start in time. With bind, the transaction of the
+ * work is bound to the thread (if t is NULL), until TPoolUnbind().
+ */
+static TPoolThread *TPoolStart(TPool *tp, TPoolThread *t, unsigned int ms,
+                               TPoolWork func, void *data, int bind) {
+  Tcl_Time deadline, remaining, *timeout = NULL;
+  TPoolThread *idle;
+
+  if ( ms ) TPoolDeadline(&deadline, ms);
 
-  TPoolThreadWait(t);
+  Tcl_MutexLock(&tp->lock);
+  while ( (idle = TPoolEligible(tp, t)) == NULL ) {
+    if ( ms ) {
+      if ( !TPoolRemaining(&deadline, &remaining) ) break;
+      timeout = &remaining;
+    }
+    Tcl_ConditionWait(&tp->wait, &tp->lock, timeout);
+  }
+
+  if ( idle ) {
+    if ( bind && t == NULL ) {
+      idle->bound++;
+      idle->usage.served++;
+    }
+    idle->claims++; // until TPoolThreadWait*()
+    Tcl_MutexLock(&idle->lock);
+    idle->func = func;
+    idle->data = data;
+    idle->work = 1;
+    TPoolWake(idle, idle->id);
+    Tcl_MutexUnlock(&idle->lock);
+  }
+  Tcl_MutexUnlock(&tp->lock);
+
+  return idle;
+}
+
+TPoolThread *TPoolStartTimeout(TPool *tp, TPoolThread *t, unsigned int ms,
+                               TPoolWork func, void *data) {
+  return TPoolStart(tp, t, ms, func, data, 0);
+}
+
+TPoolThread *TPoolStartBound(TPool *tp, TPoolThread *t, unsigned int ms,
+                             TPoolWork func, void *data) {
+  return TPoolStart(tp, t, ms, func, data, 1);
+}
+
+/*
+ * The transaction bound to thread t has ended, with bytes of content.
+ * Returns the usage of the interp of t.
+ */
+void TPoolUnbind(TPoolThread *t, Tcl_WideInt bytes, TPoolUsage *usage) {
+  TPool *tp = t->tp;
+  Tcl_MutexLock(&tp->lock);
+  if ( t->bound ) t->bound--;
+  t->usage.bytes += bytes;
+  *usage = t->usage;
+  // A replaced thread may be drained...
   Tcl_MutexLock(&t->lock);
-  t->func = func;
-  t->data = data;
-  t->work = 1;
+  TPoolDrain(t);
+  Tcl_MutexUnlock(&t->lock);
+  Tcl_MutexUnlock(&tp->lock);
+}
 
-  Tcl_ConditionNotify(&t->wait);
+/*
+ * Is t a thread of the pool (serving, or replaced and still draining)?
+ */
+int TPoolOwns(TPool *tp, TPoolThread *t) {
+  TPoolThread *r;
+  unsigned int i;
+  int          owns = 0;
+  Tcl_MutexLock(&tp->lock);
+  for ( i = 0; i < tp->nthread && !owns; i++ ) owns = tp->thread[i] == t;
+  for ( r = tp->retired; r && !owns; r = r->next ) owns = r == t;
+  Tcl_MutexUnlock(&tp->lock);
+  return owns;
+}
+
+/*
+ * The thread whose interp has served the most content
+ */
+TPoolThread *TPoolHeaviest(TPool *tp) {
+  TPoolThread *heaviest = NULL;
+  unsigned int i;
+  Tcl_MutexLock(&tp->lock);
+  for ( i = 0; i < tp->nthread; i++ ) {
+    if ( heaviest == NULL ||
+         tp->thread[i]->usage.bytes > heaviest->usage.bytes ) {
+      heaviest = tp->thread[i];
+    }
+  }
+  Tcl_MutexUnlock(&tp->lock);
+  return heaviest;
+}
 
+/*
+ * Replaces the interp of thread t with a new one (see TPoolReplacer), one
+ * thread of the pool at a time (until the new one is ready: then the old
+ * one drains, while another is replaced). Returns 0 if the replacement did
+ * not start.
+ */
+int TPoolRecycle(TPoolThread *t) {
+  TPool        *tp = t->tp;
+  Tcl_ThreadId  id;
+  int           started = 0;
+
+  Tcl_MutexLock(&tp->lock);
+  if ( !t->retiring && !tp->retiring && !tp->stopping ) {
+    t->retiring = 1;
+    tp->retiring++;
+    started = 1;
+  }
+  Tcl_MutexUnlock(&tp->lock);
+  if ( started && Tcl_CreateThread(&id, TPoolReplacer, t,
+                     TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK ) {
+    Tcl_MutexLock(&tp->lock);
+    t->retiring = 0;
+    tp->retiring--;
+    Tcl_MutexUnlock(&tp->lock);
+    started = 0;
+  }
+  return started;
+}
+
+static void TPoolEventsIn(TPoolThread *t, int events) {
+  Tcl_MutexLock(&t->lock);
+  if ( t->events != events ) {
+    // Wake the thread where it waits now, so it waits the other way...
+    TPoolWake(t, t->id);
+    t->events = events;
+  }
   Tcl_MutexUnlock(&t->lock);
+}
 
-  return t;
+/*
+ * Makes the threads of the pool service the events of their interps between
+ * works (events 1), or just wait for work (events 0).
+ */
+void TPoolEvents(TPool *tp, int events) {
+  TPoolThread *r;
+  unsigned int i;
+  Tcl_MutexLock(&tp->lock);
+  for ( i = 0; i < tp->nthread; i++ ) TPoolEventsIn(tp->thread[i], events);
+  for ( r = tp->retired; r; r = r->next ) TPoolEventsIn(r, events);
+  Tcl_MutexUnlock(&tp->lock);
+}
+
+/*
+ * The caller that started work in t is done waiting for it.
+ */
+static void TPoolRelease(TPoolThread *t) {
+   TPool *tp = t->tp;
+   Tcl_MutexLock(&tp->lock);
+   Tcl_MutexLock(&t->lock);
+   if ( t->claims ) t->claims--;
+   TPoolDrain(t);
+   Tcl_MutexUnlock(&t->lock);
+   Tcl_MutexUnlock(&tp->lock);
 }
 
 void TPoolThreadWait(TPoolThread *t) {
@@ -140,4 +552,27 @@ void TPoolThreadWait(TPoolThread *t) {
    }
 
    Tcl_MutexUnlock(&t->lock);
+   TPoolRelease(t);
+}
+
+/*
+ * Waits for the thread to finish its work, at most ms milliseconds.
+ * Returns 1 if the thread has no work, 0 if the wait timed out.
+ */
+int TPoolThreadWaitTimeout(TPoolThread *t, unsigned int ms) {
+   Tcl_Time deadline, remaining;
+   int idle;
+
+   TPoolDeadline(&deadline, ms);
+   Tcl_MutexLock(&t->lock);
+
+   while ( t->work ) {
+       if ( !TPoolRemaining(&deadline, &remaining) ) break;
+       Tcl_ConditionWait(&t->wait, &t->lock, &remaining);
+   }
+   idle = !t->work;
+
+   Tcl_MutexUnlock(&t->lock);
+   TPoolRelease(t);
+   return idle;
 }
@@ -7,6 +7,18 @@ extern "C" {
 #endif
 
 typedef void (*TPoolWork)(Tcl_Interp *interp, void *data);
+typedef int  (*TPoolWarm)(Tcl_Interp *interp, void *data);
+typedef Tcl_WideInt (*TPoolRetire)(Tcl_Interp *interp, void *data);
+typedef void (*TPoolJoined)(void *data, Tcl_WideInt mark);
+
+/*
+ * What the interp of a thread has served, since it was created
+ */
+typedef struct _TPoolUsage {
+   unsigned long served; /* transactions bound to the thread */
+   Tcl_WideInt   bytes;  /* their content */
+   Tcl_Time      born;
+} TPoolUsage;
 
 typedef struct _TPoolThread {
    struct _TPool *tp;
@@ -19,6 +31,18 @@ typedef struct _TPoolThread {
    void        *data;
    int          work;
    Tcl_Interp  *interp;
+
+   int          events; /* services the events of interp, between works */
+
+   /* Transactions keep their state in the interp: they are bound to the
+    * thread until they end (tp->lock). A replaced thread takes no new
+    * transactions, and exits once it has none (see TPoolRecycle). */
+   unsigned int bound;
+   unsigned int claims;   /* callers that will wait for its work */
+   int          retiring; /* 1: being replaced, 2: replaced, 3: drained */
+   TPoolUsage   usage;
+   Tcl_WideInt  mark;     /* returned by tp->retire */
+   struct _TPoolThread *next; /* tp->retired */
 } TPoolThread;
 
 typedef struct _TPool {
@@ -27,17 +51,42 @@ typedef struct _TPool {
 
    unsigned int         next;
    unsigned int         nthread;
-   TPoolThread         *thread;
+   TPoolThread        **thread;
+   TPoolThread         *retired; /* replaced, still draining */
+
+   /* Replacing the interps of the threads: warm initialises a new interp
+    * (TCL_OK, or the replacement is given up), retire deletes an old one
+    * (both in the thread of the interp), and joined is called with the
+    * mark retire returned, once that thread has exited. */
+   TPoolWarm            warm;
+   TPoolRetire          retire;
+   TPoolJoined          joined;
+   void                *data;
+   int                  retiring; /* threads being replaced */
+
+   int                  stopping; /* TPoolFree(): no thread is replaced */
+   unsigned int         reaping;  /* threads joining exited ones */
 } TPool;
 
 TPool *TPoolInit(int n);
 void TPoolFree(TPool *tp);
+TPoolThread *TPoolThreadIdle(TPool *tp, unsigned int ms);
 TPoolThread *TPoolThreadStart(TPool *tp, TPoolWork func, void *data);
 TPoolThread *TPoolStartInThreadPosition(TPool *tp, int thread,
                                 TPoolWork func, void *data);
 TPoolThread *TPoolStartInThread(TPoolThread *t,
                                 TPoolWork func, void *data);
+TPoolThread *TPoolStartTimeout(TPool *tp, TPoolThread *t, unsigned int ms,
+                               TPoolWork func, void *data);
+TPoolThread *TPoolStartBound(TPool *tp, TPoolThread *t, unsigned int ms,
+                             TPoolWork func, void *data);
+void TPoolUnbind(TPoolThread *t, Tcl_WideInt bytes, TPoolUsage *usage);
+int  TPoolOwns(TPool *tp, TPoolThread *t);
+TPoolThread *TPoolHeaviest(TPool *tp);
+int  TPoolRecycle(TPoolThread *t);
+void TPoolEvents(TPool *tp, int events);
 void TPoolThreadWait (TPoolThread *t);
+int  TPoolThreadWaitTimeout (TPoolThread *t, unsigned int ms);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,72 @@
+/*
+ * workerpool.cc: The pools of worker threads of the eCAP Tcl adapter.
+ */
+
+#include "workerpool.h"
+
+/* The order must follow enum PoolCounter... */
+const char *const Adapter::WorkerPool::names[] = {
+  "xactions",
+  "active_xactions",
+  "calls",
+  "queue_usecs",
+  "tcl_usecs",
+  "call_timeouts",
+  "call_limits",
+  "shed_depth",
+  "recycled",
+  "reclaimed_bytes",
+  NULL
+};
+
+Adapter::WorkerPool::WorkerPool(const std::string &n): name(n) {
+}
+
+Adapter::WorkerPool::~WorkerPool() {
+  Tcl_MutexFinalize(&lock);
+}
+
+bool Adapter::WorkerPool::servesMime(const std::string &mime) const {
+  if (mime_types.empty() || mime.empty()) return false;
+  if (mime_types.count(mime)) return true;
+  std::string::size_type slash = mime.find('/');
+  return slash != std::string::npos &&
+         mime_types.count(mime.substr(0, slash) + "/*");
+}
+
+bool Adapter::WorkerPool::servesProcessor(const std::string &processor)
+    const {
+  return !processor.empty() && processors.count(processor);
+}
+
+void Adapter::WorkerPool::incr(PoolCounter counter, Tcl_WideInt value) {
+  Tcl_MutexLock(&lock);
+  counters[counter] += value;
+  Tcl_MutexUnlock(&lock);
+}
+
+Tcl_WideInt Adapter::WorkerPool::get(PoolCounter counter) const {
+  Tcl_WideInt value;
+  Tcl_MutexLock(&lock);
+  value = counters[counter];
+  Tcl_MutexUnlock(&lock);
+  return value;
+}
+
+Tcl_Obj *Adapter::WorkerPool::toDict() const {
+  Tcl_WideInt values[POOL_COUNTERS_NUMBER];
+  Tcl_Obj *dict = Tcl_NewDictObj();
+
+  /* Take a consistent snapshot of all counters... */
+  Tcl_MutexLock(&lock);
+  for (int i = 0; i < POOL_COUNTERS_NUMBER; i++) values[i] = counters[i];
+  Tcl_MutexUnlock(&lock);
+
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("threads", -1),
+                             Tcl_NewWideIntObj(threads ? nthread : 0));
+  for (int i = 0; i < POOL_COUNTERS_NUMBER; i++) {
+    Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj(names[i], -1),
+                               Tcl_NewWideIntObj(values[i]));
+  }
+  return dict;
+}
@@ -0,0 +1,90 @@
+/*
+ * workerpool.h: The pools of worker threads of the eCAP Tcl adapter.
+ * Besides the default pool (threads_number), named pools can be configured,
+ * each with its own threads, initialisation script and limits, so that a
+ * heavy processor cannot take the threads the others need. A transaction is bound
+ * to a pool when it starts: by its MIME type, or by the processor that
+ * handles its MIME type. All the calls of the transaction are evaluated by
+ * (a thread of) its pool.
+ * The counters of a pool are updated by the host thread (and by the threads
+ * retiring their interpreters), and read by ::ecap-tcl::stats.
+ */
+#ifndef ECAPTCL_WORKERPOOL_H
+#define ECAPTCL_WORKERPOOL_H
+
+#include <memory>
+#include <set>
+#include <string>
+#include <tcl.h>
+
+struct _TPool;
+
+namespace Adapter {
+
+class Service;
+
+enum PoolCounter {
+  POOL_XACTIONS,         // transactions bound to the pool
+  POOL_ACTIVE_XACTIONS,  // transactions being adapted (not a counter)
+  POOL_CALLS,            // calls evaluated by the pool
+  POOL_QUEUE_USECS,      // time calls waited for a thread
+  POOL_TCL_USECS,        // time calls spent in Tcl
+  POOL_CALL_TIMEOUTS,    // calls abandoned by the host (and cancelled)
+  POOL_CALL_LIMITS,      // calls that exceeded their Tcl limits
+  POOL_SHED_DEPTH,       // transactions bypassed, too many active
+  POOL_RECYCLED,         // interpreters replaced (see recycle_*)
+  POOL_RECLAIMED_BYTES,  // RSS released by deleting them
+  POOL_COUNTERS_NUMBER
+};
+
+class WorkerPool {
+  public:
+    WorkerPool(const std::string &name);
+    ~WorkerPool();
+
+    const std::string name;
+
+    // Configuration (pool.<name>.<option>)
+    unsigned int nthread = 0;           // threads_number
+    std::string  thread_init_script;
+    unsigned int call_timeout = 0;      // msecs, 0: the budgets of the service
+    unsigned int shed_queue_depth = 0;  // 0: never shed by depth
+    std::set<std::string> mime_types;   // lower case, or type/*
+    std::set<std::string> processors;
+
+    // Does the pool serve this MIME type (or processor)?
+    bool servesMime(const std::string &mime) const;
+    bool servesProcessor(const std::string &processor) const;
+
+    struct _TPool *threads = NULL; // NULL: the main interpreter
+    // Incremented when the threads are freed: the transactions bound to
+    // them before cannot be served any more
+    unsigned long generation = 0;
+    // What initialises the interpreters of the threads (when the pool is
+    // created, and when they are recycled)
+    const Service *service = NULL;
+    std::string    init_script;
+    bool headers_hook = false;     // ::ecap-tcl::headersAdapt is defined
+
+    void        incr(PoolCounter counter, Tcl_WideInt value = 1);
+    Tcl_WideInt get(PoolCounter counter) const;
+    // Returns a (zero reference count) dict with the counters
+    Tcl_Obj    *toDict() const;
+
+    static const char *const names[];
+
+  private:
+    WorkerPool(const WorkerPool &);
+    WorkerPool &operator =(const WorkerPool &);
+
+    mutable Tcl_Mutex lock = NULL;
+    Tcl_WideInt       counters[POOL_COUNTERS_NUMBER] = {0};
+};
+
+// Shared by the service and the transactions bound to the pool: a pool
+// dropped by a reconfiguration lives until its last transaction ends
+typedef std::shared_ptr<WorkerPool> WorkerPoolPtr;
+
+} // namespace Adapter
+
+#endif /* ECAPTCL_WORKERPOOL_H */
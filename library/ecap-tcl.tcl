@@ -17,6 +17,14 @@ namespace eval ::ecap-tcl {
     set brotli [::brotli new]
   }
 
+  ## The charset of a HTML document, declared by a meta tag
+  variable meta_charset {<meta(?!\s*(?:name|value)\s*=)(?:[^>]*?content\s*=[\s\"']*)?([^>]*?)[\s\"';]*charset\s*=[\s\"']*([^\s\"'/>]*)}
+  ## If the adapter has PCRE2, compile the patterns once per interpreter
+  ## (the library is sourced by service_thread_init_script)...
+  if {[info commands ::ecap-tcl::re] ne ""} {
+    ::ecap-tcl::re compile -nocase ecap-tcl::meta-charset $meta_charset
+  }
+
   namespace eval tcloo {
     variable client_objects {}
 
@@ -25,8 +33,29 @@ namespace eval ::ecap-tcl {
       if {![info object class $client ::ecap-tcl::AbstractProcessor]} {
         error "client must be a supeclass of ::ecap-tcl::AbstractProcessor"
       }
+      ## ::ecap-tcl::headersAdapt is called by the adapter only if it exists,
+      ## and only for the MIME types of the processors that adapt headers...
+      set headers [expr {[lindex [info object call $client onHeadersAdapt] \
+                           0 2] ne "::ecap-tcl::AbstractProcessor"}]
       foreach type [$client mime-types] {
         dict set client_objects $type $client
+        ## Let the adapter route the MIME type to the pool of the processor
+        ## (see pool.<name>.processors)...
+        ::ecap-tcl::pool register [lindex [split $type ";"] 0] \
+          [info object class $client] {*}[if {$headers} {list -headers}]
+      }
+      ## The responses of a processor declaring a version are cached by the
+      ## adapter, for the MIME types it handles...
+      set version [$client cache-version]
+      if {$version ne ""} {
+        foreach type [$client mime-types] {
+          ::ecap-tcl::cache version [lindex [split $type ";"] 0] $version
+        }
+      }
+      if {$headers} {
+        proc ::ecap-tcl::headersAdapt {token} {
+          tcloo::call_client onHeadersAdapt $token
+        }
       }
     };# register
 
@@ -37,6 +66,11 @@ namespace eval ::ecap-tcl {
           dict unset client_objects $type
         }
       }
+      if {[$client cache-version] ne ""} {
+        foreach type [$client mime-types] {
+          ::ecap-tcl::cache version [lindex [split $type ";"] 0] {}
+        }
+      }
     };# unregister
 
     proc call_client {action token args} {
@@ -55,6 +89,21 @@ namespace eval ::ecap-tcl {
       } else {
         return -code break
       }
+      if {$action in {onHeadersAdapt onActionStart}} {
+        ## Let the adapter know which processor it is (for its circuit
+        ## breaker), and how the processor wants the content...
+        ::ecap-tcl::action processor name [info object class $client]
+      }
+      if {$action eq "onActionStart"} {
+        set mode [$client content-mode]
+        if {$mode eq "tags"} {
+          ::ecap-tcl::action content tags {*}[$client html-tags]
+        } elseif {$mode eq "json"} {
+          ::ecap-tcl::action content json {*}[$client json-paths]
+        } else {
+          ::ecap-tcl::action content mode $mode
+        }
+      }
       try {
         $client $action $token $mime $params {*}$args
       } on continue {result options} {
@@ -123,8 +172,24 @@ namespace eval ::ecap-tcl {
     # return {}; # Empty response
   };# contentAdapt
 
-  proc contentDone {token atEnd} {
-    tcloo::call_client onContentDone $token $atEnd
+  proc tagsAdapt {token tags} {
+    ## In tags mode, the tags of a chunk are passed as a list: return a list
+    ## with a replacement for each one...
+    tcloo::call_client onTagsAdapt $token $tags
+    # return -code continue | break;  # Do not modify the tags
+  };# tagsAdapt
+
+  proc jsonAdapt {token values} {
+    ## In json mode, the values of a chunk are passed as a list of path
+    ## value pairs (values are JSON text): return a list with a replacement
+    ## (JSON text) for each value...
+    tcloo::call_client onJsonAdapt $token $values
+    # return -code continue | break;  # Do not modify the values
+  };# jsonAdapt
+
+  proc contentDone {token atEnd args} {
+    ## In whole-body mode, the content is passed as an extra argument...
+    tcloo::call_client onContentDone $token $atEnd {*}$args
     # return -code continue | break; # Do not append anything at the end
     #                                  of the content
     # any other value, will be appended at the returned result.
@@ -151,10 +216,48 @@ oo::class create ::ecap-tcl::AbstractProcessor {
     error "abstract class"
   };# mime-types
 
+  ## chunked: the content is passed in chunks to onContentAdapt.
+  ## whole:   the content is buffered by the adapter, and passed only to
+  ##          onContentDone, as an extra argument.
+  ## tags:    the content is tokenized by the adapter, and only the HTML
+  ##          tags returned by html-tags are passed to onTagsAdapt.
+  ## json:    the content is scanned by the adapter, and only the JSON
+  ##          values at the paths returned by json-paths are passed to
+  ##          onJsonAdapt.
+  method content-mode {} {
+    return chunked
+  };# content-mode
+
+  ## The tags passed to onTagsAdapt: a name for start tags (i.e. a), a
+  ## name preceded by / for end tags (i.e. /a).
+  method html-tags {} {
+    return {}
+  };# html-tags
+
+  ## The paths of the values passed to onJsonAdapt (i.e. $.items[*].url).
+  method json-paths {} {
+    return {}
+  };# json-paths
+
+  ## A processor whose output depends only on the response (not on the
+  ## client, or on the time) may return a version: its adapted responses are
+  ## then cached (with cache_size), and served without calling it. The
+  ## version must change whenever the output would.
+  method cache-version {} {
+    return {}
+  };# cache-version
+
   method onWantsUrl {url} {
     return true
   };# onWantsUrl
 
+  ## Called before onActionStart, only with header access. Returning done
+  ## sends the adapted headers with the original body, without calling any
+  ## other method for the message.
+  method onHeadersAdapt {token mime params} {
+    return -code break
+  };# onHeadersAdapt
+
   method onActionStart  {token mime params} {
     return -code break
   };# onActionStart
@@ -167,7 +270,15 @@ oo::class create ::ecap-tcl::AbstractProcessor {
     return -code break
   };# onContentAdapt
 
-  method onContentDone  {token mime params atEnd} {
+  method onTagsAdapt    {token mime params tags} {
+    return -code break
+  };# onTagsAdapt
+
+  method onJsonAdapt    {token mime params values} {
+    return -code break
+  };# onJsonAdapt
+
+  method onContentDone  {token mime params atEnd args} {
     return -code break
   };# onContentDone
 
@@ -186,6 +297,12 @@ oo::class create ::ecap-tcl::AbstractProcessor {
     flush $channel
   };# printHeaders
 
+  ## Logs the headers (as the fields of a single message), without blocking
+  ## the worker on a channel.
+  method logHeaders {{level debug}} {
+    ::ecap-tcl::log $level headers [::ecap-tcl::action header get]
+  };# logHeaders
+
   method setContentLength {data} {
     ::ecap-tcl::action header set Content-Length \
       [::ecap-tcl::action content bytelength $data]
@@ -197,6 +314,25 @@ oo::class create ::ecap-tcl::AbstractProcessor {
 oo::class create ::ecap-tcl::ContentProcessor {
   superclass ::ecap-tcl::AbstractProcessor
 
+  ## Content is only processed in onContentDone: let the adapter buffer it,
+  ## unless a sub-class processes chunks in onContentAdapt (which whole-body
+  ## mode never calls)...
+  method content-mode {} {
+    my variable content_mode
+    if {![info exists content_mode]} {
+      if {[lindex [info object call [self] onContentAdapt] 0 2] eq
+          "::ecap-tcl::ContentProcessor"} {
+        set content_mode whole
+      } else {
+        set content_mode chunked
+        ::ecap-tcl::log warning \
+          "onContentAdapt is overridden: whole-body mode not used" \
+          [list processor [info object class [self]]]
+      }
+    }
+    return $content_mode
+  };# content-mode
+
   method onActionStart {token mime params} {
     my variable content_action request_uri
     dict set content_action $token {}
@@ -214,11 +350,20 @@ oo::class create ::ecap-tcl::ContentProcessor {
     return {}
   };# onContentAdapt
 
-  method onContentDone {token mime params atEnd} {
+  method onContentDone {token mime params atEnd args} {
+    my storeContent $token {*}$args
     if {!$atEnd} {return -code continue}
     my processContent $token $mime $params
   };# onContentDone
 
+  method storeContent {token args} {
+    ## In whole-body mode, the content is given to onContentDone...
+    if {[llength $args]} {
+      my variable content_action
+      dict set content_action $token [lindex $args 0]
+    }
+  };# storeContent
+
   method processContent {token mime params} {
     ## Variable content_action contains the data
     my variable content_action
@@ -256,10 +401,12 @@ oo::class create ::ecap-tcl::UncompressProcessor {
     next $token $mime $params
   };# onActionStart
 
-  method onContentDone {token mime params atEnd} {
+  method onContentDone {token mime params atEnd args} {
+    my storeContent $token {*}$args
     if {!$atEnd} {return -code continue}
     if {[catch {my uncompressContent $token $mime $params} error]} {
-      puts "Decompression error: $error"
+      ## Count it against the processor, for its circuit breaker...
+      ::ecap-tcl::action processor failed "decompression error: $error"
       ## Return the original content. We failed to decompress it...
       my variable content_action
       return [dict get $content_action $token]
@@ -354,7 +501,14 @@ oo::class create ::ecap-tcl::TextProcessor {
       }
     } else {
       ## Maybe we can locate encoding in the content?
-      set match [regexp -nocase -inline {<meta(?!\s*(?:name|value)\s*=)(?:[^>]*?content\s*=[\s\"']*)?([^>]*?)[\s\"';]*charset\s*=[\s\"']*([^\s\"'/>]*)} [dict get $content_uncompressed $token]]
+      ## (compiled by PCRE2, if the adapter has it)
+      if {[info commands ::ecap-tcl::re] ne ""} {
+        set match [::ecap-tcl::re match ecap-tcl::meta-charset \
+                     [dict get $content_uncompressed $token]]
+      } else {
+        set match [regexp -nocase -inline ${::ecap-tcl::meta_charset} \
+                     [dict get $content_uncompressed $token]]
+      }
       lassign $match _ type iata_content_encoding
       if {$iata_content_encoding ne ""} {
         set iata_content_encoding [string map {
@@ -380,6 +534,113 @@ oo::class create ::ecap-tcl::TextProcessor {
 
 };# class ::ecap-tcl::TextProcessor
 
+oo::class create ::ecap-tcl::TagProcessor {
+  superclass ::ecap-tcl::AbstractProcessor
+
+  ## Compressed content cannot be tokenized: it is passed unmodified.
+  method content-mode {} {
+    if {[::ecap-tcl::action header exists Content-Encoding] &&
+        [string tolower [::ecap-tcl::action header get Content-Encoding]]
+          ne "identity"} {
+      return chunked
+    }
+    return tags
+  };# content-mode
+
+  method html-tags {} {
+    error "abstract class"
+  };# html-tags
+
+  method onActionStart {token mime params} {
+    ## Tags may be replaced: the length of the content is not known (unless
+    ## it is passed unmodified)...
+    if {[::ecap-tcl::action content mode] eq "tags"} {
+      ::ecap-tcl::action header remove Content-Length
+    }
+  };# onActionStart
+
+  method onTagsAdapt {token mime params tags} {
+    lmap tag $tags {my processTag $token $tag}
+  };# onTagsAdapt
+
+  ## Returns the replacement of a tag (an empty string drops it).
+  method processTag {token tag} {
+    return $tag
+  };# processTag
+
+};# class ::ecap-tcl::TagProcessor
+
+oo::class create ::ecap-tcl::JsonProcessor {
+  superclass ::ecap-tcl::AbstractProcessor
+
+  ## Compressed content cannot be scanned: it is passed unmodified.
+  method content-mode {} {
+    if {[::ecap-tcl::action header exists Content-Encoding] &&
+        [string tolower [::ecap-tcl::action header get Content-Encoding]]
+          ne "identity"} {
+      return chunked
+    }
+    return json
+  };# content-mode
+
+  method json-paths {} {
+    error "abstract class"
+  };# json-paths
+
+  method onActionStart {token mime params} {
+    ## Values may be replaced: the length of the content is not known (unless
+    ## it is passed unmodified)...
+    if {[::ecap-tcl::action content mode] eq "json"} {
+      ::ecap-tcl::action header remove Content-Length
+    }
+  };# onActionStart
+
+  method onJsonAdapt {token mime params values} {
+    lmap {path value} $values {my processValue $token $path $value}
+  };# onJsonAdapt
+
+  ## Returns the replacement of a value (JSON text, i.e. with its quotes).
+  method processValue {token path value} {
+    return $value
+  };# processValue
+
+};# class ::ecap-tcl::JsonProcessor
+
+oo::class create ::ecap-tcl::StreamProcessor {
+  superclass ::ecap-tcl::AbstractProcessor
+
+  ## The calls of a transaction resume a coroutine, running the stream
+  ## method, instead of being dispatched to the on* methods.
+  method onActionStart {token mime params} {
+    ::ecap-tcl::action coroutine [self] stream $token $mime $params
+  };# onActionStart
+
+  ## Each [yield] returns an event: the name of a hook and its arguments
+  ## (contentAdapt chunk, tagsAdapt tags, jsonAdapt values, contentDone
+  ## atEnd ?body?, actionStop). The value yielded next is its result.
+  ## Returning ends the adaptation: the rest of the content is passed
+  ## unmodified.
+  method stream {token mime params} {
+    set result {}
+    while {1} {
+      lassign [yield $result] hook arg body
+      switch -- $hook {
+        contentAdapt {set result [my processChunk $token $arg]}
+        tagsAdapt    {set result $arg}
+        jsonAdapt    {set result [lmap {path value} $arg {set value}]}
+        contentDone  {set result $body}
+        actionStop   {return}
+      }
+    }
+  };# stream
+
+  ## Returns the replacement of a chunk.
+  method processChunk {token chunk} {
+    return $chunk
+  };# processChunk
+
+};# class ::ecap-tcl::StreamProcessor
+
 oo::class create ::ecap-tcl::SampleHTMLProcessor {
   superclass ::ecap-tcl::TextProcessor
 
@@ -391,10 +652,9 @@ oo::class create ::ecap-tcl::SampleHTMLProcessor {
     my variable content_uncompressed content_action request_uri
     ::ecap-tcl::action header add X-Ecap \
       [::ecap-tcl::action host uri]
-    my printHeaders
-    puts "URL: \"$request_uri\""
-    puts "Token: $token, Data:\
-        \"[string range [dict get $content_uncompressed $token] 0 30]\"..."
+    my logHeaders info
+    ::ecap-tcl::log info "adapted" [list url $request_uri token $token \
+      data [string range [dict get $content_uncompressed $token] 0 30]]
     dict get $content_action $token
   };# processContent
 